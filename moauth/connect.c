@@ -19,6 +19,34 @@ moauthClose(moauth_t *server)		// I - OAuth server connection
 {
   if (server)
   {
+    size_t	i;			// Looping var
+
+    // Wait for asynchronous requests to finish and stop the threads...
+    cupsMutexLock(&server->pool_lock);
+    while (server->num_async > 0)
+      cupsCondWait(&server->async_cond, &server->pool_lock, 1.0);
+
+    server->async_done = true;
+    cupsCondBroadcast(&server->async_cond);
+    cupsMutexUnlock(&server->pool_lock);
+
+    for (i = 0; i < server->num_async_threads; i ++)
+      cupsThreadWait(server->async_threads[i]);
+
+    for (i = 0; i < _MOAUTH_POOL_SIZE; i ++)
+      httpClose(server->pool[i].http);
+
+    for (i = 0; i < server->cache_size; i ++)
+    {
+      free(server->cache[i].username);
+      free(server->cache[i].scope);
+    }
+
+    free(server->cache);
+
+    cupsCondDestroy(&server->async_cond);
+    cupsMutexDestroy(&server->pool_lock);
+    cupsMutexDestroy(&server->cache_lock);
     cupsJSONDelete(server->metadata);
     free(server);
   }
@@ -100,13 +128,20 @@ moauthConnect(
   char		*body = NULL;		// HTTP message body
 
 
-  // Connect to the OAuth URI...
-  if ((http = _moauthConnect(oauth_uri, resource, sizeof(resource))) == NULL)
-    return (NULL);			// Unable to connect to server
-
   if ((server = calloc(1, sizeof(moauth_t))) == NULL)
     return (NULL);			// Unable to allocate server structure
 
+  cupsMutexInit(&server->pool_lock);
+  cupsCondInit(&server->async_cond);
+  cupsMutexInit(&server->cache_lock);
+
+  // Connect to the OAuth URI...
+  if ((http = _moauthGetConnection(server, oauth_uri, resource, sizeof(resource))) == NULL)
+  {
+    moauthClose(server);
+    return (NULL);			// Unable to connect to server
+  }
+
   // Get the metadata from the specified URL.  If the resource is "/" (default)
   // then grab the well-known RFC 8414 or OpenID configuration paths.
   if (!strcmp(resource, "/"))
@@ -173,6 +208,9 @@ moauthConnect(
     }
   }
 
+  // Keep the connection for the endpoints that follow...
+  _moauthReleaseConnection(server, http);
+
   if (content_type && body)
   {
     char	scheme[32],		// URI scheme
@@ -182,8 +220,6 @@ moauthConnect(
     bool	is_json = !*content_type || !strcmp(content_type, "text/json");
 					// JSON metadata?
 
-    httpClose(http);
-
     if (is_json)
     {
       // OpenID/RFC 8414 JSON metadata...
@@ -227,6 +263,18 @@ moauthConnect(
         server->registration_endpoint = uri;
       }
 
+      if ((uri = cupsJSONGetString(cupsJSONFind(server->metadata, "revocation_endpoint"))) != NULL)
+      {
+	if (httpSeparateURI(HTTP_URI_CODING_ALL, uri, scheme, sizeof(scheme), userpass, sizeof(userpass), host, sizeof(host), &port, resource, sizeof(resource)) < HTTP_URI_STATUS_OK || strcmp(scheme, "https"))
+        {
+          // Bad revocation URI...
+          moauthClose(server);
+	  return (NULL);
+	}
+
+        server->revocation_endpoint = uri;
+      }
+
       if ((uri = cupsJSONGetString(cupsJSONFind(server->metadata, "token_endpoint"))) != NULL)
       {
 	if (httpSeparateURI(HTTP_URI_CODING_ALL, uri, scheme, sizeof(scheme), userpass, sizeof(userpass), host, sizeof(host), &port, resource, sizeof(resource)) < HTTP_URI_STATUS_OK || strcmp(scheme, "https"))
@@ -264,3 +312,142 @@ moauthErrorString(moauth_t *server)	// I - OAuth server connection
 {
   return ((server && server->error[0]) ? server->error : NULL);
 }
+
+
+//
+// '_moauthGetConnection()' - Get a pooled connection for the provided URI and
+//                            return the associated resource.
+//
+// Idle connections to the same host and port are reused when they have not
+// timed out or been closed by the server, otherwise a new connection is
+// opened.  Release the connection with `_moauthReleaseConnection`.
+//
+
+http_t *				// O - HTTP connection or `NULL`
+_moauthGetConnection(
+    moauth_t   *server,			// I - OAuth server connection
+    const char *uri,			// I - URI to connect to
+    char       *resource,		// I - Resource buffer
+    size_t     resourcelen)		// I - Size of resource buffer
+{
+  char		scheme[32],		// URI scheme
+		userpass[256],		// Username:password (unused)
+		host[256];		// Host
+  int		port;			// Port number
+  http_t	*http = NULL;		// HTTP connection
+  _moauth_conn_t *conn,			// Current pooled connection
+		*unused = NULL;		// Unused or oldest idle connection
+  size_t	i;			// Looping var
+  time_t	curtime = time(NULL);	// Current time
+
+
+  if (httpSeparateURI(HTTP_URI_CODING_ALL, uri, scheme, sizeof(scheme), userpass, sizeof(userpass), host, sizeof(host), &port, resource, (int)resourcelen) < HTTP_URI_STATUS_OK || strcmp(scheme, "https"))
+    return (NULL);			// Bad URI
+
+  cupsMutexLock(&server->pool_lock);
+
+  for (i = 0, conn = server->pool; i < _MOAUTH_POOL_SIZE; i ++, conn ++)
+  {
+    if (conn->in_use)
+      continue;
+
+    if (conn->http && ((curtime - conn->last_used) >= _MOAUTH_POOL_IDLE || httpWait(conn->http, 0)))
+    {
+      // Close connections that have timed out or been closed (or sent
+      // unexpected data) by the server...
+      httpClose(conn->http);
+      conn->http = NULL;
+    }
+
+    if (!conn->http)
+    {
+      if (!unused || unused->http)
+        unused = conn;
+    }
+    else if (conn->port == port && !strcmp(conn->host, host))
+    {
+      // Reuse this connection...
+      conn->in_use = true;
+      http         = conn->http;
+      break;
+    }
+    else if (!unused || (unused->http && conn->last_used < unused->last_used))
+    {
+      unused = conn;
+    }
+  }
+
+  if (!http && unused)
+  {
+    // Reserve a slot for the new connection...
+    httpClose(unused->http);
+
+    cupsCopyString(unused->host, host, sizeof(unused->host));
+    unused->port   = port;
+    unused->http   = NULL;
+    unused->in_use = true;
+  }
+
+  cupsMutexUnlock(&server->pool_lock);
+
+  if (http)
+    return (http);
+
+  // Open a new connection outside the lock...
+  if ((http = _moauthConnect(uri, resource, resourcelen)) != NULL && unused)
+  {
+    // No locking needed since the slot is reserved...
+    unused->http = http;
+  }
+  else if (unused)
+  {
+    cupsMutexLock(&server->pool_lock);
+    unused->in_use = false;
+    cupsMutexUnlock(&server->pool_lock);
+  }
+
+  return (http);
+}
+
+
+//
+// '_moauthReleaseConnection()' - Return a connection to the pool.
+//
+// Connections that are not ready for another request are closed.
+//
+
+void
+_moauthReleaseConnection(
+    moauth_t *server,			// I - OAuth server connection
+    http_t   *http)			// I - HTTP connection
+{
+  _moauth_conn_t *conn;			// Current pooled connection
+  size_t	i;			// Looping var
+  bool		reuse;			// Keep the connection open?
+
+
+  if (!http)
+    return;
+
+  reuse = httpGetState(http) == HTTP_STATE_WAITING;
+
+  cupsMutexLock(&server->pool_lock);
+
+  for (i = 0, conn = server->pool; i < _MOAUTH_POOL_SIZE; i ++, conn ++)
+  {
+    if (conn->http == http)
+    {
+      conn->in_use    = false;
+      conn->last_used = time(NULL);
+
+      if (!reuse)
+        conn->http = NULL;
+      break;
+    }
+  }
+
+  cupsMutexUnlock(&server->pool_lock);
+
+  if (!reuse || i >= _MOAUTH_POOL_SIZE)
+    httpClose(http);
+}
@@ -16,21 +16,82 @@
 #  include <stdio.h>
 #  include <cups/cups.h>
 #  include <cups/json.h>
+#  include <cups/thread.h>
 #  include "moauth.h"
 
 
+//
+// Constants...
+//
+
+#  define _MOAUTH_POOL_SIZE	8	// Maximum number of pooled connections
+#  define _MOAUTH_POOL_IDLE	30	// Seconds before idle connections are closed
+#  define _MOAUTH_MAX_DIGEST	32	// Size of SHA-256 token digests
+#  define _MOAUTH_MAX_BATCH	100	// Maximum number of tokens per introspection request
+#  define _MOAUTH_ASYNC_THREADS	4	// Maximum number of asynchronous introspection threads
+#  define _MOAUTH_ASYNC_QUEUE	64	// Maximum number of pending asynchronous requests
+
+
 //
 // Private types...
 //
 
+typedef struct _moauth_conn_s		// Pooled HTTP connection
+{
+  char		host[256];		// Hostname
+  int		port;			// Port number
+  http_t	*http;			// HTTP connection or `NULL` if unused
+  bool		in_use;			// Is the connection checked out?
+  time_t	last_used;		// When the connection was last released
+} _moauth_conn_t;
+
+typedef struct _moauth_async_s		// Asynchronous introspection request
+{
+  struct _moauth_async_s *next;		// Next request in queue
+  size_t		num_tokens;	// Number of tokens
+  char			**tokens;	// Tokens
+  moauth_introspect_cb_t cb;		// Callback
+  void			*cb_data;	// Callback data
+} _moauth_async_t;
+
+typedef struct _moauth_icache_s		// Cached introspection result
+{
+  unsigned char	digest[_MOAUTH_MAX_DIGEST];
+					// SHA-256 digest of token
+  time_t	expires;		// When the entry expires, 0 if unused
+  bool		active;			// Is the token active?
+  char		*username,		// Username, if any
+		*scope;			// Scope, if any
+  time_t	exp;			// Token expiration date/time
+} _moauth_icache_t;
+
 struct _moauth_s			// OAuth server connection data
 {
   char		error[1024];		// Last error message, if any
   const char	*authorization_endpoint,// Authorization endpoint
 		*introspection_endpoint,// Introspection endpoint
 		*registration_endpoint,	// Registration endpoint
+		*revocation_endpoint,	// Revocation endpoint
 		*token_endpoint;	// Token endpoint
   cups_json_t	*metadata;		// Metadata values
+  cups_mutex_t	pool_lock;		// Connection pool lock
+  _moauth_conn_t pool[_MOAUTH_POOL_SIZE];
+					// Connection pool
+  size_t	num_async;		// Number of pending asynchronous requests
+  cups_cond_t	async_cond;		// Condition for asynchronous requests
+  _moauth_async_t *async_first,		// First queued asynchronous request
+		*async_last;		// Last queued asynchronous request
+  size_t	num_async_threads;	// Number of asynchronous request threads
+  cups_thread_t	async_threads[_MOAUTH_ASYNC_THREADS];
+					// Asynchronous request threads
+  bool		async_done;		// Stop asynchronous request threads?
+  cups_mutex_t	cache_lock;		// Introspection cache lock
+  _moauth_icache_t *cache;		// Introspection cache, if enabled
+  size_t	cache_size;		// Number of cache entries
+  int		cache_ttl,		// Maximum seconds to cache active tokens
+		cache_negative_ttl;	// Seconds to cache inactive tokens
+  size_t	cache_hits,		// Number of cache hits
+		cache_misses;		// Number of cache misses
 };
 
 
@@ -40,6 +101,8 @@ struct _moauth_s			// OAuth server connection data
 
 extern http_t	*_moauthConnect(const char *uri, char *resource, size_t resourcelen);
 extern char	*_moauthCopyMessageBody(http_t *http);
+extern http_t	*_moauthGetConnection(moauth_t *server, const char *uri, char *resource, size_t resourcelen);
+extern void	_moauthReleaseConnection(moauth_t *server, http_t *http);
 
 extern void	_moauthGetRandomBytes(void *data, size_t bytes);
 
@@ -17,6 +17,17 @@
 
 typedef struct _moauth_s moauth_t;	// OAuth server connection
 
+typedef struct moauth_introspect_s	// Token introspection result
+{
+  bool		active;			// Is the token active?
+  char		username[256];		// Username, if any
+  char		scope[1024];		// Scope, if any
+  time_t	expires;		// Expiration date/time, if any
+} moauth_introspect_t;
+
+typedef void (*moauth_introspect_cb_t)(moauth_t *server, bool status, size_t num_tokens, const char * const *tokens, const moauth_introspect_t *results, void *cb_data);
+					// Introspection callback
+
 
 //
 // Functions...
@@ -29,14 +40,20 @@ extern moauth_t	*moauthConnect(const char *oauth_uri);
 
 extern const char *moauthErrorString(moauth_t *server);
 
+extern bool	moauthGetIntrospectionStats(moauth_t *server, size_t *hits, size_t *misses);
 extern char	*moauthGetToken(moauth_t *server, const char *redirect_uri, const char *client_id, const char *grant, const char *code_verifier, char *token, size_t tokensize, char *refresh, size_t refreshsize, time_t *expires);
 
 extern bool	moauthIntrospectToken(moauth_t *server, const char *token, char *username, size_t username_size, char *scope, size_t scope_size, time_t *expires);
+extern bool	moauthIntrospectTokens(moauth_t *server, size_t num_tokens, const char * const *tokens, moauth_introspect_t *results);
+extern bool	moauthIntrospectTokensAsync(moauth_t *server, size_t num_tokens, const char * const *tokens, moauth_introspect_cb_t cb, void *cb_data);
 
 extern char	*moauthPasswordToken(moauth_t *server, const char *username, const char *password, const char *scope, char *token, size_t tokensize, char *refresh, size_t refreshsize, time_t *expires);
 
 extern char	*moauthRefreshToken(moauth_t *server, const char *refresh, char *token, size_t tokensize, char *new_refresh, size_t new_refreshsize, time_t *expires);
 
 extern char	*moauthRegisterClient(moauth_t *server, const char *redirect_uri, const char *client_name, const char *client_uri, const char *logo_uri, const char *tos_uri, char *client_id, size_t client_id_size);
+extern bool	moauthRevokeToken(moauth_t *server, const char *token, const char *token_type_hint);
+
+extern bool	moauthSetIntrospectionCache(moauth_t *server, size_t num_entries, int max_ttl, int negative_ttl);
 
 #endif // !MOAUTH_H
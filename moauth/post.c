@@ -21,23 +21,46 @@ _moauthCopyMessageBody(http_t *http)	// I - HTTP connection
 		*end,			// End of data
 		*ptr;			// Pointer into string
   size_t	bodylen;		// Allocated length of string
+  off_t		length;			// Content-Length value
   ssize_t	bytes;			// Bytes read
   http_state_t	initial_state;		// Initial HTTP state
 
 
-  // Allocate memory for string...
+  // Allocate memory for string - exactly the Content-Length when known,
+  // otherwise start small and grow up to 64k...
   initial_state = httpGetState(http);
 
-  if ((bodylen = httpGetLength(http)) == 0 || bodylen > 65536)
-    bodylen = 65536;			// Accept up to 64k for POSTs
+  if ((length = httpGetLength(http)) > 0 && length <= 65536)
+    bodylen = (size_t)length;
+  else
+    bodylen = 1024;
 
-  if ((body = calloc(1, bodylen + 1)) != NULL)
+  if ((body = malloc(bodylen + 1)) != NULL)
   {
-    for (ptr = body, end = body + bodylen; ptr < end; ptr += bytes)
+    for (ptr = body, end = body + bodylen;; ptr += bytes)
     {
-      if ((bytes = httpRead(http, ptr, end - ptr)) <= 0)
+      if (ptr >= end)
+      {
+        // Grow the buffer for chunked or unknown-length bodies...
+        char	*temp;			// New buffer
+
+        if (length > 0 && length <= 65536)
+          break;
+
+        if (bodylen >= 65536 || (temp = realloc(body, 2 * bodylen + 1)) == NULL)
+          break;
+
+        ptr     = temp + (ptr - body);
+        body    = temp;
+        bodylen *= 2;
+        end     = body + bodylen;
+      }
+
+      if ((bytes = httpRead(http, ptr, (size_t)(end - ptr))) <= 0)
         break;
     }
+
+    *ptr = '\0';
   }
 
   if (httpGetState(http) == initial_state)
@@ -10,24 +10,168 @@
 #include <config.h>
 #include "moauth-private.h"
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef HAVE_GETRANDOM
+#  include <sys/random.h>
+#endif // HAVE_GETRANDOM
+
+
+//
+// Local types...
+//
+
+typedef struct _moauth_random_s		// Per-thread random byte buffer
+{
+  unsigned	generation;		// Fork generation that filled the buffer
+  size_t	used;			// Bytes used from buffer
+  unsigned char	buffer[512];		// Random bytes
+} _moauth_random_t;
+
+
+//
+// Local globals...
+//
+
+static __thread _moauth_random_t moauth_random = { 0, sizeof(moauth_random.buffer), { 0 } };
+					// Random bytes for current thread
+static atomic_uint	moauth_generation = 1;
+					// Fork generation, bumped in each child
+static pthread_once_t	moauth_once = PTHREAD_ONCE_INIT;
+					// One-time initialization
+
+
+//
+// Local functions...
+//
+
+static void	fill_random(void *data, size_t bytes);
+static void	fork_child(void);
+static void	init_random(void);
 
 
 //
 // '_moauthGetRandomBytes()' - Get a series of random bytes suitable for an OAuth 2.0
 //                             exchange.
 //
+// Random bytes are read from the system CSPRNG in batches and handed out from
+// a per-thread buffer so that callers don't pay for a system call (or a lock)
+// for every token.
+//
 
 void
 _moauthGetRandomBytes(void   *data,	// I - Buffer
                       size_t bytes)	// I - Number of bytes to generate
+{
+  _moauth_random_t *r = &moauth_random;	// Random bytes for this thread
+  unsigned char	*ptr = (unsigned char *)data;
+					// Pointer to byte data
+  size_t	count;			// Bytes to copy
+  unsigned	generation;		// Current fork generation
+
+
+  // Don't share buffered bytes with a forked child...
+  pthread_once(&moauth_once, init_random);
+
+  if (r->generation != (generation = atomic_load_explicit(&moauth_generation, memory_order_relaxed)))
+  {
+    r->generation = generation;
+    r->used       = sizeof(r->buffer);
+  }
+
+  // Large requests bypass the buffer...
+  if (bytes >= sizeof(r->buffer))
+  {
+    fill_random(data, bytes);
+    return;
+  }
+
+  while (bytes > 0)
+  {
+    if (r->used >= sizeof(r->buffer))
+    {
+      fill_random(r->buffer, sizeof(r->buffer));
+      r->used = 0;
+    }
+
+    if ((count = sizeof(r->buffer) - r->used) > bytes)
+      count = bytes;
+
+    memcpy(ptr, r->buffer + r->used, count);
+
+    // Clear used bytes so they cannot be handed out again...
+    memset(r->buffer + r->used, 0, count);
+
+    r->used += count;
+    ptr     += count;
+    bytes   -= count;
+  }
+}
+
+
+//
+// 'fill_random()' - Fill a buffer from the system random number generator.
+//
+
+static void
+fill_random(void   *data,		// I - Buffer
+            size_t bytes)		// I - Number of bytes to generate
 {
   unsigned char *ptr = (unsigned char *)data;
 					// Pointer to byte data
 
+
+#ifdef HAVE_ARC4RANDOM_BUF
+  arc4random_buf(ptr, bytes);
+  return;
+
+#else
+#  ifdef HAVE_GETRANDOM
+  ssize_t	count;			// Bytes returned
+
+
+  while (bytes > 0)
+  {
+    if ((count = getrandom(ptr, bytes, 0)) > 0)
+    {
+      ptr   += count;
+      bytes -= (size_t)count;
+    }
+    else if (count == 0 || errno != EINTR)
+      break;
+  }
+#  endif // HAVE_GETRANDOM
+
+  // Fall back on the CUPS random number generator as needed...
   while (bytes > 0)
   {
     *ptr++ = (unsigned char)cupsGetRand();
     bytes --;
   }
+#endif // HAVE_ARC4RANDOM_BUF
 }
 
+
+//
+// 'fork_child()' - Invalidate buffered random bytes in a forked child.
+//
+
+static void
+fork_child(void)
+{
+  atomic_fetch_add_explicit(&moauth_generation, 1, memory_order_relaxed);
+}
+
+
+//
+// 'init_random()' - Watch for forks so buffered bytes are not reused.
+//
+
+static void
+init_random(void)
+{
+  pthread_atfork(/*prepare*/NULL, /*parent*/NULL, fork_child);
+}
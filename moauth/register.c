@@ -82,7 +82,7 @@ moauthRegisterClient(
   json_length = strlen(json_data);
 
   // Send a POST request with the JSON data...
-  if ((http = _moauthConnect(server->registration_endpoint, resource, sizeof(resource))) == NULL)
+  if ((http = _moauthGetConnection(server, server->registration_endpoint, resource, sizeof(resource))) == NULL)
   {
     snprintf(server->error, sizeof(server->error), "Connection to registration endpoint failed: %s", cupsGetErrorString());
     goto done;
@@ -141,7 +141,7 @@ moauthRegisterClient(
   // Return whatever we got...
   done:
 
-  httpClose(http);
+  _moauthReleaseConnection(server, http);
 
   cupsJSONDelete(json);
   free(json_data);
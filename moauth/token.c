@@ -10,6 +10,54 @@
 #include <config.h>
 #include "moauth-private.h"
 #include <cups/form.h>
+#include <errno.h>
+
+
+//
+// Local functions...
+//
+
+static void	*async_introspection(moauth_t *server);
+static bool	find_introspection(moauth_t *server, const unsigned char *digest, char *username, size_t username_size, char *scope, size_t scope_size, time_t *expires, bool *active);
+static void	forget_introspection(moauth_t *server, const unsigned char *digest);
+static void	save_introspection(moauth_t *server, const unsigned char *digest, bool active, const char *username, const char *scope, time_t exp);
+static http_status_t send_introspection(moauth_t *server, size_t num_batch, const size_t *batch, const char * const *tokens, unsigned char digests[][_MOAUTH_MAX_DIGEST], moauth_introspect_t *results);
+
+
+//
+// 'moauthGetIntrospectionStats()' - Get the introspection cache statistics.
+//
+
+bool					// O - `true` if the cache is enabled, `false` otherwise
+moauthGetIntrospectionStats(
+    moauth_t *server,			// I - Connection to OAuth server
+    size_t   *hits,			// O - Number of cache hits or `NULL`
+    size_t   *misses)			// O - Number of cache misses or `NULL`
+{
+  bool	enabled;			// Is the cache enabled?
+
+
+  if (hits)
+    *hits = 0;
+  if (misses)
+    *misses = 0;
+
+  if (!server)
+    return (false);
+
+  cupsMutexLock(&server->cache_lock);
+
+  enabled = server->cache != NULL;
+
+  if (hits)
+    *hits = server->cache_hits;
+  if (misses)
+    *misses = server->cache_misses;
+
+  cupsMutexUnlock(&server->cache_lock);
+
+  return (enabled);
+}
 
 
 //
@@ -83,7 +131,7 @@ moauthGetToken(
   form_length = strlen(form_data);
 
   // Send a POST request with the form data...
-  if ((http = _moauthConnect(server->token_endpoint, resource, sizeof(resource))) == NULL)
+  if ((http = _moauthGetConnection(server, server->token_endpoint, resource, sizeof(resource))) == NULL)
   {
     snprintf(server->error, sizeof(server->error), "Connection to token endpoint failed: %s", cupsGetErrorString());
     goto done;
@@ -143,7 +191,7 @@ moauthGetToken(
   // Return whatever we got...
   done:
 
-  httpClose(http);
+  _moauthReleaseConnection(server, http);
 
   cupsFreeOptions(num_form, form);
   free(form_data);
@@ -177,6 +225,8 @@ moauthIntrospectToken(
   cups_json_t	*json;			// JSON variables
   const char	*value;			// JSON value
   bool		active = false;		// Is the token active?
+  unsigned char	digest[_MOAUTH_MAX_DIGEST];
+					// SHA-256 digest of token
 
 
   // Range check input...
@@ -203,6 +253,12 @@ moauthIntrospectToken(
     return (false);
   }
 
+  // See if we have a cached result...
+  cupsHashData("sha2-256", token, strlen(token), digest, sizeof(digest));
+
+  if (find_introspection(server, digest, username, username_size, scope, scope_size, expires, &active))
+    return (active);
+
   // Prepare form data to get an access token...
   num_form = cupsAddOption("token", token, num_form, &form);
 
@@ -215,7 +271,7 @@ moauthIntrospectToken(
   form_length = strlen(form_data);
 
   // Send a POST request with the form data...
-  if ((http = _moauthConnect(server->introspection_endpoint, resource, sizeof(resource))) == NULL)
+  if ((http = _moauthGetConnection(server, server->introspection_endpoint, resource, sizeof(resource))) == NULL)
   {
     snprintf(server->error, sizeof(server->error), "Connection to introspection endpoint failed: %s", cupsGetErrorString());
     goto done;
@@ -264,6 +320,8 @@ moauthIntrospectToken(
     if (expires)
       *expires = (long)cupsJSONGetNumber(cupsJSONFind(json, "exp"));
 
+    save_introspection(server, digest, active, cupsJSONGetString(cupsJSONFind(json, "username")), cupsJSONGetString(cupsJSONFind(json, "scope")), (time_t)cupsJSONGetNumber(cupsJSONFind(json, "exp")));
+
     cupsJSONDelete(json);
     free(json_data);
   }
@@ -275,7 +333,7 @@ moauthIntrospectToken(
   // Return whatever we got...
   done:
 
-  httpClose(http);
+  _moauthReleaseConnection(server, http);
 
   cupsFreeOptions(num_form, form);
   free(form_data);
@@ -284,6 +342,188 @@ moauthIntrospectToken(
 }
 
 
+//
+// 'moauthIntrospectTokens()' - Get information about multiple access tokens.
+//
+// Cached results are used when the introspection cache is enabled, and the
+// remaining tokens are sent to the server in batches on a single pooled
+// connection.  Servers that do not support batch requests are asked about
+// each token in turn.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthIntrospectTokens(
+    moauth_t            *server,	// I - Connection to OAuth server
+    size_t              num_tokens,	// I - Number of tokens
+    const char * const  *tokens,	// I - Access tokens
+    moauth_introspect_t *results)	// O - Results, one per token
+{
+  size_t	i,			// Looping var
+		num_batch = 0,		// Number of tokens in batch
+		batch[_MOAUTH_MAX_BATCH];
+					// Token indices in batch
+  unsigned char	digests[_MOAUTH_MAX_BATCH][_MOAUTH_MAX_DIGEST];
+					// SHA-256 digests of batch tokens
+  http_status_t	status = HTTP_STATUS_OK;// Response status
+
+
+  // Range check input...
+  if (results)
+    memset(results, 0, num_tokens * sizeof(moauth_introspect_t));
+
+  if (!server || (num_tokens > 0 && (!tokens || !results)))
+  {
+    if (server)
+      snprintf(server->error, sizeof(server->error), "Bad arguments to function.");
+
+    return (false);
+  }
+
+  if (!server->introspection_endpoint)
+  {
+    snprintf(server->error, sizeof(server->error), "Introspection not supported.");
+    return (false);
+  }
+
+  for (i = 0; i < num_tokens && status == HTTP_STATUS_OK; i ++)
+  {
+    if (!tokens[i])
+      continue;
+
+    // See if we have a cached result...
+    cupsHashData("sha2-256", tokens[i], strlen(tokens[i]), digests[num_batch], sizeof(digests[num_batch]));
+
+    if (find_introspection(server, digests[num_batch], results[i].username, sizeof(results[i].username), results[i].scope, sizeof(results[i].scope), &results[i].expires, &results[i].active))
+      continue;
+
+    // No, add it to the batch and send when full...
+    batch[num_batch ++] = i;
+
+    if (num_batch == _MOAUTH_MAX_BATCH)
+    {
+      status    = send_introspection(server, num_batch, batch, tokens, digests, results);
+      num_batch = 0;
+    }
+  }
+
+  if (num_batch > 0 && status == HTTP_STATUS_OK)
+    status = send_introspection(server, num_batch, batch, tokens, digests, results);
+
+  if (status == HTTP_STATUS_BAD_REQUEST)
+  {
+    // Server doesn't support batches, ask about each token...
+    for (i = 0; i < num_tokens; i ++)
+    {
+      if (tokens[i] && !results[i].active)
+        results[i].active = moauthIntrospectToken(server, tokens[i], results[i].username, sizeof(results[i].username), results[i].scope, sizeof(results[i].scope), &results[i].expires);
+    }
+
+    status = HTTP_STATUS_OK;
+  }
+
+  return (status == HTTP_STATUS_OK);
+}
+
+
+//
+// 'moauthIntrospectTokensAsync()' - Get information about multiple access
+//                                   tokens in the background.
+//
+// The callback is called from a separate thread with the results once the
+// batch is complete.  The token strings are copied and need not remain valid
+// after this function returns.  Requests are queued for a small pool of
+// threads, and this function fails when too many requests are pending.
+// @link moauthClose@ waits for any pending callbacks.
+//
+
+bool					// O - `true` if started, `false` on error
+moauthIntrospectTokensAsync(
+    moauth_t               *server,	// I - Connection to OAuth server
+    size_t                 num_tokens,	// I - Number of tokens
+    const char * const     *tokens,	// I - Access tokens
+    moauth_introspect_cb_t cb,		// I - Callback function
+    void                   *cb_data)	// I - Callback data
+{
+  _moauth_async_t *async;		// Asynchronous request
+  size_t	i;			// Looping var
+  cups_thread_t	thread;			// Request thread
+
+
+  if (!server || !cb || (num_tokens > 0 && !tokens))
+  {
+    if (server)
+      snprintf(server->error, sizeof(server->error), "Bad arguments to function.");
+
+    return (false);
+  }
+
+  if ((async = calloc(1, sizeof(_moauth_async_t))) == NULL || (num_tokens > 0 && (async->tokens = calloc(num_tokens, sizeof(char *))) == NULL))
+    goto error;
+
+  async->num_tokens = num_tokens;
+  async->cb         = cb;
+  async->cb_data    = cb_data;
+
+  for (i = 0; i < num_tokens; i ++)
+  {
+    if (tokens[i] && (async->tokens[i] = strdup(tokens[i])) == NULL)
+      goto error;
+  }
+
+  // Queue the request, starting another thread if all of them are busy...
+  cupsMutexLock(&server->pool_lock);
+
+  if (server->num_async >= _MOAUTH_ASYNC_QUEUE)
+  {
+    cupsMutexUnlock(&server->pool_lock);
+    snprintf(server->error, sizeof(server->error), "Too many pending introspection requests.");
+    goto cleanup;
+  }
+
+  if (server->num_async >= server->num_async_threads && server->num_async_threads < _MOAUTH_ASYNC_THREADS)
+  {
+    if ((thread = cupsThreadCreate((cups_thread_func_t)async_introspection, server)) != CUPS_THREAD_INVALID)
+      server->async_threads[server->num_async_threads ++] = thread;
+    else if (server->num_async_threads == 0)
+    {
+      cupsMutexUnlock(&server->pool_lock);
+      goto error;
+    }
+  }
+
+  if (server->async_last)
+    server->async_last->next = async;
+  else
+    server->async_first = async;
+
+  server->async_last = async;
+  server->num_async ++;
+
+  cupsCondBroadcast(&server->async_cond);
+  cupsMutexUnlock(&server->pool_lock);
+
+  return (true);
+
+  // If we get here something went wrong...
+  error:
+
+  snprintf(server->error, sizeof(server->error), "Unable to start introspection: %s", strerror(errno));
+
+  cleanup:
+
+  if (async)
+  {
+    for (i = 0; async->tokens && i < num_tokens; i ++)
+      free(async->tokens[i]);
+
+    free(async->tokens);
+    free(async);
+  }
+
+  return (false);
+}
+
+
 //
 // 'moauthPasswordToken()' - Get an access token using a username and password
 //                           (if supported by the OAuth server)
@@ -353,7 +593,7 @@ moauthPasswordToken(
   form_length = strlen(form_data);
 
   // Send a POST request with the form data...
-  if ((http = _moauthConnect(server->token_endpoint, resource, sizeof(resource))) == NULL)
+  if ((http = _moauthGetConnection(server, server->token_endpoint, resource, sizeof(resource))) == NULL)
   {
     snprintf(server->error, sizeof(server->error), "Connection to token endpoint failed: %s", cupsGetErrorString());
     goto done;
@@ -411,7 +651,7 @@ moauthPasswordToken(
   // Return whatever we got...
   done:
 
-  httpClose(http);
+  _moauthReleaseConnection(server, http);
 
   cupsFreeOptions(num_form, form);
   free(form_data);
@@ -483,7 +723,7 @@ moauthRefreshToken(
   form_length = strlen(form_data);
 
   // Send a POST request with the form data...
-  if ((http = _moauthConnect(server->token_endpoint, resource, sizeof(resource))) == NULL)
+  if ((http = _moauthGetConnection(server, server->token_endpoint, resource, sizeof(resource))) == NULL)
   {
     snprintf(server->error, sizeof(server->error), "Connection to token endpoint failed: %s", cupsGetErrorString());
     goto done;
@@ -541,10 +781,520 @@ moauthRefreshToken(
   // Close the connection and return whatever we got...
   done:
 
-  httpClose(http);
+  _moauthReleaseConnection(server, http);
 
   cupsFreeOptions(num_form, form);
   free(form_data);
 
   return (*token ? token : NULL);
 }
+
+
+//
+// 'moauthRevokeToken()' - Revoke an access or refresh token.
+//
+// This function asks the OAuth server to invalidate the token per RFC 7009.
+// The "token_type_hint" argument is "access_token", "refresh_token", or `NULL`
+// if not known.  Any cached introspection result for the token is discarded
+// so the next introspection asks the server.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthRevokeToken(
+    moauth_t   *server,			// I - Connection to OAuth server
+    const char *token,			// I - Access or refresh token
+    const char *token_type_hint)	// I - Type of token or `NULL`
+{
+  http_t	*http = NULL;		// HTTP connection
+  char		resource[256];		// Revocation endpoint resource
+  http_status_t	status;			// Response status
+  size_t	num_form = 0;		// Number of form variables
+  cups_option_t	*form = NULL;		// Form variables
+  char		*form_data = NULL;	// POST form data
+  size_t	form_length;		// Length of data
+  bool		ret = false;		// Return value
+  unsigned char	digest[_MOAUTH_MAX_DIGEST];
+					// SHA-256 digest of token
+
+
+  // Range check input...
+  if (!server || !token)
+  {
+    if (server)
+      snprintf(server->error, sizeof(server->error), "Bad arguments to function.");
+
+    return (false);
+  }
+
+  if (!server->revocation_endpoint)
+  {
+    snprintf(server->error, sizeof(server->error), "Revocation not supported.");
+    return (false);
+  }
+
+  // Prepare form data to revoke the token...
+  num_form = cupsAddOption("token", token, num_form, &form);
+  if (token_type_hint)
+    num_form = cupsAddOption("token_type_hint", token_type_hint, num_form, &form);
+
+  if ((form_data = cupsFormEncode(/*url*/NULL, num_form, form)) == NULL)
+  {
+    snprintf(server->error, sizeof(server->error), "Unable to encode form data.");
+    goto done;
+  }
+
+  form_length = strlen(form_data);
+
+  // Send a POST request with the form data...
+  if ((http = _moauthGetConnection(server, server->revocation_endpoint, resource, sizeof(resource))) == NULL)
+  {
+    snprintf(server->error, sizeof(server->error), "Connection to revocation endpoint failed: %s", cupsGetErrorString());
+    goto done;
+  }
+
+  httpClearFields(http);
+  httpSetField(http, HTTP_FIELD_CONTENT_TYPE, "application/x-www-form-urlencoded");
+  httpSetLength(http, form_length);
+
+  if (!httpWriteRequest(http, "POST", resource))
+  {
+    if (!httpConnectAgain(http, 30000, NULL))
+    {
+      snprintf(server->error, sizeof(server->error), "Reconnect to revocation endpoint failed: %s", cupsGetErrorString());
+      goto done;
+    }
+
+    if (!httpWriteRequest(http, "POST", resource))
+    {
+      snprintf(server->error, sizeof(server->error), "POST failed: %s", cupsGetErrorString());
+      goto done;
+    }
+  }
+
+  if (httpWrite(http, form_data, form_length) < form_length)
+  {
+    snprintf(server->error, sizeof(server->error), "Write failed: %s", cupsGetErrorString());
+    goto done;
+  }
+
+  while ((status = httpUpdate(http)) == HTTP_STATUS_CONTINUE);
+
+  free(_moauthCopyMessageBody(http));
+
+  if (status == HTTP_STATUS_OK)
+  {
+    // Forget any cached introspection result...
+    cupsHashData("sha2-256", token, strlen(token), digest, sizeof(digest));
+    forget_introspection(server, digest);
+
+    ret = true;
+  }
+  else
+  {
+    snprintf(server->error, sizeof(server->error), "Unable to revoke token: POST status %d", status);
+  }
+
+  // Close the connection and return...
+  done:
+
+  _moauthReleaseConnection(server, http);
+
+  cupsFreeOptions(num_form, form);
+  free(form_data);
+
+  return (ret);
+}
+
+
+//
+// 'moauthSetIntrospectionCache()' - Enable or disable caching of introspection
+//                                   results.
+//
+// Active tokens are cached until their expiration date/time or for `max_ttl`
+// seconds, whichever comes first.  Inactive tokens are cached for
+// `negative_ttl` seconds - specify 0 to always ask the server about them.
+// Specify 0 entries to disable the cache.  Any previously cached results are
+// discarded.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthSetIntrospectionCache(
+    moauth_t *server,			// I - Connection to OAuth server
+    size_t   num_entries,		// I - Number of cache entries or 0 to disable
+    int      max_ttl,			// I - Maximum seconds to cache active tokens
+    int      negative_ttl)		// I - Seconds to cache inactive tokens
+{
+  _moauth_icache_t *cache = NULL,	// New cache
+		*old_cache;		// Old cache
+  size_t	old_size,		// Old cache size
+		i;			// Looping var
+
+
+  if (!server || max_ttl < 0 || negative_ttl < 0)
+  {
+    if (server)
+      snprintf(server->error, sizeof(server->error), "Bad arguments to function.");
+
+    return (false);
+  }
+
+  if (num_entries > 0 && (cache = calloc(num_entries, sizeof(_moauth_icache_t))) == NULL)
+  {
+    snprintf(server->error, sizeof(server->error), "Unable to allocate introspection cache.");
+    return (false);
+  }
+
+  cupsMutexLock(&server->cache_lock);
+
+  old_cache = server->cache;
+  old_size  = server->cache_size;
+
+  server->cache              = cache;
+  server->cache_size         = num_entries;
+  server->cache_ttl          = max_ttl;
+  server->cache_negative_ttl = negative_ttl;
+  server->cache_hits         = 0;
+  server->cache_misses       = 0;
+
+  cupsMutexUnlock(&server->cache_lock);
+
+  for (i = 0; i < old_size; i ++)
+  {
+    free(old_cache[i].username);
+    free(old_cache[i].scope);
+  }
+
+  free(old_cache);
+
+  return (true);
+}
+
+
+//
+// 'async_introspection()' - Introspect queued tokens in a background thread.
+//
+
+static void *				// O - Thread exit status
+async_introspection(
+    moauth_t *server)			// I - Connection to OAuth server
+{
+  _moauth_async_t *async;		// Asynchronous request
+  moauth_introspect_t *results;		// Results
+  bool		status;			// Status of request
+  size_t	i;			// Looping var
+
+
+  cupsMutexLock(&server->pool_lock);
+
+  while (!server->async_done)
+  {
+    if ((async = server->async_first) == NULL)
+    {
+      cupsCondWait(&server->async_cond, &server->pool_lock, 1.0);
+      continue;
+    }
+
+    if ((server->async_first = async->next) == NULL)
+      server->async_last = NULL;
+
+    cupsMutexUnlock(&server->pool_lock);
+
+    if ((results = calloc(async->num_tokens ? async->num_tokens : 1, sizeof(moauth_introspect_t))) != NULL)
+      status = moauthIntrospectTokens(server, async->num_tokens, (const char * const *)async->tokens, results);
+    else
+      status = false;
+
+    (async->cb)(server, status, async->num_tokens, (const char * const *)async->tokens, results, async->cb_data);
+
+    for (i = 0; i < async->num_tokens; i ++)
+      free(async->tokens[i]);
+
+    free(async->tokens);
+    free(async);
+    free(results);
+
+    cupsMutexLock(&server->pool_lock);
+    server->num_async --;
+    cupsCondBroadcast(&server->async_cond);
+  }
+
+  cupsMutexUnlock(&server->pool_lock);
+
+  return (NULL);
+}
+
+
+//
+// 'find_introspection()' - Find a cached introspection result.
+//
+
+static bool				// O - `true` if found, `false` otherwise
+find_introspection(
+    moauth_t            *server,	// I - Connection to OAuth server
+    const unsigned char *digest,	// I - SHA-256 digest of token
+    char                *username,	// I - Username buffer
+    size_t              username_size,	// I - Size of username string
+    char                *scope,		// I - Scope buffer
+    size_t              scope_size,	// I - Size of scope string
+    time_t              *expires,	// O - Expiration date
+    bool                *active)	// O - Is the token active?
+{
+  _moauth_icache_t *entry;		// Cache entry
+  bool		found = false;		// Found the token?
+
+
+  cupsMutexLock(&server->cache_lock);
+
+  if (server->cache)
+  {
+    entry = server->cache + ((digest[0] | (digest[1] << 8) | (digest[2] << 16)) % server->cache_size);
+
+    if (entry->expires > time(NULL) && !memcmp(entry->digest, digest, sizeof(entry->digest)))
+    {
+      found   = true;
+      *active = entry->active;
+
+      if (username && entry->username)
+        cupsCopyString(username, entry->username, username_size);
+
+      if (scope && entry->scope)
+        cupsCopyString(scope, entry->scope, scope_size);
+
+      if (expires)
+        *expires = entry->exp;
+
+      server->cache_hits ++;
+    }
+    else
+    {
+      server->cache_misses ++;
+    }
+  }
+
+  cupsMutexUnlock(&server->cache_lock);
+
+  return (found);
+}
+
+
+//
+// 'forget_introspection()' - Remove a cached introspection result.
+//
+
+static void
+forget_introspection(
+    moauth_t            *server,	// I - Connection to OAuth server
+    const unsigned char *digest)	// I - SHA-256 digest of token
+{
+  _moauth_icache_t *entry;		// Cache entry
+
+
+  cupsMutexLock(&server->cache_lock);
+
+  if (server->cache)
+  {
+    entry = server->cache + ((digest[0] | (digest[1] << 8) | (digest[2] << 16)) % server->cache_size);
+
+    if (!memcmp(entry->digest, digest, sizeof(entry->digest)))
+      entry->expires = 0;
+  }
+
+  cupsMutexUnlock(&server->cache_lock);
+}
+
+
+//
+// 'save_introspection()' - Cache an introspection result.
+//
+
+static void
+save_introspection(
+    moauth_t            *server,	// I - Connection to OAuth server
+    const unsigned char *digest,	// I - SHA-256 digest of token
+    bool                active,		// I - Is the token active?
+    const char          *username,	// I - Username or `NULL`
+    const char          *scope,		// I - Scope or `NULL`
+    time_t              exp)		// I - Token expiration date/time or 0
+{
+  _moauth_icache_t *entry;		// Cache entry
+  time_t	curtime = time(NULL),	// Current time
+		expires;		// When the entry expires
+
+
+  cupsMutexLock(&server->cache_lock);
+
+  if (!server->cache)
+    goto done;
+
+  // Figure out how long to keep the result...
+  if (active)
+  {
+    expires = curtime + server->cache_ttl;
+
+    if (exp > 0 && exp < expires)
+      expires = exp;
+  }
+  else
+  {
+    expires = curtime + server->cache_negative_ttl;
+  }
+
+  entry = server->cache + ((digest[0] | (digest[1] << 8) | (digest[2] << 16)) % server->cache_size);
+
+  if (expires <= curtime)
+  {
+    // Not caching this result, but don't keep a stale one either...
+    if (!memcmp(entry->digest, digest, sizeof(entry->digest)))
+      entry->expires = 0;
+
+    goto done;
+  }
+
+  // Replace whatever is in the slot for this digest...
+  free(entry->username);
+  free(entry->scope);
+
+  memcpy(entry->digest, digest, sizeof(entry->digest));
+  entry->expires  = expires;
+  entry->active   = active;
+  entry->username = username ? strdup(username) : NULL;
+  entry->scope    = scope ? strdup(scope) : NULL;
+  entry->exp      = exp;
+
+  done:
+
+  cupsMutexUnlock(&server->cache_lock);
+}
+
+
+//
+// 'send_introspection()' - Send a batch introspection request.
+//
+
+static http_status_t			// O - Response status
+send_introspection(
+    moauth_t            *server,	// I - Connection to OAuth server
+    size_t              num_batch,	// I - Number of tokens in batch
+    const size_t        *batch,		// I - Token indices
+    const char * const  *tokens,	// I - Access tokens
+    unsigned char       digests[][_MOAUTH_MAX_DIGEST],
+					// I - SHA-256 digests of batch tokens
+    moauth_introspect_t *results)	// O - Results
+{
+  http_t	*http = NULL;		// HTTP connection
+  char		resource[256];		// Introspection endpoint resource
+  http_status_t	status = HTTP_STATUS_ERROR;
+					// Response status
+  cups_json_t	*request,		// JSON request
+		*array,			// Array of tokens
+		*json = NULL,		// JSON response
+		*jresults,		// Array of results
+		*jresult;		// Current result
+  char		*json_data = NULL;	// JSON request/response data
+  size_t	i,			// Looping var
+		json_length;		// Length of JSON request
+  const char	*value;			// JSON value
+  moauth_introspect_t *result;		// Current result
+
+
+  // Prepare the JSON request...
+  request = cupsJSONNew(/*parent*/NULL, /*after*/NULL, CUPS_JTYPE_OBJECT);
+  array   = cupsJSONNew(request, cupsJSONNewKey(request, /*after*/NULL, "tokens"), CUPS_JTYPE_ARRAY);
+
+  for (i = 0; i < num_batch; i ++)
+    cupsJSONNewString(array, /*after*/NULL, tokens[batch[i]]);
+
+  json_data = cupsJSONExportString(request);
+  cupsJSONDelete(request);
+
+  if (!json_data)
+  {
+    snprintf(server->error, sizeof(server->error), "Unable to encode JSON request.");
+    goto done;
+  }
+
+  json_length = strlen(json_data);
+
+  // Send a POST request with the JSON data...
+  if ((http = _moauthGetConnection(server, server->introspection_endpoint, resource, sizeof(resource))) == NULL)
+  {
+    snprintf(server->error, sizeof(server->error), "Connection to introspection endpoint failed: %s", cupsGetErrorString());
+    goto done;
+  }
+
+  httpClearFields(http);
+  httpSetField(http, HTTP_FIELD_CONTENT_TYPE, "application/json");
+  httpSetLength(http, json_length);
+
+  if (!httpWriteRequest(http, "POST", resource))
+  {
+    if (!httpConnectAgain(http, 30000, NULL))
+    {
+      snprintf(server->error, sizeof(server->error), "Reconnect failed: %s", cupsGetErrorString());
+      goto done;
+    }
+
+    if (!httpWriteRequest(http, "POST", resource))
+    {
+      snprintf(server->error, sizeof(server->error), "POST failed: %s", cupsGetErrorString());
+      goto done;
+    }
+  }
+
+  if (httpWrite(http, json_data, json_length) < json_length)
+  {
+    snprintf(server->error, sizeof(server->error), "Write failed: %s", cupsGetErrorString());
+    goto done;
+  }
+
+  free(json_data);
+  json_data = NULL;
+
+  while ((status = httpUpdate(http)) == HTTP_STATUS_CONTINUE);
+
+  if (status == HTTP_STATUS_OK)
+  {
+    json_data = _moauthCopyMessageBody(http);
+    json      = cupsJSONImportString(json_data);
+    jresults  = cupsJSONFind(json, "results");
+
+    if (cupsJSONGetType(jresults) != CUPS_JTYPE_ARRAY || cupsJSONGetCount(jresults) != num_batch)
+    {
+      snprintf(server->error, sizeof(server->error), "Bad introspection response.");
+      status = HTTP_STATUS_ERROR;
+      goto done;
+    }
+
+    for (i = 0; i < num_batch; i ++)
+    {
+      jresult = cupsJSONGetChild(jresults, i);
+      result  = results + batch[i];
+
+      result->active = cupsJSONGetType(cupsJSONFind(jresult, "active")) == CUPS_JTYPE_TRUE;
+
+      if ((value = cupsJSONGetString(cupsJSONFind(jresult, "username"))) != NULL)
+        cupsCopyString(result->username, value, sizeof(result->username));
+
+      if ((value = cupsJSONGetString(cupsJSONFind(jresult, "scope"))) != NULL)
+        cupsCopyString(result->scope, value, sizeof(result->scope));
+
+      result->expires = (time_t)cupsJSONGetNumber(cupsJSONFind(jresult, "exp"));
+
+      save_introspection(server, digests[i], result->active, cupsJSONGetString(cupsJSONFind(jresult, "username")), cupsJSONGetString(cupsJSONFind(jresult, "scope")), result->expires);
+    }
+  }
+  else if (status != HTTP_STATUS_BAD_REQUEST)
+  {
+    snprintf(server->error, sizeof(server->error), "Unable to introspect access tokens: POST status %d", status);
+  }
+
+  // Return whatever we got...
+  done:
+
+  _moauthReleaseConnection(server, http);
+
+  cupsJSONDelete(json);
+  free(json_data);
+
+  return (status);
+}
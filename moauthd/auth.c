@@ -37,6 +37,7 @@ typedef struct moauthd_authdata_s	// PAM authentication data
 // Local functions...
 //
 
+static bool	get_auth_digest(moauthd_server_t *server, const char *username, const char *password, unsigned char *digest);
 #ifdef HAVE_LIBPAM
 static int	moauthd_pam_func(int num_msg, const struct pam_message **msg, struct pam_response **resp, moauthd_authdata_t *data);
 #endif // HAVE_LIBPAM
@@ -45,6 +46,10 @@ static int	moauthd_pam_func(int num_msg, const struct pam_message **msg, struct
 //
 // 'moauthdAuthenticateUser()' - Validate a username + password combination.
 //
+// Successful PAM authentications are cached for "AuthCacheLife" seconds using
+// a salted SHA-256 digest of the username and password.  Failures are never
+// cached.
+//
 
 bool					// O - `true` if correct, `false` otherwise
 moauthdAuthenticateUser(
@@ -53,9 +58,32 @@ moauthdAuthenticateUser(
     const char       *password)		// I - Password string
 {
   int	status = 0;			// Return status
+  moauthd_server_t *server = client->server;
+					// Server object
+  unsigned char	digest[32];		// Digest of username:password
+  bool		have_digest = false;	// Have a digest?
+  moauthd_authcache_t *entry;		// Cache entry
+
+
+  if (!server->test_password && server->auth_cache_life > 0 && get_auth_digest(server, username, password, digest))
+  {
+    // See if we have authenticated this user recently...
+    have_digest = true;
+    entry       = server->auth_cache + (((size_t)digest[0] << 8) | digest[1]) % MOAUTHD_AUTH_CACHE_SIZE;
 
+    cupsMutexLock(&server->auth_cache_lock);
+    status = entry->expires > time(NULL) && !memcmp(entry->digest, digest, sizeof(digest));
+    cupsMutexUnlock(&server->auth_cache_lock);
+
+    if (status)
+    {
+      atomic_fetch_add_explicit(&server->auth_cache_hits, 1, memory_order_relaxed);
+      moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "Cached authentication of \"%s\" succeeded.", username);
+      return (true);
+    }
 
-  (void)username;
+    atomic_fetch_add_explicit(&server->auth_cache_misses, 1, memory_order_relaxed);
+  }
 
   if (client->server->test_password)
   {
@@ -72,6 +100,8 @@ moauthdAuthenticateUser(
     pam_handle_t	*pamh;		// PAM authentication handle
     int			pamerr;		// PAM error code
     struct pam_conv	pamdata;	// PAM conversation data
+    double		start = moauthdGetClock();
+					// Start of authentication
 
     data.username = username;
     data.password = password;
@@ -115,6 +145,8 @@ moauthdAuthenticateUser(
     if (pamh)
       pam_end(pamh, PAM_SUCCESS);
 
+    moauthdAddLatency(&server->pam_latency, moauthdGetClock() - start);
+
     if (pamerr == PAM_SUCCESS)
     {
       moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "PAM authentication of \"%s\" succeeded.", username);
@@ -123,6 +155,125 @@ moauthdAuthenticateUser(
   }
 #endif // HAVE_LIBPAM
 
+  if (status && have_digest)
+  {
+    // Cache the successful authentication...
+    entry = server->auth_cache + (((size_t)digest[0] << 8) | digest[1]) % MOAUTHD_AUTH_CACHE_SIZE;
+
+    cupsMutexLock(&server->auth_cache_lock);
+    memcpy(entry->digest, digest, sizeof(entry->digest));
+    entry->expires = time(NULL) + server->auth_cache_life;
+    cupsMutexUnlock(&server->auth_cache_lock);
+  }
+
+  return (status);
+}
+
+
+//
+// 'moauthdGetUserGroups()' - Get the groups for a user.
+//
+// Group lists are cached by UID for "GroupCacheLife" seconds.
+//
+
+int					// O - Number of groups or `-1` on error
+moauthdGetUserGroups(
+    moauthd_server_t *server,		// I - Server object
+    const char       *username,		// I - Username
+    uid_t            uid,		// I - User ID
+    gid_t            gid,		// I - Primary group ID
+#ifdef __APPLE__
+    int              *gids,		// O - Groups
+#else
+    gid_t            *gids,		// O - Groups
+#endif // __APPLE__
+    int              num_gids)		// I - Size of groups array
+{
+  moauthd_groupcache_t	*entry = server->group_cache + uid % MOAUTHD_GROUP_CACHE_SIZE;
+					// Cache entry
+  time_t		curtime = time(NULL);
+					// Current time
+
+
+  if (server->group_cache_life > 0)
+  {
+    // Use the cached list as needed...
+    cupsMutexLock(&server->auth_cache_lock);
+
+    if (entry->uid == uid && entry->expires > curtime)
+    {
+      if (num_gids > entry->num_gids)
+        num_gids = entry->num_gids;
+
+      memcpy(gids, entry->gids, (size_t)num_gids * sizeof(gids[0]));
+      cupsMutexUnlock(&server->auth_cache_lock);
+
+      atomic_fetch_add_explicit(&server->group_cache_hits, 1, memory_order_relaxed);
+
+      return (num_gids);
+    }
+
+    cupsMutexUnlock(&server->auth_cache_lock);
+
+    atomic_fetch_add_explicit(&server->group_cache_misses, 1, memory_order_relaxed);
+  }
+
+#ifdef __APPLE__
+  if (getgrouplist(username, (int)gid, gids, &num_gids))
+#else
+  if (getgrouplist(username, gid, gids, &num_gids))
+#endif // __APPLE__
+    return (-1);
+
+  if (server->group_cache_life > 0 && num_gids <= MOAUTHD_MAX_GROUPS)
+  {
+    // Cache the list...
+    cupsMutexLock(&server->auth_cache_lock);
+
+    entry->uid      = uid;
+    entry->expires  = curtime + server->group_cache_life;
+    entry->num_gids = num_gids;
+    memcpy(entry->gids, gids, (size_t)num_gids * sizeof(gids[0]));
+
+    cupsMutexUnlock(&server->auth_cache_lock);
+  }
+
+  return (num_gids);
+}
+
+
+//
+// 'get_auth_digest()' - Compute the salted digest for a username and password.
+//
+
+static bool				// O - `true` on success, `false` if too long
+get_auth_digest(
+    moauthd_server_t *server,		// I - Server object
+    const char       *username,		// I - Username
+    const char       *password,		// I - Password
+    unsigned char    *digest)		// O - SHA-256 digest (32 bytes)
+{
+  unsigned char	buffer[1024];		// Salt + username + password
+  size_t	userlen = strlen(username),
+					// Length of username
+		passlen = strlen(password),
+					// Length of password
+		bytes;			// Total length
+  bool		status;			// Return status
+
+
+  if ((bytes = sizeof(server->auth_cache_salt) + userlen + 1 + passlen) > sizeof(buffer))
+    return (false);
+
+  memcpy(buffer, server->auth_cache_salt, sizeof(server->auth_cache_salt));
+  memcpy(buffer + sizeof(server->auth_cache_salt), username, userlen + 1);
+  memcpy(buffer + sizeof(server->auth_cache_salt) + userlen + 1, password, passlen);
+
+  status = cupsHashData("sha2-256", buffer, bytes, digest, 32) == 32;
+
+  // Don't leave the password on the stack...
+  memset(buffer, 0, sizeof(buffer));
+
   return (status);
 }
 
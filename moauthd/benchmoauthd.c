@@ -0,0 +1,869 @@
+//
+// Benchmark program for moauth daemon
+//
+// Copyright © 2017-2024 by Michael R Sweet
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// Usage:
+//
+//   ./benchmoauthd [OPTIONS] [OAUTH-URL]
+//
+// Options:
+//
+//   -B PATH        Resource fetched by the "bearer" workload
+//   -F PATH        Resource fetched by the "file" workload
+//   -c CLIENTS     Number of concurrent clients (default 4)
+//   -d SECONDS     Duration of the benchmark (default 10)
+//   -n REQUESTS    Number of requests per client instead of a duration
+//   -p PASSWORD    Password (default $TEST_PASSWORD or "test123")
+//   -u USERNAME    Username (default current user)
+//   -v             Run a spawned moauthd with debug logging
+//   -w WORKLOADS   Comma-delimited list of workloads (default "all")
+//
+// Workloads are "password" (password grants), "code" (authorization code
+// grants with PKCE), "refresh" (refresh token grants), "introspect" (token
+// introspection), "bearer" (Bearer-authenticated GET requests), and "file"
+// (unauthenticated GET requests).  Each client runs the selected workloads in
+// turn on its own keep-alive connection.
+//
+// When no URL is given, moauthd is started using the "test.conf" file, just
+// like testmoauthd.
+//
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <spawn.h>
+#include <cups/form.h>
+#include <cups/thread.h>
+#include <signal.h>
+#include <time.h>
+#include <moauth/moauth-private.h>
+extern char **environ;
+
+
+//
+// Constants...
+//
+
+#define REDIRECT_URI	"https://localhost:10000"
+#define CLIENT_ID	"testmoauthd"
+
+
+//
+// Local types...
+//
+
+typedef enum bench_op_e			// Benchmark workloads
+{
+  BENCH_OP_PASSWORD,			// Password grants
+  BENCH_OP_CODE,			// Authorization code grants with PKCE
+  BENCH_OP_REFRESH,			// Refresh token grants
+  BENCH_OP_INTROSPECT,			// Token introspection
+  BENCH_OP_BEARER,			// Bearer-authenticated GET requests
+  BENCH_OP_FILE,			// Unauthenticated GET requests
+  BENCH_OP_MAX				// Number of workloads
+} bench_op_t;
+
+typedef struct bench_stats_s		// Workload statistics
+{
+  size_t	count,			// Number of requests
+		errors,			// Number of failed requests
+		num_samples,		// Number of latency samples
+		alloc_samples;		// Allocated latency samples
+  double	*samples;		// Latency samples in seconds
+} bench_stats_t;
+
+typedef struct bench_client_s		// Benchmark client
+{
+  int		number;			// Client number
+  cups_thread_t	tid;			// Client thread
+  moauth_t	*server;		// Connection to OAuth server
+  http_t	*http;			// Keep-alive connection for GET/authorize
+  char		token[2048],		// Current access token
+		refresh[2048];		// Current refresh token
+  bench_stats_t	stats[BENCH_OP_MAX];	// Statistics for each workload
+} bench_client_t;
+
+
+//
+// Local globals...
+//
+
+static const char * const bench_names[BENCH_OP_MAX] =
+{					// Workload names
+  "password",
+  "code",
+  "refresh",
+  "introspect",
+  "bearer",
+  "file"
+};
+static bool		bench_ops[BENCH_OP_MAX];
+					// Selected workloads
+static double		bench_end = 0.0;// End time for benchmark
+static int		bench_requests = 0;
+					// Number of requests per client
+static const char	*bench_bearer = "/private/private.pdf",
+					// Resource for bearer workload
+			*bench_file = "/LICENSE.md",
+					// Resource for file workload
+			*bench_username = NULL,
+					// Username
+			*bench_password = NULL;
+					// Password
+static char		bench_host[256],// OAuth server hostname
+			bench_resource[256];
+					// OAuth server resource path
+static int		bench_port;	// OAuth server port
+static moauth_t		*bench_server = NULL;
+					// Initial connection to OAuth server
+static volatile bool	stop_bench = false;
+					// Stop the benchmark?
+
+
+//
+// Local functions...
+//
+
+static void	add_sample(bench_stats_t *stats, double secs, bool success);
+static int	compare_samples(const double *a, const double *b);
+static double	get_clock(void);
+static bool	get_code(bench_client_t *bc, const char *verifier, char *code, size_t codesize);
+static http_status_t send_request(bench_client_t *bc, const char *method, const char *resource, const char *token, const char *body, char *location, size_t locsize);
+static void	report_stats(const char *name, bench_stats_t *stats, double elapsed);
+static bool	run_op(bench_client_t *bc, bench_op_t op);
+static void	*run_client(bench_client_t *bc);
+static void	sig_handler(int sig);
+static pid_t	start_moauthd(int verbosity);
+static int	usage(FILE *out);
+
+
+//
+// 'main()' - Main entry for benchmark program.
+//
+
+int					// O - Exit status
+main(int  argc,				// I - Number of command-line arguments
+     char *argv[])			// I - Command-line arguments
+{
+  int			i,		// Looping var
+			j,		// Looping var
+			num_clients = 4,// Number of concurrent clients
+			duration = 10,	// Duration in seconds
+			verbosity = 0;	// Verbosity for server
+  const char		*opt,		// Current option
+			*workloads = "all",
+					// Selected workloads
+			*url = NULL;	// OAuth server URL
+  char			temp[1024],	// Temporary string
+			*ptr,		// Pointer into string
+			scheme[32],	// URL scheme
+			userpass[256];	// URL username:password
+  pid_t			moauthd_pid = 0;// moauthd process ID
+  bench_client_t	*clients;	// Benchmark clients
+  bench_stats_t		totals[BENCH_OP_MAX + 1];
+					// Combined statistics
+  double		start,		// Start time
+			elapsed;	// Elapsed time
+  size_t		errors = 0;	// Total number of errors
+  time_t		timeout;	// Connection timeout
+
+
+  // Parse command-line arguments...
+  for (i = 1; i < argc; i ++)
+  {
+    if (!strcmp(argv[i], "--help"))
+    {
+      return (usage(stdout));
+    }
+    else if (argv[i][0] == '-' && argv[i][1] != '-')
+    {
+      for (opt = argv[i] + 1; *opt; opt ++)
+      {
+        switch (*opt)
+        {
+          case 'B' : // -B PATH
+              if (++ i >= argc)
+                return (usage(stderr));
+              bench_bearer = argv[i];
+              break;
+
+          case 'F' : // -F PATH
+              if (++ i >= argc)
+                return (usage(stderr));
+              bench_file = argv[i];
+              break;
+
+          case 'c' : // -c CLIENTS
+              if (++ i >= argc || (num_clients = atoi(argv[i])) < 1)
+                return (usage(stderr));
+              break;
+
+          case 'd' : // -d SECONDS
+              if (++ i >= argc || (duration = atoi(argv[i])) < 1)
+                return (usage(stderr));
+              break;
+
+          case 'n' : // -n REQUESTS
+              if (++ i >= argc || (bench_requests = atoi(argv[i])) < 1)
+                return (usage(stderr));
+              break;
+
+          case 'p' : // -p PASSWORD
+              if (++ i >= argc)
+                return (usage(stderr));
+              bench_password = argv[i];
+              break;
+
+          case 'u' : // -u USERNAME
+              if (++ i >= argc)
+                return (usage(stderr));
+              bench_username = argv[i];
+              break;
+
+          case 'v' : // -v
+              verbosity ++;
+              break;
+
+          case 'w' : // -w WORKLOADS
+              if (++ i >= argc)
+                return (usage(stderr));
+              workloads = argv[i];
+              break;
+
+          default :
+              fprintf(stderr, "benchmoauthd: Unknown option '-%c'.\n", *opt);
+              return (usage(stderr));
+        }
+      }
+    }
+    else if (!url)
+    {
+      url = argv[i];
+    }
+    else
+    {
+      return (usage(stderr));
+    }
+  }
+
+  // Figure out which workloads to run...
+  cupsCopyString(temp, workloads, sizeof(temp));
+
+  for (ptr = strtok(temp, ","); ptr; ptr = strtok(NULL, ","))
+  {
+    if (!strcmp(ptr, "all"))
+    {
+      for (j = 0; j < BENCH_OP_MAX; j ++)
+        bench_ops[j] = true;
+      continue;
+    }
+
+    for (j = 0; j < BENCH_OP_MAX; j ++)
+    {
+      if (!strcmp(ptr, bench_names[j]))
+        break;
+    }
+
+    if (j >= BENCH_OP_MAX)
+    {
+      fprintf(stderr, "benchmoauthd: Unknown workload \"%s\".\n", ptr);
+      return (usage(stderr));
+    }
+
+    bench_ops[j] = true;
+  }
+
+  for (j = 0; j < BENCH_OP_MAX; j ++)
+  {
+    if (bench_ops[j])
+      break;
+  }
+
+  if (j >= BENCH_OP_MAX)
+  {
+    fputs("benchmoauthd: No workloads specified.\n", stderr);
+    return (usage(stderr));
+  }
+
+  if (!bench_username)
+    bench_username = cupsGetUser();
+
+  if (!bench_password && (bench_password = getenv("TEST_PASSWORD")) == NULL)
+    bench_password = "test123";
+
+  // Catch signals...
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Start a server as needed...
+  if (!url)
+  {
+    if ((moauthd_pid = start_moauthd(verbosity)) <= 0)
+    {
+      fprintf(stderr, "benchmoauthd: Unable to start moauthd: %s\n", strerror(errno));
+      return (1);
+    }
+
+    httpGetHostname(NULL, temp, sizeof(temp));
+    httpAssembleURI(HTTP_URI_CODING_ALL, userpass, sizeof(userpass), "https", NULL, temp, 9000 + (getuid() % 1000), "/");
+    url = userpass;
+  }
+
+  if (httpSeparateURI(HTTP_URI_CODING_ALL, url, scheme, sizeof(scheme), temp, sizeof(temp), bench_host, sizeof(bench_host), &bench_port, bench_resource, sizeof(bench_resource)) < HTTP_URI_STATUS_OK || strcmp(scheme, "https"))
+  {
+    fprintf(stderr, "benchmoauthd: Bad OAuth URL \"%s\".\n", url);
+    goto finish_up;
+  }
+
+  // Remove the trailing slash from the resource path so that endpoint paths
+  // can be appended...
+  if ((ptr = bench_resource + strlen(bench_resource) - 1) >= bench_resource && *ptr == '/')
+    *ptr = '\0';
+
+  // Connect to the server, waiting up to 30 seconds for a spawned server...
+  for (timeout = time(NULL) + 30; !stop_bench && time(NULL) < timeout;)
+  {
+    if ((bench_server = moauthConnect(url)) != NULL || !moauthd_pid)
+      break;
+
+    sleep(1);
+  }
+
+  if (!bench_server)
+  {
+    fprintf(stderr, "benchmoauthd: Unable to connect to \"%s\".\n", url);
+    goto finish_up;
+  }
+
+  // Start the clients...
+  if ((clients = calloc((size_t)num_clients, sizeof(bench_client_t))) == NULL)
+  {
+    fprintf(stderr, "benchmoauthd: Unable to allocate clients: %s\n", strerror(errno));
+    goto finish_up;
+  }
+
+  if (bench_requests)
+    printf("Running %d clients for %d requests each against \"%s\"...\n", num_clients, bench_requests, url);
+  else
+    printf("Running %d clients for %d seconds against \"%s\"...\n", num_clients, duration, url);
+
+  start     = get_clock();
+  bench_end = bench_requests ? 0.0 : start + duration;
+
+  for (i = 0; i < num_clients; i ++)
+  {
+    clients[i].number = i + 1;
+
+    // Each client gets its own connection pool and error string so that the
+    // benchmark measures the endpoints and not TLS handshakes...
+    if ((clients[i].server = moauthConnect(url)) == NULL)
+    {
+      fprintf(stderr, "benchmoauthd: Unable to connect client %d to \"%s\".\n", i + 1, url);
+      num_clients = i;
+      stop_bench  = true;
+      break;
+    }
+
+    if ((clients[i].tid = cupsThreadCreate((cups_thread_func_t)run_client, clients + i)) == CUPS_THREAD_INVALID)
+    {
+      fprintf(stderr, "benchmoauthd: Unable to start client thread: %s\n", strerror(errno));
+      moauthClose(clients[i].server);
+      num_clients = i;
+      stop_bench  = true;
+      break;
+    }
+  }
+
+  for (i = 0; i < num_clients; i ++)
+    cupsThreadWait(clients[i].tid);
+
+  elapsed = get_clock() - start;
+
+  // Merge and report the statistics...
+  memset(totals, 0, sizeof(totals));
+
+  for (j = 0; j < BENCH_OP_MAX; j ++)
+  {
+    for (i = 0; i < num_clients; i ++)
+    {
+      bench_stats_t	*stats = clients[i].stats + j;
+					// Client statistics
+      size_t		k;		// Looping var
+
+      for (k = 0; k < stats->num_samples; k ++)
+      {
+        add_sample(totals + j, stats->samples[k], true);
+        add_sample(totals + BENCH_OP_MAX, stats->samples[k], true);
+      }
+
+      totals[j].errors            += stats->errors;
+      totals[BENCH_OP_MAX].errors += stats->errors;
+      totals[j].count             += stats->errors;
+      totals[BENCH_OP_MAX].count  += stats->errors;
+
+      free(stats->samples);
+    }
+  }
+
+  printf("\n%-12s %10s %8s %10s %9s %9s %9s %9s\n", "WORKLOAD", "REQUESTS", "ERRORS", "REQ/SEC", "P50-MS", "P90-MS", "P99-MS", "MAX-MS");
+
+  for (j = 0; j < BENCH_OP_MAX; j ++)
+  {
+    if (bench_ops[j])
+      report_stats(bench_names[j], totals + j, elapsed);
+
+    free(totals[j].samples);
+  }
+
+  report_stats("total", totals + BENCH_OP_MAX, elapsed);
+  free(totals[BENCH_OP_MAX].samples);
+
+  errors = totals[BENCH_OP_MAX].errors;
+
+  for (i = 0; i < num_clients; i ++)
+  {
+    httpClose(clients[i].http);
+    moauthClose(clients[i].server);
+  }
+
+  free(clients);
+
+  // Stop the server...
+  finish_up:
+
+  moauthClose(bench_server);
+
+  if (moauthd_pid > 0)
+    kill(moauthd_pid, SIGTERM);
+
+  return (bench_server && !errors ? 0 : 1);
+}
+
+
+//
+// 'add_sample()' - Add a latency sample to the statistics.
+//
+
+static void
+add_sample(bench_stats_t *stats,	// I - Statistics
+           double        secs,		// I - Latency in seconds
+           bool          success)	// I - Did the request succeed?
+{
+  stats->count ++;
+
+  if (!success)
+  {
+    stats->errors ++;
+    return;
+  }
+
+  if (stats->num_samples >= stats->alloc_samples)
+  {
+    size_t	alloc_samples = stats->alloc_samples ? 2 * stats->alloc_samples : 1024;
+					// New allocation size
+    double	*samples;		// New samples array
+
+    if ((samples = realloc(stats->samples, alloc_samples * sizeof(double))) == NULL)
+      return;
+
+    stats->samples       = samples;
+    stats->alloc_samples = alloc_samples;
+  }
+
+  stats->samples[stats->num_samples ++] = secs;
+}
+
+
+//
+// 'compare_samples()' - Compare two latency samples.
+//
+
+static int				// O - Result of comparison
+compare_samples(const double *a,	// I - First sample
+                const double *b)	// I - Second sample
+{
+  if (*a < *b)
+    return (-1);
+  else if (*a > *b)
+    return (1);
+  else
+    return (0);
+}
+
+
+//
+// 'get_clock()' - Get the current monotonic time in seconds.
+//
+
+static double				// O - Seconds
+get_clock(void)
+{
+  struct timespec	curtime;	// Current time
+
+
+  clock_gettime(CLOCK_MONOTONIC, &curtime);
+
+  return ((double)curtime.tv_sec + 0.000000001 * curtime.tv_nsec);
+}
+
+
+//
+// 'get_code()' - Get an authorization code using the password form.
+//
+// This is the same POST that the "/authorize" web page does, so the code
+// exchange can be timed without a browser.
+//
+
+static bool				// O - `true` on success, `false` on failure
+get_code(bench_client_t *bc,		// I - Benchmark client
+         const char     *verifier,	// I - Code verifier
+         char           *code,		// I - Code buffer
+         size_t         codesize)	// I - Size of code buffer
+{
+  size_t	num_vars = 0;		// Number of form variables
+  cups_option_t	*vars = NULL;		// Form variables
+  unsigned char	sha256[32];		// SHA-256 hash of code verifier
+  char		challenge[64],		// Code challenge
+		resource[1024],		// Resource path
+		location[2048],		// Redirect location
+		*body,			// Form data
+		*ptr,			// Pointer into location
+		*end;			// End of code
+  http_status_t	status;			// Response status
+
+
+  cupsHashData("sha2-256", verifier, strlen(verifier), sha256, sizeof(sha256));
+  httpEncode64(challenge, sizeof(challenge), (char *)sha256, sizeof(sha256), true);
+
+  num_vars = cupsAddOption("response_type", "code", num_vars, &vars);
+  num_vars = cupsAddOption("client_id", CLIENT_ID, num_vars, &vars);
+  num_vars = cupsAddOption("redirect_uri", REDIRECT_URI, num_vars, &vars);
+  num_vars = cupsAddOption("state", "bench", num_vars, &vars);
+  num_vars = cupsAddOption("code_challenge", challenge, num_vars, &vars);
+  num_vars = cupsAddOption("username", bench_username, num_vars, &vars);
+  num_vars = cupsAddOption("password", bench_password, num_vars, &vars);
+
+  body = cupsFormEncode(NULL, num_vars, vars);
+  cupsFreeOptions(num_vars, vars);
+
+  if (!body)
+    return (false);
+
+  snprintf(resource, sizeof(resource), "%s/authorize", bench_resource);
+  status = send_request(bc, "POST", resource, NULL, body, location, sizeof(location));
+  free(body);
+
+  if (status != HTTP_STATUS_FOUND)
+    return (false);
+
+  // Pull the code out of the redirect URI...
+  if ((ptr = strstr(location, "?code=")) == NULL && (ptr = strstr(location, "&code=")) == NULL)
+    return (false);
+
+  cupsCopyString(code, ptr + 6, codesize);
+  if ((end = strchr(code, '&')) != NULL)
+    *end = '\0';
+
+  return (*code != '\0');
+}
+
+
+//
+// 'report_stats()' - Report the statistics for a workload.
+//
+
+static void
+report_stats(const char    *name,	// I - Workload name
+             bench_stats_t *stats,	// I - Statistics
+             double        elapsed)	// I - Elapsed time in seconds
+{
+  double	p50 = 0.0,		// 50th percentile
+		p90 = 0.0,		// 90th percentile
+		p99 = 0.0,		// 99th percentile
+		max = 0.0;		// Maximum
+
+
+  if (stats->num_samples > 0)
+  {
+    qsort(stats->samples, stats->num_samples, sizeof(double), (int (*)(const void *, const void *))compare_samples);
+
+    p50 = stats->samples[(stats->num_samples - 1) * 50 / 100];
+    p90 = stats->samples[(stats->num_samples - 1) * 90 / 100];
+    p99 = stats->samples[(stats->num_samples - 1) * 99 / 100];
+    max = stats->samples[stats->num_samples - 1];
+  }
+
+  printf("%-12s %10lu %8lu %10.1f %9.3f %9.3f %9.3f %9.3f\n", name, (unsigned long)stats->count, (unsigned long)stats->errors, elapsed > 0.0 ? stats->count / elapsed : 0.0, 1000.0 * p50, 1000.0 * p90, 1000.0 * p99, 1000.0 * max);
+}
+
+
+//
+// 'run_client()' - Run the selected workloads until the benchmark is done.
+//
+
+static void *				// O - Thread exit status
+run_client(bench_client_t *bc)		// I - Benchmark client
+{
+  int		count = 0;		// Number of requests
+  bench_op_t	op;			// Current workload
+  bool		ops[BENCH_OP_MAX];	// Workloads for this client
+
+
+  // Get the initial access and refresh tokens...
+  if (!moauthPasswordToken(bc->server, bench_username, bench_password, NULL, bc->token, sizeof(bc->token), bc->refresh, sizeof(bc->refresh), NULL))
+  {
+    fprintf(stderr, "benchmoauthd: Client %d unable to get access token: %s\n", bc->number, moauthErrorString(bc->server));
+    bc->stats[BENCH_OP_PASSWORD].count ++;
+    bc->stats[BENCH_OP_PASSWORD].errors ++;
+    return (NULL);
+  }
+
+  // Not every server issues refresh tokens...
+  memcpy(ops, bench_ops, sizeof(ops));
+
+  if (ops[BENCH_OP_REFRESH] && !bc->refresh[0])
+  {
+    if (bc->number == 1)
+      fputs("benchmoauthd: No refresh token issued, skipping \"refresh\" workload.\n", stderr);
+
+    ops[BENCH_OP_REFRESH] = false;
+  }
+
+  for (op = BENCH_OP_PASSWORD; op < BENCH_OP_MAX; op ++)
+  {
+    if (ops[op])
+      break;
+  }
+
+  while (!stop_bench && op < BENCH_OP_MAX)
+  {
+    if (bench_requests ? count >= bench_requests : get_clock() >= bench_end)
+      break;
+
+    if (ops[op])
+    {
+      double	start = get_clock();	// Start of request
+      bool	success = run_op(bc, op);
+					// Did the request succeed?
+
+      add_sample(bc->stats + op, get_clock() - start, success);
+      count ++;
+    }
+
+    op = (bench_op_t)((op + 1) % BENCH_OP_MAX);
+  }
+
+  return (NULL);
+}
+
+
+//
+// 'run_op()' - Run a single request for a workload.
+//
+
+static bool				// O - `true` on success, `false` on failure
+run_op(bench_client_t *bc,		// I - Benchmark client
+       bench_op_t     op)		// I - Workload
+{
+  char		verifier[45],		// Code verifier
+		code[1024],		// Authorization code
+		token[2048],		// Access token
+		refresh[2048],		// Refresh token
+		resource[1024],		// Resource path
+		username[256];		// Introspected username
+  unsigned char	data[32];		// Random bytes for code verifier
+
+
+  switch (op)
+  {
+    case BENCH_OP_PASSWORD :
+        return (moauthPasswordToken(bc->server, bench_username, bench_password, NULL, token, sizeof(token), refresh, sizeof(refresh), NULL) != NULL);
+
+    case BENCH_OP_CODE :
+        _moauthGetRandomBytes(data, sizeof(data));
+        httpEncode64(verifier, sizeof(verifier), (char *)data, sizeof(data), true);
+
+        if (!get_code(bc, verifier, code, sizeof(code)))
+          return (false);
+
+        return (moauthGetToken(bc->server, REDIRECT_URI, CLIENT_ID, code, verifier, token, sizeof(token), refresh, sizeof(refresh), NULL) != NULL);
+
+    case BENCH_OP_REFRESH :
+        // Refresh tokens are single-use, so save the new pair...
+        if (!moauthRefreshToken(bc->server, bc->refresh, token, sizeof(token), refresh, sizeof(refresh), NULL))
+          return (false);
+
+        cupsCopyString(bc->token, token, sizeof(bc->token));
+        cupsCopyString(bc->refresh, refresh, sizeof(bc->refresh));
+        return (true);
+
+    case BENCH_OP_INTROSPECT :
+        return (moauthIntrospectToken(bc->server, bc->token, username, sizeof(username), NULL, 0, NULL));
+
+    case BENCH_OP_BEARER :
+        snprintf(resource, sizeof(resource), "%s%s", bench_resource, bench_bearer);
+        return (send_request(bc, "GET", resource, bc->token, NULL, NULL, 0) == HTTP_STATUS_OK);
+
+    case BENCH_OP_FILE :
+        snprintf(resource, sizeof(resource), "%s%s", bench_resource, bench_file);
+        return (send_request(bc, "GET", resource, NULL, NULL, NULL, 0) == HTTP_STATUS_OK);
+
+    default :
+        return (false);
+  }
+}
+
+
+//
+// 'send_request()' - Send a request on the client's keep-alive connection.
+//
+// The connection is (re)opened as needed and the response body is read and
+// discarded.
+//
+
+static http_status_t			// O - HTTP status
+send_request(bench_client_t *bc,	// I - Benchmark client
+             const char     *method,	// I - Request method
+             const char     *resource,	// I - Resource path
+             const char     *token,	// I - Bearer token or `NULL` for none
+             const char     *body,	// I - Form data or `NULL` for none
+             char           *location,	// I - Location buffer or `NULL` for none
+             size_t         locsize)	// I - Size of location buffer
+{
+  int		tries;			// Number of tries
+  http_status_t	status = HTTP_STATUS_ERROR;
+					// Response status
+  char		buffer[8192];		// Read buffer
+
+
+  if (location)
+    *location = '\0';
+
+  if (!bc->http && (bc->http = httpConnect(bench_host, bench_port, NULL, AF_UNSPEC, HTTP_ENCRYPTION_ALWAYS, true, 30000, NULL)) == NULL)
+    return (HTTP_STATUS_ERROR);
+
+  // The server may have closed an idle connection, so try again once...
+  for (tries = 0; tries < 2; tries ++)
+  {
+    if (tries && !httpConnectAgain(bc->http, 30000, NULL))
+      break;
+
+    httpClearFields(bc->http);
+
+    if (token)
+    {
+      httpSetAuthString(bc->http, "Bearer", token);
+      httpSetField(bc->http, HTTP_FIELD_AUTHORIZATION, httpGetAuthString(bc->http));
+    }
+    else
+    {
+      httpSetAuthString(bc->http, NULL, NULL);
+    }
+
+    if (body)
+    {
+      httpSetField(bc->http, HTTP_FIELD_CONTENT_TYPE, "application/x-www-form-urlencoded");
+      httpSetLength(bc->http, strlen(body));
+    }
+
+    if (!httpWriteRequest(bc->http, method, resource))
+      continue;
+
+    if (body && httpWrite(bc->http, body, strlen(body)) < (ssize_t)strlen(body))
+      continue;
+
+    while ((status = httpUpdate(bc->http)) == HTTP_STATUS_CONTINUE);
+
+    if (status == HTTP_STATUS_ERROR)
+      continue;
+
+    if (location && httpGetField(bc->http, HTTP_FIELD_LOCATION))
+      cupsCopyString(location, httpGetField(bc->http, HTTP_FIELD_LOCATION), locsize);
+
+    while (httpRead(bc->http, buffer, sizeof(buffer)) > 0);
+    break;
+  }
+
+  return (status);
+}
+
+
+//
+// 'sig_handler()' - Signal handler.
+//
+
+static void
+sig_handler(int sig)			// I - Signal number
+{
+  (void)sig;
+
+  stop_bench = true;
+}
+
+
+//
+// 'start_moauthd()' - Start moauthd with the test config file.
+//
+
+static pid_t				// O - Process ID
+start_moauthd(int verbosity)		// I - Verbosity
+{
+  pid_t		pid = 0;		// Process ID
+  static char * const normal_argv[] =	// moauthd arguments (normal)
+  {
+    "moauthd",
+    "-c",
+    "test.conf",
+    NULL
+  };
+  static char * const verbose_argv[] =	// moauthd arguments (verbose)
+  {
+    "moauthd",
+    "-vvv",
+    "-c",
+    "test.conf",
+    NULL
+  };
+
+
+  if (chdir(".."))
+    return (-1);
+
+  unlink("test.state");
+
+  if (posix_spawn(&pid, "moauthd/moauthd", NULL, NULL, verbosity ? verbose_argv : normal_argv, environ))
+    return (-1);
+
+  return (pid);
+}
+
+
+//
+// 'usage()' - Show program usage.
+//
+
+static int				// O - Exit status
+usage(FILE *out)			// I - Output file
+{
+  fputs("Usage: ./benchmoauthd [OPTIONS] [OAUTH-URL]\n", out);
+  fputs("Options:\n", out);
+  fputs("  --help         Show this help.\n", out);
+  fputs("  -B PATH        Resource fetched by the \"bearer\" workload.\n", out);
+  fputs("  -F PATH        Resource fetched by the \"file\" workload.\n", out);
+  fputs("  -c CLIENTS     Number of concurrent clients (default 4).\n", out);
+  fputs("  -d SECONDS     Duration of the benchmark (default 10).\n", out);
+  fputs("  -n REQUESTS    Number of requests per client instead of a duration.\n", out);
+  fputs("  -p PASSWORD    Password (default $TEST_PASSWORD or \"test123\").\n", out);
+  fputs("  -u USERNAME    Username (default current user).\n", out);
+  fputs("  -v             Run a spawned moauthd with debug logging.\n", out);
+  fputs("  -w WORKLOADS   Comma-delimited list of password, code, refresh,\n", out);
+  fputs("                 introspect, bearer, file, or all (default all).\n", out);
+
+  return (out == stdout ? 0 : 1);
+}
@@ -8,23 +8,165 @@
 //
 
 #include "moauthd.h"
-#include <cups/form.h>
 #include <pwd.h>
 #include <grp.h>
+#include <stddef.h>
+
+
+//
+// Local types...
+//
+
+typedef struct moauthd_form_s		// Known form variables
+{
+  const char	*client_id,		// client_id variable
+		*code,			// code variable
+		*code_challenge,	// code_challenge variable
+		*code_challenge_method,	// code_challenge_method variable
+		*code_verifier,		// code_verifier variable
+		*grant_type,		// grant_type variable
+		*password,		// password variable
+		*redirect_uri,		// redirect_uri variable
+		*response_type,		// response_type variable
+		*scope,			// scope variable
+		*state,			// state variable
+		*token,			// token variable
+		*username;		// username variable
+} moauthd_form_t;
+
+typedef struct moauthd_fvar_s		// Known form variable name
+{
+  const char	*name;			// Variable name
+  size_t	offset;			// Offset in moauthd_form_t
+} moauthd_fvar_t;
+
+
+//
+// Local globals...
+//
+
+static const moauthd_fvar_t form_vars[] =
+{					// Known form variables, sorted by name
+  { "client_id",		offsetof(moauthd_form_t, client_id) },
+  { "code",			offsetof(moauthd_form_t, code) },
+  { "code_challenge",		offsetof(moauthd_form_t, code_challenge) },
+  { "code_challenge_method",	offsetof(moauthd_form_t, code_challenge_method) },
+  { "code_verifier",		offsetof(moauthd_form_t, code_verifier) },
+  { "grant_type",		offsetof(moauthd_form_t, grant_type) },
+  { "password",			offsetof(moauthd_form_t, password) },
+  { "redirect_uri",		offsetof(moauthd_form_t, redirect_uri) },
+  { "response_type",		offsetof(moauthd_form_t, response_type) },
+  { "scope",			offsetof(moauthd_form_t, scope) },
+  { "state",			offsetof(moauthd_form_t, state) },
+  { "token",			offsetof(moauthd_form_t, token) },
+  { "username",			offsetof(moauthd_form_t, username) }
+};
 
 
 //
 // Local functions...
 //
 
+static void	add_introspection(moauthd_client_t *client, moauthd_token_t *token);
+static int	compare_form_var(const char *name, const moauthd_fvar_t *var);
+static char	*copy_message_body(moauthd_client_t *client, size_t *length);
+static bool	decode_form(char *data, moauthd_form_t *form);
+static char	*decode_form_string(char **ptr, int delim, int *term);
 static bool	do_authorize(moauthd_client_t *client);
 static bool	do_introspect(moauthd_client_t *client);
 static bool	do_register(moauthd_client_t *client);
+static bool	do_replicate(moauthd_client_t *client);
+static bool	do_revoke(moauthd_client_t *client);
 static bool	do_token(moauthd_client_t *client);
 static bool	do_userinfo(moauthd_client_t *client);
+static bool	introspect_batch(moauthd_client_t *client, const char *data);
 static bool	validate_uri(const char *uri, const char *urischeme);
 
 
+//
+// 'moauthdArenaAlloc()' - Allocate memory for the current request.
+//
+// Memory is carved out of per-connection blocks and is only valid until the
+// next request on the connection, when @link moauthdArenaReset@ is called.
+// The returned memory is zeroed.
+//
+
+void *					// O - Memory or `NULL` on error
+moauthdArenaAlloc(
+    moauthd_client_t *client,		// I - Client object
+    size_t           size)		// I - Number of bytes
+{
+  moauthd_arena_t	*block;		// Current block
+  void			*ptr;		// Allocated memory
+
+
+  // Keep allocations aligned for any type...
+  size = (size + 15) & ~(size_t)15;
+
+  if ((block = client->arena) == NULL || (block->alloc - block->used) < size)
+  {
+    // Add a new block, sized for large requests as needed...
+    size_t alloc = size > MOAUTHD_ARENA_SIZE ? size : MOAUTHD_ARENA_SIZE;
+					// Size of block
+
+    if ((block = malloc(sizeof(moauthd_arena_t) + alloc)) == NULL)
+    {
+      moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate %lu bytes for request: %s", (unsigned long)size, strerror(errno));
+      return (NULL);
+    }
+
+    block->next   = client->arena;
+    block->used   = 0;
+    block->alloc  = alloc;
+    block->data   = (char *)(block + 1);
+    client->arena = block;
+  }
+
+  ptr         = block->data + block->used;
+  block->used += size;
+
+  memset(ptr, 0, size);
+
+  return (ptr);
+}
+
+
+//
+// 'moauthdArenaReset()' - Release all memory allocated for the last request.
+//
+// One standard-sized block is kept for the next request; larger and extra
+// blocks are returned to the system.
+//
+
+void
+moauthdArenaReset(
+    moauthd_client_t *client)		// I - Client object
+{
+  moauthd_arena_t	*block,		// Current block
+			*next,		// Next block
+			*keep = NULL;	// Block to keep
+
+
+  for (block = client->arena; block; block = next)
+  {
+    next = block->next;
+
+    if (!keep && block->alloc == MOAUTHD_ARENA_SIZE)
+    {
+      keep       = block;
+      keep->next = NULL;
+      keep->used = 0;
+    }
+    else
+    {
+      free(block);
+    }
+  }
+
+  client->arena = keep;
+}
+
+
 //
 // 'moauthdCreateClient()' - Accept a connection and create a client object.
 //
@@ -59,19 +201,8 @@ moauthdCreateClient(
 
   moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "Accepted connection from \"%s\".", client->remote_host);
 
-  if (!httpSetEncryption(client->http, HTTP_ENCRYPTION_ALWAYS))
-  {
-    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to establish TLS session: %s", cupsGetErrorString());
-    httpClose(client->http);
-    free(client);
-
-    return (NULL);
-  }
-
-  httpSetBlocking(client->http, true);
-
-  moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "TLS session established.");
-
+  // The TLS handshake is done by the worker thread in moauthdRunClient, with a
+  // deadline enforced by the main thread, once the client starts it...
   return (client);
 }
 
@@ -84,6 +215,15 @@ void
 moauthdDeleteClient(
     moauthd_client_t *client)		// I - Client object
 {
+  if (client->remote_token)
+    moauthdReleaseToken(client->server, client->remote_token);
+
+  free(client->html_buffer);
+  free(client->json_buffer);
+
+  moauthdArenaReset(client);
+  free(client->arena);
+
   httpClose(client->http);
 
   moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "Connection closed.");
@@ -95,8 +235,12 @@ moauthdDeleteClient(
 //
 // 'moauthdRunClient()' - Process requests from a client object.
 //
+// This function returns `true` when the connection is idle and should be
+// handed back to the event loop, or `false` when the connection should be
+// closed.
+//
 
-void *					// O - Thread return status (ignored)
+bool					// O - `true` to keep alive, `false` to close
 moauthdRunClient(
     moauthd_client_t *client)		// I - Client object
 {
@@ -109,17 +253,69 @@ moauthdRunClient(
   int			host_port;	// Port number
   char			uri_prefix[300];// URI prefix for server
   size_t		uri_prefix_len;	// Length of URI prefix
+  double		start;		// Start of TLS handshake or authentication
+  bool			established;	// TLS session established?
+  double		deadline;	// Deadline for request line
+  int			timeout;	// Time remaining for request line
 
 
   snprintf(host_value, sizeof(host_value), "%s:%d", client->server->name, client->server->port);
   snprintf(uri_prefix, sizeof(uri_prefix), "https://%s:%d", client->server->name, client->server->port);
   uri_prefix_len = strlen(uri_prefix);
 
+  if (!client->encrypted)
+  {
+    // Establish the TLS session for a new connection, keeping track of how
+    // long the handshakes take...
+    moauthdSetClientDeadline(client, MOAUTHD_REQUEST_TIMEOUT);
+
+    start            = moauthdGetClock();
+    established      = httpSetEncryption(client->http, HTTP_ENCRYPTION_ALWAYS);
+    client->tls_time = moauthdGetClock() - start;
+
+    cupsMutexLock(&client->server->clients_lock);
+    if (established)
+      client->server->num_tls_sessions ++;
+    else
+      client->server->num_tls_failures ++;
+    client->server->tls_time += client->tls_time;
+    cupsMutexUnlock(&client->server->clients_lock);
+
+    if (!established)
+    {
+      moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to establish TLS session: %s", cupsGetErrorString());
+      return (false);
+    }
+
+    httpSetBlocking(client->http, true);
+
+    client->encrypted = true;
+
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "TLS session established in %.3f seconds.", client->tls_time);
+
+    if (!httpGetReady(client->http))
+    {
+      moauthdSetClientDeadline(client, 0);
+      return (true);
+    }
+  }
+
   while (!done)
   {
-    // Get a request line...
+    // Get a request line and header before the deadline...
+    moauthdSetClientDeadline(client, MOAUTHD_REQUEST_TIMEOUT);
+
+    deadline = moauthdGetClock() + MOAUTHD_REQUEST_TIMEOUT;
+
     while ((state = httpReadRequest(client->http, client->path_info, sizeof(client->path_info))) == HTTP_STATE_WAITING)
-      usleep(1);
+    {
+      // Wait for the rest of the request line...
+      if ((timeout = (int)(1000.0 * (deadline - moauthdGetClock()))) <= 0 || !httpWait(client->http, timeout))
+      {
+        moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "Timed out waiting for request.");
+        return (false);
+      }
+    }
 
     if (state == HTTP_STATE_ERROR)
     {
@@ -143,7 +339,18 @@ moauthdRunClient(
       break;
     }
 
-    client->request_method = state;
+    // Record the resource generation used by this request so that resources
+    // replaced by a reload are not freed while we use them...
+    atomic_store(client->server->worker_generation + client->worker, atomic_load(&client->server->resources_generation));
+
+    client->request_method  = state;
+    client->request_time    = moauthdGetClock();
+    client->header_time     = 0.0;
+    client->auth_time       = 0.0;
+    client->write_time      = 0.0;
+    client->auth_type       = NULL;
+    client->response_status = HTTP_STATUS_NONE;
+    client->response_bytes  = 0;
 
     moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "%s %s", httpStateString(state), client->path_info);
 
@@ -166,6 +373,8 @@ moauthdRunClient(
       // Not a supported path or URI...
       moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad request URI \"%s\".", client->path_info);
       moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0);
+      moauthdLogRequest(client);
+      moauthdRecordRequest(client);
       break;
     }
 
@@ -176,9 +385,15 @@ moauthdRunClient(
       // Unable to get the request headers...
       moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Problem getting request headers.");
       moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0);
+      moauthdLogRequest(client);
+      moauthdRecordRequest(client);
       break;
     }
 
+    client->header_time = moauthdGetClock() - client->request_time;
+
+    moauthdSetClientDeadline(client, 0);
+
     // Validate Host: header...
     cupsCopyString(host_value, httpGetField(client->http, HTTP_FIELD_HOST), sizeof(host_value));
 
@@ -215,12 +430,25 @@ moauthdRunClient(
         // Log it...
 	moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Bad Host: header value \"%s\" (expected \"%s:%d\").", httpGetField(client->http, HTTP_FIELD_HOST), client->server->name, client->server->port);
 	moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0);
+	moauthdLogRequest(client);
+	moauthdRecordRequest(client);
 	break;
       }
     }
 
-    client->remote_user[0] = '\0';
-    client->remote_uid     = (uid_t)-1;
+    client->remote_user[0]   = '\0';
+    client->remote_uid       = (uid_t)-1;
+    client->accept_ranges    = false;
+    client->content_range[0] = '\0';
+    client->content_encoding = NULL;
+
+    moauthdArenaReset(client);
+
+    if (client->remote_token)
+      moauthdReleaseToken(client->server, client->remote_token);
+    client->remote_token = NULL;
+
+    start = moauthdGetClock();
 
     if ((authorization = httpGetField(client->http, HTTP_FIELD_AUTHORIZATION)) != NULL && *authorization)
     {
@@ -235,6 +463,7 @@ moauthdRunClient(
 					// Length of username:password
         struct passwd *user;		// User information
 
+        client->auth_type = "basic";
 
         for (authorization += 6; *authorization && isspace(*authorization & 255); authorization ++);
 
@@ -251,13 +480,7 @@ moauthdRunClient(
 	      cupsCopyString(client->remote_user, username, sizeof(client->remote_user));
 	      client->remote_uid = user->pw_uid;
 
-              client->num_remote_gids = (int)(sizeof(client->remote_gids) / sizeof(client->remote_gids[0]));
-
-#ifdef __APPLE__
-              if (getgrouplist(client->remote_user, (int)user->pw_gid, client->remote_gids, &client->num_remote_gids))
-#else
-              if (getgrouplist(client->remote_user, user->pw_gid, client->remote_gids, &client->num_remote_gids))
-#endif // __APPLE__
+              if ((client->num_remote_gids = moauthdGetUserGroups(client->server, client->remote_user, user->pw_uid, user->pw_gid, client->remote_gids, (int)(sizeof(client->remote_gids) / sizeof(client->remote_gids[0])))) < 0)
               {
                 moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to lookup groups for user \"%s\": %s", username, strerror(errno));
                 client->num_remote_gids = 0;
@@ -283,19 +506,34 @@ moauthdRunClient(
         // Bearer (OAuth) token...
         moauthd_token_t *token;		// Access token
 
+        client->auth_type = "bearer";
+
         authorization += 7;
         while (*authorization && isspace(*authorization & 255))
           authorization ++;
 
-        if ((token = moauthdFindToken(client->server, authorization)) != NULL)
+        if (client->server->options & MOAUTHD_OPTION_STATELESS_TOKENS)
+        {
+          // Validate the signature and claims of the JWT...
+          if ((token = moauthdValidateToken(client->server, authorization)) == NULL)
+	    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bearer token is not valid.");
+        }
+        else if ((token = moauthdFindToken(client->server, authorization)) != NULL)
         {
           if (token->expires <= time(NULL))
           {
 	    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bearer token has expired.");
 
-            pthread_rwlock_wrlock(&client->server->tokens_lock);
-            cupsArrayRemove(client->server->tokens, token);
-            pthread_rwlock_unlock(&client->server->tokens_lock);
+            moauthdDeleteToken(client->server, token);
+            moauthdReleaseToken(client->server, token);
+
+            token = NULL;
+          }
+          else if (token->jti && moauthdIsTokenRevoked(client->server, token->jti))
+          {
+	    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bearer token has been revoked.");
+
+            moauthdReleaseToken(client->server, token);
 
             token = NULL;
           }
@@ -303,6 +541,8 @@ moauthdRunClient(
           {
 	    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bearer token is of the wrong type.");
 
+            moauthdReleaseToken(client->server, token);
+
             token = NULL;
 	  }
 	}
@@ -316,35 +556,53 @@ moauthdRunClient(
 
 	  client->num_remote_gids = (int)(sizeof(client->remote_gids) / sizeof(client->remote_gids[0]));
 
-#ifdef __APPLE__
-	  if (getgrouplist(token->user, (int)token->gid, client->remote_gids, &client->num_remote_gids))
-#else
-	  if (getgrouplist(token->user, token->gid, client->remote_gids, &client->num_remote_gids))
-#endif // __APPLE__
+	  if (token->gids)
+	  {
+	    // Use the groups looked up when the token was validated...
+	    if (client->num_remote_gids > token->num_gids)
+	      client->num_remote_gids = token->num_gids;
+
+	    memcpy(client->remote_gids, token->gids, (size_t)client->num_remote_gids * sizeof(client->remote_gids[0]));
+	  }
+	  else if ((client->num_remote_gids = moauthdGetUserGroups(client->server, token->user, token->uid, token->gid, client->remote_gids, client->num_remote_gids)) < 0)
 	  {
 	    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to lookup groups for user \"%s\": %s", token->user, strerror(errno));
 	    client->num_remote_gids = 0;
 	  }
         }
       }
+      else if (!strncmp(authorization, "Replicate ", 10) && client->server->replication_key)
+      {
+        // Replication peer, the signature covers the message body so it is
+        // checked by do_replicate()...
+        client->auth_type = "replicate";
+      }
       else
       {
         // Unsupported Authorization scheme...
         char	scheme[32];		// Scheme name
 
+        client->auth_type = "other";
+
         cupsCopyString(scheme, authorization, sizeof(scheme));
         strtok(scheme, " \t");
 
 	moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unsupported Authorization scheme \"%s\".", scheme);
       }
 
-      if (!client->remote_user[0])
+      if (!client->remote_user[0] && (!client->auth_type || strcmp(client->auth_type, "replicate")))
       {
+        client->auth_time = moauthdGetClock() - start;
+
 	moauthdRespondClient(client, HTTP_STATUS_UNAUTHORIZED, NULL, NULL, 0, 0);
+	moauthdLogRequest(client);
+	moauthdRecordRequest(client);
 	break;
       }
     }
 
+    client->auth_time = moauthdGetClock() - start;
+
     if (httpGetExpect(client->http) && client->request_method == HTTP_STATE_POST)
     {
       // Handle Expect: nnn
@@ -383,6 +641,8 @@ moauthdRunClient(
       case HTTP_STATE_GET :
 	  if (!strcmp(client->path_info, "/authorize"))
 	    done = !do_authorize(client);
+	  else if (!strcmp(client->path_info, "/metrics"))
+	    done = !moauthdRespondMetrics(client);
 	  else if (!strcmp(client->path_info, "/userinfo"))
 	    done = !do_userinfo(client);
 	  else if (moauthdGetFile(client) >= HTTP_STATUS_BAD_REQUEST)
@@ -402,6 +662,14 @@ moauthdRunClient(
 	  {
 	    done = !do_register(client);
 	  }
+	  else if (!strcmp(client->path_info, "/replicate"))
+	  {
+	    done = !do_replicate(client);
+	  }
+	  else if (!strcmp(client->path_info, "/revoke"))
+	  {
+	    done = !do_revoke(client);
+	  }
 	  else if (!strcmp(client->path_info, "/token"))
 	  {
 	    done = !do_token(client);
@@ -423,11 +691,225 @@ moauthdRunClient(
           done = true;
 	  break;
     }
+
+    moauthdLogRequest(client);
+    moauthdRecordRequest(client);
+
+    atomic_store(client->server->worker_generation + client->worker, 0);
+
+    // Hand the connection back to the event loop if nothing else is pending...
+    if (!done && !httpGetReady(client->http))
+      return (true);
   }
 
-  moauthdDeleteClient(client);
+  return (false);
+}
+
 
-  return (NULL);
+//
+// 'add_introspection()' - Add the RFC 7662 members for a token to a JSON
+//                         response.
+//
+
+static void
+add_introspection(
+    moauthd_client_t *client,		// I - Client object
+    moauthd_token_t  *token)		// I - Token
+{
+  static const char * const types[] =	// Token types
+  {
+    "access",
+    "grant",
+    "renewal"
+  };
+
+
+  // "scope" is a space-delimited string...
+  moauthdJSONAddBoolean(client, "active", token->expires > time(NULL));
+  moauthdJSONAddString(client, "scope", token->scopes);
+  if (token->application)
+    moauthdJSONAddString(client, "client_id", token->application->client_id);
+  moauthdJSONAddString(client, "username", token->user);
+  moauthdJSONAddString(client, "token_type", types[token->type]);
+  moauthdJSONAddInteger(client, "exp", (long long)token->expires);
+  moauthdJSONAddInteger(client, "iat", (long long)token->created);
+}
+
+
+//
+// 'compare_form_var()' - Compare a name against a known form variable.
+//
+
+static int				// O - Result of comparison
+compare_form_var(
+    const char           *name,		// I - Variable name
+    const moauthd_fvar_t *var)		// I - Known variable
+{
+  return (strcmp(name, var->name));
+}
+
+
+//
+// 'copy_message_body()' - Copy the request message body to the arena.
+//
+// The body is limited to `MOAUTHD_MAX_BODY` bytes.  When the Content-Length
+// is known exactly that many bytes are allocated, otherwise the buffer grows
+// as chunks are read.
+//
+
+static char *				// O - Message body string or `NULL` on error
+copy_message_body(
+    moauthd_client_t *client,		// I - Client object
+    size_t           *bodysize)		// O - Length of message body or `NULL`
+{
+  char		*body,			// Message body data string
+		*ptr;			// Pointer into string
+  size_t	bodylen,		// Allocated length of string
+		used = 0;		// Bytes read so far
+  off_t		length;			// Content-Length value
+  bool		fixed;			// Is the length known?
+  ssize_t	bytes;			// Bytes read
+  http_state_t	initial_state;		// Initial HTTP state
+
+
+  initial_state = httpGetState(client->http);
+
+  if ((length = httpGetLength(client->http)) > 0 && length <= MOAUTHD_MAX_BODY)
+  {
+    bodylen = (size_t)length;
+    fixed   = true;
+  }
+  else
+  {
+    bodylen = 1024;
+    fixed   = false;
+  }
+
+  if ((body = moauthdArenaAlloc(client, bodylen + 1)) != NULL)
+  {
+    for (;;)
+    {
+      if (used >= bodylen)
+      {
+        // Grow the buffer for chunked or unknown-length bodies - the old
+        // buffer is reclaimed when the arena is reset...
+        if (fixed || bodylen >= MOAUTHD_MAX_BODY || (ptr = moauthdArenaAlloc(client, 2 * bodylen + 1)) == NULL)
+          break;
+
+        memcpy(ptr, body, used);
+        body    = ptr;
+        bodylen *= 2;
+      }
+
+      if ((bytes = httpRead(client->http, body + used, bodylen - used)) <= 0)
+        break;
+
+      used += (size_t)bytes;
+    }
+
+    body[used] = '\0';
+  }
+
+  if (httpGetState(client->http) == initial_state)
+    httpFlush(client->http);
+
+  if (bodysize)
+    *bodysize = used;
+
+  return (body);
+}
+
+
+//
+// 'decode_form()' - Decode "application/x-www-form-urlencoded" data in place.
+//
+// The data is decoded in a single pass and the values of the known variables
+// are left pointing into it - nothing is allocated.  Unknown variables are
+// ignored and the last value of a repeated variable is used.  `NULL` data
+// yields an empty form.
+//
+
+static bool				// O - `true` on success, `false` on error
+decode_form(char           *data,	// I - Form data (modified)
+            moauthd_form_t *form)	// O - Form variables
+{
+  char			*name,		// Variable name
+			*value;		// Variable value
+  int			term;		// Character that ended the name
+  const moauthd_fvar_t	*var;		// Known variable
+
+
+  memset(form, 0, sizeof(moauthd_form_t));
+
+  while (data && *data)
+  {
+    if ((name = decode_form_string(&data, '=', &term)) == NULL)
+      return (false);
+
+    if (term != '=')
+      value = name + strlen(name);	// "name" or "name&" has an empty value
+    else if ((value = decode_form_string(&data, '&', &term)) == NULL)
+      return (false);
+
+    if ((var = (const moauthd_fvar_t *)bsearch(name, form_vars, sizeof(form_vars) / sizeof(form_vars[0]), sizeof(form_vars[0]), (int (*)(const void *, const void *))compare_form_var)) != NULL)
+      *(const char **)((char *)form + var->offset) = value;
+  }
+
+  return (true);
+}
+
+
+//
+// 'decode_form_string()' - Decode a form name or value in place.
+//
+// The string ends at the delimiter, an ampersand, or the end of the data.
+// The pointer is left after the terminating character, which is returned
+// separately since the decoded string may overwrite it.
+//
+
+static char *				// O - Decoded string or `NULL` on error
+decode_form_string(char **ptr,		// IO - Pointer into form data
+                   int  delim,		// I  - Delimiter character
+                   int  *term)		// O  - Terminating character
+{
+  char	*src = *ptr,			// Source pointer
+	*dst = *ptr,			// Destination pointer
+	*start = *ptr;			// Start of string
+  int	ch;				// Current character
+
+
+  while ((ch = *src) != '\0' && ch != delim && ch != '&')
+  {
+    src ++;
+
+    if (ch == '+')
+    {
+      ch = ' ';
+    }
+    else if (ch == '%')
+    {
+      if (!isxdigit(src[0] & 255) || !isxdigit(src[1] & 255))
+        return (NULL);
+
+      ch = (isdigit(src[0] & 255) ? src[0] - '0' : tolower(src[0] & 255) - 'a' + 10) << 4;
+      ch |= isdigit(src[1] & 255) ? src[1] - '0' : tolower(src[1] & 255) - 'a' + 10;
+      src += 2;
+
+      if (!ch)
+        return (NULL);
+    }
+
+    *dst++ = (char)ch;
+  }
+
+  if (ch)
+    src ++;
+
+  *dst  = '\0';
+  *ptr  = src;
+  *term = ch;
+
+  return (start);
 }
 
 
@@ -438,8 +920,7 @@ moauthdRunClient(
 static bool				// O - `true` on success, `false` on failure
 do_authorize(moauthd_client_t *client)	// I - Client object
 {
-  size_t	num_vars;		// Number of form variables
-  cups_option_t	*vars;			// Form variables
+  moauthd_form_t form;			// Form variables
   char		*data;			// Form data
   const char	*client_id,		// client_id variable (REQUIRED)
 		*redirect_uri,		// redirect_uri variable (OPTIONAL)
@@ -462,15 +943,37 @@ do_authorize(moauthd_client_t *client)	// I - Client object
         return (moauthdRespondClient(client, HTTP_STATUS_OK, "text/html", NULL, 0, 0));
 
     case HTTP_STATE_GET :
-        // Get form variable on the request line...
-        num_vars      = cupsFormDecode(client->query_string, &vars);
-        client_id     = cupsGetOption("client_id", num_vars, vars);
-        redirect_uri  = cupsGetOption("redirect_uri", num_vars, vars);
-        response_type = cupsGetOption("response_type", num_vars, vars);
-        scope         = cupsGetOption("scope", num_vars, vars);
-        state         = cupsGetOption("state", num_vars, vars);
-        challenge     = cupsGetOption("code_challenge", num_vars, vars);
-        method        = cupsGetOption("code_challenge_method", num_vars, vars);
+        // Get form variables on the request line, decoding a copy so that the
+        // original query string can still be logged...
+        if (client->query_string)
+        {
+          size_t qslen = strlen(client->query_string) + 1;
+					// Length of query string
+
+          if ((data = moauthdArenaAlloc(client, qslen)) == NULL)
+            return (moauthdRespondClient(client, HTTP_STATUS_SERVER_ERROR, NULL, NULL, 0, 0));
+
+          memcpy(data, client->query_string, qslen);
+        }
+        else
+        {
+          data = NULL;
+        }
+
+        if (!decode_form(data, &form))
+        {
+          moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad form data in authorize request.");
+
+          return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+        }
+
+        client_id     = form.client_id;
+        redirect_uri  = form.redirect_uri;
+        response_type = form.response_type;
+        scope         = form.scope;
+        state         = form.state;
+        challenge     = form.code_challenge;
+        method        = form.code_challenge_method;
 
         if (!client_id || !response_type || strcmp(response_type, "code") || (method && strcmp(method, "S256")))
         {
@@ -486,8 +989,6 @@ do_authorize(moauthd_client_t *client)	// I - Client object
 
 	  moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Query string was \"%s\".", client->query_string);
 
-          cupsFreeOptions(num_vars, vars);
-
           return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
         }
 
@@ -500,17 +1001,11 @@ do_authorize(moauthd_client_t *client)	// I - Client object
 
 	  moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Query string was \"%s\".", client->query_string);
 
-          cupsFreeOptions(num_vars, vars);
-
           return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
         }
 
         if (!moauthdRespondClient(client, HTTP_STATUS_OK, "text/html", NULL, 0, 0))
-        {
-	  cupsFreeOptions(num_vars, vars);
-
           return (false);
-	}
 
         moauthdHTMLHeader(client, "Authorization");
         if (app->client_name)
@@ -550,7 +1045,7 @@ do_authorize(moauthd_client_t *client)	// I - Client object
             "    <input type=\"hidden\" name=\"redirect_uri\" value=\"%s\">\n"
             "    <input type=\"hidden\" name=\"response_type\" value=\"%s\">\n"
             "    <input type=\"hidden\" name=\"scope\" value=\"%s\">\n",
-            client_id, app->redirect_uri, response_type, scope ? scope : "private shared");
+            client_id, redirect_uri ? redirect_uri : app->redirect_uri, response_type, scope ? scope : "private shared");
         if (state)
           moauthdHTMLPrintf(client, "    <input type=\"hidden\" name=\"state\" value=\"%s\">\n", state);
         if (challenge)
@@ -560,24 +1055,27 @@ do_authorize(moauthd_client_t *client)	// I - Client object
             "</div>\n");
         moauthdHTMLFooter(client);
 
-        cupsFreeOptions(num_vars, vars);
         break;
 
     case HTTP_STATE_POST :
-        if ((data = _moauthCopyMessageBody(client->http)) == NULL)
+        if ((data = copy_message_body(client, NULL)) == NULL)
           return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
 
-        num_vars      = cupsFormDecode(data, &vars);
-        client_id     = cupsGetOption("client_id", num_vars, vars);
-        redirect_uri  = cupsGetOption("redirect_uri", num_vars, vars);
-        response_type = cupsGetOption("response_type", num_vars, vars);
-        scope         = cupsGetOption("scope", num_vars, vars);
-        state         = cupsGetOption("state", num_vars, vars);
-        username      = cupsGetOption("username", num_vars, vars);
-        password      = cupsGetOption("password", num_vars, vars);
-        challenge     = cupsGetOption("code_challenge", num_vars, vars);
+        if (!decode_form(data, &form))
+        {
+          moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad form data in authorize request.");
+
+          return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+        }
 
-	free(data);
+        client_id     = form.client_id;
+        redirect_uri  = form.redirect_uri;
+        response_type = form.response_type;
+        scope         = form.scope;
+        state         = form.state;
+        username      = form.username;
+        password      = form.password;
+        challenge     = form.code_challenge;
 
         if (!client_id || !response_type || strcmp(response_type, "code"))
         {
@@ -589,8 +1087,6 @@ do_authorize(moauthd_client_t *client)	// I - Client object
           else if (strcmp(response_type, "code"))
             moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad response_type in authorize request.");
 
-          cupsFreeOptions(num_vars, vars);
-
           return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
         }
 
@@ -603,8 +1099,6 @@ do_authorize(moauthd_client_t *client)	// I - Client object
 
 	  moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Query string was \"%s\".", client->query_string);
 
-          cupsFreeOptions(num_vars, vars);
-
           return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
         }
 
@@ -617,20 +1111,16 @@ do_authorize(moauthd_client_t *client)	// I - Client object
         {
           snprintf(uri, sizeof(uri), "%s%serror=access_denied&error_description=Bad+username+or+password.%s%s", redirect_uri, prefix, state ? "&state=" : "", state ? state : "");
         }
-        else if ((token = moauthdCreateToken(client->server, MOAUTHD_TOKTYPE_GRANT, app, username, scope)) == NULL)
+        else if ((token = moauthdCreateToken(client->server, MOAUTHD_TOKTYPE_GRANT, app, username, scope, challenge)) == NULL)
         {
           snprintf(uri, sizeof(uri), "%s%serror=server_error&error_description=Unable+to+create+grant.%s%s", redirect_uri, prefix, state ? "&state=" : "", state ? state : "");
         }
         else
         {
-          if (challenge)
-            token->challenge = strdup(challenge);
-
           snprintf(uri, sizeof(uri), "%s%scode=%s%s%s", redirect_uri, prefix, token->token, state ? "&state=" : "", state ? state : "");
+          moauthdReleaseToken(client->server, token);
         }
 
-        cupsFreeOptions(num_vars, vars);
-
         return (moauthdRespondClient(client, HTTP_STATUS_FOUND, NULL, uri, 0, 0));
 
     default :
@@ -649,20 +1139,11 @@ static bool				// O - `true` on success, `false` on failure
 do_introspect(moauthd_client_t *client)	// I - Client object
 {
   http_status_t	status = HTTP_STATUS_OK;// Response status
-  size_t	num_vars;		// Number of form (request) variables
-  cups_option_t	*vars;			// Form (request) variables
+  moauthd_form_t form;			// Form (request) variables
   char		*data;			// Form data
-  const char	*token_var;		// token variable (REQUIRED)
+  const char	*content_type,		// Content-Type of request
+		*token_var;		// token variable (REQUIRED)
   moauthd_token_t *token;		// Token
-  cups_json_t	*json,			// JSON response
-		*jarray;		// JSON array
-  size_t	datalen;		// Length of JSON data
-  static const char * const types[] =	// Token types
-  {
-    "access",
-    "grant",
-    "renewal"
-  };
 
 
   if (client->server->introspect_group != (gid_t)-1)
@@ -689,13 +1170,22 @@ do_introspect(moauthd_client_t *client)	// I - Client object
   if (status != HTTP_STATUS_OK)
     return (moauthdRespondClient(client, status, NULL, NULL, 0, 0));
 
-  if ((data = _moauthCopyMessageBody(client->http)) == NULL)
+  content_type = httpGetField(client->http, HTTP_FIELD_CONTENT_TYPE);
+
+  if ((data = copy_message_body(client, NULL)) == NULL)
     return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
 
-  num_vars  = cupsFormDecode(data, &vars);
-  token_var = cupsGetOption("token", num_vars, vars);
+  if (content_type && !strncmp(content_type, "application/json", 16))
+    return (introspect_batch(client, data));
 
-  free(data);
+  if (!decode_form(data, &form))
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad form data in introspect request.");
+
+    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+  }
+
+  token_var = form.token;
 
   if (!token_var)
   {
@@ -705,58 +1195,23 @@ do_introspect(moauthd_client_t *client)	// I - Client object
     goto bad_request;
   }
 
-  if ((token = moauthdFindToken(client->server, token_var)) == NULL)
+  if ((token = moauthdFindToken(client->server, token_var)) == NULL && (!(client->server->options & MOAUTHD_OPTION_STATELESS_TOKENS) || (token = moauthdValidateToken(client->server, token_var)) == NULL))
   {
     moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad token in introspect request.");
 
     goto bad_request;
   }
 
-  json = cupsJSONNew(/*parent*/NULL, /*after*/NULL, CUPS_JTYPE_OBJECT);
-  cupsJSONNew(json, cupsJSONNewKey(json, /*after*/NULL, "active"), token->expires > time(NULL) ? CUPS_JTYPE_TRUE : CUPS_JTYPE_FALSE);
-  jarray = cupsJSONNew(json, cupsJSONNewKey(json, /*after*/NULL, "scope"), CUPS_JTYPE_ARRAY);
-  cupsJSONNewString(jarray, /*after*/NULL, token->scopes);// TODO: Fix this
-  cupsJSONNewString(json, cupsJSONNewKey(json, /*after*/NULL, "client_id"), token->application->client_id);
-  cupsJSONNewString(json, cupsJSONNewKey(json, /*after*/NULL, "username"), token->user);
-  cupsJSONNewString(json, cupsJSONNewKey(json, /*after*/NULL, "token_type"), types[token->type]);
-  cupsJSONNewNumber(json, cupsJSONNewKey(json, /*after*/NULL, "exp"), (double)token->expires);
-  cupsJSONNewNumber(json, cupsJSONNewKey(json, /*after*/NULL, "iat"), (double)token->created);
+  // Send the response per RFC 7662...
+  moauthdJSONStart(client);
+  add_introspection(client, token);
+  moauthdReleaseToken(client->server, token);
 
-  data = cupsJSONExportString(json);
-  cupsJSONDelete(json);
-
-  if (!data)
-  {
-    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to create JSON response.");
-
-    goto bad_request;
-  }
-
-  cupsFreeOptions(num_vars, vars);
-
-  datalen = strlen(data);
-
-  if (!moauthdRespondClient(client, HTTP_STATUS_OK, "application/json", NULL, 0, datalen))
-  {
-    free(data);
-    return (false);
-  }
-
-  if (httpWrite(client->http, data, datalen) < datalen)
-  {
-    free(data);
-    return (false);
-  }
-
-  free(data);
-
-  return (true);
+  return (moauthdJSONRespond(client, HTTP_STATUS_OK));
 
   // If we get here there was a bad request...
   bad_request:
 
-  cupsFreeOptions(num_vars, vars);
-
   return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
 }
 
@@ -780,7 +1235,9 @@ do_register(moauthd_client_t *client)	// I - Client object
 		*logo_uri,		// logo_uri variable (OPTIONAL)
 		*tos_uri;		// tos_uri variable (OPTIONAL)
   size_t	datalen;		// Length of JSON data
-  unsigned char	client_id_hash[32];	// SHA2-256 hash of client_name or redirect_uris
+  char		*client_key;		// client_name and redirect_uris
+  size_t	client_keylen;		// Length of client_key
+  unsigned char	client_id_hash[32];	// SHA2-256 hash of client_key
   char		client_id[65];		// client_id value
   const char	*error = NULL;		// Error code, if any
   char		error_message[1024];	// Error message, if any
@@ -813,7 +1270,7 @@ do_register(moauthd_client_t *client)	// I - Client object
     return (moauthdRespondClient(client, status, NULL, NULL, 0, 0));
 
   // Get request data...
-  if ((data = _moauthCopyMessageBody(client->http)) == NULL)
+  if ((data = copy_message_body(client, NULL)) == NULL)
     return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
 
   request       = cupsJSONImportString(data);
@@ -823,8 +1280,6 @@ do_register(moauthd_client_t *client)	// I - Client object
   logo_uri      = cupsJSONGetString(cupsJSONFind(request, "logo_uri"));
   tos_uri       = cupsJSONGetString(cupsJSONFind(request, "tos_uri"));
 
-  free(data);
-
   if (!redirect_uris)
   {
     // Missing required variables!
@@ -864,12 +1319,24 @@ do_register(moauthd_client_t *client)	// I - Client object
     goto bad_request;
   }
 
-  // Parse redirect_uris to add application entries...
+  // The client_id is derived from both the name and the redirection URI so
+  // that registering an existing name cannot add a URI to somebody else's
+  // client.  URIs never contain spaces, so the key is unambiguous...
+  client_keylen = (client_name ? strlen(client_name) + 1 : 0) + strlen(redirect_uris) + 1;
+
+  if ((client_key = moauthdArenaAlloc(client, client_keylen)) == NULL)
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate memory for client_id.");
+
+    goto bad_request;
+  }
+
   if (client_name)
-    cupsHashData("sha2-256", client_name, strlen(client_name), client_id_hash, sizeof(client_id_hash));
+    snprintf(client_key, client_keylen, "%s %s", client_name, redirect_uris);
   else
-    cupsHashData("sha2-256", redirect_uris, strlen(redirect_uris), client_id_hash, sizeof(client_id_hash));
+    cupsCopyString(client_key, redirect_uris, client_keylen);
 
+  cupsHashData("sha2-256", client_key, strlen(client_key), client_id_hash, sizeof(client_id_hash));
   cupsHashString(client_id_hash, sizeof(client_id_hash), client_id, sizeof(client_id));
   client_id[16] = '\0';
 
@@ -879,6 +1346,14 @@ do_register(moauthd_client_t *client)	// I - Client object
   {
     moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Client %s %s is already registered.", client_id, redirect_uris);
   }
+  else if (moauthdFindApplication(client->server, client_id, NULL))
+  {
+    // Only the configuration file can add redirection URIs to a client...
+    error = "invalid_redirect_uri";
+    snprintf(error_message, sizeof(error_message), "Client \"%s\" is already registered with a different redirect_uri.", client_id);
+
+    goto bad_request;
+  }
   else if (moauthdAddApplication(client->server, client_id, redirect_uris, client_name, client_uri, logo_uri, tos_uri))
   {
     moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Client %s %s registered.", client_id, redirect_uris);
@@ -936,7 +1411,7 @@ do_register(moauthd_client_t *client)	// I - Client object
     return (false);
   }
 
-  if (httpWrite(client->http, data, datalen) < datalen)
+  if (!moauthdWriteClient(client, data, datalen))
   {
     free(data);
     return (false);
@@ -976,6 +1451,146 @@ do_register(moauthd_client_t *client)	// I - Client object
 }
 
 
+//
+// 'do_replicate()' - Process a request for the /replicate endpoint.
+//
+// The message body contains journal records from a replication peer and is
+// signed with an HMAC-SHA256 using the shared "ReplicationKey".
+//
+
+static bool				// O - `true` on success, `false` on failure
+do_replicate(moauthd_client_t *client)	// I - Client object
+{
+  moauthd_server_t *server = client->server;
+					// Server object
+  const char	*authorization;		// Authorization header
+  char		*data,			// Journal records
+		signature[65];		// Expected signature
+  size_t	i,			// Looping var
+		datalen;		// Length of records
+  unsigned char	hmac[32],		// HMAC-SHA256 of records
+		diff = 0;		// Differences in signature
+
+
+  if (!server->replication_key)
+    return (moauthdRespondClient(client, HTTP_STATUS_NOT_FOUND, NULL, NULL, 0, 0));
+
+  if (!client->auth_type || strcmp(client->auth_type, "replicate") || (authorization = httpGetField(client->http, HTTP_FIELD_AUTHORIZATION)) == NULL)
+    return (moauthdRespondClient(client, HTTP_STATUS_UNAUTHORIZED, NULL, NULL, 0, 0));
+
+  if ((data = copy_message_body(client, &datalen)) == NULL || (off_t)datalen != httpGetLength(client->http))
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Missing or truncated replication request.");
+    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+  }
+
+  // Compare signatures in constant time...
+  for (authorization += 10; *authorization && isspace(*authorization & 255); authorization ++);
+
+  cupsHMACData("sha2-256", (unsigned char *)server->replication_key, strlen(server->replication_key), data, datalen, hmac, sizeof(hmac));
+  cupsHashString(hmac, sizeof(hmac), signature, sizeof(signature));
+
+  if (strlen(authorization) != (sizeof(signature) - 1))
+    diff = 1;
+
+  for (i = 0; i < (sizeof(signature) - 1) && authorization[i]; i ++)
+    diff |= (unsigned char)(authorization[i] ^ signature[i]);
+
+  if (diff)
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad replication signature.");
+    return (moauthdRespondClient(client, HTTP_STATUS_UNAUTHORIZED, NULL, NULL, 0, 0));
+  }
+
+  if (!moauthdReplayJournal(server, (unsigned char *)data, datalen))
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad records in replication request.");
+    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+  }
+
+  moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Replayed %lu bytes of replicated records.", (unsigned long)datalen);
+
+  moauthdJSONStart(client);
+
+  return (moauthdJSONRespond(client, HTTP_STATUS_OK));
+}
+
+
+//
+// 'do_revoke()' - Process a request for the /revoke endpoint.
+//
+// Per RFC 7009, unknown and already invalid tokens are not an error.
+//
+
+static bool				// O - `true` on success, `false` on failure
+do_revoke(moauthd_client_t *client)	// I - Client object
+{
+  moauthd_form_t form;			// Form (request) variables
+  char		*data;			// Form data
+  const char	*client_id,		// client_id variable (OPTIONAL)
+		*token_var;		// token variable (REQUIRED)
+  moauthd_token_t *token;		// Token
+
+
+  if ((data = copy_message_body(client, NULL)) == NULL)
+    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+
+  if (!decode_form(data, &form))
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad form data in revoke request.");
+
+    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+  }
+
+  client_id = form.client_id;
+  token_var = form.token;
+
+  // The token_type_hint variable is not needed since all token types share
+  // the same token table...
+  if (!token_var)
+  {
+    // Missing required variables!
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Missing token in revoke request.");
+
+    goto bad_request;
+  }
+
+  if ((token = moauthdFindToken(client->server, token_var)) != NULL)
+  {
+    if (client_id && token->application && strcmp(client_id, token->application->client_id))
+    {
+      moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad client_id in revoke request.");
+      moauthdReleaseToken(client->server, token);
+
+      goto bad_request;
+    }
+
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "Revoking token for user \"%s\".", token->user);
+    moauthdDeleteToken(client->server, token);
+    moauthdReleaseToken(client->server, token);
+  }
+  else if ((client->server->options & MOAUTHD_OPTION_STATELESS_TOKENS) && (token = moauthdValidateToken(client->server, token_var)) != NULL)
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "Revoking stateless token for user \"%s\".", token->user);
+    moauthdRevokeToken(client->server, token->jti, token->hash, token->expires);
+    moauthdReleaseToken(client->server, token);
+  }
+  else
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Unknown token in revoke request.");
+  }
+
+  moauthdJSONStart(client);
+
+  return (moauthdJSONRespond(client, HTTP_STATUS_OK));
+
+  // If we get here there was a bad request...
+  bad_request:
+
+  return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+}
+
+
 //
 // 'do_token()' - Process a request for the /token endpoint.
 //
@@ -983,8 +1598,7 @@ do_register(moauthd_client_t *client)	// I - Client object
 static bool				// O - `true` on success, `false` on failure
 do_token(moauthd_client_t *client)	// I - Client object
 {
-  size_t	num_vars;		// Number of form (request) variables
-  cups_option_t	*vars;			// Form (request) variables
+  moauthd_form_t form;			// Form (request) variables
   char		*data;			// Form data
   const char	*client_id,		// client_id variable (REQUIRED)
 		*code,			// code variable (REQUIRED)
@@ -995,26 +1609,28 @@ do_token(moauthd_client_t *client)	// I - Client object
 		*username,		// username variable (REQURIED for Resource Owner Password Grant)
 		*verifier;		// code_verify variable (OPTIONAL)
   moauthd_application_t *app;		// Application
-  moauthd_token_t *grant_token,		// Grant token
+  moauthd_token_t *grant_token = NULL,	// Grant token
 		*access_token;		// Access token
-  cups_json_t	*response;		// JSON response
-  size_t	datalen;		// Length of JSON data
 
 
-  if ((data = _moauthCopyMessageBody(client->http)) == NULL)
+  if ((data = copy_message_body(client, NULL)) == NULL)
     return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
 
-  num_vars      = cupsFormDecode(data, &vars);
-  client_id     = cupsGetOption("client_id", num_vars, vars);
-  code          = cupsGetOption("code", num_vars, vars);
-  grant_type    = cupsGetOption("grant_type", num_vars, vars);
-  password      = cupsGetOption("password", num_vars, vars);
-  redirect_uri  = cupsGetOption("redirect_uri", num_vars, vars);
-  username      = cupsGetOption("username", num_vars, vars);
-  scope         = cupsGetOption("scope", num_vars, vars);
-  verifier      = cupsGetOption("code_verifier", num_vars, vars);
+  if (!decode_form(data, &form))
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad form data in token request.");
 
-  free(data);
+    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+  }
+
+  client_id     = form.client_id;
+  code          = form.code;
+  grant_type    = form.grant_type;
+  password      = form.password;
+  redirect_uri  = form.redirect_uri;
+  username      = form.username;
+  scope         = form.scope;
+  verifier      = form.code_verifier;
 
   if (!grant_type || (strcmp(grant_type, "authorization_code") && strcmp(grant_type, "password")))
   {
@@ -1050,7 +1666,12 @@ do_token(moauthd_client_t *client)	// I - Client object
     if (!moauthdAuthenticateUser(client, username, password))
       goto bad_request;
 
-    access_token = moauthdCreateToken(client->server, MOAUTHD_TOKTYPE_ACCESS, NULL, username, scope);
+    if ((access_token = moauthdCreateToken(client->server, MOAUTHD_TOKTYPE_ACCESS, NULL, username, scope, NULL)) == NULL)
+    {
+      moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to create access token.");
+
+      goto bad_request;
+    }
   }
   else
   {
@@ -1112,7 +1733,7 @@ do_token(moauthd_client_t *client)	// I - Client object
       }
     }
 
-    if ((access_token = moauthdCreateToken(client->server, MOAUTHD_TOKTYPE_ACCESS, app, grant_token->user, grant_token->scopes)) == NULL)
+    if ((access_token = moauthdCreateToken(client->server, MOAUTHD_TOKTYPE_ACCESS, app, grant_token->user, grant_token->scopes, NULL)) == NULL)
     {
       moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to create access token.");
 
@@ -1120,49 +1741,25 @@ do_token(moauthd_client_t *client)	// I - Client object
     }
 
     moauthdDeleteToken(client->server, grant_token);
+    moauthdReleaseToken(client->server, grant_token);
   }
 
-  response = cupsJSONNew(/*parent*/NULL, /*after*/NULL, CUPS_JTYPE_OBJECT);
-  cupsJSONNewString(response, cupsJSONNewKey(response, /*after*/NULL, "access_token"), access_token->token);
-  cupsJSONNewString(response, cupsJSONNewKey(response, /*after*/NULL, "token_type"), "access");
-  cupsJSONNewNumber(response, cupsJSONNewKey(response, /*after*/NULL, "expires_in"), client->server->max_token_life);
-
-  data = cupsJSONExportString(response);
-  cupsJSONDelete(response);
-
-  if (!data)
-  {
-    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to create JSON response.");
-
-    goto bad_request;
-  }
-
-  cupsFreeOptions(num_vars, vars);
-
-  datalen = strlen(data);
-
-  if (!moauthdRespondClient(client, HTTP_STATUS_OK, "application/json", NULL, 0, datalen))
-  {
-    free(data);
-    return (false);
-  }
-
-  if (httpWrite(client->http, data, datalen) < datalen)
-  {
-    free(data);
-    return (false);
-  }
+  moauthdJSONStart(client);
+  moauthdJSONAddString(client, "access_token", access_token->token);
+  moauthdJSONAddString(client, "token_type", "access");
+  moauthdJSONAddInteger(client, "expires_in", client->server->max_token_life);
 
-  free(data);
+  moauthdReleaseToken(client->server, access_token);
 
-  return (true);
+  return (moauthdJSONRespond(client, HTTP_STATUS_OK));
 
   // If we get here there was a bad request...
 
   // TODO: generate JSON error message body
   bad_request:
 
-  cupsFreeOptions(num_vars, vars);
+  if (grant_token)
+    moauthdReleaseToken(client->server, grant_token);
 
   return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
 }
@@ -1177,7 +1774,6 @@ do_userinfo(moauthd_client_t *client)	// I - Client
 {
   bool		ret = false;		// Return value
   int		error;			// Error value
-  const char	*authorization;		// Authorization header
   moauthd_token_t *token;		// Token
   struct passwd	pw,			// User info
 		*pwresult = NULL;	// Matching result
@@ -1189,23 +1785,12 @@ do_userinfo(moauthd_client_t *client)	// I - Client
 
   // Discard any POST data...
   if (httpGetState(client->http) == HTTP_STATE_POST_RECV)
-    free(_moauthCopyMessageBody(client->http));
+    copy_message_body(client, NULL);
 
-  // Get the Bearer token from the request...
-  if ((authorization = httpGetField(client->http, HTTP_FIELD_AUTHORIZATION)) == NULL || strncmp(authorization, "Bearer ", 7))
+  // Use the Bearer token that was validated by moauthdRunClient...
+  if ((token = client->remote_token) == NULL)
     return (moauthdRespondClient(client, HTTP_STATUS_UNAUTHORIZED, NULL, NULL, 0, 0));
 
-  authorization += 7;
-  while (*authorization && isspace(*authorization & 255))
-    authorization ++;
-
-  if ((token = moauthdFindToken(client->server, authorization)) == NULL)
-  {
-    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Bad token in userinfo request.");
-
-    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
-  }
-
   if ((error = getpwnam_r(token->user, &pw, pwbuffer, sizeof(pwbuffer), &pwresult)) != 0)
   {
     moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to lookup user '%s' information: %s", token->user, strerror(error));
@@ -1235,8 +1820,7 @@ do_userinfo(moauthd_client_t *client)	// I - Client
 
   if (moauthdRespondClient(client, HTTP_STATUS_OK, "application/json", NULL, 0, datalen))
   {
-    if (httpWrite(client->http, data, datalen) == datalen)
-      ret = true;
+    ret = moauthdWriteClient(client, data, datalen);
   }
 
   free(data);
@@ -1245,6 +1829,69 @@ do_userinfo(moauthd_client_t *client)	// I - Client
 }
 
 
+//
+// 'introspect_batch()' - Process a batch of tokens for the /introspect
+//                        endpoint.
+//
+// The request is a JSON object with a "tokens" array of strings and the
+// response is a JSON object with a "results" array containing the RFC 7662
+// members for each token, in order.  Unknown tokens are reported as inactive.
+//
+
+static bool				// O - `true` on success, `false` on failure
+introspect_batch(
+    moauthd_client_t *client,		// I - Client object
+    const char       *data)		// I - Request message body
+{
+  cups_json_t	*request,		// JSON request
+		*tokens;		// Array of tokens
+  size_t	i,			// Looping var
+		num_tokens;		// Number of tokens
+  const char	*token_var;		// Token string
+  moauthd_token_t *token;		// Token
+
+
+  request = cupsJSONImportString(data);
+  tokens  = cupsJSONFind(request, "tokens");
+
+  if (cupsJSONGetType(tokens) != CUPS_JTYPE_ARRAY || (num_tokens = cupsJSONGetCount(tokens)) == 0 || num_tokens > MOAUTHD_MAX_INTROSPECT)
+  {
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Missing or bad tokens in introspect request.");
+    cupsJSONDelete(request);
+
+    return (moauthdRespondClient(client, HTTP_STATUS_BAD_REQUEST, NULL, NULL, 0, 0));
+  }
+
+  moauthdJSONStart(client);
+  moauthdJSONStartArray(client, "results");
+
+  for (i = 0; i < num_tokens; i ++)
+  {
+    moauthdJSONStartObject(client, NULL);
+
+    if ((token_var = cupsJSONGetString(cupsJSONGetChild(tokens, i))) != NULL && ((token = moauthdFindToken(client->server, token_var)) != NULL || ((client->server->options & MOAUTHD_OPTION_STATELESS_TOKENS) && (token = moauthdValidateToken(client->server, token_var)) != NULL)))
+    {
+      add_introspection(client, token);
+      moauthdReleaseToken(client->server, token);
+    }
+    else
+    {
+      moauthdJSONAddBoolean(client, "active", false);
+    }
+
+    moauthdJSONEndObject(client);
+  }
+
+  moauthdJSONEndArray(client);
+
+  cupsJSONDelete(request);
+
+  moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Introspected %u tokens.", (unsigned)num_tokens);
+
+  return (moauthdJSONRespond(client, HTTP_STATUS_OK));
+}
+
+
 //
 // 'validate_uri()' - Validate the URI.
 //
@@ -0,0 +1,905 @@
+//
+// Event loop and worker pool for moauth daemon
+//
+// Copyright © 2017-2024 by Michael R Sweet
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// The main thread accepts connections and watches new and idle keep-alive
+// clients using epoll (Linux), kqueue (BSD/macOS), or poll (everything else).
+// When a client has data to read it is queued for one of the worker threads,
+// which process requests until the connection goes idle and then hand the
+// client back to the main thread.  SIGHUP makes the main thread reload the
+// configuration file between events.
+//
+// Workers have MOAUTHD_REQUEST_TIMEOUT seconds to complete the TLS handshake
+// and read each request header.  The main thread shuts down the socket of any
+// client that misses its deadline, which makes the blocked worker's read fail,
+// so a client that trickles in its handshake or header cannot hold a worker.
+//
+
+#include "moauthd.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#ifdef HAVE_EPOLL
+#  include <sys/epoll.h>
+#elif defined(HAVE_KQUEUE)
+#  include <sys/event.h>
+#endif // HAVE_EPOLL
+
+
+//
+// Constants...
+//
+
+#define MOAUTHD_MAX_EVENTS	64	// Maximum number of events per wait
+
+
+//
+// Local globals...
+//
+
+static volatile sig_atomic_t reload_pending = 0;
+					// Reload the configuration file?
+static int		reload_pipe = -1;
+					// Wakeup pipe for signal handler
+
+
+//
+// Local functions...
+//
+
+static int	check_deadlines(moauthd_server_t *server);
+static bool	event_add(moauthd_server_t *server, int fd, void *data);
+static void	event_close(moauthd_server_t *server);
+static bool	event_open(moauthd_server_t *server);
+static void	event_remove(moauthd_server_t *server, int fd);
+static int	event_wait(moauthd_server_t *server, bool listening, int timeout, void **ready, int num_ready);
+static void	idle_add(moauthd_server_t *server, moauthd_client_t *client);
+static void	idle_remove(moauthd_server_t *server, moauthd_client_t *client);
+static int	idle_timeout(moauthd_server_t *server);
+static void	queue_client(moauthd_server_t *server, moauthd_client_t *client);
+static void	sighup_handler(int sig);
+static void	wakeup_server(moauthd_server_t *server);
+static void	*worker_thread(moauthd_server_t *server);
+
+
+//
+// 'moauthdRunServer()' - Listen for client connections and process requests.
+//
+
+int					// O - Exit status
+moauthdRunServer(
+    moauthd_server_t *server)		// I - Server object
+{
+  bool		done = false;		// Are we done yet?
+  bool		listening = false;	// Are we accepting new connections?
+  int		i,			// Looping var
+		num_ready;		// Number of ready descriptors
+  void		*ready[MOAUTHD_MAX_EVENTS];
+					// Ready descriptors
+  int		timeout,		// Idle client timeout
+		deadline;		// Request deadline timeout
+  moauthd_client_t *client,		// Current client
+		*next;			// Next client
+  sigset_t	sighup;			// SIGHUP signal set
+
+
+  if (!server)
+    return (1);
+
+  // Block SIGHUP while starting the sweeper, logging, replication, and worker
+  // threads so that only the main thread sees it...
+  sigemptyset(&sighup);
+  sigaddset(&sighup, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &sighup, NULL);
+
+  if (!event_open(server))
+    return (1);
+
+  if (!moauthdStartSweeper(server))
+  {
+    event_close(server);
+    return (1);
+  }
+
+  moauthdStartLogging(server);
+
+  if (!moauthdStartReplication(server))
+  {
+    moauthdStopLogging(server);
+    moauthdStopSweeper(server);
+    event_close(server);
+    return (1);
+  }
+
+  // Start the worker threads...
+  for (i = 0; i < server->num_workers; i ++)
+  {
+    if ((server->workers[i] = cupsThreadCreate((void *(*)(void *))worker_thread, server)) == CUPS_THREAD_INVALID)
+    {
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create worker thread: %s", strerror(errno));
+      break;
+    }
+  }
+
+  if ((server->num_workers = i) == 0)
+  {
+    moauthdStopReplication(server);
+    moauthdStopLogging(server);
+    moauthdStopSweeper(server);
+    event_close(server);
+    return (1);
+  }
+
+  moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Listening for client connections with %d worker threads.", server->num_workers);
+
+  // Reload the configuration file on SIGHUP...
+  reload_pipe = server->wakeup_pipe[1];
+  signal(SIGHUP, sighup_handler);
+  pthread_sigmask(SIG_UNBLOCK, &sighup, NULL);
+
+  while (!done)
+  {
+    bool	at_capacity;		// Are we at the maximum number of clients?
+
+    if (reload_pending)
+    {
+      // Workers keep processing requests while the new configuration is
+      // loaded...
+      reload_pending = 0;
+      moauthdReloadServer(server);
+    }
+
+    // Add clients that have been handed back by the workers to the idle list...
+    cupsMutexLock(&server->clients_lock);
+
+    client                   = server->returned_clients;
+    server->returned_clients = NULL;
+    at_capacity              = server->num_active_clients >= server->max_clients;
+
+    cupsMutexUnlock(&server->clients_lock);
+
+    for (; client; client = next)
+    {
+      next = client->next;
+
+      if (event_add(server, httpGetFd(client->http), client))
+      {
+        idle_add(server, client);
+      }
+      else
+      {
+	moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to watch idle connection: %s", strerror(errno));
+
+	cupsMutexLock(&server->clients_lock);
+	server->num_active_clients --;
+	at_capacity = server->num_active_clients >= server->max_clients;
+	cupsMutexUnlock(&server->clients_lock);
+
+	moauthdDeleteClient(client);
+      }
+    }
+
+    // Stop accepting connections when we are at capacity - new connections
+    // wait in the listen queue until a client is closed...
+    if (at_capacity && listening)
+    {
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "At MaxClients, no longer accepting connections.");
+
+      for (i = 0; i < server->num_listeners; i ++)
+        event_remove(server, server->listeners[i].fd);
+
+      listening = false;
+    }
+    else if (!at_capacity && !listening)
+    {
+      for (i = 0; i < server->num_listeners; i ++)
+        event_add(server, server->listeners[i].fd, server->listeners + i);
+
+      listening = true;
+    }
+
+    // Wait for something to happen...
+    timeout  = idle_timeout(server);
+    deadline = check_deadlines(server);
+
+    if (timeout < 0 || deadline < timeout)
+      timeout = deadline;
+
+    if ((num_ready = event_wait(server, listening, timeout, ready, (int)(sizeof(ready) / sizeof(ready[0])))) < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+      {
+        moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to wait for events: %s", strerror(errno));
+        done = true;
+      }
+
+      continue;
+    }
+
+    for (i = 0; i < num_ready; i ++)
+    {
+      if (ready[i] == server->wakeup_pipe)
+      {
+        // Drain the wakeup pipe...
+        char	buffer[256];		// Read buffer
+
+        while (read(server->wakeup_pipe[0], buffer, sizeof(buffer)) > 0);
+      }
+      else if (ready[i] >= (void *)server->listeners && ready[i] < (void *)(server->listeners + server->num_listeners))
+      {
+        // Accept a new connection...
+        struct pollfd *lis = (struct pollfd *)ready[i];
+					// Listener
+
+        if (!listening)
+          continue;
+
+        if ((client = moauthdCreateClient(server, lis->fd)) != NULL)
+        {
+	  cupsMutexLock(&server->clients_lock);
+	  server->num_active_clients ++;
+	  at_capacity = server->num_active_clients >= server->max_clients;
+	  cupsMutexUnlock(&server->clients_lock);
+
+          // Watch the new connection until the client starts the TLS
+          // handshake rather than tying up a worker...
+	  if (event_add(server, httpGetFd(client->http), client))
+	  {
+	    idle_add(server, client);
+	  }
+	  else
+	  {
+	    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to watch new connection: %s", strerror(errno));
+
+	    cupsMutexLock(&server->clients_lock);
+	    server->num_active_clients --;
+	    at_capacity = server->num_active_clients >= server->max_clients;
+	    cupsMutexUnlock(&server->clients_lock);
+
+	    moauthdDeleteClient(client);
+	  }
+
+	  if (at_capacity)
+	  {
+	    // Don't accept any more connections until the next time through...
+	    moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "At MaxClients, no longer accepting connections.");
+
+	    for (int j = 0; j < server->num_listeners; j ++)
+	      event_remove(server, server->listeners[j].fd);
+
+	    listening = false;
+	  }
+        }
+      }
+      else
+      {
+        // Idle client has data, hand it to a worker...
+        client = (moauthd_client_t *)ready[i];
+
+        event_remove(server, httpGetFd(client->http));
+        idle_remove(server, client);
+        queue_client(server, client);
+      }
+    }
+  }
+
+  signal(SIGHUP, SIG_DFL);
+  reload_pipe = -1;
+
+  // Stop the worker threads...
+  cupsMutexLock(&server->clients_lock);
+  server->shutdown = true;
+  cupsCondBroadcast(&server->clients_cond);
+  cupsMutexUnlock(&server->clients_lock);
+
+  for (i = 0; i < server->num_workers; i ++)
+    cupsThreadWait(server->workers[i]);
+
+  moauthdStopReplication(server);
+  moauthdStopSweeper(server);
+
+  for (client = server->idle_clients; client; client = next)
+  {
+    next = client->next;
+    moauthdDeleteClient(client);
+  }
+
+  server->idle_clients     = NULL;
+  server->idle_last        = NULL;
+  server->num_idle_clients = 0;
+
+  event_close(server);
+
+  if (server->num_tls_sessions > 0)
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Established %lu TLS sessions (%lu failed), %.3f seconds average handshake.", (unsigned long)server->num_tls_sessions, (unsigned long)server->num_tls_failures, server->tls_time / (server->num_tls_sessions + server->num_tls_failures));
+
+  moauthdStopLogging(server);
+
+  return (0);
+}
+
+
+//
+// 'moauthdSetClientDeadline()' - Set or clear the deadline for reading a
+//                                request.
+//
+// A timeout of 0 clears the deadline.  Clients that miss their deadline have
+// their socket shut down by the main thread.
+//
+
+void
+moauthdSetClientDeadline(
+    moauthd_client_t *client,		// I - Client object
+    int              timeout)		// I - Timeout in seconds or 0 to clear
+{
+  moauthd_server_t	*server = client->server;
+					// Server object
+
+
+  cupsMutexLock(&server->clients_lock);
+
+  if (timeout > 0)
+  {
+    client->deadline                = moauthdGetClock() + timeout;
+    server->reading[client->worker] = client;
+  }
+  else
+  {
+    client->deadline                = 0.0;
+    server->reading[client->worker] = NULL;
+  }
+
+  cupsMutexUnlock(&server->clients_lock);
+}
+
+
+//
+// 'check_deadlines()' - Shut down clients that have missed their request
+//                       deadline and return the time until the next check.
+//
+// Deadlines are set by the workers without waking up the main thread, so the
+// deadlines are checked at least every MOAUTHD_REQUEST_TIMEOUT seconds.
+//
+
+static int				// O - Timeout in milliseconds
+check_deadlines(moauthd_server_t *server)// I - Server object
+{
+  int			i;		// Looping var
+  moauthd_client_t	*client;	// Current client
+  double		curtime,	// Current time
+			next;		// Next deadline
+
+
+  curtime = moauthdGetClock();
+  next    = curtime + MOAUTHD_REQUEST_TIMEOUT;
+
+  cupsMutexLock(&server->clients_lock);
+
+  for (i = 0; i < server->num_running; i ++)
+  {
+    if ((client = server->reading[i]) == NULL)
+      continue;
+
+    if (client->deadline <= curtime)
+    {
+      // The worker still owns the client, so just shut down the socket and
+      // let the worker's blocked read fail...
+      moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "Timed out waiting for request.");
+
+      shutdown(httpGetFd(client->http), SHUT_RDWR);
+
+      client->deadline   = 0.0;
+      server->reading[i] = NULL;
+    }
+    else if (client->deadline < next)
+    {
+      next = client->deadline;
+    }
+  }
+
+  cupsMutexUnlock(&server->clients_lock);
+
+  return ((int)(1000.0 * (next - curtime)) + 1);
+}
+
+
+//
+// 'event_add()' - Start watching a file descriptor for input.
+//
+
+static bool				// O - `true` on success, `false` on error
+event_add(moauthd_server_t *server,	// I - Server object
+          int              fd,		// I - File descriptor
+          void             *data)	// I - Data pointer for events
+{
+#ifdef HAVE_EPOLL
+  struct epoll_event	event;		// Event data
+
+
+  memset(&event, 0, sizeof(event));
+  event.events   = EPOLLIN;
+  event.data.ptr = data;
+
+  return (!epoll_ctl(server->event_fd, EPOLL_CTL_ADD, fd, &event));
+
+#elif defined(HAVE_KQUEUE)
+  struct kevent	event;			// Event data
+
+
+  EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, data);
+
+  return (!kevent(server->event_fd, &event, 1, NULL, 0, NULL));
+
+#else
+  // poll() rebuilds its list from the listeners and idle clients each time...
+  (void)server;
+  (void)fd;
+  (void)data;
+
+  return (true);
+#endif // HAVE_EPOLL
+}
+
+
+//
+// 'event_close()' - Close the event notification descriptors.
+//
+
+static void
+event_close(moauthd_server_t *server)	// I - Server object
+{
+  if (server->event_fd >= 0)
+  {
+    close(server->event_fd);
+    server->event_fd = -1;
+  }
+
+  if (server->wakeup_pipe[0] >= 0)
+  {
+    close(server->wakeup_pipe[0]);
+    close(server->wakeup_pipe[1]);
+
+    server->wakeup_pipe[0] = server->wakeup_pipe[1] = -1;
+  }
+}
+
+
+//
+// 'event_open()' - Open the event notification descriptors.
+//
+
+static bool				// O - `true` on success, `false` on error
+event_open(moauthd_server_t *server)	// I - Server object
+{
+  server->event_fd       = -1;
+  server->wakeup_pipe[0] = server->wakeup_pipe[1] = -1;
+
+  // The wakeup pipe is used by the worker threads to tell the main thread that
+  // a client has been handed back...
+  if (pipe(server->wakeup_pipe))
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create wakeup pipe: %s", strerror(errno));
+    return (false);
+  }
+
+  fcntl(server->wakeup_pipe[0], F_SETFL, fcntl(server->wakeup_pipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl(server->wakeup_pipe[1], F_SETFL, fcntl(server->wakeup_pipe[1], F_GETFL) | O_NONBLOCK);
+  fcntl(server->wakeup_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(server->wakeup_pipe[1], F_SETFD, FD_CLOEXEC);
+
+#ifdef HAVE_EPOLL
+  if ((server->event_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create epoll descriptor: %s", strerror(errno));
+    event_close(server);
+    return (false);
+  }
+
+#elif defined(HAVE_KQUEUE)
+  if ((server->event_fd = kqueue()) < 0)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create kqueue descriptor: %s", strerror(errno));
+    event_close(server);
+    return (false);
+  }
+
+  fcntl(server->event_fd, F_SETFD, FD_CLOEXEC);
+#endif // HAVE_EPOLL
+
+  if (!event_add(server, server->wakeup_pipe[0], server->wakeup_pipe))
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to watch wakeup pipe: %s", strerror(errno));
+    event_close(server);
+    return (false);
+  }
+
+  return (true);
+}
+
+
+//
+// 'event_remove()' - Stop watching a file descriptor.
+//
+
+static void
+event_remove(moauthd_server_t *server,	// I - Server object
+             int              fd)	// I - File descriptor
+{
+#ifdef HAVE_EPOLL
+  struct epoll_event	event;		// Event data (ignored, but required by older kernels)
+
+
+  epoll_ctl(server->event_fd, EPOLL_CTL_DEL, fd, &event);
+
+#elif defined(HAVE_KQUEUE)
+  struct kevent	event;			// Event data
+
+
+  EV_SET(&event, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  kevent(server->event_fd, &event, 1, NULL, 0, NULL);
+
+#else
+  (void)server;
+  (void)fd;
+#endif // HAVE_EPOLL
+}
+
+
+//
+// 'event_wait()' - Wait for input on the listeners, idle clients, or wakeup
+//                  pipe.
+//
+
+static int				// O - Number of ready descriptors or -1 on error
+event_wait(moauthd_server_t *server,	// I - Server object
+           bool             listening,	// I - Watch the listener sockets?
+           int              timeout,	// I - Timeout in milliseconds or -1 for none
+           void             **ready,	// I - Array of ready data pointers
+           int              num_ready)	// I - Size of ready array
+{
+  int	i,				// Looping var
+	count;				// Number of events
+
+
+#ifdef HAVE_EPOLL
+  struct epoll_event	events[MOAUTHD_MAX_EVENTS];
+					// Events
+
+
+  (void)listening;
+
+  if (num_ready > MOAUTHD_MAX_EVENTS)
+    num_ready = MOAUTHD_MAX_EVENTS;
+
+  if ((count = epoll_wait(server->event_fd, events, num_ready, timeout)) < 0)
+    return (-1);
+
+  for (i = 0; i < count; i ++)
+    ready[i] = events[i].data.ptr;
+
+#elif defined(HAVE_KQUEUE)
+  struct kevent	events[MOAUTHD_MAX_EVENTS];
+					// Events
+  struct timespec ts;			// Timeout
+
+
+  (void)listening;
+
+  ts.tv_sec  = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000;
+
+  if (num_ready > MOAUTHD_MAX_EVENTS)
+    num_ready = MOAUTHD_MAX_EVENTS;
+
+  if ((count = kevent(server->event_fd, NULL, 0, events, num_ready, timeout < 0 ? NULL : &ts)) < 0)
+    return (-1);
+
+  for (i = 0; i < count; i ++)
+    ready[i] = events[i].udata;
+
+#else
+  int			num_fds,	// Number of descriptors to poll
+			alloc_fds;	// Allocated descriptors
+  struct pollfd		*fds,		// Descriptors to poll
+			*fdptr;		// Current descriptor
+  void			**fddata;	// Data for each descriptor
+  moauthd_client_t	*client;	// Current client
+
+
+  // Build the list of descriptors to poll...
+  alloc_fds = server->num_listeners + server->num_idle_clients + 1;
+
+  if ((fds = calloc((size_t)alloc_fds, sizeof(struct pollfd))) == NULL)
+    return (-1);
+
+  if ((fddata = calloc((size_t)alloc_fds, sizeof(void *))) == NULL)
+  {
+    free(fds);
+    return (-1);
+  }
+
+  fds[0].fd     = server->wakeup_pipe[0];
+  fds[0].events = POLLIN;
+  fddata[0]     = server->wakeup_pipe;
+  num_fds       = 1;
+
+  if (listening)
+  {
+    for (i = 0; i < server->num_listeners; i ++, num_fds ++)
+    {
+      fds[num_fds].fd     = server->listeners[i].fd;
+      fds[num_fds].events = POLLIN;
+      fddata[num_fds]     = server->listeners + i;
+    }
+  }
+
+  for (client = server->idle_clients; client; client = client->next, num_fds ++)
+  {
+    fds[num_fds].fd     = httpGetFd(client->http);
+    fds[num_fds].events = POLLIN;
+    fddata[num_fds]     = client;
+  }
+
+  if (poll(fds, (nfds_t)num_fds, timeout) < 0)
+  {
+    count = -1;
+  }
+  else
+  {
+    for (i = 0, count = 0, fdptr = fds; i < num_fds && count < num_ready; i ++, fdptr ++)
+    {
+      if (fdptr->revents)
+        ready[count ++] = fddata[i];
+    }
+  }
+
+  free(fds);
+  free(fddata);
+#endif // HAVE_EPOLL
+
+  return (count);
+}
+
+
+//
+// 'idle_add()' - Add a client to the end of the idle list.
+//
+// The idle list is kept in the order clients went idle so that the first
+// client is always the next one to time out.
+//
+
+static void
+idle_add(moauthd_server_t *server,	// I - Server object
+         moauthd_client_t *client)	// I - Client object
+{
+  client->idle_time = time(NULL);
+  client->next      = NULL;
+  client->prev      = server->idle_last;
+
+  if (server->idle_last)
+    server->idle_last->next = client;
+  else
+    server->idle_clients = client;
+
+  server->idle_last = client;
+  server->num_idle_clients ++;
+}
+
+
+//
+// 'idle_remove()' - Remove a client from the idle list.
+//
+
+static void
+idle_remove(moauthd_server_t *server,	// I - Server object
+            moauthd_client_t *client)	// I - Client object
+{
+  if (client->prev)
+    client->prev->next = client->next;
+  else
+    server->idle_clients = client->next;
+
+  if (client->next)
+    client->next->prev = client->prev;
+  else
+    server->idle_last = client->prev;
+
+  client->next = client->prev = NULL;
+
+  server->num_idle_clients --;
+}
+
+
+//
+// 'idle_timeout()' - Close idle clients that have timed out and return the
+//                    time until the next one times out.
+//
+
+static int				// O - Timeout in milliseconds or -1 for none
+idle_timeout(moauthd_server_t *server)	// I - Server object
+{
+  moauthd_client_t	*client;	// Current client
+  time_t		curtime,	// Current time
+			expires;	// Expiration time
+  int			keep_alive_timeout,
+					// Keep-alive timeout in seconds
+			num_closed = 0;	// Number of clients closed
+
+
+  if ((keep_alive_timeout = atomic_load_explicit(&server->keep_alive_timeout, memory_order_relaxed)) <= 0)
+    return (-1);
+
+  curtime = time(NULL);
+
+  while ((client = server->idle_clients) != NULL)
+  {
+    if ((expires = client->idle_time + keep_alive_timeout) > curtime)
+      break;
+
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_DEBUG, "Closing idle connection.");
+
+    event_remove(server, httpGetFd(client->http));
+    idle_remove(server, client);
+    moauthdDeleteClient(client);
+
+    num_closed ++;
+  }
+
+  if (num_closed > 0)
+  {
+    // Update the active count so the listeners are re-enabled as needed...
+    cupsMutexLock(&server->clients_lock);
+    server->num_active_clients -= num_closed;
+    cupsMutexUnlock(&server->clients_lock);
+
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "Closed %d idle connections, %d remaining.", num_closed, server->num_idle_clients);
+
+    return (0);
+  }
+  else if (client)
+    return ((int)(expires - curtime) * 1000);
+  else
+    return (-1);
+}
+
+
+//
+// 'queue_client()' - Queue a client for processing by a worker thread.
+//
+
+static void
+queue_client(moauthd_server_t *server,	// I - Server object
+             moauthd_client_t *client)	// I - Client object
+{
+  client->next = NULL;
+
+  cupsMutexLock(&server->clients_lock);
+
+  if (server->ready_last)
+    server->ready_last->next = client;
+  else
+    server->ready_first = client;
+
+  server->ready_last = client;
+
+  cupsCondBroadcast(&server->clients_cond);
+  cupsMutexUnlock(&server->clients_lock);
+}
+
+
+//
+// 'sighup_handler()' - Flag a configuration reload and wake up the main thread.
+//
+
+static void
+sighup_handler(int sig)			// I - Signal number (unused)
+{
+  int	saved_errno = errno;		// Current errno value
+
+
+  (void)sig;
+
+  reload_pending = 1;
+
+  // Errors are ignored - a full pipe already means a wakeup is pending...
+  if (reload_pipe >= 0)
+  {
+    ssize_t bytes = write(reload_pipe, "", 1);
+					// Bytes written
+
+    (void)bytes;
+  }
+
+  errno = saved_errno;
+}
+
+
+//
+// 'wakeup_server()' - Wake up the main thread.
+//
+
+static void
+wakeup_server(moauthd_server_t *server)	// I - Server object
+{
+  // A full pipe already means the main thread has a wakeup pending...
+  if (write(server->wakeup_pipe[1], "", 1) < 0 && errno != EAGAIN)
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to wake up main thread: %s", strerror(errno));
+}
+
+
+//
+// 'worker_thread()' - Process requests from queued clients.
+//
+
+static void *				// O - Thread exit status (unused)
+worker_thread(moauthd_server_t *server)	// I - Server object
+{
+  moauthd_client_t	*client;	// Current client
+  bool			keep_alive;	// Keep the connection open?
+  int			worker;		// Index of this worker
+
+
+  cupsMutexLock(&server->clients_lock);
+  worker = server->num_running ++;
+  cupsMutexUnlock(&server->clients_lock);
+
+  for (;;)
+  {
+    // Wait for a client to process...
+    cupsMutexLock(&server->clients_lock);
+
+    while (!server->ready_first && !server->shutdown)
+      cupsCondWait(&server->clients_cond, &server->clients_lock, -1.0);
+
+    if (server->shutdown)
+    {
+      cupsMutexUnlock(&server->clients_lock);
+      break;
+    }
+
+    client = server->ready_first;
+
+    if ((server->ready_first = client->next) == NULL)
+      server->ready_last = NULL;
+
+    client->next   = NULL;
+    client->worker = worker;
+
+    cupsMutexUnlock(&server->clients_lock);
+
+    // Process requests until the connection goes idle or is closed...
+    keep_alive = moauthdRunClient(client);
+
+    cupsMutexLock(&server->clients_lock);
+
+    // Make sure the main thread no longer watches the client's deadline and
+    // that retired resources can be freed...
+    server->reading[worker] = NULL;
+    client->deadline        = 0.0;
+
+    atomic_store(server->worker_generation + worker, 0);
+
+    if (keep_alive)
+    {
+      client->next             = server->returned_clients;
+      server->returned_clients = client;
+    }
+    else
+    {
+      server->num_active_clients --;
+    }
+
+    cupsMutexUnlock(&server->clients_lock);
+
+    if (!keep_alive)
+      moauthdDeleteClient(client);
+
+    wakeup_server(server);
+  }
+
+  return (NULL);
+}
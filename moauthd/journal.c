@@ -0,0 +1,992 @@
+//
+// Token and application journal for moauth daemon
+//
+// Copyright © 2017-2024 by Michael R Sweet
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// Issued tokens and registered applications are appended to a binary journal
+// next to the state file so they survive a restart.  The journal starts with
+// an 8 byte magic string followed by records:
+//
+//   uint32_t length;			// Length of record data
+//   uint32_t type;			// Record type
+//   uint8_t  data[length];		// Record data
+//
+// Strings in the record data are stored as a 32-bit length (0xffffffff for
+// `NULL`) followed by the bytes, without a nul terminator.  Integers are
+// stored in host byte order, so the journal is not portable between hosts.
+//
+// The same records are sent to replication peers, who replay them and append
+// them to their own journal.
+//
+
+#include "moauthd.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+
+//
+// Constants...
+//
+
+#define MOAUTHD_JOURNAL_MAGIC	"MOAUTHJ1"
+					// Journal file magic
+
+typedef enum moauthd_jtype_e		// Journal record types
+{
+  MOAUTHD_JTYPE_APPLICATION = 1,	// Registered application
+  MOAUTHD_JTYPE_TOKEN,			// Issued token
+  MOAUTHD_JTYPE_DELETE_TOKEN,		// Deleted token
+  MOAUTHD_JTYPE_REVOKE_TOKEN		// Revoked access token
+} moauthd_jtype_t;
+
+
+//
+// Local types...
+//
+
+typedef struct moauthd_jbuf_s		// Journal record buffer
+{
+  unsigned char	*data;			// Record data
+  size_t	used,			// Bytes used
+		alloc;			// Bytes allocated
+} moauthd_jbuf_t;
+
+typedef bool (*moauthd_jcb_t)(void *cb_data, moauthd_jtype_t type, moauthd_jbuf_t *jbuf);
+					// Snapshot record callback
+
+
+//
+// Local globals...
+//
+
+static __thread bool journal_replay = false;
+					// Replaying records in this thread?
+
+
+//
+// Local functions...
+//
+
+static void	add_record(moauthd_server_t *server, moauthd_jtype_t type, moauthd_jbuf_t *jbuf);
+static bool	append_record(moauthd_jbuf_t *out, moauthd_jtype_t type, moauthd_jbuf_t *jbuf);
+static bool	copy_records(int from, off_t offset, int to);
+static bool	get_int(const unsigned char **ptr, const unsigned char *end, void *value, size_t size);
+static bool	get_string(const unsigned char **ptr, const unsigned char *end, char **s);
+static bool	put_application(moauthd_jbuf_t *jbuf, moauthd_application_t *app, const char *redirect_uri);
+static bool	put_data(moauthd_jbuf_t *jbuf, const void *data, size_t length);
+static bool	put_string(moauthd_jbuf_t *jbuf, const char *s);
+static bool	put_snapshot(moauthd_server_t *server, moauthd_jcb_t cb, void *cb_data, size_t *num_records);
+static bool	put_token(moauthd_jbuf_t *jbuf, moauthd_token_t *token);
+static bool	replay_record(moauthd_server_t *server, moauthd_jtype_t type, const unsigned char *data, size_t length, time_t curtime);
+static bool	save_record(int *fd, moauthd_jtype_t type, moauthd_jbuf_t *jbuf);
+static bool	write_record(int fd, moauthd_jtype_t type, moauthd_jbuf_t *jbuf);
+
+
+//
+// 'moauthdCompactJournal()' - Rewrite the journal with only the live tokens
+//                             and applications.
+//
+// The snapshot is written without holding the journal lock so that new
+// records are not held up.  Records appended to the old journal while the
+// snapshot was written are then copied to the new journal under the lock
+// before it replaces the old one.  Replaying a record that is already part
+// of the snapshot has no effect.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdCompactJournal(
+    moauthd_server_t *server)		// I - Server object
+{
+  char			newfile[1024];	// New journal file
+  int			fd;		// New journal file descriptor
+  size_t		num_records = 0,// Number of records written
+			start_records;	// Journal records before snapshot
+  off_t			start_offset = 0;
+					// Journal size before snapshot
+  bool			ret = true;	// Return value
+
+
+  if (!server->journal_file)
+    return (true);
+
+  snprintf(newfile, sizeof(newfile), "%s.N", server->journal_file);
+
+  if ((fd = open(newfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create journal file \"%s\": %s", newfile, strerror(errno));
+    return (false);
+  }
+
+  // Remember where the old journal ends before taking the snapshot...
+  cupsMutexLock(&server->journal_lock);
+
+  if (server->journal_fd >= 0 && (start_offset = lseek(server->journal_fd, 0, SEEK_END)) < 0)
+    start_offset = 0;
+
+  start_records = server->journal_records;
+
+  cupsMutexUnlock(&server->journal_lock);
+
+  if (write(fd, MOAUTHD_JOURNAL_MAGIC, 8) != 8)
+    ret = false;
+
+  // Write the applications, unexpired tokens, and revocations...
+  if (ret)
+    ret = put_snapshot(server, (moauthd_jcb_t)save_record, &fd, &num_records);
+
+  if (ret && fsync(fd))
+    ret = false;
+
+  cupsMutexLock(&server->journal_lock);
+
+  // Copy any records that were added while writing the snapshot...
+  if (ret && server->journal_fd >= 0 && server->journal_records > start_records)
+  {
+    if ((ret = copy_records(server->journal_fd, start_offset, fd)) && (ret = !fsync(fd)))
+      num_records += server->journal_records - start_records;
+  }
+
+  if (!ret)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to write journal file \"%s\": %s", newfile, strerror(errno));
+    close(fd);
+    unlink(newfile);
+  }
+  else if (rename(newfile, server->journal_file))
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to rename journal file \"%s\": %s", newfile, strerror(errno));
+    close(fd);
+    unlink(newfile);
+    ret = false;
+  }
+  else
+  {
+    // Switch to appending to the new journal...
+    if (server->journal_fd >= 0)
+      close(server->journal_fd);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+
+    server->journal_fd      = fd;
+    server->journal_records = num_records;
+
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "Compacted journal to %lu records.", (unsigned long)num_records);
+  }
+
+  cupsMutexUnlock(&server->journal_lock);
+
+  return (ret);
+}
+
+
+//
+// 'moauthdCopyJournal()' - Copy the live tokens and applications as journal
+//                          records.
+//
+// The returned buffer holds the same records that would be written by
+// moauthdCompactJournal(), without the magic string, and must be freed by
+// the caller.  This is used to bring replication peers up to date.
+//
+
+unsigned char *				// O - Journal records or `NULL` on error
+moauthdCopyJournal(
+    moauthd_server_t *server,		// I - Server object
+    size_t           *length)		// O - Length of records
+{
+  moauthd_jbuf_t	out;		// Output buffer
+  size_t		num_records = 0;// Number of records
+
+
+  memset(&out, 0, sizeof(out));
+
+  if (!put_snapshot(server, (moauthd_jcb_t)append_record, &out, &num_records))
+  {
+    free(out.data);
+    *length = 0;
+    return (NULL);
+  }
+
+  *length = out.used;
+
+  return (out.data);
+}
+
+
+//
+// 'moauthdJournalApplication()' - Add an application redirection URI to the
+//                                 journal.
+//
+
+void
+moauthdJournalApplication(
+    moauthd_server_t      *server,	// I - Server object
+    moauthd_application_t *app,		// I - Application
+    const char            *redirect_uri)// I - Redirection URI
+{
+  moauthd_jbuf_t	jbuf;		// Record buffer
+
+
+  if (journal_replay || (server->journal_fd < 0 && !server->num_peers))
+    return;
+
+  memset(&jbuf, 0, sizeof(jbuf));
+
+  if (put_application(&jbuf, app, redirect_uri))
+    add_record(server, MOAUTHD_JTYPE_APPLICATION, &jbuf);
+
+  free(jbuf.data);
+}
+
+
+//
+// 'moauthdJournalRevoke()' - Add a revoked access token to the journal.
+//
+
+void
+moauthdJournalRevoke(
+    moauthd_server_t *server,		// I - Server object
+    const char       *jti,		// I - JWT ID
+    uint64_t         token_hash,	// I - Hash of token string or 0 if unknown
+    time_t           expires)		// I - When the token expires
+{
+  moauthd_jbuf_t	jbuf;		// Record buffer
+  int64_t		exp = (int64_t)expires;
+					// Expiration time
+
+
+  if (journal_replay || (server->journal_fd < 0 && !server->num_peers))
+    return;
+
+  memset(&jbuf, 0, sizeof(jbuf));
+
+  if (put_data(&jbuf, &exp, sizeof(exp)) && put_string(&jbuf, jti) && put_data(&jbuf, &token_hash, sizeof(token_hash)))
+    add_record(server, MOAUTHD_JTYPE_REVOKE_TOKEN, &jbuf);
+
+  free(jbuf.data);
+}
+
+
+//
+// 'moauthdJournalToken()' - Add a new or deleted token to the journal.
+//
+
+void
+moauthdJournalToken(
+    moauthd_server_t *server,		// I - Server object
+    moauthd_token_t  *token,		// I - Token
+    bool             deleted)		// I - Was the token deleted?
+{
+  moauthd_jbuf_t	jbuf;		// Record buffer
+  bool			ret;		// Did the record encode?
+
+
+  if (journal_replay || (server->journal_fd < 0 && !server->num_peers))
+    return;
+
+  memset(&jbuf, 0, sizeof(jbuf));
+
+  if (deleted)
+    ret = put_string(&jbuf, token->token);
+  else
+    ret = put_token(&jbuf, token);
+
+  if (ret)
+    add_record(server, deleted ? MOAUTHD_JTYPE_DELETE_TOKEN : MOAUTHD_JTYPE_TOKEN, &jbuf);
+
+  free(jbuf.data);
+}
+
+
+//
+// 'moauthdLoadJournal()' - Load tokens and applications from the journal.
+//
+// The journal is memory-mapped and replayed in a single pass, then opened for
+// appending.  A truncated record at the end (from a crash) is discarded.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdLoadJournal(
+    moauthd_server_t *server)		// I - Server object
+{
+  char			filename[1024];	// Journal filename
+  int			fd;		// Journal file descriptor
+  struct stat		fileinfo;	// Journal file information
+  const unsigned char	*map,		// Mapped journal
+			*ptr,		// Pointer into journal
+			*rec,		// Start of current record
+			*end;		// End of journal
+  size_t		num_records = 0,// Number of records
+			num_tokens;	// Number of live tokens
+  uint32_t		length,		// Record length
+			type;		// Record type
+  time_t		curtime;	// Current time
+
+
+  snprintf(filename, sizeof(filename), "%s.journal", server->state_file);
+
+  if ((server->journal_file = strdup(filename)) == NULL)
+  {
+    fprintf(stderr, "moauthd: Unable to allocate memory for journal filename: %s\n", strerror(errno));
+    return (false);
+  }
+
+  if ((fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+  {
+    fprintf(stderr, "moauthd: Unable to open journal file \"%s\": %s\n", filename, strerror(errno));
+    return (false);
+  }
+
+  if (fstat(fd, &fileinfo))
+  {
+    fprintf(stderr, "moauthd: Unable to get information on journal file \"%s\": %s\n", filename, strerror(errno));
+    close(fd);
+    return (false);
+  }
+
+  if (fileinfo.st_size == 0)
+  {
+    // New journal...
+    if (write(fd, MOAUTHD_JOURNAL_MAGIC, 8) != 8)
+    {
+      fprintf(stderr, "moauthd: Unable to write journal file \"%s\": %s\n", filename, strerror(errno));
+      close(fd);
+      return (false);
+    }
+  }
+  else
+  {
+    // Map and replay the existing journal...
+    if ((map = mmap(NULL, (size_t)fileinfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+      fprintf(stderr, "moauthd: Unable to map journal file \"%s\": %s\n", filename, strerror(errno));
+      close(fd);
+      return (false);
+    }
+
+    end = map + fileinfo.st_size;
+
+    if (fileinfo.st_size < 8 || memcmp(map, MOAUTHD_JOURNAL_MAGIC, 8))
+    {
+      fprintf(stderr, "moauthd: Bad journal file \"%s\".\n", filename);
+      munmap((void *)map, (size_t)fileinfo.st_size);
+      close(fd);
+      return (false);
+    }
+
+    curtime = time(NULL);
+
+    for (ptr = map + 8; ptr < end; ptr += length, num_records ++)
+    {
+      rec = ptr;
+
+      if (!get_int(&ptr, end, &length, sizeof(length)) || !get_int(&ptr, end, &type, sizeof(type)) || length > (size_t)(end - ptr))
+      {
+        // Truncated record, discard it...
+        moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Discarding truncated record at end of journal file \"%s\".", filename);
+
+        if (ftruncate(fd, (off_t)(rec - map)))
+        {
+	  fprintf(stderr, "moauthd: Unable to truncate journal file \"%s\": %s\n", filename, strerror(errno));
+	  munmap((void *)map, (size_t)fileinfo.st_size);
+	  close(fd);
+	  return (false);
+        }
+        break;
+      }
+
+      journal_replay = true;
+
+      if (!replay_record(server, (moauthd_jtype_t)type, ptr, length, curtime))
+        moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Bad record %lu in journal file \"%s\" ignored.", (unsigned long)num_records + 1, filename);
+
+      journal_replay = false;
+    }
+
+    munmap((void *)map, (size_t)fileinfo.st_size);
+  }
+
+  server->journal_records = num_records;
+
+  // Position at the end for appending...
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+
+  server->journal_fd = fd;
+
+  // Compact the journal if it is mostly dead records...
+  num_tokens = moauthdGetNumTokens(server);
+
+  moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Loaded %lu tokens from %lu journal records.", (unsigned long)num_tokens, (unsigned long)num_records);
+
+  if (num_records > 2 * num_tokens + MOAUTHD_JOURNAL_SLACK)
+    return (moauthdCompactJournal(server));
+
+  return (true);
+}
+
+
+//
+// 'moauthdReplayJournal()' - Replay journal records from a replication peer.
+//
+// The records are applied to the token table and applications and then
+// appended to the local journal.  They are not sent on to other peers.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdReplayJournal(
+    moauthd_server_t    *server,	// I - Server object
+    const unsigned char *data,		// I - Journal records
+    size_t              length)		// I - Length of records
+{
+  const unsigned char	*ptr,		// Pointer into records
+			*end = data + length;
+					// End of records
+  size_t		num_records = 0;// Number of records
+  uint32_t		reclen,		// Record length
+			type;		// Record type
+  time_t		curtime = time(NULL);
+					// Current time
+
+
+  // Check the framing first so that a bad batch is not partially applied...
+  for (ptr = data; ptr < end; ptr += reclen)
+  {
+    if (!get_int(&ptr, end, &reclen, sizeof(reclen)) || !get_int(&ptr, end, &type, sizeof(type)) || reclen > (size_t)(end - ptr))
+      return (false);
+  }
+
+  for (ptr = data; ptr < end; ptr += reclen, num_records ++)
+  {
+    get_int(&ptr, end, &reclen, sizeof(reclen));
+    get_int(&ptr, end, &type, sizeof(type));
+
+    journal_replay = true;
+
+    if (!replay_record(server, (moauthd_jtype_t)type, ptr, reclen, curtime))
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Bad replicated record %lu ignored.", (unsigned long)num_records + 1);
+
+    journal_replay = false;
+  }
+
+  // Append the whole batch to the local journal at once...
+  if (server->journal_fd >= 0 && length > 0)
+  {
+    cupsMutexLock(&server->journal_lock);
+
+    if (write(server->journal_fd, data, length) == (ssize_t)length)
+      server->journal_records += num_records;
+    else
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to write to journal file \"%s\": %s", server->journal_file, strerror(errno));
+
+    cupsMutexUnlock(&server->journal_lock);
+  }
+
+  return (true);
+}
+
+
+//
+// 'add_record()' - Write a record to the journal and queue it for peers.
+//
+
+static void
+add_record(moauthd_server_t *server,	// I - Server object
+           moauthd_jtype_t  type,	// I - Record type
+           moauthd_jbuf_t   *jbuf)	// I - Record buffer
+{
+  if (server->journal_fd >= 0)
+  {
+    cupsMutexLock(&server->journal_lock);
+
+    if (write_record(server->journal_fd, type, jbuf))
+      server->journal_records ++;
+    else
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to write to journal file \"%s\": %s", server->journal_file, strerror(errno));
+
+    cupsMutexUnlock(&server->journal_lock);
+  }
+
+  if (server->num_peers > 0)
+    moauthdReplicate(server, (unsigned)type, jbuf->data, jbuf->used);
+}
+
+
+//
+// 'append_record()' - Append a record with its header to a buffer.
+//
+
+static bool				// O - `true` on success, `false` on error
+append_record(moauthd_jbuf_t  *out,	// I - Output buffer
+              moauthd_jtype_t type,	// I - Record type
+              moauthd_jbuf_t  *jbuf)	// I - Record buffer
+{
+  uint32_t	header[2];		// Record header
+
+
+  header[0] = (uint32_t)jbuf->used;
+  header[1] = (uint32_t)type;
+
+  return (put_data(out, header, sizeof(header)) && put_data(out, jbuf->data, jbuf->used));
+}
+
+
+//
+// 'copy_records()' - Copy journal records from an offset to the end of a file.
+//
+
+static bool				// O - `true` on success, `false` on error
+copy_records(int   from,		// I - Source journal file descriptor
+             off_t offset,		// I - Starting offset
+             int   to)			// I - Destination journal file descriptor
+{
+  unsigned char	buffer[65536];		// Copy buffer
+  ssize_t	bytes;			// Bytes read
+
+
+  while ((bytes = pread(from, buffer, sizeof(buffer), offset)) != 0)
+  {
+    if (bytes < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return (false);
+    }
+
+    if (write(to, buffer, (size_t)bytes) != bytes)
+      return (false);
+
+    offset += bytes;
+  }
+
+  return (true);
+}
+
+
+//
+// 'get_int()' - Get a fixed-size integer from a journal record.
+
+static bool				// O - `true` on success, `false` on error
+get_int(const unsigned char **ptr,	// IO - Pointer into record
+        const unsigned char *end,	// I  - End of record
+        void                *value,	// O  - Value
+        size_t              size)	// I  - Size of value
+{
+  if ((size_t)(end - *ptr) < size)
+    return (false);
+
+  memcpy(value, *ptr, size);
+  *ptr += size;
+
+  return (true);
+}
+
+
+//
+// 'get_string()' - Get a string from a journal record.
+//
+
+static bool				// O - `true` on success, `false` on error
+get_string(const unsigned char **ptr,	// IO - Pointer into record
+           const unsigned char *end,	// I  - End of record
+           char                **s)	// O  - String or `NULL`
+{
+  uint32_t	length;			// Length of string
+
+
+  *s = NULL;
+
+  if (!get_int(ptr, end, &length, sizeof(length)))
+    return (false);
+
+  if (length == 0xffffffff)
+    return (true);
+
+  if (length > (size_t)(end - *ptr) || (*s = strndup((const char *)*ptr, length)) == NULL)
+    return (false);
+
+  *ptr += length;
+
+  return (true);
+}
+
+
+//
+// 'put_application()' - Encode an application record.
+//
+
+static bool				// O - `true` on success, `false` on error
+put_application(
+    moauthd_jbuf_t        *jbuf,	// I - Record buffer
+    moauthd_application_t *app,		// I - Application
+    const char            *redirect_uri)// I - Redirection URI
+{
+  return (put_string(jbuf, app->client_id) && put_string(jbuf, redirect_uri) && put_string(jbuf, app->client_name) && put_string(jbuf, app->client_uri) && put_string(jbuf, app->logo_uri) && put_string(jbuf, app->tos_uri));
+}
+
+
+//
+// 'put_data()' - Append data to a record buffer.
+//
+
+static bool				// O - `true` on success, `false` on error
+put_data(moauthd_jbuf_t *jbuf,		// I - Record buffer
+         const void     *data,		// I - Data
+         size_t         length)		// I - Length of data
+{
+  if ((jbuf->used + length) > jbuf->alloc)
+  {
+    size_t	alloc = jbuf->alloc ? 2 * jbuf->alloc : 1024;
+					// New allocation
+    unsigned char *temp;		// New buffer
+
+    while (alloc < (jbuf->used + length))
+      alloc *= 2;
+
+    if ((temp = realloc(jbuf->data, alloc)) == NULL)
+      return (false);
+
+    jbuf->data  = temp;
+    jbuf->alloc = alloc;
+  }
+
+  memcpy(jbuf->data + jbuf->used, data, length);
+  jbuf->used += length;
+
+  return (true);
+}
+
+
+//
+// 'put_snapshot()' - Encode the live applications, tokens, and revocations.
+//
+// The callback is called for each record and returns `false` to stop.
+//
+
+static bool				// O - `true` on success, `false` on error
+put_snapshot(
+    moauthd_server_t *server,		// I - Server object
+    moauthd_jcb_t    cb,		// I - Record callback
+    void             *cb_data,		// I - Callback data
+    size_t           *num_records)	// O - Number of records
+{
+  int			i;		// Looping var
+  size_t		j;		// Looping var
+  bool			ret = true;	// Return value
+  moauthd_jbuf_t	jbuf;		// Record buffer
+  moauthd_apptable_t	*table;		// Application hash table
+  moauthd_application_t	*app;		// Current application
+  moauthd_uri_t		*uri;		// Current redirection URI
+  moauthd_tshard_t	*shard;		// Current token shard
+  moauthd_token_t	*token;		// Current token
+  moauthd_revoked_t	*r;		// Current revoked token
+  int64_t		expires;	// Revoked token expiration
+  time_t		curtime;	// Current time
+
+
+  memset(&jbuf, 0, sizeof(jbuf));
+
+  // Write the applications, one record per redirection URI...
+  cupsMutexLock(&server->applications_lock);
+
+  table = atomic_load_explicit(&server->applications, memory_order_relaxed);
+
+  for (j = 0; ret && table && j < table->num_slots; j ++)
+  {
+    if ((app = atomic_load_explicit(table->slots + j, memory_order_relaxed)) == NULL)
+      continue;
+
+    for (uri = app->redirect_uris; ret && uri; uri = atomic_load_explicit(&uri->next, memory_order_relaxed))
+    {
+      jbuf.used = 0;
+
+      if ((ret = put_application(&jbuf, app, uri->uri) && (cb)(cb_data, MOAUTHD_JTYPE_APPLICATION, &jbuf)) == true)
+	(*num_records) ++;
+    }
+  }
+
+  cupsMutexUnlock(&server->applications_lock);
+
+  // Then the unexpired tokens...
+  curtime = time(NULL);
+
+  for (i = MOAUTHD_TOKEN_SHARDS, shard = server->tokens; ret && i > 0; i --, shard ++)
+  {
+    cupsRWLockRead(&shard->lock);
+
+    for (j = 0; ret && j < shard->num_buckets; j ++)
+    {
+      for (token = shard->buckets[j]; ret && token; token = token->next)
+      {
+        if (token->expires <= curtime)
+          continue;
+
+        jbuf.used = 0;
+
+	if ((ret = put_token(&jbuf, token) && (cb)(cb_data, MOAUTHD_JTYPE_TOKEN, &jbuf)) == true)
+	  (*num_records) ++;
+      }
+    }
+
+    cupsRWUnlock(&shard->lock);
+  }
+
+  // And finally the revoked tokens that have not expired...
+  cupsRWLockRead(&server->revoked_lock);
+
+  for (j = 0; ret && j < server->num_revoked_buckets; j ++)
+  {
+    for (r = server->revoked[j]; ret && r; r = r->next)
+    {
+      if (r->expires <= curtime)
+        continue;
+
+      jbuf.used = 0;
+      expires   = (int64_t)r->expires;
+
+      if ((ret = put_data(&jbuf, &expires, sizeof(expires)) && put_string(&jbuf, r->jti) && put_data(&jbuf, &r->token_hash, sizeof(r->token_hash)) && (cb)(cb_data, MOAUTHD_JTYPE_REVOKE_TOKEN, &jbuf)) == true)
+        (*num_records) ++;
+    }
+  }
+
+  cupsRWUnlock(&server->revoked_lock);
+
+  free(jbuf.data);
+
+  return (ret);
+}
+
+
+//
+// 'put_string()' - Append a string to a record buffer.
+//
+
+static bool				// O - `true` on success, `false` on error
+put_string(moauthd_jbuf_t *jbuf,	// I - Record buffer
+           const char     *s)		// I - String or `NULL`
+{
+  uint32_t	length = s ? (uint32_t)strlen(s) : 0xffffffff;
+					// Length of string
+
+
+  return (put_data(jbuf, &length, sizeof(length)) && (!s || put_data(jbuf, s, length)));
+}
+
+
+//
+// 'put_token()' - Encode a token record.
+//
+
+static bool				// O - `true` on success, `false` on error
+put_token(moauthd_jbuf_t  *jbuf,	// I - Record buffer
+          moauthd_token_t *token)	// I - Token
+{
+  int64_t	created = (int64_t)token->created,
+					// Creation time
+		expires = (int64_t)token->expires;
+					// Expiration time
+  int32_t	uid = (int32_t)token->uid,
+					// User ID
+		gid = (int32_t)token->gid;
+					// Group ID
+  uint32_t	type = (uint32_t)token->type;
+					// Token type
+
+
+  return (put_data(jbuf, &created, sizeof(created)) && put_data(jbuf, &expires, sizeof(expires)) && put_data(jbuf, &uid, sizeof(uid)) && put_data(jbuf, &gid, sizeof(gid)) && put_data(jbuf, &type, sizeof(type)) && put_string(jbuf, token->token) && put_string(jbuf, token->jti) && put_string(jbuf, token->challenge) && put_string(jbuf, token->user) && put_string(jbuf, token->scopes) && put_string(jbuf, token->application ? token->application->client_id : NULL) && put_string(jbuf, token->application ? token->application->redirect_uri : NULL));
+}
+
+
+//
+// 'replay_record()' - Replay a journal record.
+//
+
+static bool				// O - `true` on success, `false` on error
+replay_record(
+    moauthd_server_t    *server,	// I - Server object
+    moauthd_jtype_t     type,		// I - Record type
+    const unsigned char *data,		// I - Record data
+    size_t              length,		// I - Length of record data
+    time_t              curtime)	// I - Current time
+{
+  const unsigned char	*end = data + length;
+					// End of record
+  bool			ret = false;	// Return value
+
+
+  switch (type)
+  {
+    case MOAUTHD_JTYPE_APPLICATION :
+        {
+          char	*client_id = NULL,	// Client ID
+		*redirect_uri = NULL,	// Redirection URI
+		*client_name = NULL,	// Name, if any
+		*client_uri = NULL,	// Web page, if any
+		*logo_uri = NULL,	// Logo URI, if any
+		*tos_uri = NULL;	// Terms-of-service URI, if any
+
+          if (get_string(&data, end, &client_id) && get_string(&data, end, &redirect_uri) && get_string(&data, end, &client_name) && get_string(&data, end, &client_uri) && get_string(&data, end, &logo_uri) && get_string(&data, end, &tos_uri) && client_id && redirect_uri)
+            ret = moauthdAddApplication(server, client_id, redirect_uri, client_name, client_uri, logo_uri, tos_uri) != NULL;
+
+          free(client_id);
+          free(redirect_uri);
+          free(client_name);
+          free(client_uri);
+          free(logo_uri);
+          free(tos_uri);
+        }
+        break;
+
+    case MOAUTHD_JTYPE_TOKEN :
+        {
+	  int64_t	created,	// Creation time
+			expires;	// Expiration time
+	  int32_t	uid,		// User ID
+			gid;		// Group ID
+	  uint32_t	toktype;	// Token type
+	  char		*client_id = NULL,
+					// Client ID
+			*redirect_uri = NULL;
+					// Redirection URI
+	  moauthd_token_t *token,	// Token
+			*existing;	// Existing token, if any
+
+          if ((token = (moauthd_token_t *)calloc(1, sizeof(moauthd_token_t))) == NULL)
+            break;
+
+          if (get_int(&data, end, &created, sizeof(created)) && get_int(&data, end, &expires, sizeof(expires)) && get_int(&data, end, &uid, sizeof(uid)) && get_int(&data, end, &gid, sizeof(gid)) && get_int(&data, end, &toktype, sizeof(toktype)) && get_string(&data, end, &token->token) && get_string(&data, end, &token->jti) && get_string(&data, end, &token->challenge) && get_string(&data, end, &token->user) && get_string(&data, end, &token->scopes) && get_string(&data, end, &client_id) && get_string(&data, end, &redirect_uri) && token->token && token->user && token->scopes && toktype <= MOAUTHD_TOKTYPE_RENEWAL)
+          {
+            ret = true;
+
+            if (client_id && redirect_uri)
+              token->application = moauthdFindApplication(server, client_id, redirect_uri);
+
+            if ((existing = moauthdFindToken(server, token->token)) != NULL)
+              moauthdReleaseToken(server, existing);
+
+            // Skip tokens that were deleted or revoked after this record was
+            // written...
+            if (expires > curtime && !existing && (!token->jti || !moauthdIsTokenRevoked(server, token->jti)))
+            {
+              // Still valid, add it to the token table...
+	      token->type         = (moauthd_toktype_t)toktype;
+	      token->scopes_array = cupsArrayNewStrings(token->scopes, ' ');
+	      token->uid          = (uid_t)uid;
+	      token->gid          = (gid_t)gid;
+	      token->created      = (time_t)created;
+	      token->expires      = (time_t)expires;
+
+              moauthdAddToken(server, token);
+              token = NULL;
+            }
+          }
+
+          free(client_id);
+          free(redirect_uri);
+
+          if (!token)
+            break;
+
+          // Expired, duplicate, revoked, or bad token...
+          moauthdFreeToken(token);
+        }
+        break;
+
+    case MOAUTHD_JTYPE_DELETE_TOKEN :
+        {
+          char		*token_id = NULL;
+					// Token string
+	  moauthd_token_t *token;	// Token
+
+          if (get_string(&data, end, &token_id) && token_id)
+          {
+            if ((token = moauthdFindToken(server, token_id)) != NULL)
+            {
+              moauthdDeleteToken(server, token);
+              moauthdReleaseToken(server, token);
+            }
+
+            ret = true;
+          }
+
+          free(token_id);
+        }
+        break;
+
+    case MOAUTHD_JTYPE_REVOKE_TOKEN :
+        {
+          int64_t	expires;	// Expiration time
+          char		*jti = NULL;	// JWT ID
+          uint64_t	token_hash = 0;	// Hash of token string, if known
+
+          if (get_int(&data, end, &expires, sizeof(expires)) && get_string(&data, end, &jti) && jti)
+          {
+            // Older records do not include the token hash...
+            if (data < end && !get_int(&data, end, &token_hash, sizeof(token_hash)))
+              token_hash = 0;
+
+            // Newly revoked tokens are also removed from the token table
+            // since the matching delete record may have been lost...
+            if (expires > curtime && moauthdRevokeToken(server, jti, token_hash, (time_t)expires))
+              moauthdDeleteRevokedToken(server, jti, token_hash);
+
+            ret = true;
+          }
+
+          free(jti);
+        }
+        break;
+
+    default :
+        break;
+  }
+
+  return (ret);
+}
+
+
+//
+// 'save_record()' - Write a snapshot record to a journal file.
+//
+
+static bool				// O - `true` on success, `false` on error
+save_record(int             *fd,	// I - Journal file descriptor
+            moauthd_jtype_t type,	// I - Record type
+            moauthd_jbuf_t  *jbuf)	// I - Record buffer
+{
+  return (write_record(*fd, type, jbuf));
+}
+
+
+//
+// 'write_record()' - Write a record to the journal.
+//
+
+static bool				// O - `true` on success, `false` on error
+write_record(int             fd,	// I - Journal file descriptor
+             moauthd_jtype_t type,	// I - Record type
+             moauthd_jbuf_t  *jbuf)	// I - Record buffer
+{
+  uint32_t	header[2];		// Record header
+  struct iovec	iov[2];			// Record header and data
+  ssize_t	bytes;			// Bytes written
+
+
+  header[0] = (uint32_t)jbuf->used;
+  header[1] = (uint32_t)type;
+
+  iov[0].iov_base = header;
+  iov[0].iov_len  = sizeof(header);
+  iov[1].iov_base = jbuf->data;
+  iov[1].iov_len  = jbuf->used;
+
+  // Write the whole record at once so that concurrent readers never see a
+  // partial record...
+  bytes = writev(fd, iov, 2);
+
+  return (bytes == (ssize_t)(sizeof(header) + jbuf->used));
+}
@@ -9,6 +9,7 @@
 #include "moauthd.h"
 #include <stdarg.h>
 #include <syslog.h>
+#include <sys/uio.h>
 
 
 //
@@ -16,13 +17,38 @@
 //
 
 static const int priorities[] = { LOG_ERR, LOG_INFO, LOG_DEBUG };
+static __thread time_t log_time = 0;	// Time of cached timestamp
+static __thread char log_prefix[32];	// Cached timestamp prefix
 
 
 //
 // Local functions...
 //
 
-static void	file_log(int fd, const char *message, va_list ap);
+static void	file_log(moauthd_server_t *server, const char *message, va_list ap);
+static const char *get_prefix(void);
+static char	*json_string(char *lineptr, char *lineend, const char *s);
+static void	*log_writer(moauthd_logbuf_t *lb);
+static bool	queue_log(moauthd_logbuf_t *lb, const char *line, size_t length);
+static bool	start_buffer(moauthd_server_t *server, moauthd_logbuf_t *lb, int fd);
+static void	stop_buffer(moauthd_logbuf_t *lb);
+static void	write_log(int fd, struct iovec *iov, int iovcnt);
+
+
+//
+// 'moauthdGetClock()' - Get the current monotonic time in seconds.
+//
+
+double					// O - Seconds
+moauthdGetClock(void)
+{
+  struct timespec	curtime;	// Current time
+
+
+  clock_gettime(CLOCK_MONOTONIC, &curtime);
+
+  return ((double)curtime.tv_sec + 0.000000001 * curtime.tv_nsec);
+}
 
 
 //
@@ -50,12 +76,82 @@ moauthdLogc(moauthd_client_t   *client,	// I - Client object
   if (server->log_file == 0)
     vsyslog(priorities[level], cmessage, ap);
   else
-    file_log(server->log_file, cmessage, ap);
+    file_log(server, cmessage, ap);
 
   va_end(ap);
 }
 
 
+//
+// 'moauthdLogRequest()' - Log a completed request to the access log.
+//
+// Each request is logged as a line of JSON with the request method, path,
+// response status and length, authorization scheme, and the time spent in
+// each phase of the request in milliseconds.
+//
+
+void
+moauthdLogRequest(
+    moauthd_client_t *client)		// I - Client object
+{
+  moauthd_server_t *server = client->server;
+					// Server object
+  char		line[8192],		// Access log line
+		*lineptr,		// Pointer into line
+		*lineend = line + sizeof(line) - 2;
+					// End of line
+  time_t	curtime;		// Current date/time in seconds
+  struct tm	curdate;		// Current date/time info
+  double	handler_time;		// Seconds in request handler
+  const char	*method;		// Request method
+  struct iovec	iov;			// Line for direct write
+
+
+  if (server->access_file < 0)
+    return;
+
+  handler_time = moauthdGetClock() - client->request_time - client->header_time - client->auth_time - client->write_time;
+  if (handler_time < 0.0)
+    handler_time = 0.0;
+
+  time(&curtime);
+  gmtime_r(&curtime, &curdate);
+
+  snprintf(line, sizeof(line), "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02dZ\",\"client\":%d,\"host\":", curdate.tm_year + 1900, curdate.tm_mon + 1, curdate.tm_mday, curdate.tm_hour, curdate.tm_min, curdate.tm_sec, client->number);
+  lineptr = line + strlen(line);
+  lineptr = json_string(lineptr, lineend, client->remote_host);
+
+  if (client->remote_user[0])
+  {
+    cupsCopyString(lineptr, ",\"user\":", (size_t)(lineend - lineptr));
+    lineptr += strlen(lineptr);
+    lineptr = json_string(lineptr, lineend, client->remote_user);
+  }
+
+  if (!strncmp(method = httpStateString(client->request_method), "HTTP_STATE_", 11))
+    method += 11;
+
+  snprintf(lineptr, (size_t)(lineend - lineptr), ",\"method\":\"%s\",\"path\":", method);
+  lineptr += strlen(lineptr);
+  lineptr = json_string(lineptr, lineend, client->path_info);
+
+  snprintf(lineptr, (size_t)(lineend - lineptr), ",\"status\":%d,\"bytes\":%lu,\"auth\":\"%s\",\"tls_ms\":%.3f,\"header_ms\":%.3f,\"auth_ms\":%.3f,\"handler_ms\":%.3f,\"write_ms\":%.3f}", client->response_status, (unsigned long)client->response_bytes, client->auth_type ? client->auth_type : "none", 1000.0 * client->tls_time, 1000.0 * client->header_time, 1000.0 * client->auth_time, 1000.0 * handler_time, 1000.0 * client->write_time);
+  lineptr += strlen(lineptr);
+  *lineptr++ = '\n';
+
+  // The TLS handshake is only reported for the first request...
+  client->tls_time = 0.0;
+
+  if (!queue_log(&server->access_buffer, line, (size_t)(lineptr - line)))
+  {
+    iov.iov_base = line;
+    iov.iov_len  = (size_t)(lineptr - line);
+
+    write_log(server->access_file, &iov, 1);
+  }
+}
+
+
 //
 // 'moauthdLogs()' - Log a server message.
 //
@@ -77,33 +173,67 @@ moauthdLogs(moauthd_server_t   *server,	// I - Server object
   if (server->log_file == 0)
     vsyslog(priorities[level], message, ap);
   else
-    file_log(server->log_file, message, ap);
+    file_log(server, message, ap);
 
   va_end(ap);
 }
 
 
 //
-// "file_log()" - Log a message to a file.
+// 'moauthdStartLogging()' - Start the log writer threads.
+//
+// Once started, messages for log files are queued in ring buffers and
+// written in batches so that logging never blocks request processing.
+// Messages are dropped (and counted) when a buffer is full.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdStartLogging(
+    moauthd_server_t *server)		// I - Server object
+{
+  bool	ret = true;			// Return value
+
+
+  // Syslog and stderr are written directly...
+  if (server->log_file > 2 && !start_buffer(server, &server->log_buffer, server->log_file))
+    ret = false;
+
+  if (server->access_file >= 0 && !start_buffer(server, &server->access_buffer, server->access_file))
+    ret = false;
+
+  return (ret);
+}
+
+
+//
+// 'moauthdStopLogging()' - Flush the log buffers and stop the log writer
+//                          threads.
+//
+
+void
+moauthdStopLogging(
+    moauthd_server_t *server)		// I - Server object
+{
+  stop_buffer(&server->access_buffer);
+  stop_buffer(&server->log_buffer);
+}
+
+
+//
+// 'file_log()' - Log a message to a file.
 //
 
 static void
-file_log(int        fd,			// I - File to write to
-         const char *message,		// I - Printf-style message
-         va_list    ap)			// I - Argument pointer
+file_log(moauthd_server_t *server,	// I - Server object
+         const char       *message,	// I - Printf-style message
+         va_list          ap)		// I - Argument pointer
 {
-  time_t	curtime;		// Current date/time in seconds
-  struct tm	curdate;		// Current date/time info
   char		buffer[8192],		// Message buffer
 		*bufptr;		// Pointer into buffer
-  size_t        total;                  // Length of log line
-  ssize_t       bytes;                  // Bytes written
+  struct iovec	iov;			// Line for direct write
 
 
-  time(&curtime);
-  gmtime_r(&curtime, &curdate);
-
-  snprintf(buffer, sizeof(buffer), "[%04d-%02d-%02d %02d:%02d:%02d+0000]  ", curdate.tm_year + 1900, curdate.tm_mon + 1, curdate.tm_mday, curdate.tm_hour, curdate.tm_min, curdate.tm_sec);
+  cupsCopyString(buffer, get_prefix(), sizeof(buffer));
   bufptr = buffer + strlen(buffer);
 
   vsnprintf(bufptr, sizeof(buffer) - (bufptr - buffer) - 1, message, ap);
@@ -111,15 +241,320 @@ file_log(int        fd,			// I - File to write to
   if (bufptr[-1] != '\n')
     *bufptr++ = '\n';
 
-  for (total = bufptr - buffer, bufptr = buffer; total > 0; total -= (size_t)bytes, bufptr += bytes)
+  if (!queue_log(&server->log_buffer, buffer, (size_t)(bufptr - buffer)))
   {
-    if ((bytes = write(fd, bufptr, total)) < 0)
+    // No writer thread, write directly...
+    iov.iov_base = buffer;
+    iov.iov_len  = (size_t)(bufptr - buffer);
+
+    write_log(server->log_file, &iov, 1);
+  }
+}
+
+
+//
+// 'get_prefix()' - Get the timestamp prefix for a log line.
+//
+// The prefix is only formatted once per second for each thread.
+//
+
+static const char *			// O - Timestamp prefix
+get_prefix(void)
+{
+  time_t	curtime;		// Current date/time in seconds
+  struct tm	curdate;		// Current date/time info
+
+
+  if ((curtime = time(NULL)) != log_time)
+  {
+    gmtime_r(&curtime, &curdate);
+
+    snprintf(log_prefix, sizeof(log_prefix), "[%04d-%02d-%02d %02d:%02d:%02d+0000]  ", curdate.tm_year + 1900, curdate.tm_mon + 1, curdate.tm_mday, curdate.tm_hour, curdate.tm_min, curdate.tm_sec);
+    log_time = curtime;
+  }
+
+  return (log_prefix);
+}
+
+
+//
+// 'json_string()' - Add a quoted JSON string to a line.
+//
+
+static char *				// O - New end of line
+json_string(char       *lineptr,	// I - Pointer into line
+            char       *lineend,	// I - End of line
+            const char *s)		// I - String
+{
+  static const char hexdigits[] = "0123456789abcdef";
+					// Hex digits for \u escapes
+
+
+  if (lineptr < lineend)
+    *lineptr++ = '"';
+
+  for (; *s && lineptr < (lineend - 7); s ++)
+  {
+    if (*s == '"' || *s == '\\')
+    {
+      *lineptr++ = '\\';
+      *lineptr++ = *s;
+    }
+    else if ((*s & 255) < ' ')
+    {
+      *lineptr++ = '\\';
+      *lineptr++ = 'u';
+      *lineptr++ = '0';
+      *lineptr++ = '0';
+      *lineptr++ = hexdigits[(*s >> 4) & 15];
+      *lineptr++ = hexdigits[*s & 15];
+    }
+    else
+    {
+      *lineptr++ = *s;
+    }
+  }
+
+  if (lineptr < lineend)
+    *lineptr++ = '"';
+
+  *lineptr = '\0';
+
+  return (lineptr);
+}
+
+
+//
+// 'log_writer()' - Write queued log messages.
+//
+
+static void *				// O - Thread exit status
+log_writer(moauthd_logbuf_t *lb)	// I - Log buffer
+{
+  size_t	tail,			// Start of data
+		total,			// Bytes to write
+		offset,			// Offset in ring buffer
+		dropped;		// Number of dropped messages
+  struct iovec	iov[3];			// Data to write
+  int		iovcnt;			// Number of data segments
+  char		note[256];		// Dropped messages note
+
+
+  cupsMutexLock(&lb->lock);
+
+  for (;;)
+  {
+    if (lb->head == lb->tail && !lb->dropped)
+    {
+      if (lb->stop)
+        break;
+
+      cupsCondWait(&lb->cond, &lb->lock, 1.0);
+      continue;
+    }
+
+    // Grab the pending data - producers only write past the head, so the data
+    // can be written without holding the lock...
+    tail    = lb->tail;
+    total   = lb->head - tail;
+    dropped = lb->dropped;
+
+    lb->dropped = 0;
+
+    cupsMutexUnlock(&lb->lock);
+
+    offset = tail % MOAUTHD_LOG_BUFFER;
+    iovcnt = 0;
+
+    if (total > 0)
+    {
+      iov[iovcnt].iov_base = lb->buffer + offset;
+
+      if ((offset + total) > MOAUTHD_LOG_BUFFER)
+      {
+        iov[iovcnt ++].iov_len = MOAUTHD_LOG_BUFFER - offset;
+        iov[iovcnt].iov_base   = lb->buffer;
+        iov[iovcnt ++].iov_len = total - (MOAUTHD_LOG_BUFFER - offset);
+      }
+      else
+      {
+        iov[iovcnt ++].iov_len = total;
+      }
+    }
+
+    if (dropped)
+    {
+      snprintf(note, sizeof(note), "%sDropped %lu log messages.\n", get_prefix(), (unsigned long)dropped);
+      iov[iovcnt].iov_base   = note;
+      iov[iovcnt ++].iov_len = strlen(note);
+    }
+
+    write_log(lb->fd, iov, iovcnt);
+
+    cupsMutexLock(&lb->lock);
+    lb->tail += total;
+  }
+
+  cupsMutexUnlock(&lb->lock);
+
+  return (NULL);
+}
+
+
+//
+// 'queue_log()' - Queue a line for the log writer thread.
+//
+
+static bool				// O - `true` if queued or dropped, `false` if no writer thread
+queue_log(moauthd_logbuf_t *lb,		// I - Log buffer
+          const char       *line,	// I - Line
+          size_t           length)	// I - Length of line
+{
+  size_t	offset,			// Offset in ring buffer
+		count;			// Bytes before end of ring buffer
+  bool		signal;			// Wake up the writer thread?
+
+
+  cupsMutexLock(&lb->lock);
+
+  if (!lb->running)
+  {
+    cupsMutexUnlock(&lb->lock);
+    return (false);
+  }
+
+  if ((lb->head - lb->tail + length) > MOAUTHD_LOG_BUFFER)
+  {
+    // Buffer is full, drop the message...
+    lb->dropped ++;
+    cupsMutexUnlock(&lb->lock);
+    return (true);
+  }
+
+  // Copy the line into the ring buffer, wrapping as needed...
+  offset = lb->head % MOAUTHD_LOG_BUFFER;
+
+  if ((count = MOAUTHD_LOG_BUFFER - offset) > length)
+    count = length;
+
+  memcpy(lb->buffer + offset, line, count);
+  if (count < length)
+    memcpy(lb->buffer, line + count, length - count);
+
+  signal = lb->head == lb->tail;
+
+  lb->head += length;
+
+  if (signal)
+    cupsCondBroadcast(&lb->cond);
+
+  cupsMutexUnlock(&lb->lock);
+
+  return (true);
+}
+
+
+//
+// 'start_buffer()' - Start the writer thread for a log buffer.
+//
+
+static bool				// O - `true` on success, `false` on error
+start_buffer(moauthd_server_t *server,	// I - Server object
+             moauthd_logbuf_t *lb,	// I - Log buffer
+             int              fd)	// I - Log file descriptor
+{
+  if ((lb->buffer = malloc(MOAUTHD_LOG_BUFFER)) == NULL)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate log buffer: %s", strerror(errno));
+    return (false);
+  }
+
+  lb->fd      = fd;
+  lb->head    = 0;
+  lb->tail    = 0;
+  lb->dropped = 0;
+  lb->stop    = false;
+
+  if ((lb->thread = cupsThreadCreate((void *(*)(void *))log_writer, lb)) == CUPS_THREAD_INVALID)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create log writer thread: %s", strerror(errno));
+    free(lb->buffer);
+    lb->buffer = NULL;
+    return (false);
+  }
+
+  cupsMutexLock(&lb->lock);
+  lb->running = true;
+  cupsMutexUnlock(&lb->lock);
+
+  return (true);
+}
+
+
+//
+// 'stop_buffer()' - Flush a log buffer and stop its writer thread.
+//
+
+static void
+stop_buffer(moauthd_logbuf_t *lb)	// I - Log buffer
+{
+  cupsMutexLock(&lb->lock);
+
+  if (!lb->running)
+  {
+    cupsMutexUnlock(&lb->lock);
+    return;
+  }
+
+  lb->stop = true;
+  cupsCondBroadcast(&lb->cond);
+  cupsMutexUnlock(&lb->lock);
+
+  cupsThreadWait(lb->thread);
+
+  cupsMutexLock(&lb->lock);
+  lb->running = false;
+  cupsMutexUnlock(&lb->lock);
+
+  free(lb->buffer);
+  lb->buffer = NULL;
+}
+
+
+//
+// 'write_log()' - Write data to a log file, retrying as needed.
+//
+
+static void
+write_log(int          fd,		// I - File to write to
+          struct iovec *iov,		// I - Data to write
+          int          iovcnt)		// I - Number of data segments
+{
+  ssize_t       bytes;                  // Bytes written
+
+
+  while (iovcnt > 0)
+  {
+    if ((bytes = writev(fd, iov, iovcnt)) < 0)
     {
       if (errno == EAGAIN || errno == EINTR)
-        bytes = 0;
+        continue;
       else
         break;
     }
+
+    // Skip over what was written...
+    while (iovcnt > 0 && (size_t)bytes >= iov->iov_len)
+    {
+      bytes -= (ssize_t)iov->iov_len;
+      iov ++;
+      iovcnt --;
+    }
+
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + bytes;
+      iov->iov_len  -= (size_t)bytes;
+    }
   }
 }
-
@@ -0,0 +1,375 @@
+//
+// Metrics support for moauth daemon
+//
+// Copyright © 2017-2024 by Michael R Sweet
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// Counters and latency histograms are updated with relaxed atomic operations
+// so that worker threads never wait on each other to record a request.  The
+// "/metrics" endpoint reports them using the Prometheus text format.
+//
+// Latency histograms use power-of-two buckets starting at 16 microseconds, so
+// bucket N counts samples of up to 16 << N microseconds and the last bucket
+// counts everything else.
+//
+
+#include "moauthd.h"
+#include <stdarg.h>
+
+
+//
+// Local functions...
+//
+
+static bool	metrics_histogram(moauthd_client_t *client, const char *name, const char *endpoint, moauthd_histogram_t *h);
+static bool	metrics_printf(moauthd_client_t *client, const char *format, ...) __attribute__((__format__(__printf__, 2, 3)));
+
+
+//
+// Local globals...
+//
+
+static const char * const moauthd_endpoints[MOAUTHD_ENDPOINT_MAX] =
+{					// Endpoint names
+  "authorize",
+  "introspect",
+  "metrics",
+  "register",
+  "replicate",
+  "revoke",
+  "token",
+  "userinfo",
+  "file"
+};
+
+
+//
+// 'moauthdAddLatency()' - Add a sample to a latency histogram.
+//
+
+void
+moauthdAddLatency(
+    moauthd_histogram_t *h,		// I - Histogram
+    double              seconds)	// I - Latency in seconds
+{
+  int		i;			// Bucket number
+  size_t	usecs,			// Latency in microseconds
+		limit;			// Upper bound of bucket
+
+
+  usecs = seconds > 0.0 ? (size_t)(seconds * 1000000.0) : 0;
+
+  for (i = 0, limit = MOAUTHD_LATENCY_MIN; i < (MOAUTHD_LATENCY_BUCKETS - 1) && usecs > limit; i ++, limit <<= 1);
+
+  atomic_fetch_add_explicit(h->buckets + i, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->usecs, usecs, memory_order_relaxed);
+}
+
+
+//
+// 'moauthdRecordRequest()' - Record the latency and status of a request.
+//
+
+void
+moauthdRecordRequest(
+    moauthd_client_t *client)		// I - Client object
+{
+  moauthd_server_t	*server = client->server;
+					// Server object
+  moauthd_endpoint_t	endpoint;	// Endpoint
+
+
+  if (!strcmp(client->path_info, "/authorize"))
+    endpoint = MOAUTHD_ENDPOINT_AUTHORIZE;
+  else if (!strcmp(client->path_info, "/introspect"))
+    endpoint = MOAUTHD_ENDPOINT_INTROSPECT;
+  else if (!strcmp(client->path_info, "/metrics"))
+    endpoint = MOAUTHD_ENDPOINT_METRICS;
+  else if (!strcmp(client->path_info, "/register"))
+    endpoint = MOAUTHD_ENDPOINT_REGISTER;
+  else if (!strcmp(client->path_info, "/replicate"))
+    endpoint = MOAUTHD_ENDPOINT_REPLICATE;
+  else if (!strcmp(client->path_info, "/revoke"))
+    endpoint = MOAUTHD_ENDPOINT_REVOKE;
+  else if (!strcmp(client->path_info, "/token"))
+    endpoint = MOAUTHD_ENDPOINT_TOKEN;
+  else if (!strcmp(client->path_info, "/userinfo"))
+    endpoint = MOAUTHD_ENDPOINT_USERINFO;
+  else
+    endpoint = MOAUTHD_ENDPOINT_FILE;
+
+  moauthdAddLatency(server->latency + endpoint, moauthdGetClock() - client->request_time);
+
+  if (client->response_status >= HTTP_STATUS_BAD_REQUEST)
+    atomic_fetch_add_explicit(server->num_errors + endpoint, 1, memory_order_relaxed);
+}
+
+
+//
+// 'moauthdRespondMetrics()' - Respond to a request for the /metrics endpoint.
+//
+// The endpoint is only available when the "MetricsGroup" directive is used,
+// and then only to members of that group.
+//
+
+bool					// O - `true` on success, `false` on failure
+moauthdRespondMetrics(
+    moauthd_client_t *client)		// I - Client object
+{
+  moauthd_server_t *server = client->server;
+					// Server object
+  http_status_t	status = HTTP_STATUS_OK;// Response status
+  int		i,			// Looping var
+		num_active,		// Number of open connections
+		num_idle;		// Number of idle connections
+  size_t	num_tls_sessions,	// Number of TLS sessions
+		num_tls_failures,	// Number of failed TLS handshakes
+		jwt_hits,		// JWT cache hits
+		jwt_misses;		// JWT cache misses
+  double	tls_time;		// Time spent in TLS handshakes
+  struct
+  {
+    const char	*name;			// Cache name
+    size_t	hits,			// Number of hits
+		misses;			// Number of misses
+  }		caches[3];		// Cache statistics
+
+
+  if (server->metrics_group == (gid_t)-1)
+  {
+    // Metrics are disabled...
+    status = HTTP_STATUS_NOT_FOUND;
+  }
+  else if (!client->remote_user[0])
+  {
+    // Not yet authenticated...
+    status = HTTP_STATUS_UNAUTHORIZED;
+  }
+  else
+  {
+    // See if the authenticated user is in the specified group...
+    for (i = 0; i < client->num_remote_gids; i ++)
+      if (client->remote_gids[i] == server->metrics_group)
+	break;
+
+    if (i >= client->num_remote_gids)
+      status = HTTP_STATUS_FORBIDDEN;
+  }
+
+  if (status != HTTP_STATUS_OK)
+    return (moauthdRespondClient(client, status, NULL, NULL, 0, 0));
+
+  // Copy the values that are protected by locks...
+  cupsMutexLock(&server->clients_lock);
+  num_active       = server->num_active_clients;
+  num_idle         = server->num_idle_clients;
+  num_tls_sessions = server->num_tls_sessions;
+  num_tls_failures = server->num_tls_failures;
+  tls_time         = server->tls_time;
+  cupsMutexUnlock(&server->clients_lock);
+
+  cupsMutexLock(&server->jwt_cache_lock);
+  jwt_hits   = server->jwt_cache_hits;
+  jwt_misses = server->jwt_cache_misses;
+  cupsMutexUnlock(&server->jwt_cache_lock);
+
+  caches[0].name   = "auth";
+  caches[0].hits   = atomic_load_explicit(&server->auth_cache_hits, memory_order_relaxed);
+  caches[0].misses = atomic_load_explicit(&server->auth_cache_misses, memory_order_relaxed);
+  caches[1].name   = "group";
+  caches[1].hits   = atomic_load_explicit(&server->group_cache_hits, memory_order_relaxed);
+  caches[1].misses = atomic_load_explicit(&server->group_cache_misses, memory_order_relaxed);
+  caches[2].name   = "jwt";
+  caches[2].hits   = jwt_hits;
+  caches[2].misses = jwt_misses;
+
+  // Send the metrics using chunking...
+  if (!moauthdRespondClient(client, HTTP_STATUS_OK, "text/plain; version=0.0.4", NULL, 0, 0))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_uptime_seconds Seconds since the server was started.\n# TYPE moauthd_uptime_seconds gauge\nmoauthd_uptime_seconds %ld\n", (long)(time(NULL) - server->start_time)))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_connections Number of open client connections.\n# TYPE moauthd_connections gauge\nmoauthd_connections{state=\"active\"} %d\nmoauthd_connections{state=\"idle\"} %d\n", num_active, num_idle))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_connections_total Number of client connections accepted.\n# TYPE moauthd_connections_total counter\nmoauthd_connections_total %d\n", atomic_load_explicit(&server->num_clients, memory_order_relaxed)))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_workers Number of worker threads.\n# TYPE moauthd_workers gauge\nmoauthd_workers %d\n", server->num_workers))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_tokens Number of tokens in the token table.\n# TYPE moauthd_tokens gauge\nmoauthd_tokens %lu\n", (unsigned long)moauthdGetNumTokens(server)))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_tokens_issued_total Number of tokens issued.\n# TYPE moauthd_tokens_issued_total counter\nmoauthd_tokens_issued_total %lu\n", (unsigned long)atomic_load_explicit(&server->num_tokens, memory_order_relaxed)))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_tls_sessions_total Number of TLS sessions established.\n# TYPE moauthd_tls_sessions_total counter\nmoauthd_tls_sessions_total %lu\n", (unsigned long)num_tls_sessions))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_tls_failures_total Number of failed TLS handshakes.\n# TYPE moauthd_tls_failures_total counter\nmoauthd_tls_failures_total %lu\n", (unsigned long)num_tls_failures))
+    return (false);
+
+  if (!metrics_printf(client, "# HELP moauthd_tls_handshake_seconds_total Seconds spent in TLS handshakes.\n# TYPE moauthd_tls_handshake_seconds_total counter\nmoauthd_tls_handshake_seconds_total %.6f\n", tls_time))
+    return (false);
+
+  // Cache statistics...
+  if (!metrics_printf(client, "# HELP moauthd_cache_hits_total Number of cache hits.\n# TYPE moauthd_cache_hits_total counter\n"))
+    return (false);
+
+  for (i = 0; i < 3; i ++)
+  {
+    if (!metrics_printf(client, "moauthd_cache_hits_total{cache=\"%s\"} %lu\n", caches[i].name, (unsigned long)caches[i].hits))
+      return (false);
+  }
+
+  if (!metrics_printf(client, "# HELP moauthd_cache_misses_total Number of cache misses.\n# TYPE moauthd_cache_misses_total counter\n"))
+    return (false);
+
+  for (i = 0; i < 3; i ++)
+  {
+    if (!metrics_printf(client, "moauthd_cache_misses_total{cache=\"%s\"} %lu\n", caches[i].name, (unsigned long)caches[i].misses))
+      return (false);
+  }
+
+  if (!metrics_printf(client, "# HELP moauthd_cache_hit_ratio Fraction of cache lookups that were hits.\n# TYPE moauthd_cache_hit_ratio gauge\n"))
+    return (false);
+
+  for (i = 0; i < 3; i ++)
+  {
+    if (!metrics_printf(client, "moauthd_cache_hit_ratio{cache=\"%s\"} %.4f\n", caches[i].name, caches[i].hits + caches[i].misses ? (double)caches[i].hits / (double)(caches[i].hits + caches[i].misses) : 0.0))
+      return (false);
+  }
+
+  // Replication statistics...
+  if (server->num_peers > 0)
+  {
+    if (!metrics_printf(client, "# HELP moauthd_replication_batches_total Number of record batches sent to peers.\n# TYPE moauthd_replication_batches_total counter\n"))
+      return (false);
+
+    for (i = 0; i < server->num_peers; i ++)
+    {
+      if (!metrics_printf(client, "moauthd_replication_batches_total{peer=\"%s\"} %lu\n", server->peers[i].uri, (unsigned long)atomic_load_explicit(&server->peers[i].num_batches, memory_order_relaxed)))
+        return (false);
+    }
+
+    if (!metrics_printf(client, "# HELP moauthd_replication_failures_total Number of record batches that could not be sent to peers.\n# TYPE moauthd_replication_failures_total counter\n"))
+      return (false);
+
+    for (i = 0; i < server->num_peers; i ++)
+    {
+      if (!metrics_printf(client, "moauthd_replication_failures_total{peer=\"%s\"} %lu\n", server->peers[i].uri, (unsigned long)atomic_load_explicit(&server->peers[i].num_failures, memory_order_relaxed)))
+        return (false);
+    }
+  }
+
+  // Request statistics...
+  if (!metrics_printf(client, "# HELP moauthd_request_errors_total Number of error responses.\n# TYPE moauthd_request_errors_total counter\n"))
+    return (false);
+
+  for (i = 0; i < MOAUTHD_ENDPOINT_MAX; i ++)
+  {
+    if (!metrics_printf(client, "moauthd_request_errors_total{endpoint=\"%s\"} %lu\n", moauthd_endpoints[i], (unsigned long)atomic_load_explicit(server->num_errors + i, memory_order_relaxed)))
+      return (false);
+  }
+
+  if (!metrics_printf(client, "# HELP moauthd_request_duration_seconds Request latency.\n# TYPE moauthd_request_duration_seconds histogram\n"))
+    return (false);
+
+  for (i = 0; i < MOAUTHD_ENDPOINT_MAX; i ++)
+  {
+    if (!metrics_histogram(client, "moauthd_request_duration_seconds", moauthd_endpoints[i], server->latency + i))
+      return (false);
+  }
+
+  if (!metrics_printf(client, "# HELP moauthd_pam_duration_seconds PAM authentication latency.\n# TYPE moauthd_pam_duration_seconds histogram\n"))
+    return (false);
+
+  if (!metrics_histogram(client, "moauthd_pam_duration_seconds", NULL, &server->pam_latency))
+    return (false);
+
+  return (httpWrite(client->http, "", 0) >= 0);
+}
+
+
+//
+// 'metrics_histogram()' - Write a latency histogram.
+//
+// Prometheus histogram buckets are cumulative, so each "le" value includes the
+// counts of all of the smaller buckets.
+//
+
+static bool				// O - `true` on success, `false` on error
+metrics_histogram(
+    moauthd_client_t    *client,	// I - Client object
+    const char          *name,		// I - Metric name
+    const char          *endpoint,	// I - Endpoint label or `NULL` for none
+    moauthd_histogram_t *h)		// I - Histogram
+{
+  int		i;			// Looping var
+  size_t	limit,			// Upper bound of bucket
+		total;			// Cumulative count
+  char		label[256],		// Endpoint label for buckets
+		total_label[256];	// Endpoint label for sum and count
+
+
+  if (endpoint)
+  {
+    snprintf(label, sizeof(label), "endpoint=\"%s\",", endpoint);
+    snprintf(total_label, sizeof(total_label), "{endpoint=\"%s\"}", endpoint);
+  }
+  else
+  {
+    label[0]       = '\0';
+    total_label[0] = '\0';
+  }
+
+  for (i = 0, limit = MOAUTHD_LATENCY_MIN, total = 0; i < MOAUTHD_LATENCY_BUCKETS; i ++, limit <<= 1)
+  {
+    total += atomic_load_explicit(h->buckets + i, memory_order_relaxed);
+
+    if (i < (MOAUTHD_LATENCY_BUCKETS - 1))
+    {
+      if (!metrics_printf(client, "%s_bucket{%sle=\"%.6f\"} %lu\n", name, label, 0.000001 * limit, (unsigned long)total))
+        return (false);
+    }
+    else if (!metrics_printf(client, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, label, (unsigned long)total))
+    {
+      return (false);
+    }
+  }
+
+  return (metrics_printf(client, "%s_sum%s %.6f\n%s_count%s %lu\n", name, total_label, 0.000001 * atomic_load_explicit(&h->usecs, memory_order_relaxed), name, total_label, (unsigned long)total));
+}
+
+
+//
+// 'metrics_printf()' - Write formatted metrics text.
+//
+
+static bool				// O - `true` on success, `false` on error
+metrics_printf(
+    moauthd_client_t *client,		// I - Client object
+    const char       *format,		// I - Printf-style format string
+    ...)				// I - Additional arguments as needed
+{
+  va_list	ap;			// Pointer to arguments
+  char		buffer[1024];		// Output buffer
+  int		length;			// Length of output
+
+
+  va_start(ap, format);
+  length = vsnprintf(buffer, sizeof(buffer), format, ap);
+  va_end(ap);
+
+  if (length < 0)
+    return (false);
+  else if ((size_t)length >= sizeof(buffer))
+    length = (int)sizeof(buffer) - 1;
+
+  return (moauthdWriteClient(client, buffer, (size_t)length));
+}
@@ -13,11 +13,14 @@
 #  include <stdio.h>
 #  include <stdlib.h>
 #  include <stdbool.h>
+#  include <stdint.h>
 #  include <string.h>
 #  include <ctype.h>
 #  include <errno.h>
 #  include <poll.h>
+#  include <stdatomic.h>
 #  include <sys/stat.h>
+#  include <cups/jwt.h>
 #  include <cups/thread.h>
 
 
@@ -26,22 +29,77 @@
 //
 
 #  define MOAUTHD_MAX_LISTENERS	4	// Maximum number of listener sockets
+#  define MOAUTHD_MAX_WORKERS	256	// Maximum number of worker threads
+#  define MOAUTHD_REQUEST_TIMEOUT	10	// Seconds allowed for TLS handshake and request header
+#  define MOAUTHD_TOKEN_SHARDS	64	// Number of token hash table shards
+#  define MOAUTHD_APP_SLOTS	256	// Initial application hash table slots
+#  define MOAUTHD_SWEEP_BATCH	256	// Maximum tokens evicted per batch
+#  define MOAUTHD_SWEEP_GRACE	5	// Seconds to keep expired tokens
+#  define MOAUTHD_JOURNAL_SLACK	1024	// Dead journal records allowed before compaction
+#  define MOAUTHD_JWT_CACHE_WAYS	4	// Entries per JWT cache set
+#  define MOAUTHD_AUTH_CACHE_SIZE	256	// Number of cached credentials
+#  define MOAUTHD_GROUP_CACHE_SIZE	256	// Number of cached group lists
+#  define MOAUTHD_MAX_GROUPS	100	// Maximum number of groups per user
+#  define MOAUTHD_MAX_MARKDOWN	256	// Maximum number of cached Markdown pages
+#  define MOAUTHD_MAX_MAPPED	256	// Maximum number of memory-mapped files
+#  define MOAUTHD_MAX_MAPPED_BYTES	268435456
+					// Maximum bytes of memory-mapped files
+#  define MOAUTHD_MAX_MAPPED_SIZE	16777216
+					// Maximum size of a memory-mapped file
+#  define MOAUTHD_MIN_COMPRESS	1024	// Minimum length of compressed responses
+#  define MOAUTHD_ARENA_SIZE	8192	// Size of per-connection arena blocks
+#  define MOAUTHD_MAX_BODY	65536	// Maximum size of request message bodies
+#  define MOAUTHD_MAX_INTROSPECT	100	// Maximum number of tokens per introspection batch
+#  define MOAUTHD_LOG_BUFFER	262144	// Size of log ring buffer
+#  define MOAUTHD_REVOKED_BLOOM	65536	// Bits in revoked token Bloom filter
+#  define MOAUTHD_REVOKED_PRUNE	60	// Seconds between pruning of revoked tokens
+#  define MOAUTHD_LATENCY_BUCKETS	24	// Number of latency histogram buckets
+#  define MOAUTHD_LATENCY_MIN	16	// Upper bound of first bucket in microseconds
+#  define MOAUTHD_MAX_PEERS	16	// Maximum number of replication peers
+#  define MOAUTHD_REPLICATE_QUEUE	4194304	// Maximum bytes queued for each peer
+#  define MOAUTHD_REPLICATE_RETRY	5	// Seconds between replication retries
 
 
 //
 // Types...
 //
 
+typedef struct moauthd_arena_s		// Per-connection memory arena block
+{
+  struct moauthd_arena_s *next;		// Next (older) block
+  size_t		used,		// Bytes used
+			alloc;		// Bytes allocated
+  char			*data;		// Block data
+} moauthd_arena_t;
+
+
+typedef struct moauthd_uri_s		// Registered redirection URI
+{
+  _Atomic(struct moauthd_uri_s *) next;	// Next URI
+  char			uri[];		// Redirection URI
+} moauthd_uri_t;
+
 typedef struct moauthd_application_s	//// Application (Client)
 {
   char	*client_id,			// Client identifier
-	*redirect_uri,			// Redirection URI
+	*redirect_uri,			// First redirection URI
 	*client_name,			// Name, if any
 	*client_uri,			// Web page, if any
 	*logo_uri,			// Logo URI, if any
 	*tos_uri;			// Terms-of-service URI, if any
+  moauthd_uri_t	*redirect_uris,		// Registered redirection URIs
+		*last_uri;		// Last redirection URI (for adding)
 } moauthd_application_t;
 
+typedef struct moauthd_apptable_s	// Application hash table snapshot
+{
+  struct moauthd_apptable_s *prev;	// Previous (retired) table
+  size_t		num_apps,	// Number of applications
+			num_slots;	// Number of slots (power of 2)
+  _Atomic(moauthd_application_t *) slots[];
+					// Applications by client_id hash
+} moauthd_apptable_t;
+
 
 typedef enum moauthd_restype_e		// Resource Types
 {
@@ -53,6 +111,15 @@ typedef enum moauthd_restype_e		// Resource Types
 } moauthd_restype_t;
 
 
+typedef enum moauthd_scope_e		// Resource Scopes
+{
+  MOAUTHD_SCOPE_PUBLIC,			// Anyone
+  MOAUTHD_SCOPE_PRIVATE,		// Owner of file
+  MOAUTHD_SCOPE_SHARED,			// Any authenticated user
+  MOAUTHD_SCOPE_GROUP			// Members of group
+} moauthd_scope_t;
+
+
 typedef struct moauthd_resource_s	// Resource
 {
   moauthd_restype_t	type;		// Resource type
@@ -60,6 +127,7 @@ typedef struct moauthd_resource_s	// Resource
 			*local_path,	// Local path
 			*content_type,	// MIME media type, if any
 			*scope;		// Access scope
+  moauthd_scope_t	scope_type;	// Scope type
   gid_t			scope_gid;	// Scope group ID
   size_t		remote_len;	// Length of remote path
   const void		*data;		// Data (static files)
@@ -67,6 +135,26 @@ typedef struct moauthd_resource_s	// Resource
 } moauthd_resource_t;
 
 
+typedef struct moauthd_rnode_s		// Resource tree node
+{
+  char			*segment;	// Path segment
+  size_t		seglen;		// Length of path segment
+  moauthd_resource_t	*resource;	// Resource for this path, if any
+  size_t		num_children,	// Number of child nodes
+			alloc_children;	// Allocated child nodes
+  struct moauthd_rnode_s **children;	// Child nodes, sorted by segment
+} moauthd_rnode_t;
+
+
+typedef struct moauthd_rset_s		// Resources replaced by a reload
+{
+  struct moauthd_rset_s	*prev;		// Previous (older) set
+  size_t		generation;	// Last resource generation using set
+  cups_array_t		*resources;	// Resources
+  moauthd_rnode_t	*tree;		// Resources by path segment
+} moauthd_rset_t;
+
+
 typedef enum moauthd_toktype_e		// Token Type
 {
   MOAUTHD_TOKTYPE_ACCESS,		// Access token
@@ -79,6 +167,7 @@ typedef struct moauthd_token_s		// Token
 {
   moauthd_toktype_t	type;		// Type of token
   char			*token,		// Token string
+			*jti,		// JWT ID
 			*challenge,	// Challenge string
 			*user;		// Authenticated user
   moauthd_application_t	*application;	// Client ID/redirection URI used
@@ -88,9 +177,158 @@ typedef struct moauthd_token_s		// Token
   gid_t			gid;		// Primary group ID
   time_t		created;	// When the token was created
   time_t		expires;	// When the token expires
+  uint64_t		hash;		// Hash of token string
+  bool			stateless;	// Validated from JWT claims (not in token table)?
+  atomic_int		refcount;	// Reference count
+  size_t		expiry_index;	// Index in expiry heap or SIZE_MAX
+  int			num_gids;	// Number of groups (stateless tokens)
+#ifdef __APPLE__
+  int			*gids;		// Groups (stateless tokens)
+#else
+  gid_t			*gids;		// Groups (stateless tokens)
+#endif // __APPLE__
+  struct moauthd_token_s *next;		// Next token in hash bucket
 } moauthd_token_t;
 
 
+typedef struct moauthd_authcache_s	// Cached credentials
+{
+  unsigned char		digest[32];	// Salted SHA-256 digest of username:password
+  time_t		expires;	// Expiration time
+} moauthd_authcache_t;
+
+
+typedef struct moauthd_groupcache_s	// Cached group list
+{
+  uid_t			uid;		// User ID
+  time_t		expires;	// Expiration time
+  int			num_gids;	// Number of groups
+#ifdef __APPLE__
+  int			gids[MOAUTHD_MAX_GROUPS];
+#else
+  gid_t			gids[MOAUTHD_MAX_GROUPS];
+#endif // __APPLE__
+					// Groups
+} moauthd_groupcache_t;
+
+
+typedef struct moauthd_mdcache_s	// Rendered Markdown cache entry
+{
+  char			*key;		// Source and request paths
+  time_t		mtime;		// Modification time of source
+  off_t			size;		// Size of source
+  int			refcount;	// Reference count
+  double		last_used;	// When the entry was last used
+  char			*html;		// Rendered HTML
+  size_t		length;		// Length of rendered HTML
+} moauthd_mdcache_t;
+
+
+typedef struct moauthd_fcache_s		// Memory-mapped file cache entry
+{
+  char			*filename;	// Local filename
+  dev_t			dev;		// Device number
+  ino_t			ino;		// Inode number
+  time_t		mtime;		// Modification time
+  off_t			size;		// Size of file
+  int			refcount;	// Reference count
+  double		last_used;	// When the entry was last used
+  void			*data;		// Mapped file data
+} moauthd_fcache_t;
+
+
+typedef struct moauthd_jwtcache_s	// Validated JWT cache entry
+{
+  unsigned char		digest[32];	// SHA-256 digest of token string
+  moauthd_token_t	*token;		// Validated token
+  bool			referenced;	// Recently used?
+  size_t		hand;		// CLOCK hand (first entry in set only)
+} moauthd_jwtcache_t;
+
+
+typedef struct moauthd_revoked_s	// Revoked token
+{
+  struct moauthd_revoked_s *next;	// Next token in hash bucket
+  uint64_t		hash;		// Hash of JWT ID
+  uint64_t		token_hash;	// Hash of token string or 0 if unknown
+  char			*jti;		// JWT ID
+  time_t		expires;	// When the token expires
+} moauthd_revoked_t;
+
+
+typedef struct moauthd_tshard_s		// Token hash table shard
+{
+  pthread_rwlock_t	lock;		// R/W lock for shard
+  size_t		num_buckets,	// Number of hash buckets
+			num_tokens;	// Number of tokens in shard
+  moauthd_token_t	**buckets;	// Hash buckets
+} moauthd_tshard_t;
+
+
+typedef struct moauthd_expiry_s		// Token expiry heap entry
+{
+  time_t		expires;	// When the token expires
+  uint64_t		hash;		// Hash of token string
+  moauthd_token_t	*token;		// Token
+} moauthd_expiry_t;
+
+
+typedef struct moauthd_logbuf_s		// Buffered log file
+{
+  int		fd;			// Log file descriptor
+  cups_mutex_t	lock;			// Buffer lock
+  cups_cond_t	cond;			// Condition for writer thread
+  cups_thread_t	thread;			// Writer thread
+  bool		running,		// Is the writer thread running?
+		stop;			// Stop the writer thread?
+  char		*buffer;		// Ring buffer
+  size_t	head,			// Total bytes added to buffer
+		tail,			// Total bytes written from buffer
+		dropped;		// Number of dropped messages
+} moauthd_logbuf_t;
+
+
+typedef struct moauthd_peer_s		// Replication peer
+{
+  struct moauthd_server_s *server;	// Server
+  char		*uri;			// Peer URI
+  char		*certificate;		// Pinned certificate (PEM) or `NULL`
+  char		host[256];		// Peer hostname
+  int		port;			// Peer port number
+  cups_thread_t	thread;			// Sender thread
+  unsigned char	*queue;			// Queued journal records
+  size_t	queue_used,		// Bytes queued
+		queue_alloc;		// Bytes allocated
+  bool		resync;			// Send all tokens and applications next?
+  atomic_size_t	num_batches,		// Number of batches sent
+		num_failures;		// Number of failed batches
+} moauthd_peer_t;
+
+
+typedef enum moauthd_endpoint_e		// Endpoints for request metrics
+{
+  MOAUTHD_ENDPOINT_AUTHORIZE,		// /authorize
+  MOAUTHD_ENDPOINT_INTROSPECT,		// /introspect
+  MOAUTHD_ENDPOINT_METRICS,		// /metrics
+  MOAUTHD_ENDPOINT_REGISTER,		// /register
+  MOAUTHD_ENDPOINT_REPLICATE,		// /replicate
+  MOAUTHD_ENDPOINT_REVOKE,		// /revoke
+  MOAUTHD_ENDPOINT_TOKEN,		// /token
+  MOAUTHD_ENDPOINT_USERINFO,		// /userinfo
+  MOAUTHD_ENDPOINT_FILE,		// Static files and other resources
+  MOAUTHD_ENDPOINT_MAX			// Number of endpoints
+} moauthd_endpoint_t;
+
+
+typedef struct moauthd_histogram_s	// Latency histogram
+{
+  atomic_size_t	buckets[MOAUTHD_LATENCY_BUCKETS];
+					// Counts for each power-of-two bucket
+  atomic_size_t	count,			// Number of samples
+		usecs;			// Total microseconds
+} moauthd_histogram_t;
+
+
 typedef enum moauthd_loglevel_e		// Log Levels
 {
   MOAUTHD_LOGLEVEL_ERROR,		// Error messages only
@@ -101,44 +339,143 @@ typedef enum moauthd_loglevel_e		// Log Levels
 
 typedef enum moauthd_option_e		// Server options
 {
-  MOAUTHD_OPTION_BASIC_AUTH = 1		// Enable Basic authentication as a backup
+  MOAUTHD_OPTION_BASIC_AUTH = 1,	// Enable Basic authentication as a backup
+  MOAUTHD_OPTION_STATELESS_TOKENS = 2	// Validate access tokens using JWT claims
 } moauthd_option_t;
 
 
+typedef struct moauthd_client_s moauthd_client_t;
+					// Client Information
+
+
 typedef struct moauthd_server_s		// Server
 {
   char		*name;			// Server hostname
   int		port;			// Server port
+  char		*config_file;		// Configuration file, if any
   char		*state_file;		// State file
+  int		verbosity;		// Extra verbosity from command-line
   int		log_file;		// Log file descriptor
-  moauthd_loglevel_t log_level;		// Log level
+  _Atomic(moauthd_loglevel_t) log_level;// Log level
+  moauthd_logbuf_t log_buffer;		// Log file buffer
+  int		access_file;		// Access log file descriptor
+  moauthd_logbuf_t access_buffer;	// Access log file buffer
   char		*auth_service;		// PAM authentication service
-  int		num_clients;		// Number of clients served
+  atomic_int	num_clients;		// Number of clients served
   int		num_listeners;		// Number of listener sockets
   struct pollfd	listeners[MOAUTHD_MAX_LISTENERS];
 					// Listener sockets
-  unsigned	options;		// Server option flags
-  gid_t		introspect_group,	// Group allowed to introspect tokens
+  atomic_uint	options;		// Server option flags
+  _Atomic(gid_t) introspect_group,	// Group allowed to introspect tokens
+		metrics_group,		// Group allowed to read metrics
 		register_group;		// Group allowed to register clients
-  int		max_grant_life,		// Maximum life of a grant in seconds
+  atomic_int	max_grant_life,		// Maximum life of a grant in seconds
 		max_token_life;		// Maximum life of a token in seconds
-  int		num_tokens;		// Number of tokens issued
+  atomic_size_t	num_tokens;		// Number of tokens issued
   char		*secret;		// Secret value string for this invocation
-  cups_array_t	*applications;		// "Registered" applications
-  pthread_mutex_t applications_lock;	// Mutex for applications array
+  _Atomic(moauthd_apptable_t *) applications;
+					// "Registered" applications
+  pthread_mutex_t applications_lock;	// Mutex for registrations
   cups_array_t	*resources;		// Resources that are shared
-  pthread_rwlock_t resources_lock;	// R/W lock for resources array
-  cups_array_t	*tokens;		// Tokens that have been issued
-  pthread_rwlock_t tokens_lock;		// R/W lock for tokens array
+  moauthd_rnode_t *resources_tree;	// Resources by path segment
+  pthread_rwlock_t resources_lock;	// R/W lock for resources array and tree
+  moauthd_rset_t *retired_resources;	// Resources replaced by a reload
+  atomic_size_t	resources_generation;	// Current resource generation
+  atomic_size_t	worker_generation[MOAUTHD_MAX_WORKERS];
+					// Resource generation used by each worker or 0 when idle
+  cups_array_t	*markdown_cache;	// Rendered Markdown pages
+  pthread_mutex_t markdown_lock;	// Mutex for Markdown cache
+  cups_array_t	*file_cache;		// Memory-mapped files
+  size_t	file_cache_bytes;	// Bytes of memory-mapped files
+  pthread_mutex_t file_lock;		// Mutex for file cache
+  moauthd_tshard_t tokens[MOAUTHD_TOKEN_SHARDS];
+					// Tokens that have been issued
+  pthread_mutex_t expiry_lock;		// Mutex for expiry heap
+  pthread_cond_t expiry_cond;		// Condition for sweeper thread
+  size_t	num_expiry,		// Number of entries in expiry heap
+		alloc_expiry;		// Allocated entries in expiry heap
+  moauthd_expiry_t *expiry;		// Min-heap of token expiration times
+  cups_thread_t	sweeper;		// Expired token sweeper thread
+  bool		sweeper_stop;		// Stop the sweeper thread?
+  size_t	num_sweeps,		// Number of sweeps with evictions
+		last_evicted,		// Tokens evicted in the last sweep
+		total_evicted;		// Total tokens evicted
+  char		*journal_file;		// Token/application journal file
+  int		journal_fd;		// Journal file descriptor
+  pthread_mutex_t journal_lock;		// Mutex for journal file
+  size_t	journal_records;	// Number of records in journal
+  size_t	num_revoked,		// Number of revoked tokens
+		num_revoked_buckets;	// Number of revoked token hash buckets
+  moauthd_revoked_t **revoked;		// Revoked access tokens by JWT ID
+  time_t	revoked_prune;		// Next time to prune revoked tokens
+  atomic_uint_least64_t revoked_bloom[MOAUTHD_REVOKED_BLOOM / 64];
+					// Bloom filter for revoked tokens
+  pthread_rwlock_t revoked_lock;	// R/W lock for revoked tokens
+  int		num_peers;		// Number of replication peers
+  moauthd_peer_t peers[MOAUTHD_MAX_PEERS];
+					// Replication peers
+  char		*replication_key;	// Shared key for replication requests
+  pthread_mutex_t replicate_lock;	// Mutex for replication queues
+  pthread_cond_t replicate_cond;	// Condition for sender threads
+  bool		replicate_running,	// Are the sender threads running?
+		replicate_stop;		// Stop the sender threads?
+  atomic_int	auth_cache_life,	// Life of cached credentials in seconds
+		group_cache_life;	// Life of cached group lists in seconds
+  unsigned char	auth_cache_salt[16];	// Salt for cached credentials
+  pthread_mutex_t auth_cache_lock;	// Mutex for credential and group caches
+  moauthd_authcache_t auth_cache[MOAUTHD_AUTH_CACHE_SIZE];
+					// Cached credentials
+  moauthd_groupcache_t group_cache[MOAUTHD_GROUP_CACHE_SIZE];
+					// Cached group lists
+  size_t	jwt_cache_size;		// Number of JWT cache entries
+  moauthd_jwtcache_t *jwt_cache;	// Validated JWT cache
+  pthread_mutex_t jwt_cache_lock;	// Mutex for JWT cache
+  size_t	jwt_cache_generation,	// Revocation generation
+		jwt_cache_hits,		// Number of cache hits
+		jwt_cache_misses;	// Number of cache misses
+  atomic_size_t	auth_cache_hits,	// Number of credential cache hits
+		auth_cache_misses,	// Number of credential cache misses
+		group_cache_hits,	// Number of group cache hits
+		group_cache_misses;	// Number of group cache misses
+  moauthd_histogram_t latency[MOAUTHD_ENDPOINT_MAX];
+					// Request latency for each endpoint
+  atomic_size_t	num_errors[MOAUTHD_ENDPOINT_MAX];
+					// Error responses for each endpoint
+  moauthd_histogram_t pam_latency;	// PAM authentication latency
   time_t	start_time;		// Startup time
+  cups_jwa_t	signing_alg;		// JWT signing algorithm
   cups_json_t	*private_key;		// JWT private key
-  char		*public_key;		// JWT public key
+  cups_json_t	*public_jwk;		// JWT public key
+  char		*public_key;		// JWT public key set (JWKS)
   char		*test_password;		// Testing password
   char		*metadata;		// JSON metadata
+  int		num_workers;		// Number of worker threads
+  cups_thread_t	workers[MOAUTHD_MAX_WORKERS];
+					// Worker threads
+  int		num_running;		// Number of worker threads started
+  moauthd_client_t *reading[MOAUTHD_MAX_WORKERS];
+					// Clients reading a request header, by worker
+  int		max_clients;		// Maximum number of client connections
+  int		num_active_clients;	// Number of open client connections
+  atomic_int	keep_alive_timeout;	// Keep-alive timeout in seconds
+  int		num_idle_clients;	// Number of idle client connections
+  size_t	num_tls_sessions,	// Number of TLS sessions established
+		num_tls_failures;	// Number of failed TLS handshakes
+  double	tls_time;		// Total seconds spent in TLS handshakes
+  bool		shutdown;		// Shut down the worker threads?
+  pthread_mutex_t clients_lock;		// Mutex for client queues
+  pthread_cond_t clients_cond;		// Condition for ready clients
+  moauthd_client_t *ready_first,	// First client ready for processing
+		*ready_last,		// Last client ready for processing
+		*returned_clients,	// Clients returned to the event loop
+		*idle_clients,		// Clients waiting in the event loop
+		*idle_last;		// Last client waiting in the event loop
+  int		event_fd;		// epoll/kqueue descriptor, if any
+  int		wakeup_pipe[2];		// Pipe for waking up the event loop
 } moauthd_server_t;
 
 
-typedef struct moauthd_client_s		// Client Information
+struct moauthd_client_s			// Client Information
 {
   int		number;			// Client number
   moauthd_server_t *server;		// Server
@@ -151,12 +488,40 @@ typedef struct moauthd_client_s		// Client Information
   uid_t		remote_uid;		// Authenticated UID, if any
   int		num_remote_gids;	// Number of remote groups, if any
 #ifdef __APPLE__
-  int		remote_gids[100];	// Authenticated groups, if any
+  int		remote_gids[MOAUTHD_MAX_GROUPS];
+					// Authenticated groups, if any
 #else
-  gid_t		remote_gids[100];	// Authenticated groups, if any
+  gid_t		remote_gids[MOAUTHD_MAX_GROUPS];
+					// Authenticated groups, if any
 #endif // __APPLE__
   moauthd_token_t *remote_token;	// Access token used, if any
-} moauthd_client_t;
+  moauthd_arena_t *arena;		// Request memory arena
+  double	request_time,		// When the request started
+		tls_time,		// Seconds for TLS handshake, if any
+		header_time,		// Seconds to read request header
+		auth_time,		// Seconds to authenticate request
+		write_time;		// Seconds writing response
+  const char	*auth_type;		// Authorization scheme used
+  http_status_t	response_status;	// Response status
+  size_t	response_bytes;		// Bytes of response data
+  bool		accept_ranges;		// Send Accept-Ranges for response?
+  char		content_range[128];	// Content-Range for response, if any
+  const char	*content_encoding;	// Content-Encoding for response, if any
+  bool		html_capture;		// Capture output in html_buffer?
+  char		*html_buffer;		// Captured output
+  size_t	html_used,		// Bytes of captured output
+		html_alloc;		// Allocated size of html_buffer
+  bool		json_error;		// Unable to build JSON response?
+  char		*json_buffer;		// JSON response buffer
+  size_t	json_used,		// Bytes of JSON response
+		json_alloc;		// Allocated size of json_buffer
+  bool		encrypted;		// Has the TLS session been established?
+  int		worker;			// Index of worker thread processing client
+  double	deadline;		// Deadline for TLS handshake/request header or 0.0
+  time_t	idle_time;		// When the client went idle
+  moauthd_client_t *next,		// Next client in queue
+		*prev;			// Previous client in idle list
+};
 
 
 //
@@ -164,26 +529,77 @@ typedef struct moauthd_client_s		// Client Information
 //
 
 extern moauthd_application_t *moauthdAddApplication(moauthd_server_t *server, const char *client_id, const char *redirect_uri, const char *client_name, const char *client_uri, const char *logo_uri, const char *tos_uri);
+extern void		moauthdAddLatency(moauthd_histogram_t *h, double seconds);
+extern bool		moauthdAddToken(moauthd_server_t *server, moauthd_token_t *token);
+extern void		*moauthdArenaAlloc(moauthd_client_t *client, size_t size);
+extern void		moauthdArenaReset(moauthd_client_t *client);
 extern bool		moauthdAuthenticateUser(moauthd_client_t *client, const char *username, const char *password);
+extern bool		moauthdCompactJournal(moauthd_server_t *server);
+extern unsigned char	*moauthdCopyJournal(moauthd_server_t *server, size_t *length);
 extern moauthd_client_t	*moauthdCreateClient(moauthd_server_t *server, int fd);
 extern moauthd_resource_t *moauthdCreateResource(moauthd_server_t *server, moauthd_restype_t type, const char *remote_path, const char *local_path, const char *content_type, const char *scope);
 extern moauthd_server_t	*moauthdCreateServer(const char *configfile, const char *statefile, int verbosity);
-extern moauthd_token_t	*moauthdCreateToken(moauthd_server_t *server, moauthd_toktype_t type, moauthd_application_t *application, const char *user, const char *scopes);
+extern moauthd_token_t	*moauthdCreateToken(moauthd_server_t *server, moauthd_toktype_t type, moauthd_application_t *application, const char *user, const char *scopes, const char *challenge);
 extern void		moauthdDeleteClient(moauthd_client_t *client);
+extern void		moauthdDeleteResources(moauthd_server_t *server);
+extern void		moauthdDeleteRevokedToken(moauthd_server_t *server, const char *jti, uint64_t token_hash);
 extern void		moauthdDeleteServer(moauthd_server_t *server);
 extern void		moauthdDeleteToken(moauthd_server_t *server, moauthd_token_t *token);
+extern void		moauthdDeleteTokens(moauthd_server_t *server);
 extern moauthd_application_t *moauthdFindApplication(moauthd_server_t *server, const char *client_id, const char *redirect_uri);
 extern moauthd_resource_t *moauthdFindResource(moauthd_server_t *server, const char *path_info, char *name, size_t namesize, struct stat *info);
 extern moauthd_token_t	*moauthdFindToken(moauthd_server_t *server, const char *token_id);
+extern void		moauthdFreeToken(moauthd_token_t *token);
+extern void		moauthdFlushFiles(moauthd_server_t *server);
+extern void		moauthdFlushMarkdown(moauthd_server_t *server);
+extern double		moauthdGetClock(void);
 extern http_status_t	moauthdGetFile(moauthd_client_t *client);
+extern size_t		moauthdGetNumTokens(moauthd_server_t *server);
+#ifdef __APPLE__
+extern int		moauthdGetUserGroups(moauthd_server_t *server, const char *username, uid_t uid, gid_t gid, int *gids, int num_gids);
+#else
+extern int		moauthdGetUserGroups(moauthd_server_t *server, const char *username, uid_t uid, gid_t gid, gid_t *gids, int num_gids);
+#endif // __APPLE__
 extern void		moauthdHTMLFooter(moauthd_client_t *client);
 extern void		moauthdHTMLHeader(moauthd_client_t *client, const char *title);
 extern void		moauthdHTMLPrintf(moauthd_client_t *client, const char *format, ...) __attribute__((__format__(__printf__, 2, 3)));
+extern void		moauthdJSONAddBoolean(moauthd_client_t *client, const char *name, bool value);
+extern void		moauthdJSONAddInteger(moauthd_client_t *client, const char *name, long long value);
+extern void		moauthdJSONAddString(moauthd_client_t *client, const char *name, const char *value);
+extern void		moauthdJSONEndArray(moauthd_client_t *client);
+extern void		moauthdJSONEndObject(moauthd_client_t *client);
+extern bool		moauthdJSONRespond(moauthd_client_t *client, http_status_t code);
+extern void		moauthdJSONStart(moauthd_client_t *client);
+extern void		moauthdJSONStartArray(moauthd_client_t *client, const char *name);
+extern void		moauthdJSONStartObject(moauthd_client_t *client, const char *name);
+extern bool		moauthdIsTokenRevoked(moauthd_server_t *server, const char *jti);
+extern void		moauthdJournalApplication(moauthd_server_t *server, moauthd_application_t *app, const char *redirect_uri);
+extern void		moauthdJournalRevoke(moauthd_server_t *server, const char *jti, uint64_t token_hash, time_t expires);
+extern void		moauthdJournalToken(moauthd_server_t *server, moauthd_token_t *token, bool deleted);
+extern bool		moauthdLoadJournal(moauthd_server_t *server);
 extern void		moauthdLogc(moauthd_client_t *client, moauthd_loglevel_t level, const char *message, ...) __attribute__((__format__(__printf__, 3, 4)));
+extern void		moauthdLogRequest(moauthd_client_t *client);
 extern void		moauthdLogs(moauthd_server_t *server, moauthd_loglevel_t level, const char *message, ...) __attribute__((__format__(__printf__, 3, 4)));
+extern void		moauthdRecordRequest(moauthd_client_t *client);
+extern void		moauthdReleaseToken(moauthd_server_t *server, moauthd_token_t *token);
+extern bool		moauthdReloadServer(moauthd_server_t *server);
+extern bool		moauthdReplaceResources(moauthd_server_t *server, moauthd_server_t *from);
+extern bool		moauthdReplayJournal(moauthd_server_t *server, const unsigned char *data, size_t length);
+extern void		moauthdReplicate(moauthd_server_t *server, unsigned type, const unsigned char *data, size_t length);
 extern bool		moauthdRespondClient(moauthd_client_t *client, http_status_t code, const char *type, const char *uri, time_t mtime, size_t length);
-extern void		*moauthdRunClient(moauthd_client_t *client);
+extern bool		moauthdRespondMetrics(moauthd_client_t *client);
+extern bool		moauthdRevokeToken(moauthd_server_t *server, const char *jti, uint64_t token_hash, time_t expires);
+extern bool		moauthdRunClient(moauthd_client_t *client);
 extern int		moauthdRunServer(moauthd_server_t *server);
 extern bool		moauthdSaveServer(moauthd_server_t *server);
+extern void		moauthdSetClientDeadline(moauthd_client_t *client, int timeout);
+extern bool		moauthdStartLogging(moauthd_server_t *server);
+extern bool		moauthdStartReplication(moauthd_server_t *server);
+extern bool		moauthdStartSweeper(moauthd_server_t *server);
+extern void		moauthdStopLogging(moauthd_server_t *server);
+extern void		moauthdStopReplication(moauthd_server_t *server);
+extern void		moauthdStopSweeper(moauthd_server_t *server);
+extern moauthd_token_t	*moauthdValidateToken(moauthd_server_t *server, const char *token_id);
+extern bool		moauthdWriteClient(moauthd_client_t *client, const char *data, size_t length);
 
 #endif // !MOAUTHD_H
@@ -0,0 +1,566 @@
+//
+// Token replication support for moauth daemon
+//
+// Copyright © 2017-2024 by Michael R Sweet
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+// Journal records for new applications, new and deleted tokens, and revoked
+// tokens are also queued for each "Peer" in the configuration.  A sender
+// thread for each peer POSTs the queued records to the peer's "/replicate"
+// resource over a keep-alive connection, so records queued while one batch is
+// in flight are sent together in the next batch.  Each request is signed with
+// an HMAC-SHA256 of the message body using the shared "ReplicationKey":
+//
+//   Authorization: Replicate HEX-HMAC-SHA256
+//
+// When a peer is first contacted, and whenever records are lost because a
+// batch failed or the queue filled up, all live applications, tokens, and
+// revocations are sent instead of the queue.  Replaying records is
+// idempotent, so a peer simply skips the tokens it already has.  Every token
+// that is deleted before it expires is also revoked, so the revocations act
+// as tombstones: a peer that missed a delete record removes the token when it
+// replays the revocation, and never re-adds a token whose JWT ID is revoked.
+//
+// The HMAC only lets the peer authenticate us, so nothing is sent until the
+// peer's TLS certificate matches the one pinned in the "Peer" directive or,
+// without a pinned certificate, is signed by a trusted CA for the peer's
+// hostname.
+//
+
+#include "moauthd.h"
+
+
+//
+// Constants...
+//
+
+#define MOAUTHD_REPLICATE_BATCH	MOAUTHD_MAX_BODY
+					// Maximum bytes per batch
+
+
+//
+// Local functions...
+//
+
+static bool	check_peer(moauthd_peer_t *peer, http_t *http);
+static bool	connect_peer(moauthd_peer_t *peer, http_t **http);
+static void	*replicate_peer(moauthd_peer_t *peer);
+static bool	same_certificate(const char *a, const char *b);
+static bool	send_batch(moauthd_peer_t *peer, http_t **http, const unsigned char *data, size_t length);
+static bool	send_records(moauthd_peer_t *peer, http_t **http, const unsigned char *data, size_t length);
+
+
+//
+// 'moauthdReplicate()' - Queue a journal record for the replication peers.
+//
+
+void
+moauthdReplicate(
+    moauthd_server_t    *server,	// I - Server object
+    unsigned            type,		// I - Record type
+    const unsigned char *data,		// I - Record data
+    size_t              length)		// I - Length of record data
+{
+  int		i;			// Looping var
+  moauthd_peer_t *peer;			// Current peer
+  uint32_t	header[2];		// Record header
+  size_t	reclen = sizeof(header) + length;
+					// Length of record with header
+  bool		signal = false;		// Wake up the sender threads?
+
+
+  if (reclen > MOAUTHD_REPLICATE_BATCH)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Journal record of %lu bytes is too large to replicate.", (unsigned long)length);
+    return;
+  }
+
+  header[0] = (uint32_t)length;
+  header[1] = (uint32_t)type;
+
+  cupsMutexLock(&server->replicate_lock);
+
+  if (!server->replicate_running)
+  {
+    cupsMutexUnlock(&server->replicate_lock);
+    return;
+  }
+
+  for (i = server->num_peers, peer = server->peers; i > 0; i --, peer ++)
+  {
+    // Peers waiting for a full update will get this record anyways...
+    if (peer->resync)
+      continue;
+
+    if ((peer->queue_used + reclen) > peer->queue_alloc)
+    {
+      size_t		alloc = peer->queue_alloc ? 2 * peer->queue_alloc : 65536;
+					// New allocation
+      unsigned char	*temp;		// New queue
+
+      while (alloc < (peer->queue_used + reclen))
+        alloc *= 2;
+
+      if (alloc > MOAUTHD_REPLICATE_QUEUE || (temp = realloc(peer->queue, alloc)) == NULL)
+      {
+        // Queue is full, send everything once the peer catches up...
+	moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Replication queue for peer \"%s\" is full.", peer->uri);
+
+        peer->resync     = true;
+        peer->queue_used = 0;
+        signal           = true;
+        continue;
+      }
+
+      peer->queue       = temp;
+      peer->queue_alloc = alloc;
+    }
+
+    memcpy(peer->queue + peer->queue_used, header, sizeof(header));
+    memcpy(peer->queue + peer->queue_used + sizeof(header), data, length);
+
+    peer->queue_used += reclen;
+    signal           = true;
+  }
+
+  if (signal)
+    cupsCondBroadcast(&server->replicate_cond);
+
+  cupsMutexUnlock(&server->replicate_lock);
+}
+
+
+//
+// 'moauthdStartReplication()' - Start the replication sender threads.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdStartReplication(
+    moauthd_server_t *server)		// I - Server object
+{
+  int		i;			// Looping var
+  moauthd_peer_t *peer;			// Current peer
+
+
+  if (server->num_peers == 0)
+    return (true);
+
+  cupsMutexLock(&server->replicate_lock);
+
+  server->replicate_running = true;
+  server->replicate_stop    = false;
+
+  for (i = server->num_peers, peer = server->peers; i > 0; i --, peer ++)
+  {
+    peer->server = server;
+    peer->resync = true;
+  }
+
+  cupsMutexUnlock(&server->replicate_lock);
+
+  for (i = 0, peer = server->peers; i < server->num_peers; i ++, peer ++)
+  {
+    if ((peer->thread = cupsThreadCreate((void *(*)(void *))replicate_peer, peer)) == CUPS_THREAD_INVALID)
+    {
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create replication thread: %s", strerror(errno));
+      break;
+    }
+  }
+
+  if (i < server->num_peers)
+  {
+    // Stop the threads that did start...
+    cupsMutexLock(&server->replicate_lock);
+    server->replicate_stop = true;
+    cupsCondBroadcast(&server->replicate_cond);
+    cupsMutexUnlock(&server->replicate_lock);
+
+    while (i > 0)
+      cupsThreadWait(server->peers[-- i].thread);
+
+    cupsMutexLock(&server->replicate_lock);
+    server->replicate_running = false;
+    cupsMutexUnlock(&server->replicate_lock);
+
+    return (false);
+  }
+
+  moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Replicating tokens to %d peers.", server->num_peers);
+
+  return (true);
+}
+
+
+//
+// 'moauthdStopReplication()' - Send any queued records and stop the
+//                              replication sender threads.
+//
+
+void
+moauthdStopReplication(
+    moauthd_server_t *server)		// I - Server object
+{
+  int		i;			// Looping var
+  moauthd_peer_t *peer;			// Current peer
+
+
+  cupsMutexLock(&server->replicate_lock);
+
+  if (!server->replicate_running)
+  {
+    cupsMutexUnlock(&server->replicate_lock);
+    return;
+  }
+
+  server->replicate_stop = true;
+  cupsCondBroadcast(&server->replicate_cond);
+  cupsMutexUnlock(&server->replicate_lock);
+
+  for (i = server->num_peers, peer = server->peers; i > 0; i --, peer ++)
+    cupsThreadWait(peer->thread);
+
+  cupsMutexLock(&server->replicate_lock);
+
+  server->replicate_running = false;
+
+  for (i = server->num_peers, peer = server->peers; i > 0; i --, peer ++)
+  {
+    free(peer->queue);
+
+    peer->queue       = NULL;
+    peer->queue_used  = 0;
+    peer->queue_alloc = 0;
+  }
+
+  cupsMutexUnlock(&server->replicate_lock);
+}
+
+
+//
+// 'check_peer()' - Validate the TLS credentials of a replication peer.
+//
+
+static bool				// O - `true` if trusted, `false` otherwise
+check_peer(moauthd_peer_t *peer,	// I - Peer
+           http_t         *http)	// I - HTTP connection
+{
+  char		*credentials;		// Peer credentials
+  http_trust_t	trust;			// Trust level
+  bool		ret;			// Return value
+
+
+  if ((credentials = httpCopyPeerCredentials(http)) == NULL)
+  {
+    moauthdLogs(peer->server, MOAUTHD_LOGLEVEL_ERROR, "Unable to get credentials for peer \"%s\": %s", peer->uri, cupsGetErrorString());
+    return (false);
+  }
+
+  if (peer->certificate)
+  {
+    if ((ret = same_certificate(credentials, peer->certificate)) == false)
+      moauthdLogs(peer->server, MOAUTHD_LOGLEVEL_ERROR, "Certificate for peer \"%s\" does not match the pinned certificate.", peer->uri);
+  }
+  else
+  {
+    trust = cupsGetCredentialsTrust(getenv("SNAP_DATA"), peer->host, credentials, /*require_ca*/true);
+
+    if ((ret = (trust == HTTP_TRUST_OK || trust == HTTP_TRUST_RENEWED)) == false)
+      moauthdLogs(peer->server, MOAUTHD_LOGLEVEL_ERROR, "Certificate for peer \"%s\" is not trusted: %s", peer->uri, cupsGetErrorString());
+  }
+
+  free(credentials);
+
+  return (ret);
+}
+
+
+//
+// 'connect_peer()' - Connect to a replication peer as needed.
+//
+// New connections are only used once the peer's credentials are trusted.
+//
+
+static bool				// O - `true` if connected, `false` on error
+connect_peer(moauthd_peer_t *peer,	// I  - Peer
+             http_t         **http)	// IO - HTTP connection
+{
+  if (*http)
+    return (true);
+
+  if ((*http = httpConnect(peer->host, peer->port, /*addrlist*/NULL, AF_UNSPEC, HTTP_ENCRYPTION_ALWAYS, /*blocking*/true, 30000, /*cancel*/NULL)) == NULL)
+  {
+    moauthdLogs(peer->server, MOAUTHD_LOGLEVEL_ERROR, "Unable to connect to peer \"%s\": %s", peer->uri, cupsGetErrorString());
+    return (false);
+  }
+
+  if (!check_peer(peer, *http))
+  {
+    httpClose(*http);
+    *http = NULL;
+    return (false);
+  }
+
+  return (true);
+}
+
+
+//
+// 'replicate_peer()' - Send queued records to a replication peer.
+//
+
+static void *				// O - Thread exit status
+replicate_peer(moauthd_peer_t *peer)	// I - Peer
+{
+  moauthd_server_t *server = peer->server;
+					// Server object
+  http_t	*http = NULL;		// Connection to peer
+  unsigned char	*data = NULL,		// Records being sent
+		*snapshot,		// All live records
+		*temp;			// Temporary pointer
+  size_t	alloc = 0,		// Allocated size of data
+		used,			// Bytes of data
+		tsize;			// Temporary size
+  bool		resync,			// Send all live records?
+		ret;			// Were the records sent?
+  time_t	retry;			// Time to retry after an error
+
+
+  cupsMutexLock(&server->replicate_lock);
+
+  for (;;)
+  {
+    // Don't try to send everything while shutting down...
+    if (server->replicate_stop && (peer->resync || !peer->queue_used))
+      break;
+
+    if (!peer->resync && !peer->queue_used)
+    {
+      cupsCondWait(&server->replicate_cond, &server->replicate_lock, -1.0);
+      continue;
+    }
+
+    // Swap buffers with the queue so that new records can be queued while we
+    // send these...
+    temp              = peer->queue;
+    peer->queue       = data;
+    data              = temp;
+    tsize             = peer->queue_alloc;
+    peer->queue_alloc = alloc;
+    alloc             = tsize;
+    used              = peer->queue_used;
+    peer->queue_used  = 0;
+    resync            = peer->resync;
+    peer->resync      = false;
+
+    cupsMutexUnlock(&server->replicate_lock);
+
+    if (resync)
+    {
+      // Make sure the peer is reachable before copying everything...
+      ret = false;
+
+      if (connect_peer(peer, &http))
+      {
+	if ((snapshot = moauthdCopyJournal(server, &used)) != NULL)
+	{
+	  moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "Sending %lu bytes of tokens and applications to peer \"%s\".", (unsigned long)used, peer->uri);
+
+	  ret = send_records(peer, &http, snapshot, used);
+	  free(snapshot);
+	}
+	else
+	{
+	  moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to copy tokens for peer \"%s\": %s", peer->uri, strerror(errno));
+	}
+      }
+    }
+    else
+    {
+      ret = send_records(peer, &http, data, used);
+    }
+
+    cupsMutexLock(&server->replicate_lock);
+
+    if (!ret)
+    {
+      // Records were lost, send everything when the peer comes back...
+      peer->resync     = true;
+      peer->queue_used = 0;
+
+      for (retry = time(NULL) + MOAUTHD_REPLICATE_RETRY; !server->replicate_stop && time(NULL) < retry;)
+        cupsCondWait(&server->replicate_cond, &server->replicate_lock, (double)(retry - time(NULL)));
+    }
+  }
+
+  cupsMutexUnlock(&server->replicate_lock);
+
+  httpClose(http);
+  free(data);
+
+  return (NULL);
+}
+
+
+//
+// 'same_certificate()' - Compare the first certificate in two PEM strings.
+//
+// Whitespace is ignored so that line endings and wrapping do not matter.
+//
+
+static bool				// O - `true` if the same, `false` otherwise
+same_certificate(const char *a,		// I - First PEM string
+                 const char *b)		// I - Second PEM string
+{
+  if ((a = strstr(a, "-----BEGIN CERTIFICATE-----")) == NULL || (b = strstr(b, "-----BEGIN CERTIFICATE-----")) == NULL)
+    return (false);
+
+  while (*a && *b)
+  {
+    if (isspace(*a & 255))
+    {
+      a ++;
+    }
+    else if (isspace(*b & 255))
+    {
+      b ++;
+    }
+    else if (!strncmp(a, "-----END CERTIFICATE-----", 25) && !strncmp(b, "-----END CERTIFICATE-----", 25))
+    {
+      return (true);
+    }
+    else if (*a != *b)
+    {
+      return (false);
+    }
+    else
+    {
+      a ++;
+      b ++;
+    }
+  }
+
+  return (false);
+}
+
+
+//
+// 'send_batch()' - Send a batch of records to a replication peer.
+//
+
+static bool				// O  - `true` on success, `false` on error
+send_batch(
+    moauthd_peer_t      *peer,		// I  - Peer
+    http_t              **http,		// IO - HTTP connection
+    const unsigned char *data,		// I  - Records
+    size_t              length)		// I  - Length of records
+{
+  moauthd_server_t *server = peer->server;
+					// Server object
+  http_status_t	status;			// Response status
+  unsigned char	hmac[32];		// HMAC-SHA256 of records
+  char		signature[65];		// Hex version of HMAC
+
+
+  if (!connect_peer(peer, http))
+    goto failed;
+
+  cupsHMACData("sha2-256", (unsigned char *)server->replication_key, strlen(server->replication_key), data, length, hmac, sizeof(hmac));
+  cupsHashString(hmac, sizeof(hmac), signature, sizeof(signature));
+
+  httpClearFields(*http);
+  httpSetField(*http, HTTP_FIELD_CONTENT_TYPE, "application/vnd.moauthd-journal");
+  httpSetAuthString(*http, "Replicate", signature);
+  httpSetLength(*http, length);
+
+  if (!httpWriteRequest(*http, "POST", "/replicate"))
+  {
+    // Idle connections are closed by the peer, so reconnect once...
+    if (!httpConnectAgain(*http, 30000, NULL) || !check_peer(peer, *http) || !httpWriteRequest(*http, "POST", "/replicate"))
+    {
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to send replication request to peer \"%s\": %s", peer->uri, cupsGetErrorString());
+      goto failed;
+    }
+  }
+
+  if (httpWrite(*http, (const char *)data, length) < (ssize_t)length)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to send records to peer \"%s\": %s", peer->uri, cupsGetErrorString());
+    goto failed;
+  }
+
+  while ((status = httpUpdate(*http)) == HTTP_STATUS_CONTINUE);
+
+  httpFlush(*http);
+
+  if (status != HTTP_STATUS_OK)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Peer \"%s\" rejected replicated records: %s", peer->uri, httpStatusString(status));
+    goto failed;
+  }
+
+  atomic_fetch_add_explicit(&peer->num_batches, 1, memory_order_relaxed);
+
+  return (true);
+
+  // If we get here the connection is in an unknown state...
+  failed:
+
+  atomic_fetch_add_explicit(&peer->num_failures, 1, memory_order_relaxed);
+
+  httpClose(*http);
+  *http = NULL;
+
+  return (false);
+}
+
+
+//
+// 'send_records()' - Send records to a replication peer in batches.
+//
+// Batches end on a record boundary and are no larger than the maximum request
+// message body accepted by the peer.
+//
+
+static bool				// O  - `true` on success, `false` on error
+send_records(
+    moauthd_peer_t      *peer,		// I  - Peer
+    http_t              **http,		// IO - HTTP connection
+    const unsigned char *data,		// I  - Records
+    size_t              length)		// I  - Length of records
+{
+  size_t	bytes,			// Bytes in batch
+		reclen;			// Length of current record
+  uint32_t	header[2];		// Record header
+
+
+  while (length > 0)
+  {
+    for (bytes = 0; bytes < length; bytes += reclen)
+    {
+      memcpy(header, data + bytes, sizeof(header));
+      reclen = sizeof(header) + header[0];
+
+      if ((bytes + reclen) > MOAUTHD_REPLICATE_BATCH)
+        break;
+    }
+
+    if (bytes == 0)
+    {
+      // Record is too large for a batch, skip it...
+      moauthdLogs(peer->server, MOAUTHD_LOGLEVEL_ERROR, "Journal record of %lu bytes is too large to replicate.", (unsigned long)reclen);
+      bytes = reclen < length ? reclen : length;
+    }
+    else if (!send_batch(peer, http, data, bytes))
+    {
+      return (false);
+    }
+
+    data   += bytes;
+    length -= bytes;
+  }
+
+  return (true);
+}
+
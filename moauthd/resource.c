@@ -11,6 +11,7 @@
 #include "mmd.h"
 #include <unistd.h>
 #include <sys/fcntl.h>
+#include <sys/mman.h>
 #include <grp.h>
 
 
@@ -18,9 +19,24 @@
 // Local functions...
 //
 
+static moauthd_mdcache_t *cache_markdown(moauthd_server_t *server, const char *key, struct stat *info, char *html, size_t length);
+static int		compare_fcache(moauthd_fcache_t *a, moauthd_fcache_t *b);
+static int		compare_mdcache(moauthd_mdcache_t *a, moauthd_mdcache_t *b);
 static int		compare_resources(moauthd_resource_t *a, moauthd_resource_t *b);
+static bool		is_modified(moauthd_client_t *client, time_t mtime);
+static moauthd_fcache_t	*find_lru_file(cups_array_t *cache);
+static moauthd_mdcache_t *find_lru_markdown(cups_array_t *cache);
+static moauthd_mdcache_t *find_markdown(moauthd_server_t *server, const char *key, struct stat *info);
+static moauthd_rnode_t	*find_node(moauthd_rnode_t *parent, const char *segment, size_t seglen, size_t *pos);
+static void		free_node(moauthd_rnode_t *node);
 static void		free_resource(moauthd_resource_t *resource);
+static bool		insert_resource(moauthd_server_t *server, moauthd_resource_t *resource);
 static const char	*make_anchor(const char *text, char *buffer, size_t bufsize);
+static moauthd_fcache_t	*map_file(moauthd_server_t *server, const char *filename, struct stat *info);
+static void		release_file(moauthd_server_t *server, moauthd_fcache_t *file);
+static void		release_markdown(moauthd_server_t *server, moauthd_mdcache_t *entry);
+static void		select_encoding(moauthd_client_t *client, const char *content_type, size_t length);
+static http_status_t	send_data(moauthd_client_t *client, const char *content_type, const char *uri, time_t mtime, const void *data, int fd, size_t length);
 static void		write_block(moauthd_client_t *client, mmd_t *parent);
 static void		write_leaf(moauthd_client_t *client, mmd_t *node);
 static void		write_string(moauthd_client_t *client, const char *s);
@@ -65,11 +81,28 @@ moauthdCreateResource(
   resource->content_type = content_type ? strdup(content_type) : NULL;
   resource->scope        = strdup(scope);
 
-  if (strcmp(scope, "private") && strcmp(scope, "public") && strcmp(scope, "shared"))
+  if (!strcmp(scope, "public"))
   {
-    // Get the group ID for the named group...
-    if (!getgrnam_r(scope, &grp, grpbuffer, sizeof(grpbuffer), &grpresult))
+    resource->scope_type = MOAUTHD_SCOPE_PUBLIC;
+  }
+  else if (!strcmp(scope, "private"))
+  {
+    resource->scope_type = MOAUTHD_SCOPE_PRIVATE;
+  }
+  else if (!strcmp(scope, "shared"))
+  {
+    resource->scope_type = MOAUTHD_SCOPE_SHARED;
+  }
+  else
+  {
+    // Get the group ID for the named group, using an invalid group ID if
+    // the group doesn't exist so that nobody matches...
+    resource->scope_type = MOAUTHD_SCOPE_GROUP;
+
+    if (!getgrnam_r(scope, &grp, grpbuffer, sizeof(grpbuffer), &grpresult) && grpresult)
       resource->scope_gid = grpresult->gr_gid;
+    else
+      resource->scope_gid = (gid_t)-1;
   }
 
   cupsRWLockWrite(&server->resources_lock);
@@ -79,16 +112,57 @@ moauthdCreateResource(
 
   cupsArrayAdd(server->resources, resource);
 
+  if (!insert_resource(server, resource))
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to add resource \"%s\" to tree: %s", remote_path, strerror(errno));
+
   cupsRWUnlock(&server->resources_lock);
 
   return (resource);
 }
 
 
+//
+// 'moauthdDeleteResources()' - Delete all resources for a server.
+//
+
+void
+moauthdDeleteResources(
+    moauthd_server_t *server)		// I - Server object
+{
+  moauthd_rset_t	*rset,		// Current retired resources
+			*prev;		// Previous retired resources
+
+
+  cupsRWLockWrite(&server->resources_lock);
+
+  free_node(server->resources_tree);
+  server->resources_tree = NULL;
+
+  cupsArrayDelete(server->resources);
+  server->resources = NULL;
+
+  for (rset = server->retired_resources; rset; rset = prev)
+  {
+    prev = rset->prev;
+
+    free_node(rset->tree);
+    cupsArrayDelete(rset->resources);
+    free(rset);
+  }
+
+  server->retired_resources = NULL;
+
+  cupsRWUnlock(&server->resources_lock);
+}
+
+
 //
 // 'moauthdFindResource()' - Find the best matching resource for the request
 //                           path.
 //
+// Resources are stored in a tree of path segments, so the lookup walks the
+// request path once and remembers the deepest node with a resource.
+//
 
 moauthd_resource_t *			// O - Matching resource
 moauthdFindResource(
@@ -98,10 +172,10 @@ moauthdFindResource(
     size_t           namesize,		// I - Size of filename buffer
     struct stat      *info)		// O - File information
 {
-  size_t		i,		// Looping var
-			count;		// Number of resources
-  moauthd_resource_t	*resource,	// Current resource
-			*best = NULL;	// Best match
+  moauthd_rnode_t	*node;		// Current tree node
+  const char		*segment,	// Current path segment
+			*segend;	// End of segment
+  moauthd_resource_t	*best = NULL;	// Best match
 
 
   moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "FindResource %s", path_info);
@@ -111,14 +185,21 @@ moauthdFindResource(
   // path...
   cupsRWLockRead(&server->resources_lock);
 
-  for (i = 0, count = cupsArrayGetCount(server->resources); i < count; i ++)
+  if ((node = server->resources_tree) != NULL && *path_info == '/')
   {
-    resource = cupsArrayGetElement(server->resources, i);
+    // The root node holds the "/" resource, which matches everything...
+    best = node->resource;
 
-    if (!strncmp(path_info, resource->remote_path, resource->remote_len) && (!path_info[resource->remote_len] || path_info[resource->remote_len] == '/' || !strcmp(resource->remote_path, "/")))
+    for (segment = path_info + 1; node; segment = segend + 1)
     {
-      if (!best || resource->remote_len > best->remote_len)
-        best = resource;
+      if ((segend = strchr(segment, '/')) == NULL)
+        segend = segment + strlen(segment);
+
+      if ((node = find_node(node, segment, (size_t)(segend - segment), NULL)) != NULL && node->resource)
+        best = node->resource;
+
+      if (!*segend)
+        break;
     }
   }
 
@@ -172,6 +253,54 @@ moauthdFindResource(
 }
 
 
+//
+// 'moauthdFlushFiles()' - Remove all memory-mapped files from the cache.
+//
+
+void
+moauthdFlushFiles(
+    moauthd_server_t *server)		// I - Server object
+{
+  moauthd_fcache_t	*file;		// Current file
+
+
+  cupsMutexLock(&server->file_lock);
+
+  for (file = (moauthd_fcache_t *)cupsArrayGetFirst(server->file_cache); file; file = (moauthd_fcache_t *)cupsArrayGetNext(server->file_cache))
+  {
+    cupsArrayRemove(server->file_cache, file);
+    release_file(NULL, file);
+  }
+
+  server->file_cache_bytes = 0;
+
+  cupsMutexUnlock(&server->file_lock);
+}
+
+
+//
+// 'moauthdFlushMarkdown()' - Remove all rendered Markdown pages from the cache.
+//
+
+void
+moauthdFlushMarkdown(
+    moauthd_server_t *server)		// I - Server object
+{
+  moauthd_mdcache_t	*entry;		// Current entry
+
+
+  cupsMutexLock(&server->markdown_lock);
+
+  for (entry = (moauthd_mdcache_t *)cupsArrayGetFirst(server->markdown_cache); entry; entry = (moauthd_mdcache_t *)cupsArrayGetNext(server->markdown_cache))
+  {
+    cupsArrayRemove(server->markdown_cache, entry);
+    release_markdown(NULL, entry);
+  }
+
+  cupsMutexUnlock(&server->markdown_lock);
+}
+
+
 //
 // 'moauthdGetFile()' - Get the named resource file.
 //
@@ -204,10 +333,10 @@ moauthdGetFile(moauthd_client_t *client)// I - Client object
   }
 
   // Support authentication...
-  if (best->scope && strcmp(best->scope, "public"))
+  if (best->scope_type != MOAUTHD_SCOPE_PUBLIC)
   {
     // Need authentication...
-    if (!client->remote_user[0] || (!strcmp(best->scope, "private") && client->remote_uid != localinfo.st_uid))
+    if (!client->remote_user[0] || (best->scope_type == MOAUTHD_SCOPE_PRIVATE && client->remote_uid != localinfo.st_uid))
     {
       http_status_t status = client->remote_user[0] ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_UNAUTHORIZED;
 					// Returned HTTP status
@@ -217,7 +346,7 @@ moauthdGetFile(moauthd_client_t *client)// I - Client object
       return (status);
     }
 
-    if (strcmp(best->scope, "private") && strcmp(best->scope, "shared"))
+    if (best->scope_type == MOAUTHD_SCOPE_GROUP)
     {
       size_t	i;			// Looping var
 
@@ -317,6 +446,13 @@ moauthdGetFile(moauthd_client_t *client)// I - Client object
       content_type = "text/plain";
   }
 
+  // Handle conditional GET requests...
+  if (client->request_method == HTTP_STATE_GET && !is_modified(client, localinfo.st_mtime))
+  {
+    moauthdRespondClient(client, HTTP_STATUS_NOT_MODIFIED, NULL, uri, localinfo.st_mtime, 0);
+    return (HTTP_STATUS_NOT_MODIFIED);
+  }
+
   if (client->request_method == HTTP_STATE_GET)
   {
     if (!strcmp(ext, ".md"))
@@ -327,12 +463,34 @@ moauthdGetFile(moauthd_client_t *client)// I - Client object
       const char *title;		// Document title
       char	buffer[1024],		// Temporary buffer
 		*bufptr;		// Pointer into buffer
+      char	key[2048];		// Cache key
+      moauthd_mdcache_t *entry;		// Rendered page
+      http_status_t status;		// HTTP status
+
+      // Use the rendered page from the cache as needed - the request path is
+      // part of the key since it can provide the title...
+      snprintf(key, sizeof(key), "%s\n%s", best->data ? best->remote_path : localfile, client->path_info);
+
+      if ((entry = find_markdown(client->server, key, &localinfo)) != NULL)
+      {
+        status = send_data(client, content_type, uri, localinfo.st_mtime, entry->html, -1, entry->length);
+
+        release_markdown(client->server, entry);
+
+        return (status);
+      }
 
       if (best->data)
         fp = fmemopen((void *)best->data, best->length, "rb");
       else
         fp = fopen(localfile, "rb");
 
+      if (!fp)
+      {
+	moauthdRespondClient(client, HTTP_STATUS_NOT_FOUND, NULL, NULL, 0, 0);
+	return (HTTP_STATUS_NOT_FOUND);
+      }
+
       doc = mmdLoadFile(NULL, fp);
       fclose(fp);
 
@@ -364,35 +522,75 @@ moauthdGetFile(moauthd_client_t *client)// I - Client object
           title = strrchr(client->path_info, '/') + 1;
       }
 
-      moauthdRespondClient(client, HTTP_STATUS_OK, content_type, uri, localinfo.st_mtime, 0);
+      // Render the page into a buffer...
+      client->html_capture = true;
+      client->html_buffer  = NULL;
+      client->html_used    = 0;
+      client->html_alloc   = 0;
+
       moauthdHTMLHeader(client, title);
       write_block(client, doc);
       moauthdHTMLFooter(client);
       mmdFree(doc);
+
+      client->html_capture = false;
+
+      if ((entry = cache_markdown(client->server, key, &localinfo, client->html_buffer, client->html_used)) == NULL)
+      {
+        free(client->html_buffer);
+        client->html_buffer = NULL;
+
+	moauthdRespondClient(client, HTTP_STATUS_SERVER_ERROR, NULL, NULL, 0, 0);
+	return (HTTP_STATUS_SERVER_ERROR);
+      }
+
+      client->html_buffer = NULL;
+
+      // Then send it as a single buffer...
+      status = send_data(client, content_type, uri, localinfo.st_mtime, entry->html, -1, entry->length);
+
+      release_markdown(client->server, entry);
+
+      return (status);
     }
     else if (best->data)
     {
       // Serve a static/cached file...
-      moauthdRespondClient(client, HTTP_STATUS_OK, content_type, uri, localinfo.st_mtime, best->length);
+      return (send_data(client, content_type, uri, localinfo.st_mtime, best->data, -1, best->length));
+    }
+    else if ((localinfo.st_uid != 0 && localinfo.st_uid != geteuid()) || (localinfo.st_mode & (S_IWGRP | S_IWOTH)) || localinfo.st_size > MOAUTHD_MAX_MAPPED_SIZE)
+    {
+      // Truncating a mapped file makes reads past the new end raise SIGBUS, so
+      // files that users other than root or the server user can change are
+      // streamed instead, as are large files...
+      int		fd;		// File descriptor
+      http_status_t	status;		// HTTP status
 
-      if (httpWrite(client->http, best->data, best->length) < best->length)
-        return (HTTP_STATUS_BAD_REQUEST);
+      if ((fd = open(localfile, O_RDONLY)) < 0)
+      {
+	moauthdRespondClient(client, HTTP_STATUS_NOT_FOUND, NULL, NULL, 0, 0);
+	return (HTTP_STATUS_NOT_FOUND);
+      }
+
+      status = send_data(client, content_type, uri, localinfo.st_mtime, NULL, fd, (size_t)localinfo.st_size);
+
+      close(fd);
+
+      return (status);
     }
     else
     {
-      // Serve any other file...
-      int	fd;			// File descriptor
-      char	buffer[16384];		// Buffer
-      ssize_t	bytes;			// Bytes read/written
+      // Serve any other file from the memory-mapped file cache...
+      moauthd_fcache_t	*file;		// Mapped file
+      http_status_t	status;		// HTTP status
 
-      if ((fd = open(localfile, O_RDONLY)) >= 0)
+      if ((file = map_file(client->server, localfile, &localinfo)) != NULL)
       {
-	moauthdRespondClient(client, HTTP_STATUS_OK, content_type, uri, localinfo.st_mtime, localinfo.st_size);
+        status = send_data(client, content_type, uri, localinfo.st_mtime, file->data, -1, (size_t)file->size);
 
-        while ((bytes = read(fd, buffer, sizeof(buffer))) > 0)
-          httpWrite(client->http, buffer, (size_t)bytes);
+        release_file(client->server, file);
 
-        close(fd);
+        return (status);
       }
       else
       {
@@ -406,6 +604,168 @@ moauthdGetFile(moauthd_client_t *client)// I - Client object
 }
 
 
+//
+// 'moauthdReplaceResources()' - Replace the resources for a server.
+//
+// The resources of the second server object are moved to the first.  The old
+// resources are retired rather than freed since requests in progress may still
+// be using them.  Each swap starts a new resource generation, and workers
+// record the generation at the start of each request, so retired sets are
+// freed once no worker is still on a request from a generation that used them.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdReplaceResources(
+    moauthd_server_t *server,		// I - Server object
+    moauthd_server_t *from)		// I - Server object with new resources
+{
+  int			i;		// Looping var
+  moauthd_rset_t	*rset,		// Retired resources
+			**rptr,		// Pointer to retired resources
+			*unused = NULL;	// Retired resources to free
+  size_t		generation,	// Worker's resource generation
+			oldest = SIZE_MAX;
+					// Oldest generation in use
+
+
+  if ((rset = (moauthd_rset_t *)calloc(1, sizeof(moauthd_rset_t))) == NULL)
+    return (false);
+
+  cupsRWLockWrite(&from->resources_lock);
+  cupsRWLockWrite(&server->resources_lock);
+
+  rset->prev       = server->retired_resources;
+  rset->generation = atomic_fetch_add(&server->resources_generation, 1);
+  rset->resources  = server->resources;
+  rset->tree       = server->resources_tree;
+
+  server->retired_resources = rset;
+  server->resources         = from->resources;
+  server->resources_tree    = from->resources_tree;
+
+  from->resources      = NULL;
+  from->resources_tree = NULL;
+
+  // Find the oldest generation still in use by a worker...
+  for (i = 0; i < server->num_running; i ++)
+  {
+    if ((generation = atomic_load(server->worker_generation + i)) > 0 && generation < oldest)
+      oldest = generation;
+  }
+
+  // and unlink the retired sets that are older than that...
+  for (rptr = &server->retired_resources; (rset = *rptr) != NULL;)
+  {
+    if (rset->generation < oldest)
+    {
+      *rptr      = rset->prev;
+      rset->prev = unused;
+      unused     = rset;
+    }
+    else
+    {
+      rptr = &rset->prev;
+    }
+  }
+
+  cupsRWUnlock(&server->resources_lock);
+  cupsRWUnlock(&from->resources_lock);
+
+  for (; unused; unused = rset)
+  {
+    rset = unused->prev;
+
+    free_node(unused->tree);
+    cupsArrayDelete(unused->resources);
+    free(unused);
+  }
+
+  return (true);
+}
+
+
+//
+// 'cache_markdown()' - Add a rendered Markdown page to the cache.
+//
+// The cache takes ownership of the HTML buffer.  The returned entry must be
+// released using release_markdown().
+//
+
+static moauthd_mdcache_t *		// O - Cache entry or `NULL` on error
+cache_markdown(
+    moauthd_server_t *server,		// I - Server object
+    const char       *key,		// I - Cache key
+    struct stat      *info,		// I - Source file information
+    char             *html,		// I - Rendered HTML
+    size_t           length)		// I - Length of rendered HTML
+{
+  moauthd_mdcache_t	*entry,		// New entry
+			*old;		// Existing entry
+
+
+  if (!html || (entry = (moauthd_mdcache_t *)calloc(1, sizeof(moauthd_mdcache_t))) == NULL)
+    return (NULL);
+
+  if ((entry->key = strdup(key)) == NULL)
+  {
+    free(entry);
+    return (NULL);
+  }
+
+  entry->mtime     = info->st_mtime;
+  entry->size      = info->st_size;
+  entry->refcount  = 2;			// One for the cache, one for the caller
+  entry->last_used = moauthdGetClock();
+  entry->html      = html;
+  entry->length    = length;
+
+  cupsMutexLock(&server->markdown_lock);
+
+  if (!server->markdown_cache)
+    server->markdown_cache = cupsArrayNew((cups_array_cb_t)compare_mdcache, NULL, NULL, 0, NULL, NULL);
+
+  // Replace any existing entry and keep the cache bounded...
+  if ((old = (moauthd_mdcache_t *)cupsArrayFind(server->markdown_cache, entry)) == NULL && cupsArrayGetCount(server->markdown_cache) >= MOAUTHD_MAX_MARKDOWN)
+    old = find_lru_markdown(server->markdown_cache);
+
+  if (old)
+  {
+    cupsArrayRemove(server->markdown_cache, old);
+    release_markdown(NULL, old);
+  }
+
+  cupsArrayAdd(server->markdown_cache, entry);
+
+  cupsMutexUnlock(&server->markdown_lock);
+
+  return (entry);
+}
+
+
+//
+// 'compare_fcache()' - Compare the filenames of two file cache entries.
+//
+
+static int				// O - Result of comparison
+compare_fcache(moauthd_fcache_t *a,	// I - First entry
+               moauthd_fcache_t *b)	// I - Second entry
+{
+  return (strcmp(a->filename, b->filename));
+}
+
+
+//
+// 'compare_mdcache()' - Compare the keys of two Markdown cache entries.
+//
+
+static int				// O - Result of comparison
+compare_mdcache(moauthd_mdcache_t *a,	// I - First entry
+                moauthd_mdcache_t *b)	// I - Second entry
+{
+  return (strcmp(a->key, b->key));
+}
+
+
 //
 // 'compare_resources()' - Compare the remote path of two resource objects...
 //
@@ -418,6 +778,163 @@ compare_resources(moauthd_resource_t *a,// I - First resource
 }
 
 
+//
+// 'find_lru_file()' - Find the least recently used file in the file cache.
+//
+// The cache is small and only searched when it is full, so a linear search is
+// used rather than keeping a separate LRU list.  The file cache mutex must be
+// held by the caller.
+//
+
+static moauthd_fcache_t *		// O - Least recently used entry
+find_lru_file(cups_array_t *cache)	// I - File cache
+{
+  moauthd_fcache_t	*file,		// Current entry
+			*lru = NULL;	// Least recently used entry
+
+
+  for (file = (moauthd_fcache_t *)cupsArrayGetFirst(cache); file; file = (moauthd_fcache_t *)cupsArrayGetNext(cache))
+  {
+    if (!lru || file->last_used < lru->last_used)
+      lru = file;
+  }
+
+  return (lru);
+}
+
+
+//
+// 'find_lru_markdown()' - Find the least recently used page in the Markdown
+//                         cache.
+//
+// The Markdown cache mutex must be held by the caller.
+//
+
+static moauthd_mdcache_t *		// O - Least recently used entry
+find_lru_markdown(cups_array_t *cache)	// I - Markdown cache
+{
+  moauthd_mdcache_t	*entry,		// Current entry
+			*lru = NULL;	// Least recently used entry
+
+
+  for (entry = (moauthd_mdcache_t *)cupsArrayGetFirst(cache); entry; entry = (moauthd_mdcache_t *)cupsArrayGetNext(cache))
+  {
+    if (!lru || entry->last_used < lru->last_used)
+      lru = entry;
+  }
+
+  return (lru);
+}
+
+
+//
+// 'find_markdown()' - Find a current rendered Markdown page in the cache.
+//
+// Entries whose source has changed are removed.  The returned entry must be
+// released using release_markdown().
+//
+
+static moauthd_mdcache_t *		// O - Cache entry or `NULL` if not cached
+find_markdown(
+    moauthd_server_t *server,		// I - Server object
+    const char       *key,		// I - Cache key
+    struct stat      *info)		// I - Source file information
+{
+  moauthd_mdcache_t	temp,		// Search key
+			*entry;		// Matching entry
+
+
+  cupsMutexLock(&server->markdown_lock);
+
+  temp.key = (char *)key;
+
+  if ((entry = (moauthd_mdcache_t *)cupsArrayFind(server->markdown_cache, &temp)) != NULL)
+  {
+    if (entry->mtime == info->st_mtime && entry->size == info->st_size)
+    {
+      entry->refcount ++;
+      entry->last_used = moauthdGetClock();
+    }
+    else
+    {
+      // Source has changed...
+      cupsArrayRemove(server->markdown_cache, entry);
+      release_markdown(NULL, entry);
+      entry = NULL;
+    }
+  }
+
+  cupsMutexUnlock(&server->markdown_lock);
+
+  return (entry);
+}
+
+
+//
+// 'find_node()' - Find a child node for a path segment.
+//
+// Children are sorted by segment so the search is binary.  When `pos` is not
+// `NULL`, it receives the index where the segment would be inserted.
+//
+
+static moauthd_rnode_t *		// O - Child node or `NULL` if none
+find_node(moauthd_rnode_t *parent,	// I - Parent node
+          const char      *segment,	// I - Path segment
+          size_t          seglen,	// I - Length of path segment
+          size_t          *pos)		// O - Insertion position or `NULL`
+{
+  size_t		left,		// Left side of search
+			right,		// Right side of search
+			current;	// Current child
+  moauthd_rnode_t	*child;		// Current child node
+  int			result;		// Result of comparison
+
+
+  for (left = 0, right = parent->num_children; left < right;)
+  {
+    current = (left + right) / 2;
+    child   = parent->children[current];
+
+    if ((result = memcmp(segment, child->segment, seglen < child->seglen ? seglen : child->seglen)) == 0)
+      result = seglen < child->seglen ? -1 : seglen > child->seglen ? 1 : 0;
+
+    if (result == 0)
+      return (child);
+    else if (result < 0)
+      right = current;
+    else
+      left = current + 1;
+  }
+
+  if (pos)
+    *pos = left;
+
+  return (NULL);
+}
+
+
+//
+// 'free_node()' - Free a resource tree node and its children.
+//
+
+static void
+free_node(moauthd_rnode_t *node)	// I - Tree node
+{
+  size_t	i;			// Looping var
+
+
+  if (!node)
+    return;
+
+  for (i = 0; i < node->num_children; i ++)
+    free_node(node->children[i]);
+
+  free(node->children);
+  free(node->segment);
+  free(node);
+}
+
+
 //
 // 'free_resource()' - Free a resource object.
 //
@@ -436,6 +953,100 @@ free_resource(
 }
 
 
+//
+// 'insert_resource()' - Add a resource to the resource tree.
+//
+// The caller must hold the resources write lock.  When more than one resource
+// has the same remote path, the first one wins.
+//
+
+static bool				// O - `true` on success, `false` on error
+insert_resource(
+    moauthd_server_t   *server,		// I - Server object
+    moauthd_resource_t *resource)	// I - Resource
+{
+  moauthd_rnode_t	*node,		// Current node
+			*child,		// Child node
+			**children;	// New child array
+  const char		*segment,	// Current path segment
+			*segend;	// End of segment
+  size_t		pos;		// Insertion position
+
+
+  if (!server->resources_tree && (server->resources_tree = (moauthd_rnode_t *)calloc(1, sizeof(moauthd_rnode_t))) == NULL)
+    return (false);
+
+  node = server->resources_tree;
+
+  if (strcmp(resource->remote_path, "/"))
+  {
+    // Walk/add nodes for each path segment...
+    for (segment = resource->remote_path + (*resource->remote_path == '/'); node; segment = segend + 1)
+    {
+      if ((segend = strchr(segment, '/')) == NULL)
+        segend = segment + strlen(segment);
+
+      if ((child = find_node(node, segment, (size_t)(segend - segment), &pos)) == NULL)
+      {
+        // Add a new child node...
+        if (node->num_children >= node->alloc_children)
+        {
+          if ((children = realloc(node->children, (node->alloc_children + 4) * sizeof(moauthd_rnode_t *))) == NULL)
+            return (false);
+
+          node->children        = children;
+          node->alloc_children += 4;
+        }
+
+        if ((child = (moauthd_rnode_t *)calloc(1, sizeof(moauthd_rnode_t))) == NULL)
+          return (false);
+
+        child->seglen = (size_t)(segend - segment);
+
+        if ((child->segment = strndup(segment, child->seglen)) == NULL)
+        {
+          free(child);
+          return (false);
+        }
+
+        memmove(node->children + pos + 1, node->children + pos, (node->num_children - pos) * sizeof(moauthd_rnode_t *));
+        node->children[pos] = child;
+        node->num_children ++;
+      }
+
+      node = child;
+
+      if (!*segend)
+        break;
+    }
+  }
+
+  if (!node->resource)
+    node->resource = resource;
+
+  return (true);
+}
+
+
+//
+// 'is_modified()' - Check the If-Modified-Since request header.
+//
+
+static bool				// O - `true` if the resource must be sent, `false` if not modified
+is_modified(moauthd_client_t *client,	// I - Client
+            time_t           mtime)	// I - Last modified date and time
+{
+  const char	*value;			// If-Modified-Since value
+  time_t	since;			// If-Modified-Since date and time
+
+
+  if ((value = httpGetField(client->http, HTTP_FIELD_IF_MODIFIED_SINCE)) == NULL || !*value || (since = httpGetDateTime(value)) <= 0)
+    return (true);
+
+  return (mtime > since);
+}
+
+
 //
 // 'make_anchor()' - Make an anchor for internal links.
 //
@@ -463,6 +1074,332 @@ make_anchor(const char *text,           // I - Text
 }
 
 
+//
+// 'map_file()' - Map a file into memory using the file cache.
+//
+// Files stay mapped until they change or are pushed out of the least recently
+// used end of the cache, which is limited to MOAUTHD_MAX_MAPPED files and
+// MOAUTHD_MAX_MAPPED_BYTES bytes.  Only files that just root or the server
+// user can change may be mapped.  The returned entry must be released using
+// release_file().
+//
+
+static moauthd_fcache_t *		// O - Cache entry or `NULL` on error
+map_file(moauthd_server_t *server,	// I - Server object
+         const char       *filename,	// I - Local filename
+         struct stat      *info)	// I - File information
+{
+  moauthd_fcache_t	temp,		// Search key
+			*file,		// Cache entry
+			*old;		// Existing entry
+  int			fd;		// File descriptor
+
+
+  // See if the file is already mapped...
+  cupsMutexLock(&server->file_lock);
+
+  temp.filename = (char *)filename;
+
+  if ((file = (moauthd_fcache_t *)cupsArrayFind(server->file_cache, &temp)) != NULL)
+  {
+    if (file->dev == info->st_dev && file->ino == info->st_ino && file->mtime == info->st_mtime && file->size == info->st_size)
+    {
+      file->refcount ++;
+      file->last_used = moauthdGetClock();
+      cupsMutexUnlock(&server->file_lock);
+
+      return (file);
+    }
+
+    // File has changed...
+    cupsArrayRemove(server->file_cache, file);
+    server->file_cache_bytes -= (size_t)file->size;
+    release_file(NULL, file);
+  }
+
+  cupsMutexUnlock(&server->file_lock);
+
+  // Map the file...
+  if ((file = (moauthd_fcache_t *)calloc(1, sizeof(moauthd_fcache_t))) == NULL)
+    return (NULL);
+
+  if ((file->filename = strdup(filename)) == NULL)
+  {
+    free(file);
+    return (NULL);
+  }
+
+  file->dev       = info->st_dev;
+  file->ino       = info->st_ino;
+  file->mtime     = info->st_mtime;
+  file->size      = info->st_size;
+  file->refcount  = 2;			// One for the cache, one for the caller
+  file->last_used = moauthdGetClock();
+
+  if (file->size > 0)
+  {
+    if ((fd = open(filename, O_RDONLY)) < 0)
+    {
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to open \"%s\": %s", filename, strerror(errno));
+      free(file->filename);
+      free(file);
+      return (NULL);
+    }
+
+    file->data = mmap(NULL, (size_t)file->size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (file->data == MAP_FAILED)
+    {
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to map \"%s\": %s", filename, strerror(errno));
+      close(fd);
+      free(file->filename);
+      free(file);
+      return (NULL);
+    }
+
+    close(fd);
+  }
+
+  // Add it to the cache, replacing any entry added while we were mapping and
+  // keeping the cache bounded...
+  cupsMutexLock(&server->file_lock);
+
+  if (!server->file_cache)
+    server->file_cache = cupsArrayNew((cups_array_cb_t)compare_fcache, NULL, NULL, 0, NULL, NULL);
+
+  if ((old = (moauthd_fcache_t *)cupsArrayFind(server->file_cache, file)) != NULL)
+  {
+    cupsArrayRemove(server->file_cache, old);
+    server->file_cache_bytes -= (size_t)old->size;
+    release_file(NULL, old);
+  }
+
+  while ((cupsArrayGetCount(server->file_cache) >= MOAUTHD_MAX_MAPPED || server->file_cache_bytes + (size_t)file->size > MOAUTHD_MAX_MAPPED_BYTES) && (old = find_lru_file(server->file_cache)) != NULL)
+  {
+    cupsArrayRemove(server->file_cache, old);
+    server->file_cache_bytes -= (size_t)old->size;
+    release_file(NULL, old);
+  }
+
+  cupsArrayAdd(server->file_cache, file);
+  server->file_cache_bytes += (size_t)file->size;
+
+  cupsMutexUnlock(&server->file_lock);
+
+  return (file);
+}
+
+
+//
+// 'release_file()' - Release a memory-mapped file.
+//
+// Pass a `NULL` server when the file cache mutex is already held.
+//
+
+static void
+release_file(moauthd_server_t *server,	// I - Server object or `NULL` if locked
+             moauthd_fcache_t *file)	// I - Cache entry
+{
+  int	refcount;			// New reference count
+
+
+  if (server)
+    cupsMutexLock(&server->file_lock);
+
+  refcount = -- file->refcount;
+
+  if (server)
+    cupsMutexUnlock(&server->file_lock);
+
+  if (refcount <= 0)
+  {
+    if (file->data)
+      munmap(file->data, (size_t)file->size);
+
+    free(file->filename);
+    free(file);
+  }
+}
+
+
+//
+// 'release_markdown()' - Release a rendered Markdown page.
+//
+// Pass a `NULL` server when the Markdown cache mutex is already held.
+//
+
+static void
+release_markdown(
+    moauthd_server_t  *server,		// I - Server object or `NULL` if locked
+    moauthd_mdcache_t *entry)		// I - Cache entry
+{
+  int	refcount;			// New reference count
+
+
+  if (server)
+    cupsMutexLock(&server->markdown_lock);
+
+  refcount = -- entry->refcount;
+
+  if (server)
+    cupsMutexUnlock(&server->markdown_lock);
+
+  if (refcount <= 0)
+  {
+    free(entry->key);
+    free(entry->html);
+    free(entry);
+  }
+}
+
+
+//
+// 'select_encoding()' - Choose a Content-Encoding for the response.
+//
+// Text resources are compressed when the client accepts it.  Other types are
+// usually compressed already.
+//
+
+static void
+select_encoding(
+    moauthd_client_t *client,		// I - Client
+    const char       *content_type,	// I - MIME media type
+    size_t           length)		// I - Length of data
+{
+  if (length < MOAUTHD_MIN_COMPRESS || !content_type)
+    return;
+
+  if (strncmp(content_type, "text/", 5) && strcmp(content_type, "application/json") && strcmp(content_type, "image/svg+xml"))
+    return;
+
+  client->content_encoding = httpGetContentEncoding(client->http);
+}
+
+
+//
+// 'send_data()' - Send a file or static data, honoring any Range request.
+//
+// Only single byte ranges are supported - anything else gets the whole
+// resource.  Compressed responses always contain the whole resource.  When
+// "data" is `NULL` the content is read from "fd" instead.
+//
+
+static http_status_t			// O - HTTP status
+send_data(moauthd_client_t *client,	// I - Client
+          const char       *content_type,
+					// I - MIME media type
+          const char       *uri,	// I - Content-Location URI
+          time_t           mtime,	// I - Last modified date and time
+          const void       *data,	// I - Data or `NULL` to read from file
+          int              fd,		// I - File descriptor or -1
+          size_t           length)	// I - Length of data
+{
+  http_status_t	status = HTTP_STATUS_OK;// HTTP status
+  const char	*range;			// Range: header value
+  char		*ptr;			// Pointer into range
+  size_t	first = 0,		// First byte to send
+		last = length - 1;	// Last byte to send
+
+
+  select_encoding(client, content_type, length);
+
+  client->accept_ranges = !client->content_encoding;
+
+  if (client->accept_ranges && length > 0 && (range = httpGetField(client->http, HTTP_FIELD_RANGE)) != NULL && !strncmp(range, "bytes=", 6) && !strchr(range, ','))
+  {
+    range += 6;
+
+    if (*range == '-')
+    {
+      // bytes=-N for the last N bytes...
+      size_t suffix = (size_t)strtoull(range + 1, &ptr, 10);
+					// Length of suffix
+
+      if (!*ptr && suffix > 0)
+      {
+        first  = suffix < length ? length - suffix : 0;
+        status = HTTP_STATUS_PARTIAL_CONTENT;
+      }
+    }
+    else if (isdigit(*range & 255))
+    {
+      // bytes=A- or bytes=A-B...
+      first = (size_t)strtoull(range, &ptr, 10);
+
+      if (*ptr == '-')
+      {
+        if (ptr[1])
+        {
+          last = (size_t)strtoull(ptr + 1, &ptr, 10);
+
+          if (last >= length)
+            last = length - 1;
+        }
+        else
+          ptr ++;
+
+        if (!*ptr && first <= last)
+          status = HTTP_STATUS_PARTIAL_CONTENT;
+      }
+
+      if (status == HTTP_STATUS_OK)
+      {
+        first = 0;
+        last  = length - 1;
+      }
+      else if (first >= length)
+      {
+        // Unsatisfiable range...
+        snprintf(client->content_range, sizeof(client->content_range), "bytes */%lu", (unsigned long)length);
+	moauthdRespondClient(client, HTTP_STATUS_REQUESTED_RANGE, NULL, NULL, 0, 0);
+	return (HTTP_STATUS_REQUESTED_RANGE);
+      }
+    }
+  }
+
+  if (status == HTTP_STATUS_PARTIAL_CONTENT)
+  {
+    snprintf(client->content_range, sizeof(client->content_range), "bytes %lu-%lu/%lu", (unsigned long)first, (unsigned long)last, (unsigned long)length);
+    length = last - first + 1;
+  }
+
+  if (!moauthdRespondClient(client, status, content_type, uri, mtime, length))
+    return (HTTP_STATUS_BAD_REQUEST);
+
+  if (length > 0 && data)
+  {
+    if (!moauthdWriteClient(client, (const char *)data + first, length))
+      return (HTTP_STATUS_BAD_REQUEST);
+  }
+  else if (length > 0)
+  {
+    // Stream the file, failing if it is truncated while we read...
+    char	buffer[16384];		// Copy buffer
+    ssize_t	bytes;			// Bytes read
+    off_t	offset = (off_t)first;	// Current offset
+
+    while (length > 0)
+    {
+      if ((bytes = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset)) < 0 && errno == EINTR)
+        continue;
+      else if (bytes <= 0)
+        return (HTTP_STATUS_BAD_REQUEST);
+
+      if (!moauthdWriteClient(client, buffer, (size_t)bytes))
+        return (HTTP_STATUS_BAD_REQUEST);
+
+      offset += bytes;
+      length -= (size_t)bytes;
+    }
+  }
+
+  if (client->content_encoding && httpWrite(client->http, "", 0) < 0)
+    return (HTTP_STATUS_BAD_REQUEST);
+
+  return (status);
+}
+
+
 //
 // 'write_block()' - Write a block node as HTML.
 //
@@ -702,5 +1639,5 @@ static void
 write_string(moauthd_client_t *client,	// I - Client connection
              const char       *s)	// I - String to write
 {
-  httpWrite(client->http, s, strlen(s));
+  moauthdWriteClient(client, s, strlen(s));
 }
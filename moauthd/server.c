@@ -25,17 +25,32 @@
 // Local functions...
 //
 
-static int	compare_applications(moauthd_application_t *a, moauthd_application_t *b);
-static moauthd_application_t *copy_application(moauthd_application_t *a);
+static void	add_resources(moauthd_server_t *server, const char *metadata, const char *public_key);
+static moauthd_application_t *find_application(moauthd_apptable_t *table, const char *client_id);
 static void	free_application(moauthd_application_t *a);
 static int	get_seconds(const char *value);
+static bool	has_redirect_uri(moauthd_application_t *app, const char *redirect_uri);
+static uint64_t	hash_client_id(const char *s);
+static void	insert_application(moauthd_apptable_t *table, moauthd_application_t *app);
+static bool	key_matches_alg(cups_json_t *jwk, cups_jwa_t alg);
 static bool	load_config(moauthd_server_t *server, const char *configfile, cups_file_t *fp);
 static bool	load_state(moauthd_server_t *server);
+static moauthd_application_t *new_application(const char *client_id, const char *redirect_uri, const char *client_name, const char *client_uri, const char *logo_uri, const char *tos_uri);
+static moauthd_apptable_t *new_apptable(moauthd_apptable_t *table);
+static moauthd_server_t *new_server(void);
+static moauthd_uri_t *new_uri(const char *redirect_uri);
+static char	*read_file(const char *filename, size_t maxsize);
 
 
 //
 // 'moauthdAddApplication()' - Add an application (OAuth client) to the server.
 //
+// Applications live in an insert-only hash table keyed by client ID.  Readers
+// load the current table and walk each application's list of redirection URIs
+// without locking; registrations are serialized by `applications_lock`, which
+// publishes a new table when it grows or appends a URI to the end of a list.
+// Replaced tables are retired and freed with the server.
+//
 
 moauthd_application_t *			// O - New application object
 moauthdAddApplication(
@@ -47,28 +62,63 @@ moauthdAddApplication(
     const char       *logo_uri,		// I - Logo URI or `NULL` for none
     const char       *tos_uri)		// I - Terms-of-service URI or `NULL` for none
 {
-  moauthd_application_t	temp,		// Temporary application data
-			*app;		// New application
-
+  moauthd_application_t	*app;		// Application
+  moauthd_apptable_t	*table,		// Current hash table
+			*ntable;	// New hash table
+  moauthd_uri_t		*uri;		// New redirection URI
 
-  temp.client_id    = (char *)client_id;
-  temp.redirect_uri = (char *)redirect_uri;
-  temp.client_name  = (char *)client_name;
-  temp.client_uri   = (char *)client_uri;
-  temp.logo_uri     = (char *)logo_uri;
-  temp.tos_uri      = (char *)tos_uri;
 
   cupsMutexLock(&server->applications_lock);
 
-  if (!server->applications)
-    server->applications = cupsArrayNew((cups_array_cb_t)compare_applications, NULL, NULL, 0, (cups_acopy_cb_t)copy_application, (cups_afree_cb_t)free_application);
+  table = atomic_load_explicit(&server->applications, memory_order_relaxed);
+
+  if ((app = find_application(table, client_id)) != NULL)
+  {
+    // Already registered, add the redirection URI if it is new...
+    if (has_redirect_uri(app, redirect_uri))
+    {
+      cupsMutexUnlock(&server->applications_lock);
+      return (app);
+    }
+
+    if ((uri = new_uri(redirect_uri)) == NULL)
+    {
+      cupsMutexUnlock(&server->applications_lock);
+      return (NULL);
+    }
+
+    atomic_store_explicit(&app->last_uri->next, uri, memory_order_release);
+    app->last_uri = uri;
+  }
+  else
+  {
+    // New application, grow the hash table as needed to keep it at most half
+    // full...
+    if (!table || 2 * (table->num_apps + 1) > table->num_slots)
+    {
+      if ((ntable = new_apptable(table)) == NULL)
+      {
+	cupsMutexUnlock(&server->applications_lock);
+	return (NULL);
+      }
+
+      atomic_store_explicit(&server->applications, ntable, memory_order_release);
+      table = ntable;
+    }
 
-  cupsArrayAdd(server->applications, &temp);
+    if ((app = new_application(client_id, redirect_uri, client_name, client_uri, logo_uri, tos_uri)) == NULL)
+    {
+      cupsMutexUnlock(&server->applications_lock);
+      return (NULL);
+    }
 
-  app = (moauthd_application_t *)cupsArrayFind(server->applications, &temp);
+    insert_application(table, app);
+  }
 
   cupsMutexUnlock(&server->applications_lock);
 
+  moauthdJournalApplication(server, app, redirect_uri);
+
   return (app);
 }
 
@@ -89,7 +139,6 @@ moauthdCreateServer(
 		*addr;			// Current address
   char		temp[1024],		// Temporary string
 		*tempptr;		// Pointer into temporary string
-  struct stat	tempinfo;		// Temporary information
   cups_json_t	*json,			// OpenID/RFC 8414 JSON metadata
 		*jarray;		// Array value
   moauthd_resource_t *r;		// Resource
@@ -105,18 +154,22 @@ moauthdCreateServer(
   }
 
   // Allocate a server object and initialize with defaults...
-  server = calloc(1, sizeof(moauthd_server_t));
+  if ((server = new_server()) == NULL)
+  {
+    fprintf(stderr, "moauthd: Unable to allocate server: %s\n", strerror(errno));
+    if (fp)
+      cupsFileClose(fp);
+    return (NULL);
+  }
 
-  cupsMutexInit(&server->applications_lock);
-  cupsRWInit(&server->resources_lock);
-  cupsRWInit(&server->tokens_lock);
+  server->verbosity = verbosity;
 
-  server->introspect_group = -1;	// none
-  server->log_file         = 2;		// stderr
-  server->log_level        = MOAUTHD_LOGLEVEL_ERROR;
-  server->max_grant_life   = 300;	// 5 minutes
-  server->max_token_life   = 604800;	// 1 week
-  server->register_group   = -1;	// none
+  if (configfile && (server->config_file = strdup(configfile)) == NULL)
+  {
+    fprintf(stderr, "moauthd: Unable to allocate configuration filename: %s\n", strerror(errno));
+    cupsFileClose(fp);
+    goto create_failed;
+  }
 
   if (fp)
   {
@@ -128,6 +181,12 @@ moauthdCreateServer(
       goto create_failed;
   }
 
+  if (server->num_peers > 0 && !server->replication_key)
+  {
+    fprintf(stderr, "moauthd: ReplicationKey is required for Peer.\n");
+    goto create_failed;
+  }
+
   if (!server->name)
   {
     char	name[256],		// Host name
@@ -154,6 +213,19 @@ moauthdCreateServer(
   else if (verbosity > 1)
     server->log_level = MOAUTHD_LOGLEVEL_DEBUG;
 
+  // Allocate the validated JWT cache...
+  if (server->jwt_cache_size > 0)
+  {
+    // Round to a whole number of sets...
+    server->jwt_cache_size = (server->jwt_cache_size + MOAUTHD_JWT_CACHE_WAYS - 1) / MOAUTHD_JWT_CACHE_WAYS * MOAUTHD_JWT_CACHE_WAYS;
+
+    if ((server->jwt_cache = calloc(server->jwt_cache_size, sizeof(moauthd_jwtcache_t))) == NULL)
+    {
+      fprintf(stderr, "moauthd: Unable to allocate JWT cache: %s\n", strerror(errno));
+      goto create_failed;
+    }
+  }
+
   // Save state file...
   server->state_file = strdup(statefile);
 
@@ -201,6 +273,9 @@ moauthdCreateServer(
   if (!server->auth_service)
     server->auth_service = strdup("login");
 
+  // Salt for the credential cache...
+  _moauthGetRandomBytes(server->auth_cache_salt, sizeof(server->auth_cache_salt));
+
   cupsSetServerCredentials(getenv("SNAP_DATA"), server->name, true);
 
   // Generate OpenID/RFC 8414 JSON metadata...
@@ -311,6 +386,8 @@ moauthdCreateServer(
   // Authorization Code Flow).
   jarray = cupsJSONNew(json, cupsJSONNewKey(json, NULL, "id_token_signing_alg_values_supported"), CUPS_JTYPE_ARRAY);
   cupsJSONNewString(jarray, NULL, "RS256");
+  if (server->signing_alg != CUPS_JWA_RS256)
+    cupsJSONNewString(jarray, NULL, "ES256");
 
   // claims_supported
   //
@@ -338,6 +415,20 @@ moauthdCreateServer(
   httpAssembleURI(HTTP_URI_CODING_ALL, temp, sizeof(temp), "https", /*userpass*/NULL, server->name, server->port, "/introspect");
   cupsJSONNewString(json, cupsJSONNewKey(json, NULL, "introspection_endpoint"), temp);
 
+  // revocation_endpoint
+  //
+  // URL of the authorization server's OAuth 2.0 revocation endpoint [RFC8414]
+  // [RFC7009].
+  httpAssembleURI(HTTP_URI_CODING_ALL, temp, sizeof(temp), "https", /*userpass*/NULL, server->name, server->port, "/revoke");
+  cupsJSONNewString(json, cupsJSONNewKey(json, NULL, "revocation_endpoint"), temp);
+
+  // revocation_endpoint_auth_methods_supported
+  //
+  // List of client authentication methods supported by the revocation
+  // endpoint [RFC8414].  Clients are public, so "none".
+  jarray = cupsJSONNew(json, cupsJSONNewKey(json, NULL, "revocation_endpoint_auth_methods_supported"), CUPS_JTYPE_ARRAY);
+  cupsJSONNewString(jarray, NULL, "none");
+
   // grant_types_supported
   //
   // OPTIONAL. JSON array containing a list of the OAuth 2.0 Grant Type values
@@ -359,6 +450,8 @@ moauthdCreateServer(
   jarray = cupsJSONNew(json, cupsJSONNewKey(json, NULL, "keys"), CUPS_JTYPE_ARRAY);
   cupsJSONAdd(jarray, NULL, cupsJWTMakePublicKey(server->private_key));
 
+  server->public_jwk = cupsJWTMakePublicKey(server->private_key);
+
   server->public_key = cupsJSONExportString(json);
   cupsJSONDelete(json);
 
@@ -375,45 +468,8 @@ moauthdCreateServer(
     server->secret = strdup(temp);
   }
 
-  // Add RFC 8414 configuration file.
-  r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/.well-known/oauth-authorization-server", NULL, "text/json", "public");
-  r->data   = server->metadata;
-  r->length = strlen(server->metadata);
-
-  // Add OpenID configuration file.
-  r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/.well-known/openid-configuration", NULL, "text/json", "public");
-  r->data   = server->metadata;
-  r->length = strlen(server->metadata);
-
-  // Add JWKS file.
-  r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/.well-known/jwks.json", NULL, "text/json", "public");
-  r->data   = server->public_key;
-  r->length = strlen(server->public_key);
-
-  // Add other standard resources...
-  if (!moauthdFindResource(server, "/index.html", temp, sizeof(temp), &tempinfo) && !moauthdFindResource(server, "/index.md", temp, sizeof(temp), &tempinfo))
-  {
-    // Add default home page file...
-    r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/index.md", NULL, "text/markdown", "public");
-    r->data   = index_md;
-    r->length = strlen(index_md);
-  }
-
-  if (!moauthdFindResource(server, "/moauth.png", temp, sizeof(temp), &tempinfo))
-  {
-    // Add default moauth.png file...
-    r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/moauth.png", NULL, "image/png", "public");
-    r->data   = moauth_png;
-    r->length = sizeof(moauth_png);
-  }
-
-  if (!moauthdFindResource(server, "/style.css", temp, sizeof(temp), &tempinfo))
-  {
-    // Add default style.css file...
-    r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/style.css", NULL, "text/css", "public");
-    r->data   = style_css;
-    r->length = strlen(style_css);
-  }
+  // Add the well-known and default resources...
+  add_resources(server, server->metadata, server->public_key);
 
   // Return the server object...
   return (server);
@@ -436,25 +492,91 @@ void
 moauthdDeleteServer(
     moauthd_server_t *server)		// I - Server object
 {
-  int	i;				// Looping var
+  int			i;		// Looping var
+  size_t		j;		// Looping var
+  moauthd_apptable_t	*table,		// Application hash table
+			*prev;		// Previous (retired) table
+  moauthd_application_t	*app;		// Current application
 
 
   free(server->name);
+  free(server->config_file);
   free(server->state_file);
   free(server->auth_service);
 
   for (i = 0; i < server->num_listeners; i ++)
     httpAddrClose(NULL, server->listeners[i].fd);
 
-  cupsArrayDelete(server->applications);
-  cupsArrayDelete(server->resources);
-  cupsArrayDelete(server->tokens);
+  if ((table = atomic_load_explicit(&server->applications, memory_order_relaxed)) != NULL)
+  {
+    for (j = 0; j < table->num_slots; j ++)
+    {
+      if ((app = atomic_load_explicit(table->slots + j, memory_order_relaxed)) != NULL)
+        free_application(app);
+    }
+
+    for (; table; table = prev)
+    {
+      prev = table->prev;
+      free(table);
+    }
+  }
+
+  moauthdDeleteResources(server);
+  moauthdDeleteTokens(server);
 
   cupsMutexDestroy(&server->applications_lock);
   cupsRWDestroy(&server->resources_lock);
-  cupsRWDestroy(&server->tokens_lock);
+  moauthdFlushMarkdown(server);
+  cupsArrayDelete(server->markdown_cache);
+  cupsMutexDestroy(&server->markdown_lock);
+  moauthdFlushFiles(server);
+  cupsArrayDelete(server->file_cache);
+  cupsMutexDestroy(&server->file_lock);
+
+  for (i = 0; i < MOAUTHD_TOKEN_SHARDS; i ++)
+    cupsRWDestroy(&server->tokens[i].lock);
+
+  cupsMutexDestroy(&server->expiry_lock);
+  cupsCondDestroy(&server->expiry_cond);
+  cupsMutexDestroy(&server->journal_lock);
+  cupsRWDestroy(&server->revoked_lock);
+  cupsMutexDestroy(&server->replicate_lock);
+  cupsCondDestroy(&server->replicate_cond);
+
+  for (i = 0; i < server->num_peers; i ++)
+  {
+    free(server->peers[i].uri);
+    free(server->peers[i].certificate);
+    free(server->peers[i].queue);
+  }
+
+  free(server->replication_key);
+
+  for (i = 0; i < (int)server->jwt_cache_size; i ++)
+  {
+    if (server->jwt_cache[i].token)
+      moauthdReleaseToken(server, server->jwt_cache[i].token);
+  }
+
+  free(server->jwt_cache);
+  cupsMutexDestroy(&server->jwt_cache_lock);
+  cupsMutexDestroy(&server->auth_cache_lock);
+  cupsMutexDestroy(&server->clients_lock);
+  cupsCondDestroy(&server->clients_cond);
+  cupsMutexDestroy(&server->log_buffer.lock);
+  cupsCondDestroy(&server->log_buffer.cond);
+  cupsMutexDestroy(&server->access_buffer.lock);
+  cupsCondDestroy(&server->access_buffer.cond);
+
+  free(server->expiry);
+
+  if (server->journal_fd >= 0)
+    close(server->journal_fd);
+  free(server->journal_file);
 
   cupsJSONDelete(server->private_key);
+  cupsJSONDelete(server->public_jwk);
 
   free(server->public_key);
   free(server->test_password);
@@ -467,6 +589,9 @@ moauthdDeleteServer(
 //
 // 'moauthdFindApplication()' - Find an application by its client ID.
 //
+// When a redirection URI is specified, it must be one of the URIs registered
+// for the application.  No locks are taken.
+//
 
 moauthd_application_t *			// O - Matching application, if any
 moauthdFindApplication(
@@ -474,96 +599,129 @@ moauthdFindApplication(
     const char       *client_id,	// I - Client ID
     const char       *redirect_uri)	// I - Redirect URI or NULL
 {
-  moauthd_application_t	*app,		// Matching application
-			key;		// Search key
-
-
-  cupsMutexLock(&server->applications_lock);
-
-  if (redirect_uri)
-  {
-    // Exact match...
-    key.client_id    = (char *)client_id;
-    key.redirect_uri = (char *)redirect_uri;
+  moauthd_application_t	*app;		// Matching application
 
-    app = (moauthd_application_t *)cupsArrayFind(server->applications, &key);
-  }
-  else
-  {
-    // First matching client ID...
-    for (app = (moauthd_application_t *)cupsArrayGetFirst(server->applications); app; app = (moauthd_application_t *)cupsArrayGetNext(server->applications))
-    {
-      if (!strcmp(app->client_id, client_id))
-        break;
-    }
-  }
 
-  cupsMutexUnlock(&server->applications_lock);
+  if ((app = find_application(atomic_load_explicit(&server->applications, memory_order_acquire), client_id)) != NULL && redirect_uri && !has_redirect_uri(app, redirect_uri))
+    app = NULL;
 
   return (app);
 }
 
 
 //
-// 'moauthdRunServer()' - Listen for client connections and process requests.
+// 'moauthdReloadServer()' - Reload the configuration file.
+//
+// The configuration is loaded into a scratch server object and the new
+// resources, applications, and settings are then moved into the running
+// server.  Issued tokens, connections, and TLS credentials are kept.  Removed
+// applications stay registered since tokens refer to them, and directives that
+// open files, size caches or thread pools, or change the server name, signing
+// key, or replication peers only take effect on restart.
 //
 
-int					// O - Exit status
-moauthdRunServer(
+bool					// O - `true` on success, `false` on error
+moauthdReloadServer(
     moauthd_server_t *server)		// I - Server object
 {
-  bool	done = false;			// Are we done yet?
+  cups_file_t		*fp;		// Configuration file
+  moauthd_server_t	*temp;		// Scratch server object
+  bool			status;		// Load status
+  size_t		i;		// Looping var
+  moauthd_apptable_t	*table;		// New application hash table
+  moauthd_application_t	*app;		// Current application
+  moauthd_uri_t		*uri;		// Current redirection URI
 
 
-  if (!server)
-    return (1);
+  if (!server->config_file)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "No configuration file to reload.");
+    return (true);
+  }
 
-  moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Listening for client connections.");
+  moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Reloading configuration file \"%s\".", server->config_file);
 
-  while (!done)
+  if ((fp = cupsFileOpen(server->config_file, "r")) == NULL)
   {
-    if (poll(server->listeners, server->num_listeners, -1) < 0)
-    {
-      if (errno != EAGAIN && errno != EINTR)
-      {
-        moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "poll() failed: %s", strerror(errno));
-        done = true;
-      }
-    }
-    else
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to open configuration file \"%s\": %s", server->config_file, strerror(errno));
+    return (false);
+  }
+
+  if ((temp = new_server()) == NULL)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate server: %s", strerror(errno));
+    cupsFileClose(fp);
+    return (false);
+  }
+
+  status = load_config(temp, server->config_file, fp);
+
+  cupsFileClose(fp);
+
+  // Close any log files opened by the new configuration and make sure the
+  // scratch server has no JWT cache to release...
+  if (temp->access_file >= 0)
+    close(temp->access_file);
+  if (temp->log_file > 2)
+    close(temp->log_file);
+
+  temp->access_file    = -1;
+  temp->log_file       = -1;
+  temp->jwt_cache_size = 0;
+
+  if (!status)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to load configuration file \"%s\", keeping the current configuration.", server->config_file);
+    moauthdDeleteServer(temp);
+    return (false);
+  }
+
+  // Swap in the new resources...
+  add_resources(temp, server->metadata, server->public_key);
+
+  if (!moauthdReplaceResources(server, temp))
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to replace resources: %s", strerror(errno));
+    moauthdDeleteServer(temp);
+    return (false);
+  }
+
+  // Add new applications and redirection URIs...
+  if ((table = atomic_load_explicit(&temp->applications, memory_order_relaxed)) != NULL)
+  {
+    for (i = 0; i < table->num_slots; i ++)
     {
-      int		i;		// Looping var
-      struct pollfd	*lis;		// Current listener
+      if ((app = atomic_load_explicit(table->slots + i, memory_order_relaxed)) == NULL)
+        continue;
 
-      for (i = server->num_listeners, lis = server->listeners; i > 0; i --, lis ++)
-      {
-        if (lis->revents & POLLIN)
-	{
-	  moauthd_client_t *client = moauthdCreateClient(server, lis->fd);
-					// New client
-
-          if (client)
-          {
-            cups_thread_t tid;		// New processing thread
-
-            if ((tid = cupsThreadCreate((void *(*)(void *))moauthdRunClient, client)) == CUPS_THREAD_INVALID)
-            {
-              // Unable to create client thread...
-              moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create client processing thread: %s", strerror(errno));
-              moauthdDeleteClient(client);
-	    }
-	    else
-	    {
-	      // Client thread created, detach!
-	      cupsThreadDetach(tid);
-	    }
-          }
-	}
-      }
+      for (uri = app->redirect_uris; uri; uri = atomic_load_explicit(&uri->next, memory_order_relaxed))
+        moauthdAddApplication(server, app->client_id, uri->uri, app->client_name, app->client_uri, app->logo_uri, app->tos_uri);
     }
   }
 
-  return (0);
+  // Copy the settings that can change while running...
+  if (server->verbosity == 1 && temp->log_level < MOAUTHD_LOGLEVEL_DEBUG)
+    temp->log_level ++;
+  else if (server->verbosity > 1)
+    temp->log_level = MOAUTHD_LOGLEVEL_DEBUG;
+
+  // Workers read these without locking, so they are atomic...
+  atomic_store_explicit(&server->auth_cache_life, temp->auth_cache_life, memory_order_relaxed);
+  atomic_store_explicit(&server->group_cache_life, temp->group_cache_life, memory_order_relaxed);
+  atomic_store_explicit(&server->introspect_group, temp->introspect_group, memory_order_relaxed);
+  atomic_store_explicit(&server->keep_alive_timeout, temp->keep_alive_timeout, memory_order_relaxed);
+  atomic_store_explicit(&server->log_level, temp->log_level, memory_order_relaxed);
+  atomic_store_explicit(&server->max_grant_life, temp->max_grant_life, memory_order_relaxed);
+  atomic_store_explicit(&server->max_token_life, temp->max_token_life, memory_order_relaxed);
+  atomic_store_explicit(&server->metrics_group, temp->metrics_group, memory_order_relaxed);
+  atomic_store_explicit(&server->options, temp->options, memory_order_relaxed);
+  atomic_store_explicit(&server->register_group, temp->register_group, memory_order_relaxed);
+
+  moauthdDeleteServer(temp);
+
+  moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Reloaded configuration file \"%s\".", server->config_file);
+
+  return (true);
 }
 
 
@@ -622,45 +780,93 @@ moauthdSaveServer(
 
 
 //
-// 'compare_applications()' - Compare two application registrations.
+// 'add_resources()' - Add the well-known and default resources.
+//
+// The home page, logo, and style sheet are only added when the configuration
+// does not provide them.
 //
 
-static int				// O - Result of comparison
-compare_applications(
-    moauthd_application_t *a,		// I - First application
-    moauthd_application_t *b)		// I - Second application
+static void
+add_resources(
+    moauthd_server_t *server,		// I - Server object
+    const char       *metadata,		// I - OpenID/RFC 8414 JSON metadata
+    const char       *public_key)	// I - JSON Web Key Set
 {
-  return (strcmp(a->client_id, b->client_id));
+  moauthd_resource_t	*r;		// Resource
+  char			temp[1024];	// Temporary filename
+  struct stat		tempinfo;	// Temporary information
+
+
+  // Add RFC 8414 configuration file.
+  r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/.well-known/oauth-authorization-server", NULL, "text/json", "public");
+  r->data   = metadata;
+  r->length = strlen(metadata);
+
+  // Add OpenID configuration file.
+  r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/.well-known/openid-configuration", NULL, "text/json", "public");
+  r->data   = metadata;
+  r->length = strlen(metadata);
+
+  // Add JWKS file.
+  r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/.well-known/jwks.json", NULL, "text/json", "public");
+  r->data   = public_key;
+  r->length = strlen(public_key);
+
+  // Add other standard resources...
+  if (!moauthdFindResource(server, "/index.html", temp, sizeof(temp), &tempinfo) && !moauthdFindResource(server, "/index.md", temp, sizeof(temp), &tempinfo))
+  {
+    // Add default home page file...
+    r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/index.md", NULL, "text/markdown", "public");
+    r->data   = index_md;
+    r->length = strlen(index_md);
+  }
+
+  if (!moauthdFindResource(server, "/moauth.png", temp, sizeof(temp), &tempinfo))
+  {
+    // Add default moauth.png file...
+    r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/moauth.png", NULL, "image/png", "public");
+    r->data   = moauth_png;
+    r->length = sizeof(moauth_png);
+  }
+
+  if (!moauthdFindResource(server, "/style.css", temp, sizeof(temp), &tempinfo))
+  {
+    // Add default style.css file...
+    r = moauthdCreateResource(server, MOAUTHD_RESTYPE_STATIC_FILE, "/style.css", NULL, "text/css", "public");
+    r->data   = style_css;
+    r->length = strlen(style_css);
+  }
 }
 
 
 //
-// 'copy_application()' - Make a copy of an application object.
+// 'find_application()' - Find an application in a hash table.
 //
 
-static moauthd_application_t *		// O - New application object
-copy_application(
-    moauthd_application_t *a)		// I - Application object
+static moauthd_application_t *		// O - Matching application or `NULL`
+find_application(
+    moauthd_apptable_t *table,		// I - Hash table or `NULL`
+    const char         *client_id)	// I - Client ID
 {
-  moauthd_application_t	*na;		// New application object
+  size_t		i,		// Current slot
+			mask;		// Slot mask
+  moauthd_application_t	*app;		// Current application
+
 
+  if (!table || !client_id)
+    return (NULL);
+
+  // Probe until we find the client ID or an empty slot - the table is never
+  // more than half full...
+  mask = table->num_slots - 1;
 
-  if ((na = (moauthd_application_t *)calloc(1, sizeof(moauthd_application_t))) != NULL)
+  for (i = (size_t)hash_client_id(client_id) & mask; (app = atomic_load_explicit(table->slots + i, memory_order_acquire)) != NULL; i = (i + 1) & mask)
   {
-    na->client_id    = strdup(a->client_id);
-    na->redirect_uri = strdup(a->redirect_uri);
-
-    if (a->client_name)
-      na->client_name = strdup(a->client_name);
-    if (a->client_uri)
-      na->client_uri = strdup(a->client_uri);
-    if (a->logo_uri)
-      na->logo_uri = strdup(a->logo_uri);
-    if (a->tos_uri)
-      na->tos_uri = strdup(a->tos_uri);
+    if (!strcmp(app->client_id, client_id))
+      return (app);
   }
 
-  return (na);
+  return (NULL);
 }
 
 
@@ -672,6 +878,16 @@ static void
 free_application(
     moauthd_application_t *a)		// I - Application object
 {
+  moauthd_uri_t	*uri,			// Current redirection URI
+		*next;			// Next redirection URI
+
+
+  for (uri = a->redirect_uris; uri; uri = next)
+  {
+    next = atomic_load_explicit(&uri->next, memory_order_relaxed);
+    free(uri);
+  }
+
   free(a->client_id);
   free(a->redirect_uri);
   free(a->client_name);
@@ -701,13 +917,104 @@ get_seconds(const char *value)		// I - Value string
     tval *= 86400;
   else if (!strcasecmp(units, "w"))
     tval *= 604800;
-  else
+  else if (*units)
     tval = -1;
 
   return (tval);
 }
 
 
+//
+// 'has_redirect_uri()' - Determine whether a redirection URI is registered for
+//                        an application.
+//
+
+static bool				// O - `true` if present, `false` otherwise
+has_redirect_uri(
+    moauthd_application_t *app,		// I - Application
+    const char            *redirect_uri)// I - Redirection URI
+{
+  moauthd_uri_t	*uri;			// Current redirection URI
+
+
+  for (uri = app->redirect_uris; uri; uri = atomic_load_explicit(&uri->next, memory_order_acquire))
+  {
+    if (!strcmp(uri->uri, redirect_uri))
+      return (true);
+  }
+
+  return (false);
+}
+
+
+//
+// 'hash_client_id()' - Compute the FNV-1a hash of a client ID.
+//
+
+static uint64_t				// O - Hash value
+hash_client_id(const char *s)		// I - Client ID
+{
+  uint64_t	hash = 0xcbf29ce484222325ULL;
+					// Hash value
+
+
+  while (*s)
+  {
+    hash ^= (uint64_t)(*s++ & 255);
+    hash *= 0x100000001b3ULL;
+  }
+
+  return (hash);
+}
+
+
+//
+// 'insert_application()' - Publish an application in a hash table.
+//
+// The caller must hold `applications_lock`.
+//
+
+static void
+insert_application(
+    moauthd_apptable_t    *table,	// I - Hash table
+    moauthd_application_t *app)		// I - Application
+{
+  size_t	i,			// Current slot
+		mask = table->num_slots - 1;
+					// Slot mask
+
+
+  for (i = (size_t)hash_client_id(app->client_id) & mask; atomic_load_explicit(table->slots + i, memory_order_relaxed); i = (i + 1) & mask);
+
+  atomic_store_explicit(table->slots + i, app, memory_order_release);
+  table->num_apps ++;
+}
+
+
+//
+// 'key_matches_alg()' - Determine whether a private key can be used with an
+//                       algorithm.
+//
+
+static bool				// O - `true` if the key matches, `false` otherwise
+key_matches_alg(cups_json_t *jwk,	// I - JSON Web Key
+                cups_jwa_t  alg)	// I - Signing algorithm
+{
+  const char	*kty = cupsJSONGetString(cupsJSONFind(jwk, "kty")),
+					// Key type
+		*crv = cupsJSONGetString(cupsJSONFind(jwk, "crv"));
+					// Elliptic curve
+
+
+  if (!kty)
+    return (false);
+  else if (alg == CUPS_JWA_ES256)
+    return (!strcmp(kty, "EC") && crv && !strcmp(crv, "P-256"));
+  else
+    return (!strcmp(kty, "RSA"));
+}
+
+
 //
 // 'load_config()' - Load the server configuration.
 //
@@ -728,7 +1035,25 @@ load_config(
   // Load configuration from file...
   while (cupsFileGetConf(fp, line, sizeof(line), &value, &linenum))
   {
-    if (!strcasecmp(line, "Application"))
+    if (!strcasecmp(line, "AccessLog"))
+    {
+      // AccessLog {filename,none}
+      if (!value)
+      {
+	fprintf(stderr, "moauthd: Missing access log filename on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+      else if (!strcmp(value, "none"))
+      {
+	server->access_file = -1;
+      }
+      else if ((server->access_file = open(value, O_WRONLY | O_CREAT | O_APPEND, 0600)) < 0)
+      {
+	fprintf(stderr, "moauthd: Unable to open access log file \"%s\" on line %d of \"%s\": %s\n", value, linenum, configfile, strerror(errno));
+	return (false);
+      }
+    }
+    else if (!strcasecmp(line, "Application"))
     {
       // Application client-id redirect-uri client-name
       const char	*client_id,	// Client ID
@@ -763,6 +1088,64 @@ load_config(
 
       moauthdAddApplication(server, client_id, redirect_uri, client_name, NULL, NULL, NULL);
     }
+    else if (!strcasecmp(line, "AuthCacheLife"))
+    {
+      // AuthCacheLife NNN{m,h,d,w}
+      //
+      // Time to cache successful username/password authentications.  0 disables the cache.
+      int	auth_cache_life;	// Cache life value
+
+      if (!value)
+      {
+	fprintf(stderr, "moauthd: Missing time value on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+
+      if ((auth_cache_life = get_seconds(value)) < 0)
+      {
+	fprintf(stderr, "moauthd: Unknown time value \"%s\" on line %d of \"%s\".\n", value, linenum, configfile);
+	return (false);
+      }
+
+      server->auth_cache_life = auth_cache_life;
+    }
+    else if (!strcasecmp(line, "JWTCacheSize"))
+    {
+      // JWTCacheSize NNN
+      //
+      // Number of validated JWTs to cache, 0 to disable.
+      int	jwt_cache_size;		// Number of cache entries
+
+      if (!value || !isdigit(*value) || (jwt_cache_size = atoi(value)) < 0)
+      {
+	fprintf(stderr, "moauthd: Bad JWTCacheSize on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+
+      server->jwt_cache_size = (size_t)jwt_cache_size;
+    }
+    else if (!strcasecmp(line, "KeepAliveTimeout"))
+    {
+      // KeepAliveTimeout NNN{m,h,d,w}
+      //
+      // Default units are seconds.  "m" is minutes, "h" is hours, "d" is days,
+      // and "w" is weeks.  0 disables the timeout.
+      int	keep_alive_timeout;	// Keep-alive timeout value
+
+      if (!value)
+      {
+	fprintf(stderr, "moauthd: Missing time value on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+
+      if ((keep_alive_timeout = get_seconds(value)) < 0)
+      {
+	fprintf(stderr, "moauthd: Unknown time value \"%s\" on line %d of \"%s\".\n", value, linenum, configfile);
+	return (false);
+      }
+
+      server->keep_alive_timeout = keep_alive_timeout;
+    }
     else if (!strcasecmp(line, "LogFile"))
     {
       // LogFile {filename,none,stderr,syslog}
@@ -804,6 +1187,27 @@ load_config(
 	fprintf(stderr, "moauthd: Unknown LogLevel \"%s\" on line %d of \"%s\" ignored.\n", value, linenum, configfile);
       }
     }
+    else if (!strcasecmp(line, "GroupCacheLife"))
+    {
+      // GroupCacheLife NNN{m,h,d,w}
+      //
+      // Time to cache the list of groups for a user.  0 disables the cache.
+      int	group_cache_life;	// Cache life value
+
+      if (!value)
+      {
+	fprintf(stderr, "moauthd: Missing time value on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+
+      if ((group_cache_life = get_seconds(value)) < 0)
+      {
+	fprintf(stderr, "moauthd: Unknown time value \"%s\" on line %d of \"%s\".\n", value, linenum, configfile);
+	return (false);
+      }
+
+      server->group_cache_life = group_cache_life;
+    }
     else if (!strcasecmp(line, "IntrospectGroup"))
     {
       // IntrospectGroup nnn
@@ -836,6 +1240,38 @@ load_config(
 	return (false);
       }
     }
+    else if (!strcasecmp(line, "MetricsGroup"))
+    {
+      // MetricsGroup nnn
+      // MetricsGroup name
+      //
+      // Required group membership (and thus required authentication for)
+      // the metrics endpoint.
+      if (!value)
+      {
+	fprintf(stderr, "moauthd: Missing MetricsGroup on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+      else if (isdigit(*value))
+      {
+	server->metrics_group = (gid_t)strtol(value, &ptr, 10);
+
+	if (ptr && *ptr)
+	{
+	  fprintf(stderr, "moauthd: Bad MetricsGroup \"%s\" on line %d of \"%s\".\n", value, linenum, configfile);
+	  return (false);
+	}
+      }
+      else if ((group = getgrnam(value)) != NULL)
+      {
+	server->metrics_group = group->gr_gid;
+      }
+      else
+      {
+	fprintf(stderr, "moauthd: Unknown MetricsGroup \"%s\" on line %d of \"%s\".\n", value, linenum, configfile);
+	return (false);
+      }
+    }
     else if (!strcasecmp(line, "RegisterGroup"))
     {
       // RegisterGroup nnn
@@ -868,6 +1304,21 @@ load_config(
 	return (false);
       }
     }
+    else if (!strcasecmp(line, "MaxClients"))
+    {
+      // MaxClients NNN
+      //
+      // Maximum number of simultaneous client connections.
+      int	max_clients;		// Maximum number of clients
+
+      if (!value || (max_clients = atoi(value)) <= 0)
+      {
+	fprintf(stderr, "moauthd: Bad MaxClients on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+
+      server->max_clients = max_clients;
+    }
     else if (!strcasecmp(line, "MaxGrantLife"))
     {
       // MaxGrantLife NNN{m,h,d,w}
@@ -914,7 +1365,7 @@ load_config(
     }
     else if (!strcasecmp(line, "Option"))
     {
-      // Option {[-]BasicAuth}
+      // Option {BasicAuth,StatelessTokens}
       if (!value)
       {
 	fprintf(stderr, "moauthd: Bad Option on line %d of \"%s\".\n", linenum, configfile);
@@ -923,9 +1374,87 @@ load_config(
 
       if (!strcasecmp(value, "BasicAuth"))
 	server->options |= MOAUTHD_OPTION_BASIC_AUTH;
+      else if (!strcasecmp(value, "StatelessTokens"))
+	server->options |= MOAUTHD_OPTION_STATELESS_TOKENS;
       else
 	fprintf(stderr, "moauthd: Unknown Option %s on line %d of \"%s\".\n", value, linenum, configfile);
     }
+    else if (!strcasecmp(line, "Peer"))
+    {
+      // Peer https://hostname[:port] [certificate-file]
+      //
+      // Another moauthd server to replicate tokens and applications to,
+      // optionally pinning the peer's X.509 certificate.
+      moauthd_peer_t	*peer;		// New peer
+      char		scheme[32],	// URI scheme
+			userpass[256],	// Username:password (unused)
+			resource[256],	// Resource path (unused)
+			*certfile;	// Certificate file, if any
+
+      if (!value)
+      {
+	fprintf(stderr, "moauthd: Missing Peer URI on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+      else if (server->num_peers >= MOAUTHD_MAX_PEERS)
+      {
+	fprintf(stderr, "moauthd: Too many Peer directives on line %d of \"%s\" (maximum %d).\n", linenum, configfile, MOAUTHD_MAX_PEERS);
+	return (false);
+      }
+
+      peer = server->peers + server->num_peers;
+
+      ptr = value;
+      while (*ptr && !isspace(*ptr))
+	ptr ++;
+      while (*ptr && isspace(*ptr))
+	*ptr++ = '\0';
+
+      certfile = *ptr ? ptr : NULL;
+
+      if (httpSeparateURI(HTTP_URI_CODING_ALL, value, scheme, sizeof(scheme), userpass, sizeof(userpass), peer->host, sizeof(peer->host), &peer->port, resource, sizeof(resource)) < HTTP_URI_STATUS_OK || strcmp(scheme, "https"))
+      {
+	fprintf(stderr, "moauthd: Bad Peer URI \"%s\" on line %d of \"%s\".\n", value, linenum, configfile);
+	return (false);
+      }
+
+      if ((peer->uri = strdup(value)) == NULL)
+      {
+	fprintf(stderr, "moauthd: Unable to allocate memory for Peer on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+
+      if (certfile && ((peer->certificate = read_file(certfile, 65536)) == NULL || !strstr(peer->certificate, "-----BEGIN CERTIFICATE-----")))
+      {
+	fprintf(stderr, "moauthd: Unable to load Peer certificate \"%s\" on line %d of \"%s\".\n", certfile, linenum, configfile);
+	free(peer->uri);
+	free(peer->certificate);
+	peer->uri         = NULL;
+	peer->certificate = NULL;
+	return (false);
+      }
+
+      server->num_peers ++;
+    }
+    else if (!strcasecmp(line, "ReplicationKey"))
+    {
+      // ReplicationKey secret
+      //
+      // Shared key used to sign replication requests between peers.
+      if (!value || strlen(value) < 16)
+      {
+	fprintf(stderr, "moauthd: ReplicationKey on line %d of \"%s\" must be at least 16 characters.\n", linenum, configfile);
+	return (false);
+      }
+
+      free(server->replication_key);
+
+      if ((server->replication_key = strdup(value)) == NULL)
+      {
+	fprintf(stderr, "moauthd: Unable to allocate memory for ReplicationKey on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+    }
     else if (!strcasecmp(line, "Resource"))
     {
       // Resource {public,private,shared} /remote/path /local/path
@@ -982,6 +1511,25 @@ load_config(
         return (false);
       }
     }
+    else if (!strcasecmp(line, "SigningAlgorithm"))
+    {
+      // SigningAlgorithm {RS256,ES256}
+      //
+      // Algorithm used to sign tokens.
+      if (value && !strcasecmp(value, "RS256"))
+      {
+	server->signing_alg = CUPS_JWA_RS256;
+      }
+      else if (value && !strcasecmp(value, "ES256"))
+      {
+	server->signing_alg = CUPS_JWA_ES256;
+      }
+      else
+      {
+	fprintf(stderr, "moauthd: Bad SigningAlgorithm on line %d of \"%s\".\n", linenum, configfile);
+	return (false);
+      }
+    }
     else if (!strcasecmp(line, "TestPassword"))
     {
       if (value)
@@ -994,6 +1542,21 @@ load_config(
 	return (false);
       }
     }
+    else if (!strcasecmp(line, "Workers"))
+    {
+      // Workers NNN
+      //
+      // Number of worker threads processing client requests.
+      int	num_workers;		// Number of worker threads
+
+      if (!value || (num_workers = atoi(value)) <= 0 || num_workers > MOAUTHD_MAX_WORKERS)
+      {
+	fprintf(stderr, "moauthd: Bad Workers on line %d of \"%s\" (must be between 1 and %d).\n", linenum, configfile, MOAUTHD_MAX_WORKERS);
+	return (false);
+      }
+
+      server->num_workers = num_workers;
+    }
     else
     {
       fprintf(stderr, "moauthd: Unknown configuration directive \"%s\" on line %d of \"%s\" ignored.\n", line, linenum, configfile);
@@ -1027,20 +1590,233 @@ load_state(moauthd_server_t *server)	// I - Server
     }
 
     // No file means we need to generate the private key...
-    server->private_key = cupsJWTMakePrivateKey(CUPS_JWA_RS256);
-    return (server->private_key != NULL && moauthdSaveServer(server));
+    server->private_key = cupsJWTMakePrivateKey(server->signing_alg);
+    if (!server->private_key || !moauthdSaveServer(server))
+      return (false);
   }
+  else
+  {
+    // Read lines from the state file...
+    while (cupsFileGetConf(fp, line, sizeof(line), &value, &linenum))
+    {
+      if (!strcmp(line, "PrivateKey") && value)
+	server->private_key = cupsJSONImportString(value);
+      else
+	fprintf(stderr, "moauthd: Unknown state directive \"%s\" on line %d of \"%s\".\n", line, linenum, server->state_file);
+    }
 
-  // Read lines from the state file...
-  while (cupsFileGetConf(fp, line, sizeof(line), &value, &linenum))
+    cupsFileClose(fp);
+
+    if (!server->private_key)
+      return (false);
+
+    if (!key_matches_alg(server->private_key, server->signing_alg))
+    {
+      // SigningAlgorithm has changed, generate a new private key...
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_INFO, "Generating new private key for SigningAlgorithm.");
+
+      cupsJSONDelete(server->private_key);
+      server->private_key = cupsJWTMakePrivateKey(server->signing_alg);
+      if (!server->private_key || !moauthdSaveServer(server))
+        return (false);
+    }
+  }
+
+  // Load the issued tokens and registered applications...
+  return (moauthdLoadJournal(server));
+}
+
+
+//
+// 'new_application()' - Create a new application object.
+//
+
+static moauthd_application_t *		// O - New application object
+new_application(
+    const char *client_id,		// I - Client ID
+    const char *redirect_uri,		// I - Redirection URI
+    const char *client_name,		// I - Human-readable name or `NULL` for none
+    const char *client_uri,		// I - Web page or `NULL` for none
+    const char *logo_uri,		// I - Logo URI or `NULL` for none
+    const char *tos_uri)		// I - Terms-of-service URI or `NULL` for none
+{
+  moauthd_application_t	*app;		// New application object
+
+
+  if ((app = (moauthd_application_t *)calloc(1, sizeof(moauthd_application_t))) == NULL)
+    return (NULL);
+
+  if ((app->redirect_uris = new_uri(redirect_uri)) == NULL)
   {
-    if (!strcmp(line, "PrivateKey") && value)
-      server->private_key = cupsJSONImportString(value);
-    else
-      fprintf(stderr, "moauthd: Unknown state directive \"%s\" on line %d of \"%s\".\n", line, linenum, server->state_file);
+    free(app);
+    return (NULL);
+  }
+
+  app->last_uri = app->redirect_uris;
+
+  app->client_id    = strdup(client_id);
+  app->redirect_uri = strdup(redirect_uri);
+
+  if (client_name)
+    app->client_name = strdup(client_name);
+  if (client_uri)
+    app->client_uri = strdup(client_uri);
+  if (logo_uri)
+    app->logo_uri = strdup(logo_uri);
+  if (tos_uri)
+    app->tos_uri = strdup(tos_uri);
+
+  return (app);
+}
+
+
+//
+// 'new_apptable()' - Create a larger copy of an application hash table.
+//
+// The old table is retired but stays valid for readers that loaded it.
+//
+
+static moauthd_apptable_t *		// O - New hash table or `NULL` on error
+new_apptable(
+    moauthd_apptable_t *table)		// I - Current hash table or `NULL`
+{
+  size_t		i,		// Looping var
+			num_slots;	// Number of slots
+  moauthd_apptable_t	*ntable;	// New hash table
+  moauthd_application_t	*app;		// Current application
+
+
+  num_slots = table ? 2 * table->num_slots : MOAUTHD_APP_SLOTS;
+
+  if ((ntable = (moauthd_apptable_t *)calloc(1, sizeof(moauthd_apptable_t) + num_slots * sizeof(ntable->slots[0]))) == NULL)
+    return (NULL);
+
+  ntable->prev      = table;
+  ntable->num_slots = num_slots;
+
+  for (i = 0; table && i < table->num_slots; i ++)
+  {
+    if ((app = atomic_load_explicit(table->slots + i, memory_order_relaxed)) != NULL)
+      insert_application(ntable, app);
   }
 
+  return (ntable);
+}
+
+
+//
+// 'new_server()' - Allocate a server object with the default settings.
+//
+
+static moauthd_server_t *		// O - New server object or `NULL` on error
+new_server(void)
+{
+  moauthd_server_t	*server;	// Server object
+  int			i;		// Looping var
+
+
+  if ((server = calloc(1, sizeof(moauthd_server_t))) == NULL)
+    return (NULL);
+
+  cupsMutexInit(&server->applications_lock);
+  cupsRWInit(&server->resources_lock);
+  cupsMutexInit(&server->markdown_lock);
+  cupsMutexInit(&server->file_lock);
+
+  for (i = 0; i < MOAUTHD_TOKEN_SHARDS; i ++)
+    cupsRWInit(&server->tokens[i].lock);
+
+  cupsMutexInit(&server->expiry_lock);
+  cupsCondInit(&server->expiry_cond);
+  cupsMutexInit(&server->journal_lock);
+  cupsRWInit(&server->revoked_lock);
+  cupsMutexInit(&server->replicate_lock);
+  cupsCondInit(&server->replicate_cond);
+  cupsMutexInit(&server->auth_cache_lock);
+  cupsMutexInit(&server->jwt_cache_lock);
+  cupsMutexInit(&server->clients_lock);
+  cupsCondInit(&server->clients_cond);
+  cupsMutexInit(&server->log_buffer.lock);
+  cupsCondInit(&server->log_buffer.cond);
+  cupsMutexInit(&server->access_buffer.lock);
+  cupsCondInit(&server->access_buffer.cond);
+
+  server->access_file        = -1;	// none
+  server->auth_cache_life    = 60;	// 1 minute
+  server->event_fd           = -1;
+  server->group_cache_life   = 300;	// 5 minutes
+  server->introspect_group   = -1;	// none
+  server->journal_fd         = -1;
+  server->jwt_cache_size     = 1024;
+  server->keep_alive_timeout = 60;	// 1 minute
+  server->log_file           = 2;	// stderr
+  server->log_level          = MOAUTHD_LOGLEVEL_ERROR;
+  server->max_clients        = 256;
+  server->max_grant_life     = 300;	// 5 minutes
+  server->max_token_life     = 604800;	// 1 week
+  server->metrics_group      = -1;	// none
+  server->num_workers        = 8;
+  server->register_group     = -1;	// none
+  server->resources_generation = 1;
+  server->signing_alg        = CUPS_JWA_RS256;
+  server->wakeup_pipe[0]     = -1;
+  server->wakeup_pipe[1]     = -1;
+
+  return (server);
+}
+
+
+//
+// 'new_uri()' - Create a new redirection URI list entry.
+//
+
+static moauthd_uri_t *			// O - New entry or `NULL` on error
+new_uri(const char *redirect_uri)	// I - Redirection URI
+{
+  size_t	length = strlen(redirect_uri) + 1;
+					// Length of URI with nul
+  moauthd_uri_t	*uri;			// New entry
+
+
+  if ((uri = (moauthd_uri_t *)malloc(sizeof(moauthd_uri_t) + length)) == NULL)
+    return (NULL);
+
+  atomic_init(&uri->next, NULL);
+  memcpy(uri->uri, redirect_uri, length);
+
+  return (uri);
+}
+
+
+//
+// 'read_file()' - Read a small text file into a string.
+//
+
+static char *				// O - File contents or `NULL` on error
+read_file(const char *filename,		// I - Filename
+          size_t     maxsize)		// I - Maximum size of file
+{
+  cups_file_t	*fp;			// File
+  char		*buffer;		// File contents
+  size_t	used = 0;		// Bytes read
+  ssize_t	bytes;			// Bytes read this time
+
+
+  if ((fp = cupsFileOpen(filename, "r")) == NULL)
+    return (NULL);
+
+  if ((buffer = malloc(maxsize + 1)) == NULL)
+  {
+    cupsFileClose(fp);
+    return (NULL);
+  }
+
+  while (used < maxsize && (bytes = cupsFileRead(fp, buffer + used, maxsize - used)) > 0)
+    used += (size_t)bytes;
+
   cupsFileClose(fp);
 
-  return (server->private_key != NULL);
+  buffer[used] = '\0';
+
+  return (buffer);
 }
@@ -12,10 +12,12 @@
 #include <string.h>
 #include <errno.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <cups/form.h>
 #include <cups/thread.h>
 #include <signal.h>
 #include <sys/poll.h>
+#include <sys/wait.h>
 #include <moauth/moauth-private.h>
 #include <moauth/test.h>
 #ifdef __APPLE__
@@ -30,6 +32,7 @@ extern char **environ;
 //
 
 #define REDIRECT_URI	"https://localhost:10000"
+#define LEGACY_URI	"https://localhost:10001/introspect"
 
 
 //
@@ -56,11 +59,15 @@ static bool	stop_tests = false;
 //
 
 static char	*get_url(const char *url, const char *token, char *filename, size_t filesize);
+static void	introspect_cb(moauth_t *server, bool status, size_t num_tokens, const char * const *tokens, const moauth_introspect_t *results, atomic_int *result);
+static void	*legacy_server(atomic_bool *done);
 static moauth_t	*open_auth_url(const char *url, const char *state, const char *verifier);
 static void	*redirect_server(_moauth_redirect_t *data);
 static bool	respond_client(http_t *http, http_status_t code, const char *message);
 static void	sig_handler(int sig);
-static pid_t	start_moauthd(int verbosity);
+static pid_t	start_moauthd(const char *conffile, int verbosity);
+static bool	test_introspect(moauth_t *server, const char *token);
+static bool	test_revoke(moauth_t *server, const char *host, const char *token);
 
 
 //
@@ -109,8 +116,11 @@ main(int  argc,				// I - Number of command-line arguments
   signal(SIGTERM, sig_handler);
 
   // Start daemon...
+  if (chdir(".."))
+    abort();
+
   testBegin("moauthd");
-  moauthd_pid = start_moauthd(verbosity);
+  moauthd_pid = start_moauthd("test.conf", verbosity);
   testEndMessage(moauthd_pid > 0, "%d", (int)moauthd_pid);
 
   // Start redirect server thread...
@@ -248,6 +258,100 @@ main(int  argc,				// I - Number of command-line arguments
     goto finish_up;
   }
 
+  // Introspect the token with the batch APIs...
+  if (!test_introspect(server, token))
+  {
+    status = 1;
+    goto finish_up;
+  }
+
+  // Revoke the token and make sure it is no longer accepted...
+  if (!test_revoke(server, host, token))
+  {
+    status = 1;
+    goto finish_up;
+  }
+
+  // Revoking an unknown token succeeds (RFC 7009)...
+  testBegin("moauthRevokeToken(unknown token)");
+  if (moauthRevokeToken(server, "unknown-token", NULL))
+  {
+    testEnd(true);
+  }
+  else
+  {
+    testEndMessage(false, "%s", moauthErrorString(server));
+    status = 1;
+    goto finish_up;
+  }
+
+  // Restart the daemon with stateless tokens and repeat the revocation
+  // tests...
+  moauthClose(server);
+  server = NULL;
+
+  kill(moauthd_pid, SIGTERM);
+  waitpid(moauthd_pid, NULL, 0);
+
+  testBegin("moauthd (stateless tokens)");
+  moauthd_pid = start_moauthd("test-stateless.conf", verbosity);
+  testEndMessage(moauthd_pid > 0, "%d", (int)moauthd_pid);
+
+  httpAssembleURI(HTTP_URI_CODING_ALL, url, sizeof(url), "https", NULL, host, 9000 + (getuid() % 1000), "/");
+  testBegin("moauthConnect(\"%s\")", url);
+  for (timeout = 30; timeout > 0 && !stop_tests; timeout --)
+  {
+    testProgress();
+
+    if ((server = moauthConnect(url)) != NULL)
+      break;
+
+    sleep(1);
+  }
+
+  if (server)
+  {
+    testEnd(true);
+  }
+  else
+  {
+    testEndMessage(false, "unable to connect to OAuth server");
+    status = 1;
+    goto finish_up;
+  }
+
+  testBegin("moauthPasswordToken (stateless tokens)");
+  if (moauthPasswordToken(server, cupsGetUser(), password, NULL, token, sizeof(token), refresh, sizeof(refresh), &expires))
+  {
+    testEnd(true);
+  }
+  else
+  {
+    testEndMessage(false, "%s", moauthErrorString(server));
+    status = 1;
+    goto finish_up;
+  }
+
+  httpAssembleURI(HTTP_URI_CODING_ALL, url, sizeof(url), "https", NULL, host, 9000 + (getuid() % 1000), "/private/private.pdf");
+  testBegin("GET %s (stateless tokens)", url);
+  if (get_url(url, token, filename, sizeof(filename)))
+  {
+    testEndMessage(true, "filename=\"%s\"", filename);
+    unlink(filename);
+  }
+  else
+  {
+    testEndMessage(false, "%s", filename);
+    status = 1;
+    goto finish_up;
+  }
+
+  if (!test_revoke(server, host, token))
+  {
+    status = 1;
+    goto finish_up;
+  }
+
   // Stop the test server...
   finish_up:
 
@@ -357,6 +461,132 @@ get_url(const char *url,		// I - URL to fetch
 }
 
 
+//
+// 'introspect_cb()' - Save the results of an asynchronous introspection.
+//
+
+static void
+introspect_cb(
+    moauth_t                  *server,	// I - Connection to OAuth server
+    bool                      status,	// I - Status of request
+    size_t                    num_tokens,
+					// I - Number of tokens
+    const char * const        *tokens,	// I - Access tokens
+    const moauth_introspect_t *results,	// I - Results
+    atomic_int                *result)	// I - Result (1 = pass, -1 = fail)
+{
+  (void)server;
+  (void)tokens;
+
+  if (status && num_tokens == 2 && results && results[0].active && !results[1].active)
+    atomic_store(result, 1);
+  else
+    atomic_store(result, -1);
+}
+
+
+//
+// 'legacy_server()' - Run an HTTPS introspection server that does not support
+//                     batch requests.
+//
+// Batch (JSON) requests get a 400 response and every form request reports an
+// active token for the user "legacy".
+//
+
+static void *				// O - Exit status
+legacy_server(atomic_bool *done)	// I - Stop the server?
+{
+  http_addrlist_t *addrlist,		// List of listener addresses
+		*addr;			// Current address
+  int		i,			// Looping var
+		num_listeners = 0;	// Number of listener sockets
+  struct pollfd	listeners[4],		// Listener sockets
+		*lis;			// Pointer to polling data
+
+
+  // Create listener sockets for localhost on port 10001...
+  addrlist = httpAddrGetList("localhost", AF_UNSPEC, "10001");
+  for (addr = addrlist; addr && num_listeners < (int)(sizeof(listeners) / sizeof(listeners[0])); addr = addr->next)
+  {
+    int			sock = httpAddrListen(&(addr->addr), 10001);
+					// Listener socket
+
+    if (sock < 0)
+      continue;
+
+    lis = listeners + num_listeners;
+
+    num_listeners ++;
+
+    lis->fd     = sock;
+    lis->events = POLLIN | POLLHUP | POLLERR;
+  }
+
+  httpAddrFreeList(addrlist);
+
+  // Answer requests until told to stop...
+  while (!atomic_load(done))
+  {
+    if (poll(listeners, num_listeners, 1000) <= 0)
+      continue;
+
+    for (i = num_listeners, lis = listeners; i > 0; i --, lis ++)
+    {
+      http_t		*http;		// HTTP connection
+      http_state_t	state;		// HTTP state
+      char		resource[1024],	// Request path
+			buffer[8192];	// Request body
+      const char	*content_type;	// Content-Type of request
+
+      if (!(lis->revents & POLLIN))
+        continue;
+
+      if ((http = httpAcceptConnection(lis->fd, true)) == NULL)
+        continue;
+
+      if (!httpSetEncryption(http, HTTP_ENCRYPTION_ALWAYS))
+      {
+        httpClose(http);
+        continue;
+      }
+
+      // Process requests until the client closes the connection...
+      for (;;)
+      {
+        while (!atomic_load(done) && !httpWait(http, 1000));
+
+        if (atomic_load(done))
+          break;
+
+	while ((state = httpReadRequest(http, resource, sizeof(resource))) == HTTP_STATE_WAITING)
+	  usleep(1);
+
+        if (state != HTTP_STATE_POST)
+          break;
+
+	while (httpUpdate(http) == HTTP_STATUS_CONTINUE);
+
+        content_type = httpGetField(http, HTTP_FIELD_CONTENT_TYPE);
+
+        while (httpRead(http, buffer, sizeof(buffer)) > 0);
+
+        if (content_type && !strncmp(content_type, "application/json", 16))
+          respond_client(http, HTTP_STATUS_BAD_REQUEST, "Batch requests are not supported.\n");
+        else
+          respond_client(http, HTTP_STATUS_OK, "{\"active\":true,\"username\":\"legacy\"}");
+      }
+
+      httpClose(http);
+    }
+  }
+
+  for (i = num_listeners, lis = listeners; i > 0; i --, lis ++)
+    close(lis->fd);
+
+  return (NULL);
+}
+
+
 //
 // 'open_auth_url()' - Open the authentication URL for the OAuth server.
 //
@@ -623,29 +853,27 @@ sig_handler(int sig)			// I - Signal number
 //
 
 static pid_t				// O - Process ID
-start_moauthd(int verbosity)		// I - Verbosity
+start_moauthd(const char *conffile,	// I - Configuration file
+              int        verbosity)	// I - Verbosity
 {
   pid_t		pid = 0;		// Process ID
-  static char * const normal_argv[] =	// moauthd arguments (normal)
+  char		*normal_argv[] =	// moauthd arguments (normal)
   {
     "moauthd",
     "-c",
-    "test.conf",
+    (char *)conffile,
     NULL
   };
-  static char * const verbose_argv[] =	// moauthd arguments (verbose)
+  char		*verbose_argv[] =	// moauthd arguments (verbose)
   {
     "moauthd",
     "-vvv",
     "-c",
-    "test.conf",
+    (char *)conffile,
     NULL
   };
 
 
-  if (chdir(".."))
-    abort();
-
   unlink("test.state");
 
   if (verbosity)
@@ -672,3 +900,179 @@ start_moauthd(int verbosity)		// I - Verbosity
 
   return (pid);
 }
+
+
+//
+// 'test_introspect()' - Introspect a batch of tokens.
+//
+
+static bool				// O - `true` on success, `false` on failure
+test_introspect(moauth_t   *server,	// I - Connection to moauthd
+                const char *token)	// I - Access token
+{
+  const char	*tokens[2];		// Tokens to introspect
+  moauth_introspect_t results[2];	// Results
+  atomic_int	result = 0;		// Result of asynchronous introspection
+  int		timeout;		// Timeout counter
+  atomic_bool	legacy_done = false;	// Stop the legacy server?
+  cups_thread_t	legacy_tid;		// Legacy server thread
+  const char	*introspection_endpoint;// Saved introspection endpoint
+
+
+  tokens[0] = token;
+  tokens[1] = "unknown-token";
+
+  // Send both tokens using the batch form of the /introspect endpoint...
+  testBegin("moauthIntrospectTokens");
+  if (!moauthIntrospectTokens(server, 2, tokens, results))
+  {
+    testEndMessage(false, "%s", moauthErrorString(server));
+    return (false);
+  }
+  else if (!results[0].active || results[1].active)
+  {
+    testEndMessage(false, "got active=%s,%s, expected true,false", results[0].active ? "true" : "false", results[1].active ? "true" : "false");
+    return (false);
+  }
+
+  testEndMessage(true, "username=\"%s\"", results[0].username);
+
+  // Then do the same thing asynchronously...
+  testBegin("moauthIntrospectTokensAsync");
+  if (!moauthIntrospectTokensAsync(server, 2, tokens, (moauth_introspect_cb_t)introspect_cb, &result))
+  {
+    testEndMessage(false, "%s", moauthErrorString(server));
+    return (false);
+  }
+
+  for (timeout = 300; timeout > 0 && !atomic_load(&result); timeout --)
+  {
+    testProgress();
+    usleep(100000);
+  }
+
+  if (atomic_load(&result) <= 0)
+  {
+    testEndMessage(false, timeout ? "bad results" : "no callback within 30 seconds");
+    return (false);
+  }
+
+  testEnd(true);
+
+  // Finally make sure we fall back to single requests when the server does
+  // not support batches...
+  testBegin("moauthIntrospectTokens(no batch support)");
+
+  if ((legacy_tid = cupsThreadCreate((cups_thread_func_t)legacy_server, &legacy_done)) == CUPS_THREAD_INVALID)
+  {
+    testEndMessage(false, "unable to create legacy server thread");
+    return (false);
+  }
+
+  introspection_endpoint         = server->introspection_endpoint;
+  server->introspection_endpoint = LEGACY_URI;
+
+  for (timeout = 30; timeout > 0; timeout --)
+  {
+    if (moauthIntrospectTokens(server, 2, tokens, results))
+      break;
+
+    testProgress();
+    sleep(1);
+  }
+
+  server->introspection_endpoint = introspection_endpoint;
+
+  atomic_store(&legacy_done, true);
+  cupsThreadWait(legacy_tid);
+
+  if (!timeout)
+  {
+    testEndMessage(false, "%s", moauthErrorString(server));
+    return (false);
+  }
+  else if (!results[0].active || !results[1].active || strcmp(results[0].username, "legacy") || strcmp(results[1].username, "legacy"))
+  {
+    testEndMessage(false, "results not from single token requests");
+    return (false);
+  }
+
+  testEnd(true);
+
+  return (true);
+}
+
+
+//
+// 'test_revoke()' - Revoke a token and make sure it is no longer accepted.
+
+static bool				// O - `true` on success, `false` on failure
+test_revoke(moauth_t   *server,		// I - Connection to moauthd
+            const char *host,		// I - Hostname
+            const char *token)		// I - Access token
+{
+  char		url[1024],		// URL for private file
+		filename[256],		// Temporary filename
+		username[256];		// Username for token
+  time_t	expires;		// Expiration date/time
+  size_t	hits,			// Introspection cache hits
+		misses,			// Introspection cache misses
+		prev_misses;		// Misses before introspecting again
+
+
+  // Cache introspection results so we can tell when revoking the token drops
+  // the cached result...
+  moauthSetIntrospectionCache(server, 16, 60, 60);
+
+  testBegin("moauthIntrospectToken");
+  if (moauthIntrospectToken(server, token, username, sizeof(username), NULL, 0, &expires))
+  {
+    testEndMessage(true, "username=\"%s\"", username);
+  }
+  else
+  {
+    testEndMessage(false, "%s", moauthErrorString(server));
+    return (false);
+  }
+
+  testBegin("moauthRevokeToken");
+  if (moauthRevokeToken(server, token, "access_token"))
+  {
+    testEnd(true);
+  }
+  else
+  {
+    testEndMessage(false, "%s", moauthErrorString(server));
+    return (false);
+  }
+
+  testBegin("moauthIntrospectToken(revoked token)");
+  moauthGetIntrospectionStats(server, &hits, &prev_misses);
+  if (moauthIntrospectToken(server, token, username, sizeof(username), NULL, 0, &expires))
+  {
+    testEndMessage(false, "revoked token is still active");
+    return (false);
+  }
+
+  moauthGetIntrospectionStats(server, &hits, &misses);
+  if (misses == prev_misses)
+  {
+    testEndMessage(false, "cached introspection result was not dropped");
+    return (false);
+  }
+
+  testEnd(true);
+
+  httpAssembleURI(HTTP_URI_CODING_ALL, url, sizeof(url), "https", NULL, host, 9000 + (getuid() % 1000), "/private/private.pdf");
+  testBegin("GET %s (revoked token)", url);
+  if (get_url(url, token, filename, sizeof(filename)))
+  {
+    testEndMessage(false, "revoked token was accepted");
+    unlink(filename);
+    return (false);
+  }
+
+  testEndMessage(true, "%s", filename);
+
+  return (true);
+}
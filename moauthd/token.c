@@ -15,13 +15,74 @@
 // Local functions...
 //
 
-static int	compare_tokens(moauthd_token_t *a, moauthd_token_t *b, void *data);
-static void	free_token(moauthd_token_t *token, void *data);
+static void	add_bloom(atomic_uint_least64_t *bloom, uint64_t hash);
+static void	add_expiry(moauthd_server_t *server, moauthd_token_t *token);
+static void	cache_token(moauthd_server_t *server, const unsigned char *digest, moauthd_token_t *token, size_t generation);
+static bool	check_bloom(atomic_uint_least64_t *bloom, uint64_t hash);
+static moauthd_token_t *find_cached_token(moauthd_server_t *server, const unsigned char *digest);
+static uint64_t	hash_token(const char *s);
+static void	invalidate_cached_token(moauthd_server_t *server, const char *jti);
+static void	prune_revoked(moauthd_server_t *server, time_t curtime);
+static void	remove_expiry(moauthd_server_t *server, size_t i);
+static bool	resize_revoked(moauthd_server_t *server);
+static bool	resize_shard(moauthd_tshard_t *shard);
+static void	*sweep_tokens(moauthd_server_t *server);
+static bool	unlink_token(moauthd_tshard_t *shard, moauthd_token_t *token, uint64_t hash);
+
+
+//
+// 'moauthdAddToken()' - Add a token to the token table.
+//
+// The token table holds its own reference to the token, which is released
+// when the token is deleted or expires.  The token is freed on error.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdAddToken(
+    moauthd_server_t *server,		// I - Server object
+    moauthd_token_t  *token)		// I - Token
+{
+  moauthd_token_t	**bucket;	// Hash bucket
+  moauthd_tshard_t	*shard;		// Hash table shard
+
+
+  token->hash         = hash_token(token->token);
+  token->expiry_index = SIZE_MAX;
+  shard               = server->tokens + token->hash % MOAUTHD_TOKEN_SHARDS;
+
+  atomic_fetch_add_explicit(&token->refcount, 1, memory_order_relaxed);
+
+  cupsRWLockWrite(&shard->lock);
+
+  if (shard->num_tokens >= 2 * shard->num_buckets && !resize_shard(shard))
+  {
+    cupsRWUnlock(&shard->lock);
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate memory for token table: %s", strerror(errno));
+    moauthdFreeToken(token);
+    return (false);
+  }
+
+  bucket = shard->buckets + (token->hash / MOAUTHD_TOKEN_SHARDS) % shard->num_buckets;
+
+  token->next = *bucket;
+  *bucket     = token;
+
+  shard->num_tokens ++;
+
+  cupsRWUnlock(&shard->lock);
+
+  // Schedule the token for removal once it expires...
+  add_expiry(server, token);
+
+  return (true);
+}
 
 
 //
 // 'moauthdCreateToken()' - Create an OAuth token.
 //
+// The returned token must be released using moauthdReleaseToken().
+//
 
 moauthd_token_t *			// O - New token
 moauthdCreateToken(
@@ -29,11 +90,26 @@ moauthdCreateToken(
     moauthd_toktype_t     type,		// I - Token type
     moauthd_application_t *application,	// I - Application
     const char            *user,	// I - Authenticated user
-    const char            *scopes)	// I - Space-delimited list of scopes
+    const char            *scopes,	// I - Space-delimited list of scopes
+    const char            *challenge)	// I - PKCE code challenge or `NULL` for none
 {
   moauthd_token_t	*token;		// New token
   struct passwd		*passwd;	// User info
   cups_jwt_t		*jwt;		// JWT
+  unsigned char		bytes[16],	// Random bytes for JWT ID
+			opaque[32];	// Random bytes for opaque token
+  char			jti[33],	// JWT ID
+			*jtiptr,	// Pointer into JWT ID
+			temp[64];	// Opaque token string
+  size_t		i;		// Looping var
+  static const char * const types[] =	// Token types
+  {
+    "access",
+    "grant",
+    "renewal"
+  };
+  static const char hexdigits[] = "0123456789abcdef";
+					// Hex digits for JWT ID
 
 
   if (!scopes || !*scopes)
@@ -42,11 +118,15 @@ moauthdCreateToken(
   token = (moauthd_token_t *)calloc(1, sizeof(moauthd_token_t));
 
   token->type         = type;
+  token->refcount     = 1;		// One for the caller
   token->application  = application;
   token->user         = strdup(user);
   token->scopes       = strdup(scopes);
   token->scopes_array = cupsArrayNewStrings(scopes, ' ');
 
+  if (challenge)
+    token->challenge = strdup(challenge);
+
   if ((passwd = getpwnam(user)) != NULL)
   {
     token->uid = passwd->pw_uid;
@@ -65,72 +145,260 @@ moauthdCreateToken(
   else
     token->expires = token->created + server->max_token_life;
 
-  // Generate the JWT for the token...
-  jwt = cupsJWTNew("JWT");
-  cupsJWTSetClaimString(jwt, "iss", token->user);
-  cupsJWTSetClaimString(jwt, "scope", token->scopes);
-  cupsJWTSetClaimNumber(jwt, "iat", (double)token->created);
-  cupsJWTSetClaimNumber(jwt, "exp", (double)token->expires);
+  // Generate a unique ID for the token...
+  _moauthGetRandomBytes(bytes, sizeof(bytes));
 
-  cupsJWTSign(jwt, CUPS_JWA_RS256, server->private_key);
+  for (i = 0, jtiptr = jti; i < sizeof(bytes); i ++)
+  {
+    *jtiptr++ = hexdigits[bytes[i] >> 4];
+    *jtiptr++ = hexdigits[bytes[i] & 15];
+  }
+  *jtiptr = '\0';
 
-  token->token = cupsJWTExportString(jwt, CUPS_JWS_FORMAT_COMPACT);
-  cupsJWTDelete(jwt);
+  token->jti = strdup(jti);
 
-//  moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "token->user=\"%s\", ->scopes=\"%s\", uid=%d, gid=%d, created=%ld, expires=%ld, token=\"%s\"", token->user, token->scopes, (int)token->uid, (int)token->gid, (long)token->created, (long)token->expires, token->token);
+  atomic_fetch_add_explicit(&server->num_tokens, 1, memory_order_relaxed);
 
-  cupsRWLockWrite(&server->tokens_lock);
+  if (type != MOAUTHD_TOKTYPE_ACCESS)
+  {
+    // Grant and renewal tokens are single-use and only ever looked up in the
+    // token table, so just use 256 random bits instead of a signed JWT...
+    _moauthGetRandomBytes(opaque, sizeof(opaque));
+    httpEncode64(temp, sizeof(temp), (char *)opaque, sizeof(opaque), true);
+
+    token->token = strdup(temp);
+  }
+  else
+  {
+    // Generate the JWT for the token - the "sub", "uid", "gid", and
+    // "token_type" claims allow the token to be validated without the token
+    // table...
+    jwt = cupsJWTNew("JWT");
+    cupsJWTSetClaimString(jwt, "iss", token->user);
+    cupsJWTSetClaimString(jwt, "sub", token->user);
+    cupsJWTSetClaimString(jwt, "jti", token->jti);
+    cupsJWTSetClaimString(jwt, "scope", token->scopes);
+    cupsJWTSetClaimString(jwt, "token_type", types[type]);
+    cupsJWTSetClaimNumber(jwt, "uid", (double)token->uid);
+    cupsJWTSetClaimNumber(jwt, "gid", (double)token->gid);
+    cupsJWTSetClaimNumber(jwt, "iat", (double)token->created);
+    cupsJWTSetClaimNumber(jwt, "exp", (double)token->expires);
+
+    cupsJWTSign(jwt, server->signing_alg, server->private_key);
 
-  if (!server->tokens)
-    server->tokens = cupsArrayNew((cups_array_cb_t)compare_tokens, NULL, NULL, 0, NULL, (cups_afree_cb_t)free_token);
+    token->token = cupsJWTExportString(jwt, CUPS_JWS_FORMAT_COMPACT);
+    cupsJWTDelete(jwt);
+  }
 
-  cupsArrayAdd(server->tokens, token);
+//  moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "token->user=\"%s\", ->scopes=\"%s\", uid=%d, gid=%d, created=%ld, expires=%ld, token=\"%s\"", token->user, token->scopes, (int)token->uid, (int)token->gid, (long)token->created, (long)token->expires, token->token);
 
-  cupsRWUnlock(&server->tokens_lock);
+  // Add the token to the token table and journal...
+  if (!moauthdAddToken(server, token))
+    return (NULL);
+
+  moauthdJournalToken(server, token, false);
 
   return (token);
 }
 
 
+//
+// 'moauthdDeleteRevokedToken()' - Delete a token with the given JWT ID from the
+//                                 token table.
+//
+// This is used when a revocation is replayed from the journal or a peer.  The
+// revocation records the hash of the token string, so only the one hash
+// bucket that can hold the token is searched.
+//
+
+void
+moauthdDeleteRevokedToken(
+    moauthd_server_t *server,		// I - Server object
+    const char       *jti,		// I - JWT ID
+    uint64_t         token_hash)	// I - Hash of token string or 0 if unknown
+{
+  moauthd_tshard_t	*shard;		// Hash table shard
+  moauthd_token_t	*token = NULL;	// Matching token
+
+
+  if (!token_hash)
+    return;
+
+  shard = server->tokens + token_hash % MOAUTHD_TOKEN_SHARDS;
+
+  cupsRWLockRead(&shard->lock);
+
+  if (shard->buckets)
+  {
+    for (token = shard->buckets[(token_hash / MOAUTHD_TOKEN_SHARDS) % shard->num_buckets]; token; token = token->next)
+    {
+      if (token->hash == token_hash && token->jti && !strcmp(token->jti, jti))
+      {
+        atomic_fetch_add_explicit(&token->refcount, 1, memory_order_relaxed);
+        break;
+      }
+    }
+  }
+
+  cupsRWUnlock(&shard->lock);
+
+  if (token)
+  {
+    moauthdDeleteToken(server, token);
+    moauthdReleaseToken(server, token);
+  }
+}
+
+
 //
 // 'moauthdDeleteToken()' - Delete a token from the server...
 //
+// The token is removed from the token table and expiry heap.  The caller
+// must still release its own reference using moauthdReleaseToken().
+//
 
 void
 moauthdDeleteToken(
     moauthd_server_t *server,		// I - Server object
     moauthd_token_t  *token)		// I - Token
 {
-  cupsRWLockWrite(&server->tokens_lock);
+  moauthd_tshard_t	*shard;		// Hash table shard
+  bool			found;		// Was the token in the table?
+
+
+  shard = server->tokens + token->hash % MOAUTHD_TOKEN_SHARDS;
+
+  cupsRWLockWrite(&shard->lock);
+  found = unlink_token(shard, token, token->hash);
+  cupsRWUnlock(&shard->lock);
+
+  // Only release tokens that were still in the table, the sweeper may have
+  // beaten us to it...
+  if (found)
+  {
+    // Remove the token from the expiry heap so the heap never refers to a
+    // freed token...
+    cupsMutexLock(&server->expiry_lock);
+    if (token->expiry_index < server->num_expiry && server->expiry[token->expiry_index].token == token)
+      remove_expiry(server, token->expiry_index);
+    cupsMutexUnlock(&server->expiry_lock);
+
+    // Tokens deleted before they expire are revoked so that access tokens are
+    // also rejected by stateless validation, and so that the revocation acts
+    // as a tombstone that replication peers see even if the delete record is
+    // lost...
+    if (token->jti && token->expires > time(NULL))
+      moauthdRevokeToken(server, token->jti, token->hash, token->expires);
+
+    moauthdJournalToken(server, token, true);
+    moauthdReleaseToken(server, token);
+  }
+}
+
+
+//
+// 'moauthdDeleteTokens()' - Delete all tokens from the server.
+//
+
+void
+moauthdDeleteTokens(
+    moauthd_server_t *server)		// I - Server object
+{
+  int			i;		// Looping var
+  size_t		j;		// Looping var
+  moauthd_tshard_t	*shard;		// Current shard
+  moauthd_token_t	*token,		// Current token
+			*next;		// Next token
+  moauthd_revoked_t	*r,		// Current revoked token
+			*rnext;		// Next revoked token
+
+
+  for (i = MOAUTHD_TOKEN_SHARDS, shard = server->tokens; i > 0; i --, shard ++)
+  {
+    cupsRWLockWrite(&shard->lock);
+
+    for (j = 0; j < shard->num_buckets; j ++)
+    {
+      for (token = shard->buckets[j]; token; token = next)
+      {
+        next = token->next;
+        moauthdReleaseToken(server, token);
+      }
+    }
+
+    free(shard->buckets);
+
+    shard->buckets     = NULL;
+    shard->num_buckets = 0;
+    shard->num_tokens  = 0;
+
+    cupsRWUnlock(&shard->lock);
+  }
+
+  // Free the revocation set...
+  cupsRWLockWrite(&server->revoked_lock);
+
+  for (j = 0; j < server->num_revoked_buckets; j ++)
+  {
+    for (r = server->revoked[j]; r; r = rnext)
+    {
+      rnext = r->next;
+      free(r->jti);
+      free(r);
+    }
+  }
+
+  free(server->revoked);
 
-  cupsArrayRemove(server->tokens, token);
+  server->revoked             = NULL;
+  server->num_revoked         = 0;
+  server->num_revoked_buckets = 0;
 
-  cupsRWUnlock(&server->tokens_lock);
+  for (j = 0; j < (MOAUTHD_REVOKED_BLOOM / 64); j ++)
+    atomic_store_explicit(server->revoked_bloom + j, 0, memory_order_relaxed);
+
+  cupsRWUnlock(&server->revoked_lock);
 }
 
 
 //
 // 'moauthdFindToken()' - Find an OAuth token.
 //
+// The returned token must be released using moauthdReleaseToken().
+//
 
 moauthd_token_t	*			// O - Matching token
 moauthdFindToken(
     moauthd_server_t *server,		// I - Server object
     const char       *token_id)		// I - Token ID
 {
-  moauthd_token_t	*match,		// Matching token, if any
-			key;		// Search key
+  moauthd_token_t	*match = NULL;	// Matching token, if any
+  moauthd_tshard_t	*shard;		// Hash table shard
+  uint64_t		hash;		// Hash of token ID
 
 
 //  moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "FindToken(\"%s\")", token_id);
 
-  key.token = (char *)token_id;
+  hash  = hash_token(token_id);
+  shard = server->tokens + hash % MOAUTHD_TOKEN_SHARDS;
 
-  cupsRWLockRead(&server->tokens_lock);
+  cupsRWLockRead(&shard->lock);
 
-  match = cupsArrayFind(server->tokens, &key);
+  if (shard->buckets)
+  {
+    for (match = shard->buckets[(hash / MOAUTHD_TOKEN_SHARDS) % shard->num_buckets]; match; match = match->next)
+    {
+      if (match->hash == hash && !strcmp(match->token, token_id))
+      {
+        // Tokens in the table always hold the table's reference, so adding
+        // ours under the read lock is safe...
+        atomic_fetch_add_explicit(&match->refcount, 1, memory_order_relaxed);
+        break;
+      }
+    }
+  }
 
-  cupsRWUnlock(&server->tokens_lock);
+  cupsRWUnlock(&shard->lock);
 
 //  moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "FindToken: match=%p(%s)", (void *)match, match ? match->user : "???");
 
@@ -139,35 +407,952 @@ moauthdFindToken(
 
 
 //
-// 'compare_token()' - Compare two tokens.
+// 'moauthdFreeToken()' - Free the memory used by a token.
+//
+// Only use this for tokens that have never been shared - tokens returned by
+// moauthdCreateToken(), moauthdFindToken(), and moauthdValidateToken() must be
+// released using moauthdReleaseToken() instead.
+//
+
+void
+moauthdFreeToken(
+    moauthd_token_t *token)		// I - Token to free
+{
+  if (token->challenge)
+    free(token->challenge);
+  free(token->token);
+  free(token->jti);
+  free(token->user);
+  free(token->scopes);
+  free(token->gids);
+  cupsArrayDelete(token->scopes_array);
+  free(token);
+}
+
+
+//
+// 'moauthdGetNumTokens()' - Get the number of tokens in the token table.
 //
 
-static int				// O - Result of comparison
-compare_tokens(moauthd_token_t *a,	// I - First token
-               moauthd_token_t *b,	// I - Second token
-               void            *data)	// I - Callback data (unused)
+size_t					// O - Number of tokens
+moauthdGetNumTokens(
+    moauthd_server_t *server)		// I - Server object
 {
-  (void)data;
+  int			i;		// Looping var
+  size_t		num_tokens = 0;	// Number of tokens
+  moauthd_tshard_t	*shard;		// Current shard
+
 
-  return (strcmp(a->token, b->token));
+  for (i = MOAUTHD_TOKEN_SHARDS, shard = server->tokens; i > 0; i --, shard ++)
+  {
+    cupsRWLockRead(&shard->lock);
+    num_tokens += shard->num_tokens;
+    cupsRWUnlock(&shard->lock);
+  }
+
+  return (num_tokens);
 }
 
 
 //
-// 'free_token()' - Free the memory used by a token.
+// 'moauthdIsTokenRevoked()' - Determine whether a token has been revoked.
+//
+// Almost no tokens are revoked, so a Bloom filter is checked without locking
+// first and only possible matches look in the revocation hash table.
+//
+
+bool					// O - `true` if revoked, `false` otherwise
+moauthdIsTokenRevoked(
+    moauthd_server_t *server,		// I - Server object
+    const char       *jti)		// I - JWT ID
+{
+  uint64_t		hash;		// Hash of JWT ID
+  moauthd_revoked_t	*r = NULL;	// Matching entry
+
+
+  hash = hash_token(jti);
+
+  if (!check_bloom(server->revoked_bloom, hash))
+    return (false);
+
+  cupsRWLockRead(&server->revoked_lock);
+
+  if (server->revoked)
+  {
+    for (r = server->revoked[hash % server->num_revoked_buckets]; r; r = r->next)
+    {
+      if (r->hash == hash && !strcmp(r->jti, jti))
+        break;
+    }
+  }
+
+  cupsRWUnlock(&server->revoked_lock);
+
+  return (r != NULL);
+}
+
+
+//
+// 'moauthdReleaseToken()' - Release a token returned by moauthdCreateToken(),
+//                           moauthdFindToken(), or moauthdValidateToken().
+//
+
+void
+moauthdReleaseToken(
+    moauthd_server_t *server,		// I - Server object
+    moauthd_token_t  *token)		// I - Token
+{
+  (void)server;
+
+  if (atomic_fetch_sub_explicit(&token->refcount, 1, memory_order_acq_rel) <= 1)
+    moauthdFreeToken(token);
+}
+
+
+//
+// 'moauthdRevokeToken()' - Add a token to the revocation set.
+//
+// Entries are kept until the token would have expired anyway.  Expired
+// entries are pruned every MOAUTHD_REVOKED_PRUNE seconds.
+//
+
+bool					// O - `true` if newly revoked, `false` otherwise
+moauthdRevokeToken(
+    moauthd_server_t *server,		// I - Server object
+    const char       *jti,		// I - JWT ID
+    uint64_t         token_hash,	// I - Hash of token string or 0 if unknown
+    time_t           expires)		// I - When the token expires
+{
+  moauthd_revoked_t	*r = NULL,	// Current entry
+			**bucket;	// Hash bucket
+  uint64_t		hash;		// Hash of JWT ID
+  bool			added = false;	// Was the token added?
+  time_t		curtime = time(NULL);
+					// Current time
+
+
+  hash = hash_token(jti);
+
+  cupsRWLockWrite(&server->revoked_lock);
+
+  if (curtime >= server->revoked_prune)
+    prune_revoked(server, curtime);
+
+  if (server->num_revoked >= server->num_revoked_buckets && !resize_revoked(server) && !server->revoked)
+  {
+    cupsRWUnlock(&server->revoked_lock);
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate memory for revoked tokens: %s", strerror(errno));
+    return (false);
+  }
+
+  bucket = server->revoked + hash % server->num_revoked_buckets;
+
+  for (r = *bucket; r; r = r->next)
+  {
+    if (r->hash == hash && !strcmp(r->jti, jti))
+      break;
+  }
+
+  if (r)
+  {
+    if (expires > r->expires)
+      r->expires = expires;
+
+    if (!r->token_hash)
+      r->token_hash = token_hash;
+  }
+  else if ((r = (moauthd_revoked_t *)calloc(1, sizeof(moauthd_revoked_t))) != NULL)
+  {
+    if ((r->jti = strdup(jti)) != NULL)
+    {
+      r->hash       = hash;
+      r->token_hash = token_hash;
+      r->expires    = expires;
+      r->next       = *bucket;
+      *bucket       = r;
+
+      server->num_revoked ++;
+      added = true;
+
+      add_bloom(server->revoked_bloom, hash);
+    }
+    else
+    {
+      free(r);
+    }
+  }
+
+  cupsRWUnlock(&server->revoked_lock);
+
+  if (added)
+    moauthdJournalRevoke(server, jti, token_hash, expires);
+
+  // Remove any cached copy of the token...
+  invalidate_cached_token(server, jti);
+
+  return (added);
+}
+
+
+//
+// 'moauthdStartSweeper()' - Start the expired token sweeper thread.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdStartSweeper(
+    moauthd_server_t *server)		// I - Server object
+{
+  server->sweeper_stop = false;
+
+  if ((server->sweeper = cupsThreadCreate((void *(*)(void *))sweep_tokens, server)) == CUPS_THREAD_INVALID)
+  {
+    moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to create token sweeper thread: %s", strerror(errno));
+    return (false);
+  }
+
+  return (true);
+}
+
+
+//
+// 'moauthdStopSweeper()' - Stop the expired token sweeper thread.
+//
+
+void
+moauthdStopSweeper(
+    moauthd_server_t *server)		// I - Server object
+{
+  cupsMutexLock(&server->expiry_lock);
+  server->sweeper_stop = true;
+  cupsCondBroadcast(&server->expiry_cond);
+  cupsMutexUnlock(&server->expiry_lock);
+
+  cupsThreadWait(server->sweeper);
+}
+
+
+//
+// 'moauthdValidateToken()' - Validate an access token using its JWT claims.
+//
+// This is used for stateless validation and does not use the token table.
+// Validated tokens are cached by the SHA-256 digest of the token string so
+// that repeat presentations skip the signature check.  The returned token
+// must be released using moauthdReleaseToken().
+//
+
+moauthd_token_t *			// O - Validated token or `NULL` if not valid
+moauthdValidateToken(
+    moauthd_server_t *server,		// I - Server object
+    const char       *token_id)		// I - Token string
+{
+  cups_jwt_t		*jwt;		// JWT
+  const char		*sub,		// Subject (user) claim
+			*jti,		// JWT ID claim
+			*scope,		// Scope claim
+			*token_type;	// Token type claim
+  double		exp;		// Expiration time claim
+  moauthd_token_t	*token = NULL;	// Validated token
+  unsigned char		digest[32];	// SHA-256 digest of token string
+  size_t		generation;	// Revocation generation
+  int			num_gids;	// Number of groups
+
+
+  // See if we have already validated this token...
+  if (server->jwt_cache_size > 0)
+  {
+    cupsHashData("sha2-256", token_id, strlen(token_id), digest, sizeof(digest));
+
+    if ((token = find_cached_token(server, digest)) != NULL)
+      return (token);
+  }
+
+  cupsMutexLock(&server->jwt_cache_lock);
+  generation = server->jwt_cache_generation;
+  cupsMutexUnlock(&server->jwt_cache_lock);
+
+  if ((jwt = cupsJWTImportString(token_id, CUPS_JWS_FORMAT_COMPACT)) == NULL)
+    return (NULL);
+
+  sub        = cupsJWTGetClaimString(jwt, "sub");
+  jti        = cupsJWTGetClaimString(jwt, "jti");
+  scope      = cupsJWTGetClaimString(jwt, "scope");
+  token_type = cupsJWTGetClaimString(jwt, "token_type");
+  exp        = cupsJWTGetClaimNumber(jwt, "exp");
+
+  // Check the cheap things first, then the signature...
+  if (!sub || !jti || !scope || !token_type || strcmp(token_type, "access") || exp <= (double)time(NULL))
+    goto done;
+
+  if (cupsJWTGetAlgorithm(jwt) != server->signing_alg || !cupsJWTHasValidSignature(jwt, server->public_jwk))
+    goto done;
+
+  if (moauthdIsTokenRevoked(server, jti))
+    goto done;
+
+  if ((token = (moauthd_token_t *)calloc(1, sizeof(moauthd_token_t))) == NULL)
+    goto done;
+
+  token->type         = MOAUTHD_TOKTYPE_ACCESS;
+  token->stateless    = true;
+  token->refcount     = 1;
+  token->token        = strdup(token_id);
+  token->hash         = hash_token(token_id);
+  token->jti          = strdup(jti);
+  token->user         = strdup(sub);
+  token->scopes       = strdup(scope);
+  token->scopes_array = cupsArrayNewStrings(scope, ' ');
+  token->uid          = (uid_t)cupsJWTGetClaimNumber(jwt, "uid");
+  token->gid          = (gid_t)cupsJWTGetClaimNumber(jwt, "gid");
+  token->created      = (time_t)cupsJWTGetClaimNumber(jwt, "iat");
+  token->expires      = (time_t)exp;
+
+  if (!token->token || !token->jti || !token->user || !token->scopes)
+  {
+    moauthdFreeToken(token);
+    token = NULL;
+    goto done;
+  }
+
+  // Look up the groups for the user once so cached tokens don't need to...
+  if ((token->gids = calloc(MOAUTHD_MAX_GROUPS, sizeof(token->gids[0]))) != NULL)
+  {
+    if ((num_gids = moauthdGetUserGroups(server, token->user, token->uid, token->gid, token->gids, MOAUTHD_MAX_GROUPS)) < 0)
+      num_gids = 0;
+
+    token->num_gids = num_gids;
+  }
+
+  if (server->jwt_cache_size > 0)
+    cache_token(server, digest, token, generation);
+
+  done:
+
+  cupsJWTDelete(jwt);
+
+  return (token);
+}
+
+
+//
+// 'add_bloom()' - Add a hash to a Bloom filter.
+//
+// Each hash sets three bits, one for each 16-bit piece of the hash.
 //
 
 static void
-free_token(moauthd_token_t *token,	// I - Token to free
-           void            *data)	// I - Callback data (unused)
+add_bloom(atomic_uint_least64_t *bloom,	// I - Bloom filter
+          uint64_t              hash)	// I - Hash value
 {
-  (void)data;
+  int		i;			// Looping var
+  size_t	bit;			// Bit number
 
-  if (token->challenge)
-    free(token->challenge);
-  free(token->token);
-  free(token->user);
-  free(token->scopes);
-  cupsArrayDelete(token->scopes_array);
-  free(token);
+
+  for (i = 0; i < 3; i ++, hash >>= 16)
+  {
+    bit = (size_t)(hash % MOAUTHD_REVOKED_BLOOM);
+
+    atomic_fetch_or_explicit(bloom + bit / 64, (uint_least64_t)1 << (bit & 63), memory_order_release);
+  }
+}
+
+
+//
+// 'add_expiry()' - Add a token to the expiry heap.
+//
+
+static void
+add_expiry(moauthd_server_t *server,	// I - Server object
+           moauthd_token_t  *token)	// I - Token
+{
+  size_t		i,		// Current index
+			parent;		// Parent index
+  moauthd_expiry_t	*expiry;	// Expiry heap
+
+
+  cupsMutexLock(&server->expiry_lock);
+
+  if (server->num_expiry >= server->alloc_expiry)
+  {
+    size_t alloc_expiry = server->alloc_expiry ? 2 * server->alloc_expiry : 1024;
+					// New size of heap
+
+    if ((expiry = realloc(server->expiry, alloc_expiry * sizeof(moauthd_expiry_t))) == NULL)
+    {
+      // Token will only be removed when it is used after expiring...
+      cupsMutexUnlock(&server->expiry_lock);
+      moauthdLogs(server, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate memory for token expiry heap: %s", strerror(errno));
+      return;
+    }
+
+    server->expiry       = expiry;
+    server->alloc_expiry = alloc_expiry;
+  }
+
+  // Sift the new entry up to its place in the heap...
+  for (i = server->num_expiry ++, expiry = server->expiry; i > 0; i = parent)
+  {
+    parent = (i - 1) / 2;
+
+    if (expiry[parent].expires <= token->expires)
+      break;
+
+    expiry[i]                     = expiry[parent];
+    expiry[i].token->expiry_index = i;
+  }
+
+  expiry[i].expires   = token->expires;
+  expiry[i].hash      = token->hash;
+  expiry[i].token     = token;
+  token->expiry_index = i;
+
+  // Wake up the sweeper if this is now the next token to expire...
+  if (i == 0)
+    cupsCondBroadcast(&server->expiry_cond);
+
+  cupsMutexUnlock(&server->expiry_lock);
+}
+
+
+//
+// 'cache_token()' - Add a validated token to the JWT cache.
+//
+// Each digest maps to a set of MOAUTHD_JWT_CACHE_WAYS entries that are
+// replaced using the CLOCK algorithm - recently used entries get a second
+// chance before they are evicted.  The token is not cached if any token has
+// been revoked since it was validated.
+//
+
+static void
+cache_token(
+    moauthd_server_t    *server,	// I - Server object
+    const unsigned char *digest,	// I - SHA-256 digest of token string
+    moauthd_token_t     *token,		// I - Validated token
+    size_t              generation)	// I - Revocation generation when validated
+{
+  size_t		set,		// Set index
+			i;		// Looping var
+  moauthd_jwtcache_t	*entries,	// Entries in set
+			*entry = NULL;	// Entry to replace
+  moauthd_token_t	*old = NULL;	// Evicted token
+
+
+  memcpy(&set, digest, sizeof(set));
+  set %= server->jwt_cache_size / MOAUTHD_JWT_CACHE_WAYS;
+
+  cupsMutexLock(&server->jwt_cache_lock);
+
+  if (generation != server->jwt_cache_generation)
+  {
+    cupsMutexUnlock(&server->jwt_cache_lock);
+    return;
+  }
+
+  entries = server->jwt_cache + set * MOAUTHD_JWT_CACHE_WAYS;
+
+  for (i = 0; i < (2 * MOAUTHD_JWT_CACHE_WAYS) && !entry; i ++)
+  {
+    moauthd_jwtcache_t *e = entries + (entries->hand + i) % MOAUTHD_JWT_CACHE_WAYS;
+					// Current entry
+
+    if (!e->token || !e->referenced)
+      entry = e;
+    else
+      e->referenced = false;
+  }
+
+  if (!entry)
+    entry = entries + entries->hand;
+
+  entries->hand = (size_t)(entry - entries + 1) % MOAUTHD_JWT_CACHE_WAYS;
+
+  old = entry->token;
+
+  memcpy(entry->digest, digest, sizeof(entry->digest));
+  entry->token      = token;
+  entry->referenced = true;
+
+  atomic_fetch_add_explicit(&token->refcount, 1, memory_order_relaxed);
+
+  if (old && atomic_fetch_sub_explicit(&old->refcount, 1, memory_order_acq_rel) > 1)
+    old = NULL;
+
+  cupsMutexUnlock(&server->jwt_cache_lock);
+
+  if (old)
+    moauthdFreeToken(old);
+}
+
+
+//
+// 'check_bloom()' - Check whether a hash might be in a Bloom filter.
+//
+
+static bool				// O - `true` if maybe present, `false` if not
+check_bloom(
+    atomic_uint_least64_t *bloom,	// I - Bloom filter
+    uint64_t              hash)		// I - Hash value
+{
+  int		i;			// Looping var
+  size_t	bit;			// Bit number
+
+
+  for (i = 0; i < 3; i ++, hash >>= 16)
+  {
+    bit = (size_t)(hash % MOAUTHD_REVOKED_BLOOM);
+
+    if (!(atomic_load_explicit(bloom + bit / 64, memory_order_acquire) & ((uint_least64_t)1 << (bit & 63))))
+      return (false);
+  }
+
+  return (true);
+}
+
+
+//
+// 'find_cached_token()' - Find a validated token in the JWT cache.
+//
+
+static moauthd_token_t *		// O - Token or `NULL` if not cached
+find_cached_token(
+    moauthd_server_t    *server,	// I - Server object
+    const unsigned char *digest)	// I - SHA-256 digest of token string
+{
+  size_t		set,		// Set index
+			i;		// Looping var
+  moauthd_jwtcache_t	*entry;		// Current entry
+  moauthd_token_t	*token = NULL,	// Matching token
+			*expired = NULL;// Expired token
+
+
+  memcpy(&set, digest, sizeof(set));
+  set %= server->jwt_cache_size / MOAUTHD_JWT_CACHE_WAYS;
+
+  cupsMutexLock(&server->jwt_cache_lock);
+
+  for (i = MOAUTHD_JWT_CACHE_WAYS, entry = server->jwt_cache + set * MOAUTHD_JWT_CACHE_WAYS; i > 0; i --, entry ++)
+  {
+    if (entry->token && !memcmp(entry->digest, digest, sizeof(entry->digest)))
+    {
+      if (entry->token->expires <= time(NULL))
+      {
+        // Expired, remove from the cache...
+        expired      = entry->token;
+        entry->token = NULL;
+
+        if (atomic_fetch_sub_explicit(&expired->refcount, 1, memory_order_acq_rel) > 1)
+          expired = NULL;
+      }
+      else
+      {
+        token             = entry->token;
+        entry->referenced = true;
+        atomic_fetch_add_explicit(&token->refcount, 1, memory_order_relaxed);
+      }
+      break;
+    }
+  }
+
+  if (token)
+    server->jwt_cache_hits ++;
+  else
+    server->jwt_cache_misses ++;
+
+  cupsMutexUnlock(&server->jwt_cache_lock);
+
+  if (expired)
+    moauthdFreeToken(expired);
+
+  return (token);
+}
+
+
+//
+// 'hash_token()' - Compute the hash of a token string.
+//
+// This is the 64-bit FNV-1a hash, which is fast and distributes the (mostly
+// random) JWT characters well.
+//
+
+static uint64_t				// O - Hash value
+hash_token(const char *s)		// I - Token string
+{
+  uint64_t	hash = 0xcbf29ce484222325ULL;
+					// Hash value
+
+
+  while (*s)
+  {
+    hash ^= (uint64_t)(*s++ & 255);
+    hash *= 0x100000001b3ULL;
+  }
+
+  return (hash);
+}
+
+
+//
+// 'invalidate_cached_token()' - Remove a revoked token from the JWT cache.
+//
+
+static void
+invalidate_cached_token(
+    moauthd_server_t *server,		// I - Server object
+    const char       *jti)		// I - JWT ID
+{
+  size_t		i;		// Looping var
+  moauthd_jwtcache_t	*entry;		// Current entry
+  moauthd_token_t	*token = NULL;	// Revoked token
+
+
+  cupsMutexLock(&server->jwt_cache_lock);
+
+  // Tokens validated before now must not be added to the cache...
+  server->jwt_cache_generation ++;
+
+  // Revocations are rare, so just scan the whole cache...
+  for (i = server->jwt_cache_size, entry = server->jwt_cache; i > 0; i --, entry ++)
+  {
+    if (entry->token && !strcmp(entry->token->jti, jti))
+    {
+      token        = entry->token;
+      entry->token = NULL;
+
+      if (atomic_fetch_sub_explicit(&token->refcount, 1, memory_order_acq_rel) > 1)
+        token = NULL;
+      break;
+    }
+  }
+
+  cupsMutexUnlock(&server->jwt_cache_lock);
+
+  if (token)
+    moauthdFreeToken(token);
+}
+
+
+//
+// 'prune_revoked()' - Remove revoked tokens that have expired.
+//
+// The Bloom filter is rebuilt from the remaining entries.  The revocation set
+// must be write-locked by the caller.
+//
+
+static void
+prune_revoked(moauthd_server_t *server,	// I - Server object
+              time_t           curtime)	// I - Current time
+{
+  size_t		i;		// Looping var
+  moauthd_revoked_t	**rptr,		// Pointer to current entry
+			*r;		// Current entry
+  atomic_uint_least64_t	bloom[MOAUTHD_REVOKED_BLOOM / 64];
+					// New Bloom filter
+
+
+  for (i = 0; i < (MOAUTHD_REVOKED_BLOOM / 64); i ++)
+    atomic_init(bloom + i, 0);
+
+  for (i = 0; i < server->num_revoked_buckets; i ++)
+  {
+    for (rptr = server->revoked + i; (r = *rptr) != NULL;)
+    {
+      if (r->expires <= curtime)
+      {
+        *rptr = r->next;
+        free(r->jti);
+        free(r);
+        server->num_revoked --;
+      }
+      else
+      {
+        add_bloom(bloom, r->hash);
+        rptr = &r->next;
+      }
+    }
+  }
+
+  // Every word of the new filter includes the bits of the remaining entries,
+  // so lockless readers never miss a revoked token while it is copied...
+  for (i = 0; i < (MOAUTHD_REVOKED_BLOOM / 64); i ++)
+    atomic_store_explicit(server->revoked_bloom + i, atomic_load_explicit(bloom + i, memory_order_relaxed), memory_order_release);
+
+  server->revoked_prune = curtime + MOAUTHD_REVOKED_PRUNE;
+}
+
+
+//
+// 'remove_expiry()' - Remove an entry from the expiry heap.
+//
+// The expiry heap must be locked by the caller.
+//
+
+static void
+remove_expiry(moauthd_server_t *server,	// I - Server object
+              size_t           i)	// I - Index of entry to remove
+{
+  size_t		child,		// Child index
+			parent;		// Parent index
+  moauthd_expiry_t	*expiry = server->expiry,
+					// Expiry heap
+			last;		// Last entry
+
+
+  if (i >= server->num_expiry)
+    return;
+
+  expiry[i].token->expiry_index = SIZE_MAX;
+
+  last = expiry[-- server->num_expiry];
+
+  if (i == server->num_expiry)
+    return;
+
+  // Sift the last entry up if it expires before the removed entry's parent...
+  for (; i > 0; i = parent)
+  {
+    parent = (i - 1) / 2;
+
+    if (expiry[parent].expires <= last.expires)
+      break;
+
+    expiry[i]                     = expiry[parent];
+    expiry[i].token->expiry_index = i;
+  }
+
+  // Otherwise sift it down...
+  for (; (child = 2 * i + 1) < server->num_expiry; i = child)
+  {
+    if ((child + 1) < server->num_expiry && expiry[child + 1].expires < expiry[child].expires)
+      child ++;
+
+    if (last.expires <= expiry[child].expires)
+      break;
+
+    expiry[i]                     = expiry[child];
+    expiry[i].token->expiry_index = i;
+  }
+
+  expiry[i]                     = last;
+  expiry[i].token->expiry_index = i;
+}
+
+
+//
+// 'resize_revoked()' - Grow the revocation hash table.
+//
+// The revocation set must be write-locked by the caller.
+//
+
+static bool				// O - `true` on success, `false` on error
+resize_revoked(moauthd_server_t *server)// I - Server object
+{
+  size_t		i,		// Looping var
+			num_buckets;	// New number of buckets
+  moauthd_revoked_t	**buckets,	// New buckets
+			*r,		// Current entry
+			*next;		// Next entry
+
+
+  num_buckets = server->num_revoked_buckets ? 2 * server->num_revoked_buckets : 256;
+
+  if ((buckets = calloc(num_buckets, sizeof(moauthd_revoked_t *))) == NULL)
+    return (false);
+
+  for (i = 0; i < server->num_revoked_buckets; i ++)
+  {
+    for (r = server->revoked[i]; r; r = next)
+    {
+      moauthd_revoked_t **bucket = buckets + r->hash % num_buckets;
+					// New bucket for entry
+
+      next    = r->next;
+      r->next = *bucket;
+      *bucket = r;
+    }
+  }
+
+  free(server->revoked);
+
+  server->revoked             = buckets;
+  server->num_revoked_buckets = num_buckets;
+
+  return (true);
+}
+
+
+//
+// 'resize_shard()' - Grow the number of buckets in a shard.
+//
+// The shard must be write-locked by the caller.
+//
+
+static bool				// O - `true` on success, `false` on error
+resize_shard(moauthd_tshard_t *shard)	// I - Hash table shard
+{
+  size_t		i,		// Looping var
+			num_buckets;	// New number of buckets
+  moauthd_token_t	**buckets,	// New buckets
+			*token,		// Current token
+			*next;		// Next token
+
+
+  num_buckets = shard->num_buckets ? 2 * shard->num_buckets : 64;
+
+  if ((buckets = calloc(num_buckets, sizeof(moauthd_token_t *))) == NULL)
+    return (false);
+
+  for (i = 0; i < shard->num_buckets; i ++)
+  {
+    for (token = shard->buckets[i]; token; token = next)
+    {
+      moauthd_token_t **bucket = buckets + (token->hash / MOAUTHD_TOKEN_SHARDS) % num_buckets;
+					// New bucket for token
+
+      next        = token->next;
+      token->next = *bucket;
+      *bucket     = token;
+    }
+  }
+
+  free(shard->buckets);
+
+  shard->buckets     = buckets;
+  shard->num_buckets = num_buckets;
+
+  return (true);
+}
+
+
+//
+// 'sweep_tokens()' - Remove expired tokens in the background.
+//
+// Expired tokens are taken from the expiry heap in batches and each one is
+// removed with only its shard locked, so lookups are never blocked for long.
+// Tokens are kept for MOAUTHD_SWEEP_GRACE seconds after they expire so that
+// clients see "expired" rather than "unknown" errors; requests still using a
+// token hold a reference, so it is only freed once they release it.
+//
+
+static void *				// O - Thread exit status (unused)
+sweep_tokens(moauthd_server_t *server)	// I - Server object
+{
+  size_t		i,		// Looping var
+			num_batch,	// Number of entries in batch
+			num_evicted = 0;// Number of tokens evicted in this sweep
+  moauthd_expiry_t	batch[MOAUTHD_SWEEP_BATCH];
+					// Batch of expired entries
+  moauthd_tshard_t	*shard;		// Hash table shard
+  moauthd_token_t	*token;		// Current token
+  bool			found;		// Was the token in the table?
+  time_t		cutoff;		// Expiration cutoff time
+
+
+  cupsMutexLock(&server->expiry_lock);
+
+  while (!server->sweeper_stop)
+  {
+    cutoff = time(NULL) - MOAUTHD_SWEEP_GRACE;
+
+    if (server->num_expiry == 0 || server->expiry[0].expires > cutoff)
+    {
+      // Finished a sweep, update the counters...
+      if (num_evicted > 0)
+      {
+        server->num_sweeps ++;
+        server->last_evicted  = num_evicted;
+        server->total_evicted += num_evicted;
+
+        moauthdLogs(server, MOAUTHD_LOGLEVEL_DEBUG, "Evicted %lu expired tokens (%lu total).", (unsigned long)num_evicted, (unsigned long)server->total_evicted);
+
+        num_evicted = 0;
+
+        // Compact the journal once it is mostly expired tokens...
+        if (server->journal_records > 2 * moauthdGetNumTokens(server) + MOAUTHD_JOURNAL_SLACK)
+        {
+	  cupsMutexUnlock(&server->expiry_lock);
+	  moauthdCompactJournal(server);
+	  cupsMutexLock(&server->expiry_lock);
+	  continue;
+        }
+      }
+
+      // Wait for the next token to expire...
+      if (server->num_expiry == 0)
+        cupsCondWait(&server->expiry_cond, &server->expiry_lock, -1.0);
+      else
+        cupsCondWait(&server->expiry_cond, &server->expiry_lock, (double)(server->expiry[0].expires - cutoff));
+
+      continue;
+    }
+
+    // Grab a batch of expired entries - tokens in the heap have not been
+    // deleted yet, so we can safely add a reference to them while the heap is
+    // locked...
+    for (num_batch = 0; num_batch < MOAUTHD_SWEEP_BATCH && server->num_expiry > 0 && server->expiry[0].expires <= cutoff; num_batch ++)
+    {
+      batch[num_batch] = server->expiry[0];
+      atomic_fetch_add_explicit(&batch[num_batch].token->refcount, 1, memory_order_relaxed);
+      remove_expiry(server, 0);
+    }
+
+    cupsMutexUnlock(&server->expiry_lock);
+
+    // Unlink any of the tokens that are still in the table - tokens that were
+    // deleted in the meantime are simply not found...
+    for (i = 0; i < num_batch; i ++)
+    {
+      token = batch[i].token;
+      shard = server->tokens + batch[i].hash % MOAUTHD_TOKEN_SHARDS;
+
+      cupsRWLockWrite(&shard->lock);
+      found = token->expires == batch[i].expires && unlink_token(shard, token, batch[i].hash);
+      cupsRWUnlock(&shard->lock);
+
+      // Release the table's reference and then ours...
+      if (found)
+      {
+        moauthdReleaseToken(server, token);
+        num_evicted ++;
+      }
+
+      moauthdReleaseToken(server, token);
+    }
+
+    cupsMutexLock(&server->expiry_lock);
+  }
+
+  cupsMutexUnlock(&server->expiry_lock);
+
+  return (NULL);
+}
+
+
+//
+// 'unlink_token()' - Remove a token from a shard.
+//
+// The shard must be write-locked by the caller.  Both the pointer and hash
+// must match.
+//
+
+static bool				// O - `true` if found, `false` otherwise
+unlink_token(moauthd_tshard_t *shard,	// I - Hash table shard
+             moauthd_token_t  *token,	// I - Token
+             uint64_t         hash)	// I - Hash of token string
+{
+  moauthd_token_t	**ptr;		// Pointer into hash bucket
+
+
+  if (!shard->buckets)
+    return (false);
+
+  for (ptr = shard->buckets + (hash / MOAUTHD_TOKEN_SHARDS) % shard->num_buckets; *ptr; ptr = &((*ptr)->next))
+  {
+    if (*ptr == token && token->hash == hash)
+    {
+      *ptr = token->next;
+      shard->num_tokens --;
+      return (true);
+    }
+  }
+
+  return (false);
 }
@@ -14,13 +14,18 @@
 // Local functions...
 //
 
+static bool	append_buffer(char **buffer, size_t *used, size_t *alloc, const char *data, size_t length);
 static void	html_escape(moauthd_client_t *client, const char *s, size_t slen);
+static void	json_add_name(moauthd_client_t *client, const char *name);
+static void	json_add_separator(moauthd_client_t *client);
+static void	json_append(moauthd_client_t *client, const char *data, size_t length);
 
 
 //
 // 'moauthdHTMLFooter()' - Show the web interface footer.
 //
-// This function also writes the trailing 0-length chunk.
+// This function also writes the trailing 0-length chunk unless the output is
+// being captured.
 //
 
 void
@@ -30,7 +35,9 @@ moauthdHTMLFooter(moauthd_client_t *client)	// I - Client
       "    </div>\n"
       "  </body>\n"
       "</html>\n");
-  httpWrite(client->http, "", 0);
+
+  if (!client->html_capture)
+    httpWrite(client->http, "", 0);
 }
 
 
@@ -88,14 +95,14 @@ moauthdHTMLPrintf(
     if (*format == '%')
     {
       if (format > start)
-        httpWrite(client->http, start, (size_t)(format - start));
+        moauthdWriteClient(client, start, (size_t)(format - start));
 
       tptr    = tformat;
       *tptr++ = *format++;
 
       if (*format == '%')
       {
-        httpWrite(client->http, "%", 1);
+        moauthdWriteClient(client, "%", 1);
         format ++;
 	start = format;
 	continue;
@@ -203,7 +210,7 @@ moauthdHTMLPrintf(
 
 	    sprintf(temp, tformat, va_arg(ap, double));
 
-            httpWrite(client->http, temp, strlen(temp));
+            moauthdWriteClient(client, temp, strlen(temp));
 	    break;
 
         case 'B' : // Integer formats
@@ -222,7 +229,7 @@ moauthdHTMLPrintf(
 	    else
 	      sprintf(temp, tformat, va_arg(ap, int));
 
-            httpWrite(client->http, temp, strlen(temp));
+            moauthdWriteClient(client, temp, strlen(temp));
 	    break;
 
 	case 's' : // String
@@ -238,12 +245,221 @@ moauthdHTMLPrintf(
   }
 
   if (format > start)
-    httpWrite(client->http, start, (size_t)(format - start));
+    moauthdWriteClient(client, start, (size_t)(format - start));
 
   va_end(ap);
 }
 
 
+//
+// 'moauthdJSONAddBoolean()' - Add a boolean member to a JSON response.
+//
+
+void
+moauthdJSONAddBoolean(
+    moauthd_client_t *client,		// I - Client
+    const char       *name,		// I - Member name
+    bool             value)		// I - Value
+{
+  json_add_name(client, name);
+
+  if (value)
+    json_append(client, "true", 4);
+  else
+    json_append(client, "false", 5);
+}
+
+
+//
+// 'moauthdJSONAddInteger()' - Add an integer member to a JSON response.
+//
+
+void
+moauthdJSONAddInteger(
+    moauthd_client_t *client,		// I - Client
+    const char       *name,		// I - Member name
+    long long        value)		// I - Value
+{
+  char	temp[32];			// Formatted number
+
+
+  json_add_name(client, name);
+  snprintf(temp, sizeof(temp), "%lld", value);
+  json_append(client, temp, strlen(temp));
+}
+
+
+//
+// 'moauthdJSONAddString()' - Add a string member to a JSON response.
+//
+
+void
+moauthdJSONAddString(
+    moauthd_client_t *client,		// I - Client
+    const char       *name,		// I - Member name
+    const char       *value)		// I - Value
+{
+  const char	*start;			// Start of unquoted segment
+  char		temp[8];		// Escaped character
+  static const char hexdigits[] = "0123456789abcdef";
+					// Hex digits for \u escapes
+
+
+  json_add_name(client, name);
+  json_append(client, "\"", 1);
+
+  for (start = value; *value; value ++)
+  {
+    if (*value == '"' || *value == '\\' || (*value & 255) < ' ')
+    {
+      // Escape this character...
+      if (value > start)
+        json_append(client, start, (size_t)(value - start));
+
+      switch (*value)
+      {
+        case '"' :
+        case '\\' :
+            temp[0] = '\\';
+            temp[1] = *value;
+            json_append(client, temp, 2);
+            break;
+
+        case '\n' :
+            json_append(client, "\\n", 2);
+            break;
+
+        case '\r' :
+            json_append(client, "\\r", 2);
+            break;
+
+        case '\t' :
+            json_append(client, "\\t", 2);
+            break;
+
+        default :
+            temp[0] = '\\';
+            temp[1] = 'u';
+            temp[2] = '0';
+            temp[3] = '0';
+            temp[4] = hexdigits[(*value >> 4) & 15];
+            temp[5] = hexdigits[*value & 15];
+            json_append(client, temp, 6);
+            break;
+      }
+
+      start = value + 1;
+    }
+  }
+
+  if (value > start)
+    json_append(client, start, (size_t)(value - start));
+
+  json_append(client, "\"", 1);
+}
+
+
+//
+// 'moauthdJSONEndArray()' - End an array member in a JSON response.
+//
+
+void
+moauthdJSONEndArray(
+    moauthd_client_t *client)		// I - Client
+{
+  json_append(client, "]", 1);
+}
+
+
+//
+// 'moauthdJSONEndObject()' - End an object in a JSON response.
+//
+
+void
+moauthdJSONEndObject(
+    moauthd_client_t *client)		// I - Client
+{
+  json_append(client, "}", 1);
+}
+
+
+//
+// 'moauthdJSONRespond()' - Finish and send a JSON response.
+//
+
+bool					// O - `true` on success, `false` on failure
+moauthdJSONRespond(
+    moauthd_client_t *client,		// I - Client
+    http_status_t    code)		// I - HTTP status of response
+{
+  json_append(client, "}", 1);
+
+  if (client->json_error)
+  {
+    // Unable to build the response, report a server error instead...
+    moauthdLogc(client, MOAUTHD_LOGLEVEL_ERROR, "Unable to allocate memory for JSON response.");
+
+    return (moauthdRespondClient(client, HTTP_STATUS_SERVER_ERROR, NULL, NULL, 0, 0));
+  }
+
+  if (!moauthdRespondClient(client, code, "application/json", NULL, 0, client->json_used))
+    return (false);
+
+  return (moauthdWriteClient(client, client->json_buffer, client->json_used));
+}
+
+
+//
+// 'moauthdJSONStart()' - Start a JSON response.
+//
+// JSON responses are written to a buffer that is reused for each request on
+// the connection.
+//
+
+void
+moauthdJSONStart(moauthd_client_t *client)	// I - Client
+{
+  client->json_error = false;
+  client->json_used  = 0;
+
+  json_append(client, "{", 1);
+}
+
+
+//
+// 'moauthdJSONStartArray()' - Start an array member in a JSON response.
+//
+
+void
+moauthdJSONStartArray(
+    moauthd_client_t *client,		// I - Client
+    const char       *name)		// I - Member name
+{
+  json_add_name(client, name);
+  json_append(client, "[", 1);
+}
+
+
+//
+// 'moauthdJSONStartObject()' - Start an object in a JSON response.
+//
+// Pass `NULL` for the name to start an object inside an array.
+//
+
+void
+moauthdJSONStartObject(
+    moauthd_client_t *client,		// I - Client
+    const char       *name)		// I - Member name or `NULL` for array element
+{
+  if (name)
+    json_add_name(client, name);
+  else
+    json_add_separator(client);
+
+  json_append(client, "{", 1);
+}
+
+
 //
 // 'moauthdRespondClient()' - Send a HTTP response.
 //
@@ -258,6 +474,7 @@ moauthdRespondClient(
     size_t           length)		// I - Length of response or 0 for chunked
 {
   char	message[1024];			// Text message
+  double	start;			// Start of write
 
 
   moauthdLogc(client, MOAUTHD_LOGLEVEL_INFO, "HTTP/1.1 %d %s", code, httpStatusString(code));
@@ -268,8 +485,10 @@ moauthdRespondClient(
     return (httpWriteResponse(client->http, HTTP_STATUS_CONTINUE));
   }
 
+  client->response_status = code;
+
   // Format an error message...
-  if (!type && !length && code != HTTP_STATUS_OK && code != HTTP_STATUS_SWITCHING_PROTOCOLS)
+  if (!type && !length && code != HTTP_STATUS_OK && code != HTTP_STATUS_SWITCHING_PROTOCOLS && code != HTTP_STATUS_NOT_MODIFIED)
   {
     snprintf(message, sizeof(message), "%d - %s\n", code, httpStatusString(code));
 
@@ -302,6 +521,12 @@ moauthdRespondClient(
     httpSetField(client->http, HTTP_FIELD_LAST_MODIFIED, httpGetDateString(mtime, temp, sizeof(temp)));
   }
 
+  if (client->content_range[0])
+    httpSetField(client->http, HTTP_FIELD_CONTENT_RANGE, client->content_range);
+
+  if (client->accept_ranges)
+    httpSetField(client->http, HTTP_FIELD_ACCEPT_RANGES, "bytes");
+
   if (code == HTTP_STATUS_MOVED_PERMANENTLY || code == HTTP_STATUS_FOUND)
   {
     httpSetField(client->http, HTTP_FIELD_LOCATION, uri);
@@ -320,16 +545,31 @@ moauthdRespondClient(
       httpSetField(client->http, HTTP_FIELD_CONTENT_TYPE, type);
   }
 
-  httpSetLength(client->http, length);
+  if (client->content_encoding)
+  {
+    // libcups compresses the message body as it is written, so the length is
+    // not known...
+    httpSetField(client->http, HTTP_FIELD_CONTENT_ENCODING, client->content_encoding);
+    length = 0;
+  }
+
+  if (code == HTTP_STATUS_NOT_MODIFIED)
+    httpSetField(client->http, HTTP_FIELD_CONTENT_LENGTH, "0");
+  else
+    httpSetLength(client->http, length);
+
+  start = moauthdGetClock();
 
   if (!httpWriteResponse(client->http, code))
     return (false);
 
+  client->write_time += moauthdGetClock() - start;
+
   // Send the response data...
   if (message[0])
   {
     // Send a plain text message.
-    if (httpWrite(client->http, message, length) < 0)
+    if (!moauthdWriteClient(client, message, length))
       return (false);
   }
 
@@ -339,6 +579,74 @@ moauthdRespondClient(
 }
 
 
+//
+// 'moauthdWriteClient()' - Write data to the client.
+//
+// When the output is being captured, the data is appended to the client's
+// HTML buffer instead.
+//
+
+bool					// O - `true` on success, `false` on error
+moauthdWriteClient(
+    moauthd_client_t *client,		// I - Client
+    const char       *data,		// I - Data to write
+    size_t           length)		// I - Number of bytes to write
+{
+  double	start;			// Start of write
+  ssize_t	bytes;			// Bytes written
+
+
+  if (client->html_capture)
+    return (append_buffer(&client->html_buffer, &client->html_used, &client->html_alloc, data, length));
+
+  // Track the bytes and time for the access log...
+  start = moauthdGetClock();
+  bytes = httpWrite(client->http, data, length);
+
+  client->write_time += moauthdGetClock() - start;
+
+  if (bytes > 0)
+    client->response_bytes += (size_t)bytes;
+
+  return (bytes >= (ssize_t)length);
+}
+
+
+//
+// 'append_buffer()' - Append data to a growable buffer.
+//
+
+static bool				// O - `true` on success, `false` on error
+append_buffer(char       **buffer,	// IO - Buffer
+              size_t     *used,		// IO - Bytes used
+              size_t     *alloc,	// IO - Bytes allocated
+              const char *data,		// I  - Data to append
+              size_t     length)	// I  - Length of data
+{
+  if ((*used + length) > *alloc)
+  {
+    // Expand the buffer...
+    size_t	newalloc = *alloc ? 2 * *alloc : 16384;
+					// New allocation size
+    char	*newbuffer;		// New buffer
+
+    while (newalloc < (*used + length))
+      newalloc *= 2;
+
+    if ((newbuffer = realloc(*buffer, newalloc)) == NULL)
+      return (false);
+
+    *buffer = newbuffer;
+    *alloc  = newalloc;
+  }
+
+  memcpy(*buffer + *used, data, length);
+  *used += length;
+
+  return (true);
+}
+
+
 //
 // 'html_escape()' - Write a HTML-safe string.
 //
@@ -360,12 +668,12 @@ html_escape(moauthd_client_t *client,	// I - Client
     if (*s == '&' || *s == '<')
     {
       if (s > start)
-        httpWrite(client->http, start, (size_t)(s - start));
+        moauthdWriteClient(client, start, (size_t)(s - start));
 
       if (*s == '&')
-        httpWrite(client->http, "&amp;", 5);
+        moauthdWriteClient(client, "&amp;", 5);
       else
-        httpWrite(client->http, "&lt;", 4);
+        moauthdWriteClient(client, "&lt;", 4);
 
       start = s + 1;
     }
@@ -374,5 +682,60 @@ html_escape(moauthd_client_t *client,	// I - Client
   }
 
   if (s > start)
-    httpWrite(client->http, start, (size_t)(s - start));
+    moauthdWriteClient(client, start, (size_t)(s - start));
+}
+
+
+//
+// 'json_add_name()' - Add a member name to a JSON response.
+//
+// Member names are constant strings that never need quoting.
+//
+
+static void
+json_add_name(moauthd_client_t *client,	// I - Client
+              const char       *name)	// I - Member name
+{
+  json_add_separator(client);
+  json_append(client, "\"", 1);
+  json_append(client, name, strlen(name));
+  json_append(client, "\":", 2);
+}
+
+
+//
+// 'json_add_separator()' - Add a comma before the next member or element.
+//
+
+static void
+json_add_separator(
+    moauthd_client_t *client)		// I - Client
+{
+  char	last;				// Last character in response
+
+
+  if (client->json_error || client->json_used == 0)
+    return;
+
+  last = client->json_buffer[client->json_used - 1];
+
+  if (last != '{' && last != '[')
+    json_append(client, ",", 1);
+}
+
+
+//
+// 'json_append()' - Append data to a JSON response.
+//
+
+static void
+json_append(moauthd_client_t *client,	// I - Client
+            const char       *data,	// I - Data to append
+            size_t           length)	// I - Length of data
+{
+  if (!append_buffer(&client->json_buffer, &client->json_used, &client->json_alloc, data, length))
+  {
+    // Out of memory, moauthdJSONRespond() will send an error instead...
+    client->json_error = true;
+  }
 }
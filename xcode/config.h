@@ -14,3 +14,11 @@
 #define HAVE_LIBPAM 1
 #define HAVE_SECURITY_PAM_APPL_H 1
 /* #undef HAVE_PAM_PAM_APPL_H */
+
+/* Event notification APIs... */
+/* #undef HAVE_EPOLL */
+#define HAVE_KQUEUE 1
+
+/* Random number APIs... */
+#define HAVE_ARC4RANDOM_BUF 1
+/* #undef HAVE_GETRANDOM */